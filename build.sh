@@ -10,7 +10,7 @@ set -ueo pipefail
 COLORS=true # set to false to disable colors
 
 C_FLAGS="-Wall -Wextra -Werror -Wno-unused-parameter -Wno-unused-but-set-variable -Wno-unused-but-set-parameter -pedantic -std=c99 -O2 $(pkg-config --cflags clay)"
-LD_FLAGS="-lm -lbsd $(pkg-config --libs libavcodec libavformat libavutil libavdevice)"
+LD_FLAGS="-lm -lbsd -lpthread -ldl $(pkg-config --libs libavcodec libavformat libavutil libavdevice libswresample)"
 
 INCLUDE_DIRS="-I./include"
 C_FILES=""
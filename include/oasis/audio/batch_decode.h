@@ -0,0 +1,73 @@
+#ifndef BATCH_DECODE_H
+#define BATCH_DECODE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <oasis/audio/decode.h>
+#include <oasis/utils.h>
+
+/**
+ * The outcome of decoding one file of a batch.
+ */
+typedef struct {
+  const char *filename;
+  size_t index;          // Position of the file in the batch
+  oasis_result_t result; // audio_data is only filled in on OASIS_SUCCESS
+  audio_data_t audio_data;
+  double seconds;       // Wall time spent opening and decoding the file
+  double open_seconds;  // Part of it spent opening the file
+  double audio_seconds; // Length of the decoded audio
+} batch_decode_result_t;
+
+/**
+ * Called once for every file of a batch, from the worker that decoded it.
+ * Calls are serialized, so the callback does not need to lock. The PCM is
+ * freed once the callback returns unless it takes ownership by setting
+ * audio_data.pcm_data to NULL.
+ *
+ * @param result The outcome of the file.
+ * @param user_data The user data from the options.
+ */
+typedef void (*batch_decode_callback)(batch_decode_result_t *result,
+                                      void *user_data);
+
+/**
+ * Options for a batch decode, fields left at 0 fall back to their defaults.
+ */
+typedef struct {
+  int threads; // Worker threads, 0 = one per online CPU
+  batch_decode_callback on_complete;
+  void *user_data;
+} batch_decode_options_t;
+
+/**
+ * The aggregate figures of a batch.
+ */
+typedef struct {
+  size_t files;
+  size_t failed;
+  uint64_t bytes;          // PCM bytes produced
+  double audio_seconds;    // Audio decoded
+  double wall_seconds;     // Time the whole batch took
+  double open_seconds;     // Time spent opening files, over all workers
+  double max_open_seconds; // Slowest file open
+} batch_decode_stats_t;
+
+/**
+ * Decodes a list of files to PCM across worker threads. Every worker keeps
+ * one decoder and reopens it for each file it takes, so packets and frames
+ * are reused and codec contexts cycle through the codec pool.
+ *
+ * @param filenames The files to decode.
+ * @param count The number of files.
+ * @param options The batch options, NULL for the defaults.
+ * @param stats Filled in with the aggregate figures, may be NULL.
+ * @return OASIS_SUCCESS if every file was decoded, OASIS_ERROR if some failed,
+ * another error code if the batch could not run.
+ */
+oasis_result_t batch_decode(const char *const *filenames, size_t count,
+                            const batch_decode_options_t *options,
+                            batch_decode_stats_t *stats);
+
+#endif
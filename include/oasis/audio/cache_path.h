@@ -0,0 +1,48 @@
+#ifndef CACHE_PATH_H
+#define CACHE_PATH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <oasis/utils.h>
+
+/**
+ * Gets one of oasis' cache directories, $XDG_CACHE_HOME/oasis/<name> or
+ * ~/.cache/oasis/<name>.
+ *
+ * @param name The name of the cache.
+ * @param path The buffer to write the directory to.
+ * @param size The size of the buffer.
+ * @param create Create the directory and its parents if they are missing.
+ * @return OASIS_SUCCESS if the directory was resolved,
+ * OASIS_ERROR_DIRECTORY_NOT_FOUND if there is no cache home or it could not be
+ * created.
+ */
+oasis_result_t cache_path_get_dir(const char *name, char *path, size_t size,
+                                  int create);
+
+/**
+ * Gets the path of the cache entry for a file, named after a hash of the
+ * file's resolved path.
+ *
+ * @param dir The cache directory.
+ * @param filename The file the entry is for.
+ * @param extension The extension of the entry, without the dot.
+ * @param path The buffer to write the path to.
+ * @param size The size of the buffer.
+ * @param key Set to the resolved path the entry is keyed by, at least
+ * PATH_MAX bytes.
+ */
+void cache_path_get_entry(const char *dir, const char *filename,
+                          const char *extension, char *path, size_t size,
+                          char *key);
+
+/**
+ * Creates a directory and its parents.
+ *
+ * @param path The directory, modified while it runs but restored.
+ * @return 0 if the directory exists, -1 otherwise.
+ */
+int cache_path_make_dirs(char *path);
+
+#endif
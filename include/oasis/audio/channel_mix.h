@@ -0,0 +1,104 @@
+#ifndef CHANNEL_MIX_H
+#define CHANNEL_MIX_H
+
+#include <stddef.h>
+
+#include <oasis/utils.h>
+
+#define CHANNEL_MIX_MAX_CHANNELS 8
+#define CHANNEL_MIX_BLOCK_FRAMES 1024 // Staged at a time by the decoder
+
+/**
+ * How much of every input channel goes into every output channel.
+ *
+ * Channels are in the order of the default FFmpeg layout for their count:
+ * mono is FC, stereo FL FR, 5.1 FL FR FC LFE SL SR and 7.1 FL FR FC LFE BL BR
+ * SL SR.
+ */
+typedef struct {
+  int in_channels;
+  int out_channels;
+  float coefficients[CHANNEL_MIX_MAX_CHANNELS][CHANNEL_MIX_MAX_CHANNELS];
+} channel_matrix_t; // coefficients[out][in]
+
+/**
+ * Remixes a run of frames.
+ *
+ * @param dst The frames to write, out_channels interleaved.
+ * @param src The frames to read, in_channels interleaved.
+ * @param frames The number of frames.
+ * @param in_channels The number of input channels.
+ * @param out_channels The number of output channels.
+ * @param columns The matrix, CHANNEL_MIX_MAX_CHANNELS floats per input
+ * channel.
+ */
+typedef void (*channel_mix_fn)(float *dst, const float *src, size_t frames,
+                               int in_channels, int out_channels,
+                               const float *columns);
+
+/**
+ * Remixes interleaved float frames through a matrix.
+ *
+ * The matrix is stored a column per input channel, padded to a full vector,
+ * so a frame is the sum of the input samples times their columns. The kernel
+ * is picked once at runtime from the CPU features (AVX2, SSE2 or scalar),
+ * like the interleave kernels.
+ */
+typedef struct {
+  int in_channels;
+  int out_channels;
+  float columns[CHANNEL_MIX_MAX_CHANNELS][CHANNEL_MIX_MAX_CHANNELS];
+  channel_mix_fn kernel;
+  int identity; // Frames are copied as they are
+} channel_mixer_t;
+
+/**
+ * Fills in the standard matrix between two channel counts.
+ *
+ * Channels both layouts have are kept. A centre missing from the output goes
+ * to the left and right at -3 dB, left and right missing from a mono output
+ * go to the centre. Back channels fold into the sides and sides into the
+ * front, at -3 dB, and LFE is dropped. Mono to stereo, stereo to mono, 5.1
+ * to stereo (ITU-R BS.775) and 7.1 to 5.1 all come out of these rules. A
+ * downmix is scaled so no output can clip when every input is at full scale.
+ *
+ * @param matrix The matrix to fill in.
+ * @param in_channels The number of input channels, 1, 2, 6 or 8.
+ * @param out_channels The number of output channels, 1, 2, 6 or 8.
+ * @return OASIS_SUCCESS if there is a standard matrix for the pair,
+ * OASIS_ERROR_UNSUPPORTED_FORMAT otherwise.
+ */
+oasis_result_t channel_matrix_standard(channel_matrix_t *matrix,
+                                       int in_channels, int out_channels);
+
+/**
+ * Sets up a mixer for a matrix, the standard one or a user defined one.
+ *
+ * @param mixer The mixer to set up.
+ * @param matrix The matrix, copied.
+ * @return OASIS_SUCCESS if the mixer was set up, OASIS_ERROR_INVALID_ARGUMENT
+ * if the matrix has more than CHANNEL_MIX_MAX_CHANNELS on either side.
+ */
+oasis_result_t channel_mixer_init(channel_mixer_t *mixer,
+                                  const channel_matrix_t *matrix);
+
+/**
+ * Remixes frames.
+ *
+ * @param mixer The mixer.
+ * @param dst The frames to write, out_channels interleaved.
+ * @param src The frames to read, in_channels interleaved, must not overlap
+ * dst.
+ * @param frames The number of frames.
+ */
+void channel_mixer_run(const channel_mixer_t *mixer, float *dst,
+                       const float *src, size_t frames);
+
+/**
+ * Gets the name of the instruction set the remix kernels use.
+ *
+ * @return "avx2", "sse2" or "scalar".
+ */
+const char *channel_mix_get_isa_name(void);
+
+#endif
@@ -0,0 +1,116 @@
+#ifndef CODEC_POOL_H
+#define CODEC_POOL_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <libavcodec/avcodec.h>
+
+#include <oasis/utils.h>
+
+#define CODEC_POOL_CAPACITY 8
+
+/**
+ * Counters of a codec pool.
+ */
+typedef struct {
+  uint64_t opens;               // Contexts opened from scratch
+  uint64_t reuses;              // Contexts handed out again after a flush
+  uint64_t evictions;           // Idle contexts freed to make room
+  uint64_t stream_info_skipped; // Files opened from their headers alone
+  uint64_t tracks;              // Decoders opened
+  double open_seconds;          // Total time spent opening decoders
+  double max_open_seconds;      // Slowest decoder open
+} codec_pool_stats_t;
+
+/**
+ * A pool of opened, idle decoder contexts.
+ *
+ * Opening a codec context can be costly, some codecs build tables on every
+ * open. A context released to the pool is handed out again, flushed, for the
+ * next stream with the same codec and parameters. The least recently released
+ * context is freed once the pool is full. The pool is thread safe.
+ */
+typedef struct {
+  AVCodecContext *contexts[CODEC_POOL_CAPACITY];
+  uint64_t released[CODEC_POOL_CAPACITY]; // When each context was released
+  size_t count;
+  uint64_t clock; // Counts releases, orders the contexts by age
+  pthread_mutex_t lock;
+  codec_pool_stats_t stats;
+} codec_pool_t;
+
+/**
+ * Initializes an empty codec pool.
+ *
+ * @param pool The pool to initialize.
+ * @return OASIS_SUCCESS if the pool was initialized, an error code otherwise.
+ */
+oasis_result_t codec_pool_init(codec_pool_t *pool);
+
+/**
+ * Frees every idle context and the pool itself.
+ *
+ * @param pool The pool to free.
+ */
+void codec_pool_free(codec_pool_t *pool);
+
+/**
+ * Gets the pool shared by every decoder of the process.
+ *
+ * @return The default pool.
+ */
+codec_pool_t *codec_pool_default(void);
+
+/**
+ * Checks if an opened context would decode a stream exactly like a context
+ * opened for its parameters.
+ *
+ * @param codec_ctx The opened context.
+ * @param codecpar The parameters of the stream.
+ * @return 1 if the context can be reused for the stream, 0 otherwise.
+ */
+int codec_pool_matches(const AVCodecContext *codec_ctx,
+                       const AVCodecParameters *codecpar);
+
+/**
+ * Takes a flushed context matching the parameters out of the pool, or opens a
+ * new one if there is none.
+ *
+ * @param pool The pool, NULL to always open a new context.
+ * @param codecpar The parameters of the stream to decode.
+ * @param codec_ctx Set to the context.
+ * @return OASIS_SUCCESS if a context was acquired, an error code otherwise.
+ */
+oasis_result_t codec_pool_acquire(codec_pool_t *pool,
+                                  const AVCodecParameters *codecpar,
+                                  AVCodecContext **codec_ctx);
+
+/**
+ * Gives a context back to the pool.
+ *
+ * @param pool The pool, NULL to free the context.
+ * @param codec_ctx The context, set to NULL.
+ */
+void codec_pool_release(codec_pool_t *pool, AVCodecContext **codec_ctx);
+
+/**
+ * Records how long opening a decoder took.
+ *
+ * @param pool The pool.
+ * @param seconds The time the open took.
+ * @param stream_info_skipped The stream info probe was skipped.
+ */
+void codec_pool_record_open(codec_pool_t *pool, double seconds,
+                            int stream_info_skipped);
+
+/**
+ * Gets a snapshot of the pool's counters.
+ *
+ * @param pool The pool.
+ * @param stats Set to the counters.
+ */
+void codec_pool_get_stats(codec_pool_t *pool, codec_pool_stats_t *stats);
+
+#endif
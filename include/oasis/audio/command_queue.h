@@ -0,0 +1,92 @@
+#ifndef COMMAND_QUEUE_H
+#define COMMAND_QUEUE_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <oasis/utils.h>
+
+#define COMMAND_QUEUE_CAPACITY 64
+
+/**
+ * The transport commands the playback engine understands.
+ */
+typedef enum {
+  PLAYBACK_COMMAND_PLAY = 0,
+  PLAYBACK_COMMAND_PAUSE,
+  PLAYBACK_COMMAND_TOGGLE_PAUSE,
+  PLAYBACK_COMMAND_SEEK,          // value is the position in milliseconds
+  PLAYBACK_COMMAND_SEEK_RELATIVE, // value is the offset in milliseconds
+  PLAYBACK_COMMAND_RESTART,
+  PLAYBACK_COMMAND_STOP,
+  PLAYBACK_COMMAND_NEXT, // Skip to the next queued track
+  PLAYBACK_COMMAND_VOLUME,          // value is the volume in 1/100 dB
+  PLAYBACK_COMMAND_VOLUME_RELATIVE, // value is the change in 1/100 dB
+} playback_command_type_t;
+
+/**
+ * A transport command.
+ */
+typedef struct {
+  playback_command_type_t type;
+  int64_t value;
+} playback_command_t;
+
+/**
+ * A bounded queue of commands for the playback engine, any thread can push,
+ * the engine pops. The event fd becomes readable whenever commands are queued
+ * so the engine can sleep on it alongside its other inputs.
+ */
+typedef struct {
+  playback_command_t commands[COMMAND_QUEUE_CAPACITY];
+  unsigned int head;
+  unsigned int tail;
+  pthread_mutex_t lock;
+  int event_fd;
+} command_queue_t;
+
+/**
+ * Initializes a command queue.
+ *
+ * @param queue The queue to initialize.
+ * @return OASIS_SUCCESS if the queue was initialized, an error code otherwise.
+ */
+oasis_result_t command_queue_init(command_queue_t *queue);
+
+/**
+ * Frees a command queue.
+ *
+ * @param queue The queue to free.
+ */
+void command_queue_free(command_queue_t *queue);
+
+/**
+ * Queues a command.
+ *
+ * @param queue The queue.
+ * @param type The command.
+ * @param value The command's argument, 0 if it takes none.
+ * @return OASIS_SUCCESS if the command was queued, OASIS_ERROR if the queue is
+ * full.
+ */
+oasis_result_t command_queue_push(command_queue_t *queue,
+                                  playback_command_type_t type, int64_t value);
+
+/**
+ * Takes the oldest command off the queue.
+ *
+ * @param queue The queue.
+ * @param command Set to the command.
+ * @return 1 if a command was taken, 0 if the queue is empty.
+ */
+int command_queue_pop(command_queue_t *queue, playback_command_t *command);
+
+/**
+ * Gets the fd that is readable while commands are queued.
+ *
+ * @param queue The queue.
+ * @return The event fd.
+ */
+int command_queue_get_fd(command_queue_t *queue);
+
+#endif
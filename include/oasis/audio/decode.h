@@ -4,6 +4,11 @@
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
 
+#include <oasis/audio/channel_mix.h>
+#include <oasis/audio/mmap_input.h>
+#include <oasis/audio/pcm_store.h>
+#include <oasis/audio/resample.h>
+#include <oasis/audio/seek_index.h>
 #include <oasis/utils.h>
 
 typedef struct {
@@ -14,8 +19,56 @@ typedef struct {
   int channels;
   enum AVSampleFormat sample_format;
   enum AVCodecID codec_id;
+  void *mapping;       // Set when pcm_data points into a mapped cache file
+  size_t mapping_size;
 } audio_data_t;
 
+/**
+ * Which audio stream of a file to decode.
+ */
+typedef struct {
+  int stream_index;     // Stream to decode, -1 to pick one
+  const char *language; // Language to prefer when picking, e.g. "eng"
+} audio_stream_selection_t;
+
+/**
+ * A streaming audio decoder, keeps the demuxer and decoder open and produces
+ * interleaved PCM on demand, so memory use does not depend on the file length.
+ */
+typedef struct {
+  AVFormatContext *fmt_ctx;
+  mmap_input_t input; // Backs fmt_ctx when mapped, the decoder must not move
+  AVCodecContext *codec_ctx;
+  AVPacket *pkt;
+  AVFrame *frame;
+  int audio_stream_index;
+  int frame_offset; // Samples of the current frame already handed out
+  int eof;
+  int64_t position; // Next sample to be read
+  int64_t duration; // Total length in samples, 0 if unknown
+  int sample_rate;  // Of what is read, after conversion
+  int channels;     // Of what is read, after remixing
+  enum AVSampleFormat sample_format; // Always packed (interleaved)
+  enum AVCodecID codec_id;           // PCM codec matching sample_format
+  int source_rate;                   // As decoded
+  enum AVSampleFormat source_format; // As decoded, packed
+  int source_channels;               // As decoded
+  resampler_t resampler; // Converts to sample_rate and sample_format
+  channel_mixer_t remix; // Mixes source_channels down or up to channels
+  float *remix_block;    // CHANNEL_MIX_BLOCK_FRAMES source frames, NULL if
+                         // the channels are read as decoded
+  char *filename;
+  seek_index_t seek_index; // Filled in as packets are read, saved on close
+                           // when seek_index_persist_enabled
+  int sequential; // Every packet so far was read in order from the start
+  int stream_info_skipped; // Opened from the container header alone
+  int stream_selected;     // The caller picked the stream, not the default
+  double open_seconds;     // Time it took to open the file
+  int padding_handled; // libavcodec drops the encoder delay and padding
+  int64_t trim_start;  // Encoder delay dropped here instead, in samples
+  int64_t end; // Exact length without encoder padding, 0 to read to the end
+} audio_decoder_t;
+
 /**
  * Gets the name of the audio codec.
  *
@@ -35,6 +88,11 @@ char *get_sample_format_name(enum AVSampleFormat sample_format);
 /**
  * Decodes an audio file to PCM.
  *
+ * Compatibility shim kept for callers that still want the decoded frames,
+ * every frame is cloned and held until freed. The frames leave out encoder
+ * delay and padding the way decode_file_to_pcm does. Prefer
+ * decode_file_to_pcm.
+ *
  * @param filename The filename of the audio file to decode.
  * @param frames The array of frames to store the decoded audio in.
  * @param frame_count The number of frames decoded.
@@ -55,4 +113,196 @@ oasis_result_t decode_to_pcm(const char *filename, AVFrame ***frames,
 oasis_result_t append_frames_to_pcm(AVFrame **frames, int frame_count,
                                     audio_data_t *audio_data);
 
+/**
+ * Decodes a whole audio file straight into an interleaved PCM buffer.
+ *
+ * Each frame is copied into the buffer as it is decoded and released right
+ * away, the buffer is presized from the container duration when known.
+ *
+ * @param filename The filename of the audio file to decode.
+ * @param audio_data The audio data to fill, pcm_data must be freed by the
+ * caller.
+ * @return OASIS_SUCCESS if the decoding was successful, an error code
+ * otherwise.
+ */
+oasis_result_t decode_file_to_pcm(const char *filename,
+                                  audio_data_t *audio_data);
+
+/**
+ * Decodes an audio file into a segmented PCM store, for files too long to
+ * hold in one buffer.
+ *
+ * @param filename The filename of the audio file to decode.
+ * @param store The store to initialize and fill, must be freed with
+ * pcm_store_free.
+ * @return OASIS_SUCCESS if the decoding was successful, an error code
+ * otherwise.
+ */
+oasis_result_t decode_file_to_store(const char *filename, pcm_store_t *store);
+
+/**
+ * Opens an audio file for streaming decoding.
+ *
+ * The first frame is decoded up front so the output format is known once this
+ * returns, no other decoding is done until samples are read. Encoder delay and
+ * padding are left out, sample 0 is the first sample of the original audio.
+ *
+ * @param decoder The decoder to initialize.
+ * @param filename The filename of the audio file to open.
+ * @return OASIS_SUCCESS if the file was opened, an error code otherwise.
+ */
+oasis_result_t decoder_open(audio_decoder_t *decoder, const char *filename);
+
+/**
+ * Opens a specific audio stream of a file for streaming decoding, every other
+ * stream is discarded by the demuxer.
+ *
+ * @param decoder The decoder to initialize.
+ * @param filename The filename of the audio file to open.
+ * @param selection The stream to decode, NULL for the best audio stream.
+ * @return OASIS_SUCCESS if the file was opened, OASIS_ERROR_FILE_NOT_FOUND if
+ * there is no such stream, an error code otherwise.
+ */
+oasis_result_t decoder_open_stream(audio_decoder_t *decoder,
+                                   const char *filename,
+                                   const audio_stream_selection_t *selection);
+
+/**
+ * Finds the audio stream of a file to decode. Picks the requested stream, the
+ * default stream of the requested language, or whatever libavformat considers
+ * the best audio stream, in that order.
+ *
+ * @param fmt_ctx The opened file.
+ * @param selection The stream to look for, NULL for the best audio stream.
+ * @return The index of the stream, -1 if there is none.
+ */
+int decoder_find_stream(AVFormatContext *fmt_ctx,
+                        const audio_stream_selection_t *selection);
+
+/**
+ * Finds the encoder delay and padding a reader of a stream has to leave out,
+ * from an iTunSMPB tag or the codec parameters. Nothing is trimmed at the
+ * start when libavcodec already drops the delay.
+ *
+ * @param fmt_ctx The opened file.
+ * @param stream_index The audio stream.
+ * @param sample_rate The decoded sample rate.
+ * @param padding_handled Whether the stream's packets carry skip samples side
+ * data, libavcodec trims those itself.
+ * @param duration The length of the stream in samples, 0 if unknown.
+ * @param trim_start Set to the samples to drop from the start.
+ * @param end Set to the length without delay and padding, 0 if unknown.
+ */
+void decoder_find_gapless(AVFormatContext *fmt_ctx, int stream_index,
+                          int sample_rate, int padding_handled,
+                          int64_t duration, int64_t *trim_start,
+                          int64_t *end);
+
+/**
+ * Opens another audio file on a decoder that is already open, or was closed.
+ *
+ * The packet and frame are kept, the codec context goes back to the codec
+ * pool, which hands it out again if the new stream has the same codec
+ * parameters. Meant for decoding many files in a row. The output format and
+ * channels go back to those of the new file.
+ *
+ * @param decoder The decoder to reuse.
+ * @param filename The filename of the audio file to open.
+ * @return OASIS_SUCCESS if the file was opened, an error code otherwise, in
+ * which case the decoder is closed.
+ */
+oasis_result_t decoder_reopen(audio_decoder_t *decoder, const char *filename);
+
+/**
+ * Converts everything read from the decoder from then on to a sample rate and
+ * format. A source already in that rate and format is read as before, with no
+ * conversion at all. Positions and lengths are counted at the new rate.
+ *
+ * @param decoder The decoder, freshly opened or reopened.
+ * @param sample_rate The sample rate to convert to, 0 to keep the source rate.
+ * @param sample_format The packed sample format to convert to.
+ * @return OASIS_SUCCESS if the conversion was set up, an error code otherwise.
+ */
+oasis_result_t decoder_set_output_format(audio_decoder_t *decoder,
+                                         int sample_rate,
+                                         enum AVSampleFormat sample_format);
+
+/**
+ * Remixes everything read from the decoder from then on to a number of
+ * channels, with the standard matrix for the pair or a given one. Only float
+ * output is remixed, the output format is set first.
+ *
+ * @param decoder The decoder, freshly opened or reopened.
+ * @param channels The number of channels to remix to.
+ * @param matrix The matrix from the source channels to channels, NULL for the
+ * standard one.
+ * @return OASIS_SUCCESS if the remix was set up, an error code otherwise.
+ */
+oasis_result_t decoder_set_output_channels(audio_decoder_t *decoder,
+                                           int channels,
+                                           const channel_matrix_t *matrix);
+
+/**
+ * Reads interleaved samples from the decoder.
+ *
+ * @param decoder The decoder to read from.
+ * @param buffer The buffer to write to, must hold nb_samples * channels *
+ * bytes per sample bytes.
+ * @param nb_samples The number of samples (per channel) to read.
+ * @param samples_read The number of samples actually read, only less than
+ * nb_samples at the end of the stream, 0 once the stream is exhausted.
+ * @return OASIS_SUCCESS if the read was successful, an error code otherwise.
+ */
+oasis_result_t decoder_read_samples(audio_decoder_t *decoder, uint8_t *buffer,
+                                    int nb_samples, int *samples_read);
+
+/**
+ * Seeks the decoder to a sample position.
+ *
+ * The demuxer is moved to the closest seek point before the sample, from the
+ * seek index when it has one, and decoding resumes from there up to the exact
+ * sample.
+ *
+ * @param decoder The decoder to seek.
+ * @param sample The sample to seek to, clamped to the stream.
+ * @return OASIS_SUCCESS if the seek was successful, an error code otherwise.
+ */
+oasis_result_t decoder_seek(audio_decoder_t *decoder, int64_t sample);
+
+/**
+ * Reads everything left in the decoder into an interleaved PCM buffer.
+ *
+ * @param decoder The decoder to read from.
+ * @param audio_data The audio data to fill, pcm_data must be freed by the
+ * caller.
+ * @return OASIS_SUCCESS if the read was successful, an error code otherwise.
+ */
+oasis_result_t decoder_read_all(audio_decoder_t *decoder,
+                                audio_data_t *audio_data);
+
+/**
+ * Reads everything left in the decoder into a segmented PCM store.
+ *
+ * @param decoder The decoder to read from.
+ * @param store The store to initialize and fill, must be freed with
+ * pcm_store_free.
+ * @return OASIS_SUCCESS if the read was successful, an error code otherwise.
+ */
+oasis_result_t decoder_read_to_store(audio_decoder_t *decoder,
+                                     pcm_store_t *store);
+
+/**
+ * Frees the PCM of audio data, whether it was allocated or mapped.
+ *
+ * @param audio_data The audio data to free.
+ */
+void audio_data_free(audio_data_t *audio_data);
+
+/**
+ * Closes the decoder and frees everything it holds.
+ *
+ * @param decoder The decoder to close.
+ */
+void decoder_close(audio_decoder_t *decoder);
+
 #endif
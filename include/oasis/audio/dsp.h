@@ -0,0 +1,253 @@
+#ifndef DSP_H
+#define DSP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <libavutil/dict.h>
+
+#include <oasis/audio/channel_mix.h>
+#include <oasis/utils.h>
+
+#define DSP_BLOCK_FRAMES 256 // Nodes never see more than this at once
+#define DSP_MAX_NODES 8
+#define DSP_MAX_CHANNELS CHANNEL_MIX_MAX_CHANNELS
+#define DSP_EQ_MAX_BANDS 10
+#define DSP_VOLUME_RAMP_MS 20 // Volume changes glide over this long
+#define DSP_VOLUME_MUTE_DB -90.0f // This and below is silence
+#define DSP_R128_REFERENCE_DB 5.0f // -18 LUFS of ReplayGain over -23 of R128
+
+typedef struct dsp_node dsp_node_t;
+
+/**
+ * Processes a block of frames in place.
+ *
+ * @param node The node.
+ * @param block Interleaved float frames, node->channels per frame.
+ * @param frames The number of frames, at most DSP_BLOCK_FRAMES.
+ */
+typedef void (*dsp_process_fn)(dsp_node_t *node, float *block, size_t frames);
+
+/**
+ * A stage of a DSP chain, embedded first in the state of the node type.
+ * Processing never allocates, locks or logs, so a chain can run on a
+ * real-time thread.
+ */
+struct dsp_node {
+  const char *name;
+  dsp_process_fn process;
+  void (*reset)(dsp_node_t *node); // Optional, forgets the audio so far
+  int channels;
+  int bypass; // Skipped by the chain, can be flipped from any thread
+
+  uint64_t blocks; // Processed while the chain was profiling
+  uint64_t ns;     // Spent on them
+};
+
+/**
+ * Nodes run in the order they were added, a block at a time. Any of them can
+ * be bypassed without being taken out.
+ */
+typedef struct {
+  int channels;
+  dsp_node_t *nodes[DSP_MAX_NODES];
+  int count;
+  int profile; // Time every node on every block
+} dsp_chain_t;
+
+/**
+ * A constant gain, what ReplayGain and R128 tags ask for.
+ */
+typedef struct {
+  dsp_node_t node;
+  float gain;
+} dsp_gain_t;
+
+/**
+ * A software volume, changes ramp linearly over DSP_VOLUME_RAMP_MS so they do
+ * not click.
+ */
+typedef struct {
+  dsp_node_t node;
+  float target; // Set from any thread
+  float gain;   // Where the ramp is
+  float step;   // Per frame towards target
+  float ramp_to; // The target step was computed for
+  int ramp_frames;
+} dsp_volume_t;
+
+typedef enum {
+  DSP_EQ_PEAK = 0,
+  DSP_EQ_LOW_SHELF,
+  DSP_EQ_HIGH_SHELF,
+  DSP_EQ_LOW_PASS,
+  DSP_EQ_HIGH_PASS,
+} dsp_eq_type_t;
+
+/**
+ * A band of a parametric EQ, one biquad from the Audio EQ Cookbook.
+ */
+typedef struct {
+  dsp_eq_type_t type;
+  double frequency; // Centre or corner, in Hz
+  double gain_db;   // Ignored by the passes
+  double q;
+} dsp_eq_band_t;
+
+/**
+ * A cascade of biquads, every channel through the same bands. A frame is
+ * processed with every channel in a lane of one vector, the kernel is picked
+ * once at runtime from the CPU features (AVX2, SSE2 or scalar).
+ */
+typedef struct {
+  dsp_node_t node;
+  int band_count;
+  float coefficients[DSP_EQ_MAX_BANDS][5]; // b0 b1 b2 a1 a2, over a0
+  float z1[DSP_EQ_MAX_BANDS][DSP_MAX_CHANNELS];
+  float z2[DSP_EQ_MAX_BANDS][DSP_MAX_CHANNELS];
+  float lanes[DSP_BLOCK_FRAMES][DSP_MAX_CHANNELS]; // The block, a vector of
+                                                    // channels per frame
+} dsp_eq_t;
+
+typedef enum {
+  DSP_REPLAYGAIN_OFF = 0,
+  DSP_REPLAYGAIN_TRACK,
+  DSP_REPLAYGAIN_ALBUM,
+} dsp_replaygain_mode_t;
+
+/**
+ * Sets up an empty chain.
+ *
+ * @param chain The chain.
+ * @param channels The number of interleaved channels it processes.
+ * @return OASIS_SUCCESS if the chain was set up, OASIS_ERROR_INVALID_ARGUMENT
+ * if there are more than DSP_MAX_CHANNELS.
+ */
+oasis_result_t dsp_chain_init(dsp_chain_t *chain, int channels);
+
+/**
+ * Appends a node to a chain, before it processes anything.
+ *
+ * @param chain The chain.
+ * @param node The node, must outlive the chain.
+ * @return OASIS_SUCCESS if the node was added, OASIS_ERROR_INVALID_ARGUMENT if
+ * the chain is full or the node is for another number of channels.
+ */
+oasis_result_t dsp_chain_add(dsp_chain_t *chain, dsp_node_t *node);
+
+/**
+ * Runs frames through every node that is not bypassed, in blocks of
+ * DSP_BLOCK_FRAMES.
+ *
+ * @param chain The chain.
+ * @param samples Interleaved float frames, processed in place.
+ * @param frames The number of frames.
+ */
+void dsp_chain_process(dsp_chain_t *chain, float *samples, size_t frames);
+
+/**
+ * Forgets the audio processed so far, for a seek or a new track. Volume ramps
+ * are kept.
+ *
+ * @param chain The chain.
+ */
+void dsp_chain_reset(dsp_chain_t *chain);
+
+/**
+ * Logs the time every node took per block while profiling.
+ *
+ * @param chain The chain.
+ */
+void dsp_chain_log_profile(const dsp_chain_t *chain);
+
+/**
+ * Bypasses a node or puts it back, from any thread. The change applies from
+ * the next block.
+ *
+ * @param node The node.
+ * @param bypass 1 to skip it, 0 to run it.
+ */
+void dsp_node_set_bypass(dsp_node_t *node, int bypass);
+
+/**
+ * Sets up a gain node at unity.
+ *
+ * @param gain The node.
+ * @param channels The number of channels.
+ */
+void dsp_gain_init(dsp_gain_t *gain, int channels);
+
+/**
+ * Sets the gain, from the thread running the chain. It applies from the next
+ * sample, meant for track boundaries.
+ *
+ * @param gain The node.
+ * @param db The gain in dB.
+ */
+void dsp_gain_set_db(dsp_gain_t *gain, float db);
+
+/**
+ * Finds the gain tags ask for. REPLAYGAIN_* tags are used first, then
+ * R128_*_GAIN ones, brought to the ReplayGain reference level. The gain of
+ * the other mode is used if the mode asked for has none, and the gain is
+ * lowered so the tagged peak can not clip.
+ *
+ * @param metadata The tags.
+ * @param mode Track or album gain.
+ * @param preamp_db Added to the tagged gain.
+ * @param db Set to the gain in dB.
+ * @return 1 if the tags have a gain, 0 otherwise.
+ */
+int dsp_replaygain_from_tags(const AVDictionary *metadata,
+                             dsp_replaygain_mode_t mode, float preamp_db,
+                             float *db);
+
+/**
+ * Sets up a volume node.
+ *
+ * @param volume The node.
+ * @param channels The number of channels.
+ * @param sample_rate The sample rate, for the ramp length.
+ * @param db The volume to start at, in dB.
+ */
+void dsp_volume_init(dsp_volume_t *volume, int channels, int sample_rate,
+                     float db);
+
+/**
+ * Changes the volume from any thread, the node ramps to it.
+ *
+ * @param volume The node.
+ * @param db The volume in dB, DSP_VOLUME_MUTE_DB or less mutes.
+ */
+void dsp_volume_set_db(dsp_volume_t *volume, float db);
+
+/**
+ * Gets the volume the node is ramping to.
+ *
+ * @param volume The node.
+ * @return The volume in dB, DSP_VOLUME_MUTE_DB when muted.
+ */
+float dsp_volume_get_db(dsp_volume_t *volume);
+
+/**
+ * Sets up an EQ node.
+ *
+ * @param eq The node.
+ * @param channels The number of channels.
+ * @param sample_rate The sample rate.
+ * @param bands The bands, in the order they are applied.
+ * @param band_count The number of bands, at most DSP_EQ_MAX_BANDS.
+ * @return OASIS_SUCCESS if the node was set up, OASIS_ERROR_INVALID_ARGUMENT
+ * if there are too many bands or a band is not below Nyquist or has no Q.
+ */
+oasis_result_t dsp_eq_init(dsp_eq_t *eq, int channels, int sample_rate,
+                           const dsp_eq_band_t *bands, int band_count);
+
+/**
+ * Gets the name of the instruction set the EQ kernels use.
+ *
+ * @return "avx2", "sse2" or "scalar".
+ */
+const char *dsp_get_isa_name(void);
+
+#endif
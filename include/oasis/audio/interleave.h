@@ -0,0 +1,36 @@
+#ifndef INTERLEAVE_H
+#define INTERLEAVE_H
+
+#include <stdint.h>
+
+#include <oasis/utils.h>
+
+/**
+ * Interleaves planar samples into a packed buffer.
+ *
+ * The kernel is picked once at runtime from the CPU features (AVX2, SSE2 or
+ * scalar) and is specialized for each sample width and for 1, 2, 6 and 8
+ * channels, any other channel count goes through a generic loop.
+ *
+ * @param dst The packed buffer to write nb_samples * channels samples to.
+ * @param src The channel planes to read from.
+ * @param offset The sample offset to start reading at in every plane.
+ * @param nb_samples The number of samples per channel to interleave.
+ * @param channels The number of channels.
+ * @param bytes_per_sample The width of a sample, 1, 2, 4 or 8.
+ * @return OASIS_SUCCESS if the samples were interleaved,
+ * OASIS_ERROR_UNSUPPORTED_FORMAT if there is no kernel for the sample width,
+ * in which case dst is left untouched.
+ */
+oasis_result_t interleave_samples(uint8_t *dst, uint8_t *const *src, int offset,
+                                  int nb_samples, int channels,
+                                  int bytes_per_sample);
+
+/**
+ * Gets the name of the instruction set the interleave kernels use.
+ *
+ * @return "avx2", "sse2" or "scalar".
+ */
+const char *interleave_get_isa_name(void);
+
+#endif
@@ -0,0 +1,193 @@
+#ifndef MIXER_H
+#define MIXER_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <libavutil/samplefmt.h>
+
+#include <oasis/audio/output.h>
+#include <oasis/audio/sample_convert.h>
+#include <oasis/utils.h>
+
+#define MIXER_MAX_STREAMS 16
+#define MIXER_BLOCK_FRAMES 1024 // Frames mixed per pass
+#define MIXER_COMMAND_CAPACITY 64 // Changes waiting for the next pull
+
+/**
+ * A source the mixer pulls from, only touched by the thread pulling the mix
+ * apart from active.
+ */
+typedef struct {
+  output_pull_callback pull;
+  void *user_data;
+  unsigned active;        // Serial of the stream in the slot, 0 once it left
+  unsigned serial;        // Serial of the stream being mixed
+  int playing;            // Being mixed
+  int remove_when_silent; // Removed once a fade to 0 completes
+  float gain;             // Gain of the next frame
+  float target;           // Gain being ramped to
+  float step;             // Gain change per frame while ramping
+  int64_t ramp_frames;    // Frames left in the ramp
+} mixer_stream_t;
+
+typedef enum {
+  MIXER_COMMAND_ADD,
+  MIXER_COMMAND_REMOVE,
+  MIXER_COMMAND_GAIN,
+  MIXER_COMMAND_FADE_OUT,
+} mixer_command_type_t;
+
+/**
+ * A change to a stream, applied by the thread pulling the mix.
+ */
+typedef struct {
+  mixer_command_type_t type;
+  int id;
+  unsigned serial; // Of the stream it applies to
+  output_pull_callback pull;
+  void *user_data;
+  float gain;
+  int64_t frames;
+} mixer_command_t;
+
+/**
+ * Sums any number of sources of one format with per-stream gain ramps.
+ *
+ * Every source is converted to float and accumulated, the sum is clamped and
+ * converted back once with the sample conversion kernels. It pulls like a
+ * single source, so it can sit between the sources and the output. The mix
+ * and gain kernels are picked once at runtime from the CPU features, like the
+ * interleave kernels.
+ *
+ * Pulling never locks or allocates, so it can run on a real-time thread.
+ * Changes to the streams are queued by the control side, which serializes
+ * itself with a lock, and applied at the start of the next pull.
+ */
+typedef struct {
+  mixer_stream_t streams[MIXER_MAX_STREAMS];
+  mixer_command_t commands[MIXER_COMMAND_CAPACITY];
+  uint64_t command_head __attribute__((aligned(64))); // Queued by control
+  uint64_t command_tail __attribute__((aligned(64))); // Applied by the pull
+  int pulling;                                        // Inside mixer_pull
+  unsigned serials[MIXER_MAX_STREAMS];                // Last one per slot
+  int sample_rate;
+  int channels;
+  enum AVSampleFormat sample_format; // Packed formats only
+  size_t stride;                     // Bytes per frame
+  float *accumulator;                // MIXER_BLOCK_FRAMES frames
+  float *samples;                    // A source converted to float
+  uint8_t *scratch;                  // A source as pulled
+  sample_convert_fn to_float;        // From sample_format
+  sample_convert_fn from_float;      // Back to sample_format
+  pthread_mutex_t lock;              // Between control threads only
+} mixer_t;
+
+/**
+ * Initializes a mixer without any stream.
+ *
+ * @param mixer The mixer to initialize.
+ * @param sample_rate The sample rate of the sources and the mix.
+ * @param channels The number of channels.
+ * @param sample_format The packed sample format of the sources and the mix.
+ * @return OASIS_SUCCESS if the mixer was initialized, an error code otherwise.
+ */
+oasis_result_t mixer_init(mixer_t *mixer, int sample_rate, int channels,
+                          enum AVSampleFormat sample_format);
+
+/**
+ * Frees a mixer, its sources are not touched.
+ *
+ * @param mixer The mixer to free.
+ */
+void mixer_free(mixer_t *mixer);
+
+/**
+ * Adds a source to the mix.
+ *
+ * @param mixer The mixer.
+ * @param pull The callback the source is pulled from.
+ * @param user_data The user data passed to pull.
+ * @param gain The gain the source starts at.
+ * @return The id of the stream, -1 if every slot is taken or too many changes
+ * are waiting.
+ */
+int mixer_add_stream(mixer_t *mixer, output_pull_callback pull,
+                     void *user_data, float gain);
+
+/**
+ * Removes a source from the mix right away. Once this returns the source will
+ * not be pulled from again.
+ *
+ * @param mixer The mixer.
+ * @param id The stream.
+ */
+void mixer_remove_stream(mixer_t *mixer, int id);
+
+/**
+ * Ramps the gain of a stream linearly.
+ *
+ * @param mixer The mixer.
+ * @param id The stream.
+ * @param gain The gain to end at.
+ * @param frames The length of the ramp, 0 to jump.
+ */
+void mixer_set_gain(mixer_t *mixer, int id, float gain, int64_t frames);
+
+/**
+ * Fades a stream out and removes it once it is silent. Without a fade it is
+ * removed like with mixer_remove_stream.
+ *
+ * @param mixer The mixer.
+ * @param id The stream.
+ * @param frames The length of the fade.
+ */
+void mixer_fade_out(mixer_t *mixer, int id, int64_t frames);
+
+/**
+ * Checks whether a stream is still part of the mix. Streams leave once their
+ * source ends or their fade out completes.
+ *
+ * @param mixer The mixer.
+ * @param id The stream.
+ * @return 1 if the stream is active, 0 otherwise.
+ */
+int mixer_stream_active(mixer_t *mixer, int id);
+
+/**
+ * Pulls the mix, an output_pull_callback taking the mixer as user data.
+ * Sources that fall short are padded with silence up to what the fullest
+ * source gave, the end of the stream comes once no source is left.
+ *
+ * @param user_data The mixer.
+ * @param buffer The buffer to fill.
+ * @param frames The number of frames wanted.
+ * @param end_of_stream Set to 1 once every source has ended.
+ * @return The number of frames written to buffer.
+ */
+size_t mixer_pull(void *user_data, uint8_t *buffer, size_t frames,
+                  int *end_of_stream);
+
+/**
+ * Adds a source to an accumulator with a linear gain ramp, frame i is scaled
+ * by gain + i * step.
+ *
+ * @param accumulator The interleaved float sum to add to.
+ * @param samples The interleaved float source.
+ * @param frames The number of frames.
+ * @param channels The number of channels.
+ * @param gain The gain of the first frame.
+ * @param step The gain change per frame, 0 for a constant gain.
+ */
+void mixer_mix_float(float *accumulator, const float *samples, size_t frames,
+                     int channels, float gain, float step);
+
+/**
+ * Gets the name of the instruction set the mixer kernels use.
+ *
+ * @return "avx2", "sse2" or "scalar".
+ */
+const char *mixer_get_isa_name(void);
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef MMAP_INPUT_H
+#define MMAP_INPUT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <libavformat/avformat.h>
+
+#include <oasis/utils.h>
+
+#define MMAP_INPUT_BUFFER_SIZE (256 * 1024)
+#define MMAP_INPUT_READAHEAD (4 * 1024 * 1024) // Faulted in ahead of a seek
+
+/**
+ * A local file mapped into memory and exposed to libavformat through a custom
+ * AVIOContext, so the demuxer reads it without a syscall per buffer refill.
+ */
+typedef struct {
+  uint8_t *data;
+  size_t size;
+  size_t position;
+  AVIOContext *avio;
+} mmap_input_t;
+
+/**
+ * Maps a file for reading through an AVIOContext. Only regular files can be
+ * mapped, anything else should be opened the usual way.
+ *
+ * Mapping can be turned off with OASIS_NO_MMAP set in the environment.
+ *
+ * @param input The input to open.
+ * @param filename The file to map.
+ * @return OASIS_SUCCESS if the file was mapped,
+ * OASIS_ERROR_UNSUPPORTED_OPERATION if it can not be and should be opened the
+ * usual way, an error code otherwise.
+ */
+oasis_result_t mmap_input_open(mmap_input_t *input, const char *filename);
+
+/**
+ * Unmaps the file and frees the AVIOContext. The format context using it has
+ * to be closed first.
+ *
+ * @param input The input to close, may be one that was never opened.
+ */
+void mmap_input_close(mmap_input_t *input);
+
+/**
+ * Opens a format context on a file, through a mapping when the file allows it.
+ *
+ * @param fmt_ctx Set to the opened format context.
+ * @param input The input backing the context, must be closed after it.
+ * @param filename The file to open.
+ * @return OASIS_SUCCESS if the file was opened, an error code otherwise.
+ */
+oasis_result_t mmap_input_open_format(AVFormatContext **fmt_ctx,
+                                      mmap_input_t *input,
+                                      const char *filename);
+
+#endif
@@ -0,0 +1,241 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <semaphore.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <libavutil/samplefmt.h>
+
+#include <oasis/utils.h>
+
+#define OUTPUT_DEFAULT_PERIOD_MS 5
+
+/**
+ * The audio output backends.
+ */
+typedef enum {
+  OUTPUT_BACKEND_MINIAUDIO = 0, // Callback driven, the default
+  OUTPUT_BACKEND_AVDEVICE = 1,  // libavdevice pulse/alsa/oss muxers
+  OUTPUT_BACKEND_NULL = 2,      // Discards what it pulls, no device needed
+  OUTPUT_BACKEND_FILE = 3,      // Writes what it pulls to a WAV or raw file
+} output_backend_t;
+
+/**
+ * Pulls interleaved PCM for the output, called from the output thread.
+ *
+ * @param user_data The user data passed to output_open.
+ * @param buffer The buffer to fill.
+ * @param frames The number of frames wanted.
+ * @param end_of_stream Set to 1 once the source has nothing more to give.
+ * @return The number of frames written to buffer.
+ */
+typedef size_t (*output_pull_callback)(void *user_data, uint8_t *buffer,
+                                       size_t frames, int *end_of_stream);
+
+/**
+ * The output configuration.
+ */
+typedef struct {
+  output_backend_t backend;
+  int sample_rate;
+  int channels;
+  enum AVSampleFormat sample_format; // Packed formats only
+  int period_size;                   // Frames per device period, 0 = 5 ms
+  int null_device;                   // Use miniaudio's null backend
+  int realtime; // Pull on a real-time thread, the source must not allocate,
+                // lock or log, see realtime.h
+  const char *path; // File backend, a .wav gets a header, the rest is raw
+  double speed;     // Null and file backends, the clock they pull at as a
+                    // multiple of real time, 0 for as fast as the source gives
+} output_config_t;
+
+typedef struct audio_output audio_output_t;
+
+/**
+ * The functions every output backend implements.
+ */
+typedef struct {
+  const char *name;
+  void (*discover)(void); // Optional, finds the device once for every open
+  oasis_result_t (*open)(audio_output_t *output);
+  oasis_result_t (*start)(audio_output_t *output);
+  void (*resume)(audio_output_t *output); // Optional, wakes a backend asleep
+                                          // on a pause or the end of stream
+  void (*close)(audio_output_t *output);
+} output_backend_ops_t;
+
+/**
+ * An audio output, pulls PCM from its source on the backend's own thread.
+ */
+struct audio_output {
+  output_config_t config;
+  const output_backend_ops_t *ops;
+  void *backend_data;
+
+  output_pull_callback pull;
+  void *user_data;
+  size_t stride; // Bytes per frame
+
+  int started;
+  int unpaced; // Pulls as fast as it can, short pulls are not underruns
+  int paused;
+  int pause_acked;
+  int finished;
+  int failed; // The backend gave up, the output has to be reopened
+  sem_t pause_ack;
+
+  double latency_ms;        // Device buffering, measured once opened
+  uint64_t frames_rendered; // Frames handed to the device by the source
+  uint64_t silence_frames;  // Frames padded with silence on underruns
+};
+
+/**
+ * Opens an audio output.
+ *
+ * @param output The output to open.
+ * @param config The output configuration.
+ * @param pull The callback the output pulls PCM from.
+ * @param user_data The user data passed to pull.
+ * @return OASIS_SUCCESS if the output was opened, an error code otherwise.
+ */
+oasis_result_t output_open(audio_output_t *output, const output_config_t *config,
+                           output_pull_callback pull, void *user_data);
+
+/**
+ * An output kept open across playbacks, only reopened when the stream format
+ * or the rest of the configuration changes.
+ */
+typedef struct {
+  audio_output_t output;
+  int open;
+} output_session_t;
+
+/**
+ * Finds the devices of every backend, once per process. Opening an output
+ * waits for this, so calling output_discover_async early at startup takes it
+ * off the path of the first playback.
+ */
+void output_discover(void);
+
+/**
+ * Runs output_discover on a background thread.
+ */
+void output_discover_async(void);
+
+/**
+ * Points an output at another source. The old source is not pulled from once
+ * this returns, the output is left paused for output_resume.
+ *
+ * @param output The output.
+ * @param pull The callback to pull from.
+ * @param user_data The user data passed to pull.
+ */
+void output_set_source(audio_output_t *output, output_pull_callback pull,
+                       void *user_data);
+
+/**
+ * Gets an output for a configuration from a session, reusing the open one
+ * when the configuration matches and reopening it otherwise.
+ *
+ * @param session The session.
+ * @param config The output configuration.
+ * @param pull The callback to pull from.
+ * @param user_data The user data passed to pull.
+ * @param output Set to the output, it has to be started or resumed.
+ * @return OASIS_SUCCESS if there is an output, an error code otherwise.
+ */
+oasis_result_t output_session_acquire(output_session_t *session,
+                                      const output_config_t *config,
+                                      output_pull_callback pull,
+                                      void *user_data,
+                                      audio_output_t **output);
+
+/**
+ * Hands the output back to the session, it is paused and keeps the device
+ * open for the next output_session_acquire.
+ *
+ * @param session The session.
+ */
+void output_session_release(output_session_t *session);
+
+/**
+ * Closes the output of a session.
+ *
+ * @param session The session.
+ */
+void output_session_close(output_session_t *session);
+
+/**
+ * Overrides the output configuration from the environment, so a headless run
+ * can pick a sink without going through the API. OASIS_OUTPUT selects the
+ * backend (miniaudio, avdevice, null or file), OASIS_OUTPUT_PATH the file and
+ * OASIS_OUTPUT_SPEED the clock of the null and file backends.
+ *
+ * @param config The configuration to override.
+ */
+void output_config_from_env(output_config_t *config);
+
+/**
+ * Starts pulling from the source.
+ *
+ * @param output The output to start.
+ * @return OASIS_SUCCESS if the output was started, an error code otherwise.
+ */
+oasis_result_t output_start(audio_output_t *output);
+
+/**
+ * Pauses the output, once this returns the source will not be pulled from
+ * until output_resume is called.
+ *
+ * @param output The output to pause.
+ */
+void output_pause(audio_output_t *output);
+
+/**
+ * Resumes a paused output.
+ *
+ * @param output The output to resume.
+ */
+void output_resume(audio_output_t *output);
+
+/**
+ * Checks if the source has reached the end of its stream. The backend keeps
+ * the device open until the output is closed or given another source.
+ *
+ * @param output The output.
+ * @return 1 if the source is finished, 0 otherwise.
+ */
+int output_finished(audio_output_t *output);
+
+/**
+ * Waits for the device to play out what it has buffered.
+ *
+ * @param output The output to drain.
+ */
+void output_drain(audio_output_t *output);
+
+/**
+ * Stops and closes the output.
+ *
+ * @param output The output to close.
+ */
+void output_close(audio_output_t *output);
+
+/**
+ * Renders frames from the source for a backend, handles pausing and the end
+ * of the stream. Only meant to be called by the backends.
+ *
+ * @param output The output.
+ * @param buffer The buffer to fill.
+ * @param frames The number of frames wanted.
+ * @return The number of frames written, the rest should be silence.
+ */
+size_t output_render(audio_output_t *output, uint8_t *buffer, size_t frames);
+
+extern const output_backend_ops_t output_backend_miniaudio;
+extern const output_backend_ops_t output_backend_avdevice;
+extern const output_backend_ops_t output_backend_null;
+extern const output_backend_ops_t output_backend_file;
+
+#endif
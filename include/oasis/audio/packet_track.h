@@ -0,0 +1,93 @@
+#ifndef PACKET_TRACK_H
+#define PACKET_TRACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+
+#include <oasis/utils.h>
+
+#define PACKET_TRACK_WINDOW_MS 2000 // Decoded PCM kept around the playhead
+#define PACKET_TRACK_PREROLL_MS 100 // Decoded and dropped ahead of a jump
+
+/**
+ * A track held in memory as its compressed packets.
+ *
+ * The whole audio stream is demuxed once, after which the file is no longer
+ * needed. Only a window of PCM around the read position is decoded, so the
+ * track costs its compressed size plus the window, and a read anywhere is a
+ * short decode from the nearest packet without touching the disk.
+ */
+typedef struct {
+  AVCodecParameters *codecpar;
+  AVRational time_base;
+  int64_t start_time; // Stream start in time_base
+
+  AVPacket **packets;
+  int64_t *packet_starts; // First sample of every packet
+  size_t count;
+  size_t capacity;
+  uint64_t packet_bytes; // Compressed bytes held
+
+  AVCodecContext *codec_ctx;
+  AVFrame *frame;
+  size_t next_packet;  // Next packet to send to the decoder
+  int64_t next_sample; // Sample the next decoded frame starts at
+  int draining;        // Every packet has been sent
+
+  uint8_t *window;        // Decoded PCM starting at window_start
+  int64_t window_start;   // Sample the window starts at
+  size_t window_frames;   // Frames in the window
+  size_t window_capacity; // Frames the window can hold
+
+  int sample_rate;
+  int channels;
+  enum AVSampleFormat sample_format; // Always packed (interleaved)
+  size_t stride;                     // Bytes per frame
+  int64_t duration;                  // Length in samples, 0 if unknown
+  int64_t trim_start; // Encoder delay left out of positions, in samples
+  int64_t end; // Exact length without encoder padding, 0 to read to the end
+} packet_track_t;
+
+/**
+ * Demuxes the audio stream of a file into memory and gets it ready to decode.
+ *
+ * @param track The track to load.
+ * @param filename The file to load.
+ * @return OASIS_SUCCESS if the track was loaded, an error code otherwise.
+ */
+oasis_result_t packet_track_load(packet_track_t *track, const char *filename);
+
+/**
+ * Frees a track.
+ *
+ * @param track The track to free.
+ */
+void packet_track_free(packet_track_t *track);
+
+/**
+ * Reads interleaved PCM from any position of the track. Positions leave out
+ * encoder delay and padding the same way a decoder does.
+ *
+ * @param track The track.
+ * @param position The sample to read from.
+ * @param buffer The buffer to fill, frames * stride bytes.
+ * @param frames The number of frames wanted.
+ * @param frames_read Set to the frames read, short only at the end.
+ * @return OASIS_SUCCESS if the read was successful, an error code otherwise.
+ */
+oasis_result_t packet_track_read(packet_track_t *track, int64_t position,
+                                 uint8_t *buffer, int frames,
+                                 int *frames_read);
+
+/**
+ * Gets the memory a track holds, packets and window.
+ *
+ * @param track The track.
+ * @return The bytes held.
+ */
+uint64_t packet_track_get_memory(const packet_track_t *track);
+
+#endif
@@ -0,0 +1,83 @@
+#ifndef PCM_CACHE_H
+#define PCM_CACHE_H
+
+#include <limits.h>
+#include <stdint.h>
+
+#include <oasis/audio/decode.h>
+#include <oasis/utils.h>
+
+#define PCM_CACHE_DEFAULT_MAX_BYTES (2ULL * 1024 * 1024 * 1024)
+
+/**
+ * An on-disk cache of decoded PCM.
+ *
+ * Every entry holds the interleaved samples of one file behind a small header,
+ * keyed by the file's path and checked against its size and modification
+ * time. Hits are mapped rather than read, so the PCM is served straight from
+ * the page cache. The entries' own modification times record their last use
+ * and the least recently used are evicted once the cache outgrows max_bytes.
+ */
+typedef struct {
+  char dir[PATH_MAX];
+  uint64_t max_bytes;
+} pcm_cache_t;
+
+/**
+ * Opens a PCM cache.
+ *
+ * @param cache The cache to open.
+ * @param dir The directory to keep the entries in, NULL for the user's cache
+ * directory.
+ * @param max_bytes The size the cache is evicted down to, 0 for the default.
+ * @return OASIS_SUCCESS if the cache was opened, an error code otherwise.
+ */
+oasis_result_t pcm_cache_open(pcm_cache_t *cache, const char *dir,
+                              uint64_t max_bytes);
+
+/**
+ * Maps the cached PCM of a file, if there is an up to date entry. The audio
+ * data must be freed with audio_data_free.
+ *
+ * @param cache The cache.
+ * @param filename The file to look up.
+ * @param audio_data Filled in with the mapped PCM.
+ * @return OASIS_SUCCESS on a hit, OASIS_ERROR_FILE_NOT_FOUND on a miss, an
+ * error code otherwise.
+ */
+oasis_result_t pcm_cache_lookup(pcm_cache_t *cache, const char *filename,
+                                audio_data_t *audio_data);
+
+/**
+ * Stores the PCM of a file, then evicts down to the cache's size.
+ *
+ * @param cache The cache.
+ * @param filename The file the PCM was decoded from.
+ * @param audio_data The decoded PCM.
+ * @return OASIS_SUCCESS if the entry was stored, an error code otherwise.
+ */
+oasis_result_t pcm_cache_store(pcm_cache_t *cache, const char *filename,
+                               const audio_data_t *audio_data);
+
+/**
+ * Removes the least recently used entries until the cache fits in max_bytes.
+ * Temp files left by interrupted stores count toward the size and go first.
+ *
+ * @param cache The cache.
+ * @return OASIS_SUCCESS if the cache fits, an error code otherwise.
+ */
+oasis_result_t pcm_cache_evict(pcm_cache_t *cache);
+
+/**
+ * Decodes a file to PCM through the cache, a hit is mapped and a miss is
+ * decoded and stored. The audio data must be freed with audio_data_free.
+ *
+ * @param cache The cache.
+ * @param filename The file to decode.
+ * @param audio_data Filled in with the PCM.
+ * @return OASIS_SUCCESS if the PCM is available, an error code otherwise.
+ */
+oasis_result_t pcm_cache_decode(pcm_cache_t *cache, const char *filename,
+                                audio_data_t *audio_data);
+
+#endif
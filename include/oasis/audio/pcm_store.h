@@ -0,0 +1,120 @@
+#ifndef PCM_STORE_H
+#define PCM_STORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <libavutil/samplefmt.h>
+
+#include <oasis/utils.h>
+
+#define PCM_STORE_DEFAULT_CHUNK_BYTES (4 * 1024 * 1024)
+
+/**
+ * Interleaved PCM kept in fixed-size chunks rather than one allocation.
+ *
+ * Chunks hold a whole number of frames and are only allocated once written
+ * to, so a store of any length never needs contiguous memory. Offsets are 64
+ * bit and map to their chunk with a division. Chunks behind the playhead can
+ * be released while the rest of the store stays usable.
+ */
+typedef struct {
+  uint8_t **chunks;  // NULL for chunks not written yet or released
+  uint64_t count;    // Chunks in use, the last one may be partial
+  uint64_t capacity; // Slots in chunks
+  uint64_t released; // Chunks before this one have been released
+  size_t chunk_size; // Bytes per chunk, a multiple of stride
+  size_t stride;     // Bytes per frame
+  uint64_t size;     // Bytes written
+  int sample_rate;
+  int channels;
+  enum AVSampleFormat sample_format; // Packed formats only
+} pcm_store_t;
+
+/**
+ * Initializes an empty store.
+ *
+ * @param store The store to initialize.
+ * @param sample_rate The sample rate of the PCM.
+ * @param channels The number of channels.
+ * @param sample_format The packed sample format of the PCM.
+ * @param chunk_size The bytes per chunk, rounded down to whole frames, 0 for
+ * the default.
+ * @return OASIS_SUCCESS if the store was initialized, an error code otherwise.
+ */
+oasis_result_t pcm_store_init(pcm_store_t *store, int sample_rate,
+                              int channels, enum AVSampleFormat sample_format,
+                              size_t chunk_size);
+
+/**
+ * Frees every chunk of a store.
+ *
+ * @param store The store to free.
+ */
+void pcm_store_free(pcm_store_t *store);
+
+/**
+ * Gets where the next bytes can be written without copying, allocating the
+ * chunk if needed. Written bytes are made part of the store by
+ * pcm_store_commit.
+ *
+ * @param store The store.
+ * @param available Set to the bytes that fit in the current chunk.
+ * @return The write position, NULL if a chunk could not be allocated.
+ */
+uint8_t *pcm_store_write_pointer(pcm_store_t *store, size_t *available);
+
+/**
+ * Makes bytes written at the write pointer part of the store.
+ *
+ * @param store The store.
+ * @param bytes The bytes written, at most what was available.
+ */
+void pcm_store_commit(pcm_store_t *store, size_t bytes);
+
+/**
+ * Appends PCM to the store.
+ *
+ * @param store The store.
+ * @param data The PCM to append.
+ * @param bytes The number of bytes to append.
+ * @return OASIS_SUCCESS if the PCM was appended, an error code otherwise.
+ */
+oasis_result_t pcm_store_append(pcm_store_t *store, const uint8_t *data,
+                                size_t bytes);
+
+/**
+ * Gets the PCM at an offset in place.
+ *
+ * @param store The store.
+ * @param offset The byte offset.
+ * @param contiguous Set to the bytes readable from the returned pointer
+ * before the chunk ends.
+ * @return The PCM at offset, NULL if it is past the end or released.
+ */
+const uint8_t *pcm_store_at(const pcm_store_t *store, uint64_t offset,
+                            size_t *contiguous);
+
+/**
+ * Copies PCM out of the store, across chunks.
+ *
+ * @param store The store.
+ * @param offset The byte offset to read from.
+ * @param buffer The buffer to copy into.
+ * @param bytes The number of bytes wanted.
+ * @return The number of bytes copied, short at the end of the store or at a
+ * released chunk.
+ */
+size_t pcm_store_read(const pcm_store_t *store, uint64_t offset,
+                      uint8_t *buffer, size_t bytes);
+
+/**
+ * Frees the chunks that lie entirely before an offset, typically the
+ * playhead.
+ *
+ * @param store The store.
+ * @param offset The byte offset nothing before which is needed anymore.
+ */
+void pcm_store_release(pcm_store_t *store, uint64_t offset);
+
+#endif
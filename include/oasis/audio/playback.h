@@ -1,8 +1,49 @@
 #ifndef PLAYBACK_H
 #define PLAYBACK_H
 
+#include <oasis/audio/channel_mix.h>
+#include <oasis/audio/command_queue.h>
+#include <oasis/audio/decode.h>
+#include <oasis/audio/dsp.h>
+#include <oasis/audio/output.h>
 #include <oasis/utils.h>
 
+#define PLAYBACK_DEFAULT_BUFFER_MS 500
+#define PLAYBACK_PRELOAD_MS 10000 // Next track is opened this close to the end
+#define PLAYBACK_REALTIME_POLL_MS 10 // How often a decoder feeding a real-time
+                                     // output checks for space
+
+/**
+ * Options for playback, fields left at 0 fall back to their defaults.
+ */
+typedef struct {
+  int buffer_ms;         // Capacity of the decode ring buffer
+  int low_watermark_ms;  // The decoder resumes once the buffer drains to this
+  int high_watermark_ms; // The decoder pauses once the buffer fills to this
+  output_backend_t output_backend; // Falls back to avdevice if miniaudio fails,
+                                   // OASIS_OUTPUT overrides it
+  int period_size;                 // Output period in frames
+  int null_output;                 // Play to a null device, for headless runs
+  const char *output_path;         // For the file backend
+  double output_speed; // Clock of the null and file backends as a multiple of
+                       // real time, 0 for as fast as decoding goes
+  command_queue_t *commands; // Commands from other threads, NULL for keys only
+  const audio_stream_selection_t *stream; // NULL for the best audio stream
+  int crossfade_ms; // Overlap between queued tracks, 0 plays them gaplessly
+  int sample_rate;  // Rate everything is played at, 0 for the first track's
+  int channels;     // Channels it is played on, 0 for the first track's
+  const channel_matrix_t *channel_matrix; // For the tracks whose channels it
+                                          // fits, NULL for standard matrices
+  int realtime; // Output on a SCHED_FIFO thread that never allocates, locks
+                // or logs, with its buffers locked in RAM
+  dsp_replaygain_mode_t replaygain; // Gain from the tags of every track
+  float replaygain_preamp_db;       // Added to the tagged gain
+  float volume_db; // Software volume, PLAYBACK_COMMAND_VOLUME changes it
+  const dsp_eq_band_t *eq_bands; // Applied after the volume, NULL for none
+  int eq_band_count;
+  int dsp_profile; // Log what every DSP node costs per block
+} playback_options_t;
+
 /**
  * Plays an audio file.
  *
@@ -12,4 +53,46 @@
 
 oasis_result_t playback_play(const char *filename);
 
+/**
+ * Plays an audio file, decoding on a separate thread into a ring buffer.
+ *
+ * @param filename The filename of the audio file to play.
+ * @param options The playback options, NULL for the defaults.
+ * @return OASIS_SUCCESS if the playback was successful, an error code
+ * otherwise.
+ */
+oasis_result_t playback_play_with_options(const char *filename,
+                                          const playback_options_t *options);
+
+/**
+ * Plays audio files one after another.
+ *
+ * The next file is opened in the background as the current one nears its end
+ * and, when it has the same format, its samples follow the last sample of the
+ * current one in the same output stream, without encoder delay or padding in
+ * between. Every track is converted to float at one sample rate and remixed
+ * to one number of channels, so only a layout without a standard matrix needs
+ * a new output. With crossfade_ms set, tracks of the same format overlap
+ * instead, the next one fading in through the mixer as the current one fades
+ * out. Files that fail to open are skipped.
+ *
+ * Every track is brought to its ReplayGain on its way into the ring buffer,
+ * the volume and EQ are applied to what the output pulls, after the mix, so
+ * they take effect within a period.
+ *
+ * @param filenames The files to play, in order.
+ * @param count The number of files.
+ * @param options The playback options, NULL for the defaults.
+ * @return OASIS_SUCCESS if the playback was successful, an error code
+ * otherwise.
+ */
+oasis_result_t playback_play_queue(const char *const *filenames, size_t count,
+                                   const playback_options_t *options);
+
+/**
+ * Closes the output device playbacks keep open between them. The next
+ * playback opens it again, so this is only needed to let go of the device.
+ */
+void playback_close_output(void);
+
 #endif
@@ -0,0 +1,42 @@
+#ifndef PROBE_H
+#define PROBE_H
+
+#include <stdint.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavutil/samplefmt.h>
+
+#include <oasis/utils.h>
+
+#define AUDIO_PROBE_SIZE 32768        // Bytes the format probe may read
+#define AUDIO_PROBE_ANALYZE_US 500000 // Stream time the probe may look at
+
+/**
+ * What the container says about the audio stream a decoder would pick.
+ */
+typedef struct {
+  int64_t duration;       // Length in samples, 0 if unknown
+  int duration_estimated; // duration was derived from the bit rate
+  int sample_rate;
+  int channels;
+  enum AVSampleFormat sample_format; // AV_SAMPLE_FMT_NONE when only decoding
+                                     // would tell, as for most lossy codecs
+  enum AVCodecID codec_id;
+  int64_t bit_rate; // Bits per second, 0 if unknown
+  int stream_index;
+} audio_probe_t;
+
+/**
+ * Reads the format and audio stream parameters of a file from its container
+ * headers alone. Nothing is decoded and the reads are bounded, so this is
+ * cheap enough to run over a whole library.
+ *
+ * @param filename The file to probe.
+ * @param probe Filled in with what was found.
+ * @return OASIS_SUCCESS if the file has an audio stream,
+ * OASIS_ERROR_FILE_NOT_FOUND if it does not exist, OASIS_ERROR_FILE_NOT_MEDIA
+ * if it is not a media file or has no audio stream.
+ */
+oasis_result_t audio_probe(const char *filename, audio_probe_t *probe);
+
+#endif
@@ -0,0 +1,89 @@
+#ifndef REALTIME_H
+#define REALTIME_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <oasis/utils.h>
+
+#define REALTIME_PRIORITY 20 // SCHED_FIFO priority, rtkit's default ceiling
+
+/**
+ * Real-time audio threads.
+ *
+ * A thread is real-time between realtime_enter and realtime_leave. It must not
+ * allocate, lock or make syscalls other than the device write there, oasis_log
+ * drops its messages and counts them as violations instead. Debug builds also
+ * count every malloc, calloc, realloc, posix_memalign and free made by a
+ * real-time thread, through the sanitizer allocator hooks under ASan or by
+ * wrapping the glibc allocator otherwise.
+ */
+
+/**
+ * Moves the calling thread to SCHED_FIFO.
+ *
+ * @param priority The SCHED_FIFO priority.
+ * @return OASIS_SUCCESS if the thread was promoted,
+ * OASIS_ERROR_UNSUPPORTED_OPERATION if we are not allowed to, see
+ * RLIMIT_RTPRIO.
+ */
+oasis_result_t realtime_promote_thread(int priority);
+
+/**
+ * Locks memory into RAM, so touching it can not page fault.
+ *
+ * @param address The start of the memory.
+ * @param size The size in bytes.
+ * @return OASIS_SUCCESS if the memory was locked, OASIS_ERROR otherwise, see
+ * RLIMIT_MEMLOCK.
+ */
+oasis_result_t realtime_lock_memory(const void *address, size_t size);
+
+/**
+ * Unlocks memory locked with realtime_lock_memory.
+ *
+ * @param address The start of the memory.
+ * @param size The size in bytes.
+ */
+void realtime_unlock_memory(const void *address, size_t size);
+
+/**
+ * Marks the calling thread as real-time until realtime_leave, calls nest.
+ */
+void realtime_enter(void);
+
+/**
+ * Ends a realtime_enter.
+ */
+void realtime_leave(void);
+
+/**
+ * Checks if the calling thread is real-time.
+ *
+ * @return 1 if it is, 0 otherwise.
+ */
+int realtime_active(void);
+
+/**
+ * Counts a call a real-time thread should not have made, safe to call from
+ * anywhere including the allocator.
+ *
+ * @param call The name of the call, a string literal.
+ */
+void realtime_violation(const char *call);
+
+/**
+ * Gets the number of violations since the last reset.
+ *
+ * @param first Set to the name of the first one, NULL if there was none. May
+ * be NULL.
+ * @return The number of violations.
+ */
+uint64_t realtime_get_violations(const char **first);
+
+/**
+ * Clears the violation count.
+ */
+void realtime_reset_violations(void);
+
+#endif
@@ -0,0 +1,96 @@
+#ifndef RESAMPLE_H
+#define RESAMPLE_H
+
+#include <stdint.h>
+
+#include <libavutil/samplefmt.h>
+#include <libswresample/swresample.h>
+
+#include <oasis/audio/sample_convert.h>
+#include <oasis/utils.h>
+
+#define AUDIO_INTERNAL_SAMPLE_FORMAT AV_SAMPLE_FMT_FLT // What playback runs on
+#define RESAMPLER_CACHE_CAPACITY 4
+
+/**
+ * Converts a source to another sample rate and packed sample format, keeping
+ * the channels as they are.
+ *
+ * A source that already has the wanted rate and packed format passes through
+ * without a conversion context, it is only copied or interleaved. One that
+ * only differs in sample format goes through the sample conversion kernels,
+ * frame for frame, and only rate changes take a conversion context. Conversion
+ * contexts come from a small process wide cache, so moving from one track to
+ * the next in the same format reuses the context instead of building its
+ * filters again.
+ */
+typedef struct {
+  SwrContext *swr; // NULL unless the rate changes
+  int passthrough;
+  sample_converter_t converter; // Set up when only the sample format changes
+  int in_rate;
+  int channels;
+  enum AVSampleFormat in_format; // Planar or packed
+  int out_rate;
+  enum AVSampleFormat out_format; // Always packed (interleaved)
+  const uint8_t **planes;         // Source planes moved to the read offset
+} resampler_t;
+
+/**
+ * Sets up a resampler, or sets it up again for another source. The context it
+ * held goes back to the cache.
+ *
+ * @param resampler The resampler, zeroed before it is first configured.
+ * @param in_rate The sample rate of the source.
+ * @param channels The number of channels.
+ * @param in_format The sample format of the source, planar or packed.
+ * @param out_rate The sample rate to convert to.
+ * @param out_format The packed sample format to convert to.
+ * @return OASIS_SUCCESS if the resampler was configured, an error code
+ * otherwise.
+ */
+oasis_result_t resampler_configure(resampler_t *resampler, int in_rate,
+                                   int channels, enum AVSampleFormat in_format,
+                                   int out_rate, enum AVSampleFormat out_format);
+
+/**
+ * Converts samples, whatever does not fit in the output is kept for the next
+ * call.
+ *
+ * @param resampler The resampler.
+ * @param dst The packed buffer to write to.
+ * @param dst_frames The number of frames dst can hold.
+ * @param src The source planes, one for packed sources, NULL to only hand out
+ * what is kept from earlier calls.
+ * @param offset The frame offset to start reading at in every plane.
+ * @param src_frames The number of frames to convert.
+ * @return The number of frames written to dst, a negative AVERROR on failure.
+ */
+int resampler_convert(resampler_t *resampler, uint8_t *dst, int dst_frames,
+                      uint8_t *const *src, int offset, int src_frames);
+
+/**
+ * Hands out what the filters still hold at the end of the source.
+ *
+ * @param resampler The resampler.
+ * @param dst The packed buffer to write to.
+ * @param dst_frames The number of frames dst can hold.
+ * @return The number of frames written to dst, 0 once nothing is left.
+ */
+int resampler_flush(resampler_t *resampler, uint8_t *dst, int dst_frames);
+
+/**
+ * Drops everything kept from earlier calls, after a seek.
+ *
+ * @param resampler The resampler.
+ */
+void resampler_reset(resampler_t *resampler);
+
+/**
+ * Gives the conversion context back to the cache and frees the rest.
+ *
+ * @param resampler The resampler.
+ */
+void resampler_free(resampler_t *resampler);
+
+#endif
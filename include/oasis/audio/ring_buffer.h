@@ -0,0 +1,185 @@
+#ifndef RING_BUFFER_H
+#define RING_BUFFER_H
+
+#include <semaphore.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <oasis/utils.h>
+
+/**
+ * A single-producer/single-consumer byte ring buffer.
+ *
+ * Reads and writes are wait-free, head is only advanced by the producer and
+ * tail only by the consumer. The producer can block once the fill level
+ * reaches the high watermark, the consumer wakes it when the fill level drops
+ * to the low watermark. A consumer on a real-time thread can leave the
+ * producer to poll instead, so reading never makes a syscall.
+ */
+typedef struct {
+  uint8_t *data;
+  size_t capacity;
+  size_t low_watermark;
+  size_t high_watermark;
+
+  // Total bytes written and read, kept on their own cache lines
+  uint64_t head __attribute__((aligned(64)));
+  uint64_t tail __attribute__((aligned(64)));
+
+  // Consumer side statistics
+  uint64_t underruns; // Reads that came back short before the end of stream
+  uint64_t reads;
+
+  int eof;
+  int producer_waiting;
+  int poll_ms; // The producer checks back this often instead of being woken
+  sem_t space_available;
+} ring_buffer_t;
+
+/**
+ * Initializes a ring buffer.
+ *
+ * The capacity and watermarks should be multiples of the frame size, so the
+ * regions handed out never split a frame.
+ *
+ * @param rb The ring buffer to initialize.
+ * @param capacity The capacity in bytes.
+ * @param low_watermark The fill level in bytes at which a waiting producer is
+ * woken up.
+ * @param high_watermark The fill level in bytes at which the producer should
+ * stop and wait.
+ * @return OASIS_SUCCESS if the ring buffer was initialized, an error code
+ * otherwise.
+ */
+oasis_result_t ring_buffer_init(ring_buffer_t *rb, size_t capacity,
+                                size_t low_watermark, size_t high_watermark);
+
+/**
+ * Frees a ring buffer.
+ *
+ * @param rb The ring buffer to free.
+ */
+void ring_buffer_free(ring_buffer_t *rb);
+
+/**
+ * Empties the ring buffer and clears the end of stream flag, only safe while
+ * neither side is running.
+ *
+ * @param rb The ring buffer to reset.
+ */
+void ring_buffer_reset(ring_buffer_t *rb);
+
+/**
+ * Gets the number of bytes that can be read.
+ *
+ * @param rb The ring buffer.
+ * @return The fill level in bytes.
+ */
+size_t ring_buffer_fill(ring_buffer_t *rb);
+
+/**
+ * Gets the number of bytes that can be written.
+ *
+ * @param rb The ring buffer.
+ * @return The free space in bytes.
+ */
+size_t ring_buffer_space(ring_buffer_t *rb);
+
+/**
+ * Writes up to bytes bytes, producer only.
+ *
+ * @param rb The ring buffer to write to.
+ * @param src The data to write.
+ * @param bytes The number of bytes to write.
+ * @return The number of bytes written.
+ */
+size_t ring_buffer_write(ring_buffer_t *rb, const uint8_t *src, size_t bytes);
+
+/**
+ * Reads up to bytes bytes, consumer only. A short read before the end of
+ * stream is counted as an underrun.
+ *
+ * @param rb The ring buffer to read from.
+ * @param dst The buffer to read into.
+ * @param bytes The number of bytes to read.
+ * @return The number of bytes read.
+ */
+size_t ring_buffer_read(ring_buffer_t *rb, uint8_t *dst, size_t bytes);
+
+/**
+ * Gets the contiguous writable region, producer only.
+ *
+ * @param rb The ring buffer.
+ * @param region Set to the start of the region.
+ * @return The size of the region in bytes.
+ */
+size_t ring_buffer_begin_write(ring_buffer_t *rb, uint8_t **region);
+
+/**
+ * Publishes bytes written into the region from ring_buffer_begin_write.
+ *
+ * @param rb The ring buffer.
+ * @param bytes The number of bytes written.
+ */
+void ring_buffer_end_write(ring_buffer_t *rb, size_t bytes);
+
+/**
+ * Gets the contiguous readable region, consumer only.
+ *
+ * @param rb The ring buffer.
+ * @param region Set to the start of the region.
+ * @return The size of the region in bytes.
+ */
+size_t ring_buffer_begin_read(ring_buffer_t *rb, uint8_t **region);
+
+/**
+ * Releases bytes read from the region from ring_buffer_begin_read.
+ *
+ * @param rb The ring buffer.
+ * @param bytes The number of bytes consumed.
+ */
+void ring_buffer_end_read(ring_buffer_t *rb, size_t bytes);
+
+/**
+ * Blocks the producer until the fill level drops to the low watermark or
+ * ring_buffer_wake_producer is called.
+ *
+ * @param rb The ring buffer.
+ */
+void ring_buffer_wait_for_space(ring_buffer_t *rb);
+
+/**
+ * Makes the producer poll the fill level while it waits instead of being
+ * woken by the consumer, ring_buffer_wake_producer still wakes it right away.
+ * Only safe while neither side is running.
+ *
+ * @param rb The ring buffer.
+ * @param poll_ms How often the producer checks the fill level, 0 to be woken
+ * by the consumer.
+ */
+void ring_buffer_set_poll_ms(ring_buffer_t *rb, int poll_ms);
+
+/**
+ * Wakes up a producer blocked in ring_buffer_wait_for_space, or makes its next
+ * wait return right away if it is not waiting yet.
+ *
+ * @param rb The ring buffer.
+ */
+void ring_buffer_wake_producer(ring_buffer_t *rb);
+
+/**
+ * Marks the end of the stream, producer only.
+ *
+ * @param rb The ring buffer.
+ */
+void ring_buffer_set_eof(ring_buffer_t *rb);
+
+/**
+ * Checks if the stream has ended and everything has been read.
+ *
+ * @param rb The ring buffer.
+ * @return 1 if the stream is drained, 0 otherwise.
+ */
+int ring_buffer_drained(ring_buffer_t *rb);
+
+#endif
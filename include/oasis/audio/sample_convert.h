@@ -0,0 +1,122 @@
+#ifndef SAMPLE_CONVERT_H
+#define SAMPLE_CONVERT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <libavutil/samplefmt.h>
+
+#include <oasis/utils.h>
+
+#define SAMPLE_CONVERT_BLOCK_FRAMES 256 // Staged at a time on layout changes
+
+/**
+ * State of the TPDF dither added when reducing the bit depth.
+ */
+typedef struct {
+  int bits;           // Depth to dither to, 0 for no dither
+  uint32_t state[8];  // xorshift state, one per vector lane
+} sample_dither_t;
+
+/**
+ * Converts a sample to another sample format, one run of samples at a time.
+ *
+ * @param dst The samples to write.
+ * @param src The samples to read.
+ * @param count The number of samples, frames times channels.
+ * @param dither The dither state, only used by the dithering kernels.
+ */
+typedef void (*sample_convert_fn)(uint8_t *dst, const uint8_t *src,
+                                  size_t count, sample_dither_t *dither);
+
+/**
+ * Converts between two sample formats, planar or packed.
+ *
+ * Every pair of U8, S16, S32, S64, FLT and DBL has its own kernel, picked
+ * once at runtime from the CPU features (AVX2, SSE2 or scalar) like the
+ * interleave kernels. Floats are full scale at 1.0, integers at their
+ * negative limit, floats are clamped on the way to integers and integers of
+ * different widths are shifted. Reducing the bit depth can add TPDF dither.
+ * A change between planar and packed goes through a small block of scratch.
+ */
+typedef struct {
+  enum AVSampleFormat src_format;
+  enum AVSampleFormat dst_format;
+  int channels;
+  sample_convert_fn kernel;
+  sample_dither_t dither;
+  uint8_t *scratch; // SAMPLE_CONVERT_BLOCK_FRAMES frames, on layout changes
+} sample_converter_t;
+
+/**
+ * Initializes a converter.
+ *
+ * @param converter The converter to initialize.
+ * @param src_format The format to convert from, planar or packed.
+ * @param dst_format The format to convert to, planar or packed.
+ * @param channels The number of channels.
+ * @param dither_bits The depth to dither to when it is lower than the source,
+ * for example 16 for S16 or 24 for S32 holding 24 bit samples, 0 for none.
+ * @return OASIS_SUCCESS if the converter was initialized, an error code
+ * otherwise.
+ */
+oasis_result_t sample_converter_init(sample_converter_t *converter,
+                                     enum AVSampleFormat src_format,
+                                     enum AVSampleFormat dst_format,
+                                     int channels, int dither_bits);
+
+/**
+ * Frees a converter.
+ *
+ * @param converter The converter to free.
+ */
+void sample_converter_free(sample_converter_t *converter);
+
+/**
+ * Converts frames.
+ *
+ * @param converter The converter.
+ * @param dst The planes to write, one for packed formats.
+ * @param src The planes to read, one for packed formats.
+ * @param offset The frame to start reading at in src.
+ * @param frames The number of frames to convert.
+ */
+void sample_converter_run(sample_converter_t *converter, uint8_t *const *dst,
+                          uint8_t *const *src, int offset, int frames);
+
+/**
+ * Converts a run of packed samples without dither.
+ *
+ * @param dst The samples to write.
+ * @param dst_format The format to write.
+ * @param src The samples to read.
+ * @param src_format The format to read.
+ * @param count The number of samples, frames times channels.
+ * @return OASIS_SUCCESS if the samples were converted,
+ * OASIS_ERROR_UNSUPPORTED_FORMAT if either format is not supported.
+ */
+oasis_result_t sample_convert(uint8_t *dst, enum AVSampleFormat dst_format,
+                              const uint8_t *src,
+                              enum AVSampleFormat src_format, size_t count);
+
+/**
+ * Gets the kernel converting between two formats.
+ *
+ * @param src_format The format to read, planar formats map to their packed
+ * kernel.
+ * @param dst_format The format to write.
+ * @param dither Whether to get the dithering kernel.
+ * @return The kernel, NULL if there is none for the pair.
+ */
+sample_convert_fn sample_convert_get_kernel(enum AVSampleFormat src_format,
+                                            enum AVSampleFormat dst_format,
+                                            int dither);
+
+/**
+ * Gets the name of the instruction set the conversion kernels use.
+ *
+ * @return "avx2", "sse2" or "scalar".
+ */
+const char *sample_convert_get_isa_name(void);
+
+#endif
@@ -0,0 +1,123 @@
+#ifndef SEEK_INDEX_H
+#define SEEK_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <libavformat/avformat.h>
+
+#include <oasis/utils.h>
+
+#define SEEK_INDEX_INTERVAL_MS 1000
+
+/**
+ * A point a decoder can restart from, the position of a keyframe packet.
+ */
+typedef struct {
+  int64_t sample;    // Sample the packet starts at
+  int64_t timestamp; // Packet pts in the stream time base
+  int64_t pos;       // Byte offset of the packet, -1 if unknown
+} seek_point_t;
+
+/**
+ * A sorted, sparse table of seek points for one file.
+ *
+ * It is filled in as packets go past the decoder or by a scan of the whole
+ * file, and persisted in the user's cache directory keyed by the file's path,
+ * size and modification time.
+ */
+typedef struct {
+  seek_point_t *points;
+  size_t count;
+  size_t capacity;
+  int64_t interval; // Minimum distance between points in samples
+  int sample_rate;
+  int complete; // The whole file has been scanned
+  int dirty;    // Changed since it was loaded or saved
+} seek_index_t;
+
+/**
+ * Initializes an empty seek index.
+ *
+ * @param index The index to initialize.
+ * @param sample_rate The sample rate of the stream it indexes.
+ * @return OASIS_SUCCESS if the index was initialized, an error code otherwise.
+ */
+oasis_result_t seek_index_init(seek_index_t *index, int sample_rate);
+
+/**
+ * Frees a seek index.
+ *
+ * @param index The index to free.
+ */
+void seek_index_free(seek_index_t *index);
+
+/**
+ * Adds a seek point, points closer than the interval to an existing one are
+ * ignored.
+ *
+ * @param index The index.
+ * @param point The point to add.
+ * @return OASIS_SUCCESS if the point was added or ignored, an error code
+ * otherwise.
+ */
+oasis_result_t seek_index_add(seek_index_t *index, const seek_point_t *point);
+
+/**
+ * Adds a packet as a seek point if it is a keyframe with a timestamp.
+ *
+ * @param index The index.
+ * @param stream The stream the packet belongs to.
+ * @param packet The packet.
+ */
+void seek_index_add_packet(seek_index_t *index, const AVStream *stream,
+                           const AVPacket *packet);
+
+/**
+ * Finds the last seek point at or before a sample.
+ *
+ * @param index The index.
+ * @param sample The sample to seek to.
+ * @return The seek point, NULL if there is none before the sample.
+ */
+const seek_point_t *seek_index_find(const seek_index_t *index, int64_t sample);
+
+/**
+ * Loads the persisted index of a file, if there is an up to date one.
+ *
+ * @param index An initialized index to load into.
+ * @param filename The file the index is for.
+ * @return OASIS_SUCCESS if an index was loaded, OASIS_ERROR_FILE_NOT_FOUND if
+ * there is none, an error code otherwise.
+ */
+oasis_result_t seek_index_load(seek_index_t *index, const char *filename);
+
+/**
+ * Tells whether decoders persist the indexes they build when they close a
+ * file. It is opt-in through the OASIS_SEEK_INDEX environment variable, so
+ * probes and tests leave the user's cache directory alone.
+ *
+ * @return 1 if decoders save their indexes, 0 otherwise.
+ */
+int seek_index_persist_enabled(void);
+
+/**
+ * Persists the index of a file.
+ *
+ * @param index The index to save.
+ * @param filename The file the index is for.
+ * @return OASIS_SUCCESS if the index was saved, an error code otherwise.
+ */
+oasis_result_t seek_index_save(seek_index_t *index, const char *filename);
+
+/**
+ * Builds a complete index by reading every packet of a file's audio stream,
+ * nothing is decoded. The result is persisted.
+ *
+ * @param index An initialized index to fill.
+ * @param filename The file to scan.
+ * @return OASIS_SUCCESS if the file was scanned, an error code otherwise.
+ */
+oasis_result_t seek_index_scan(seek_index_t *index, const char *filename);
+
+#endif
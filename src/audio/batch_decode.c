@@ -0,0 +1,178 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <oasis/audio/batch_decode.h>
+#include <oasis/audio/decode.h>
+#include <oasis/utils.h>
+
+#include <libavutil/samplefmt.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BATCH_DECODE_MAX_THREADS 64
+
+/**
+ * State shared by the workers of one batch.
+ */
+typedef struct {
+  const char *const *filenames;
+  size_t count;
+  size_t next; // Next file to hand out, taken atomically
+  batch_decode_callback on_complete;
+  void *user_data;
+  pthread_mutex_t lock; // Serializes the callback and the stats
+  batch_decode_stats_t stats;
+} batch_decode_t;
+
+static double elapsed_seconds(const struct timespec *start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double)(now.tv_sec - start->tv_sec) +
+         (double)(now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void batch_decode_file(batch_decode_t *batch, audio_decoder_t *decoder,
+                              size_t index) {
+  batch_decode_result_t result = {
+    .filename = batch->filenames[index],
+    .index = index,
+  };
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  result.result = decoder_reopen(decoder, result.filename);
+  if (result.result == OASIS_SUCCESS) {
+    result.open_seconds = decoder->open_seconds;
+    result.result = decoder_read_all(decoder, &result.audio_data);
+  }
+  result.seconds = elapsed_seconds(&start);
+
+  if (result.result == OASIS_SUCCESS) {
+    audio_data_t *audio = &result.audio_data;
+    size_t stride =
+      (size_t)av_get_bytes_per_sample(audio->sample_format) * audio->channels;
+    result.audio_seconds =
+      (double)(audio->pcm_size / stride) / audio->sample_rate;
+    oasis_log(NULL, LOG_LEVEL_DEBUG,
+              "Decoded %s in %.3f seconds (opened in %.2f ms), %.1fx "
+              "realtime, %.1f MB/s",
+              result.filename, result.seconds, result.open_seconds * 1000.0,
+              result.audio_seconds / result.seconds,
+              audio->pcm_size / result.seconds / (1024.0 * 1024.0));
+  } else {
+    oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to decode %s: %s",
+              result.filename, serialize_oasis_error_text(result.result));
+  }
+
+  pthread_mutex_lock(&batch->lock);
+  batch->stats.files++;
+  if (result.result != OASIS_SUCCESS) {
+    batch->stats.failed++;
+  } else {
+    batch->stats.bytes += result.audio_data.pcm_size;
+    batch->stats.audio_seconds += result.audio_seconds;
+    batch->stats.open_seconds += result.open_seconds;
+    if (result.open_seconds > batch->stats.max_open_seconds)
+      batch->stats.max_open_seconds = result.open_seconds;
+  }
+  if (batch->on_complete)
+    batch->on_complete(&result, batch->user_data);
+  pthread_mutex_unlock(&batch->lock);
+
+  free(result.audio_data.pcm_data);
+}
+
+static void *batch_decode_worker(void *arg) {
+  batch_decode_t *batch = arg;
+  audio_decoder_t decoder;
+
+  // Zeroed so the first reopen does a full open
+  memset(&decoder, 0, sizeof(decoder));
+
+  while (1) {
+    size_t index = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED);
+    if (index >= batch->count)
+      break;
+    batch_decode_file(batch, &decoder, index);
+  }
+
+  decoder_close(&decoder);
+  return NULL;
+}
+
+oasis_result_t batch_decode(const char *const *filenames, size_t count,
+                            const batch_decode_options_t *options,
+                            batch_decode_stats_t *stats) {
+  if (!filenames) {
+    oasis_log(NULL, LOG_LEVEL_ERROR, "Invalid arguments to batch decode");
+    return OASIS_ERROR_INVALID_ARGUMENT;
+  }
+
+  batch_decode_t batch = {
+    .filenames = filenames,
+    .count = count,
+    .on_complete = options ? options->on_complete : NULL,
+    .user_data = options ? options->user_data : NULL,
+  };
+
+  long threads = options ? options->threads : 0;
+  if (threads <= 0)
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (threads <= 0)
+    threads = 1;
+  if (threads > BATCH_DECODE_MAX_THREADS)
+    threads = BATCH_DECODE_MAX_THREADS;
+  if ((size_t)threads > count)
+    threads = count ? (long)count : 1;
+
+  if (pthread_mutex_init(&batch.lock, NULL) != 0) {
+    oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to create batch decode lock");
+    return OASIS_ERROR;
+  }
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  pthread_t workers[BATCH_DECODE_MAX_THREADS];
+  long started = 0;
+  for (; started < threads; started++) {
+    if (pthread_create(&workers[started], NULL, batch_decode_worker, &batch) !=
+        0) {
+      oasis_log(NULL, LOG_LEVEL_WARN,
+                "Failed to start batch decode worker %ld", started);
+      break;
+    }
+  }
+
+  // Without any worker the batch still runs, on this thread
+  if (started == 0)
+    batch_decode_worker(&batch);
+  for (long i = 0; i < started; i++)
+    pthread_join(workers[i], NULL);
+
+  pthread_mutex_destroy(&batch.lock);
+  batch.stats.wall_seconds = elapsed_seconds(&start);
+
+  double wall = batch.stats.wall_seconds > 0 ? batch.stats.wall_seconds : 1e-9;
+  oasis_log(NULL, LOG_LEVEL_INFO,
+            "Decoded %zu of %zu files on %ld threads in %.3f seconds, "
+            "%.1fx realtime, %.1f MB/s",
+            batch.stats.files - batch.stats.failed, count,
+            started ? started : 1, batch.stats.wall_seconds,
+            batch.stats.audio_seconds / wall,
+            batch.stats.bytes / wall / (1024.0 * 1024.0));
+
+  size_t decoded = batch.stats.files - batch.stats.failed;
+  if (decoded > 0) {
+    oasis_log(NULL, LOG_LEVEL_INFO,
+              "Opening took %.2f ms per file on average, %.2f ms at most",
+              batch.stats.open_seconds / decoded * 1000.0,
+              batch.stats.max_open_seconds * 1000.0);
+  }
+
+  if (stats)
+    *stats = batch.stats;
+  return batch.stats.failed ? OASIS_ERROR : OASIS_SUCCESS;
+}
@@ -0,0 +1,72 @@
+#define _XOPEN_SOURCE 700
+
+#include <oasis/audio/cache_path.h>
+#include <oasis/utils.h>
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+int cache_path_make_dirs(char *path) {
+  for (char *p = path + 1; *p; p++) {
+    if (*p != '/')
+      continue;
+
+    *p = '\0';
+    int ret = mkdir(path, 0755);
+    *p = '/';
+    if (ret != 0 && errno != EEXIST)
+      return -1;
+  }
+
+  return (mkdir(path, 0755) != 0 && errno != EEXIST) ? -1 : 0;
+}
+
+// FNV-1a, only used to spread entries over file names
+static uint64_t hash_string(const char *string) {
+  uint64_t hash = 14695981039346656037ULL;
+
+  for (; *string; string++) {
+    hash ^= (uint8_t)*string;
+    hash *= 1099511628211ULL;
+  }
+
+  return hash;
+}
+
+oasis_result_t cache_path_get_dir(const char *name, char *path, size_t size,
+                                  int create) {
+  const char *cache_home = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
+
+  if (cache_home && cache_home[0]) {
+    snprintf(path, size, "%s/oasis/%s", cache_home, name);
+  } else if (home && home[0]) {
+    snprintf(path, size, "%s/.cache/oasis/%s", home, name);
+  } else {
+    return OASIS_ERROR_DIRECTORY_NOT_FOUND;
+  }
+
+  if (create && cache_path_make_dirs(path) != 0) {
+    oasis_log(NULL, LOG_LEVEL_WARN, "Failed to create cache directory %s",
+              path);
+    return OASIS_ERROR_DIRECTORY_NOT_FOUND;
+  }
+
+  return OASIS_SUCCESS;
+}
+
+void cache_path_get_entry(const char *dir, const char *filename,
+                          const char *extension, char *path, size_t size,
+                          char *key) {
+  if (!realpath(filename, key)) {
+    strncpy(key, filename, PATH_MAX - 1);
+    key[PATH_MAX - 1] = '\0';
+  }
+
+  snprintf(path, size, "%s/%016llx.%s", dir, (unsigned long long)hash_string(key),
+           extension);
+}
@@ -0,0 +1,265 @@
+#include <oasis/audio/channel_mix.h>
+
+#include <math.h>
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#  define CHANNEL_MIX_X86 1
+#  include <immintrin.h>
+#else
+#  define CHANNEL_MIX_X86 0
+#endif
+
+#define MINUS_3DB 0.70710678f
+
+enum { FL, FR, FC, LFE, BL, BR, SL, SR, POSITION_COUNT };
+
+static channel_mix_fn mix_kernel;
+static const char *isa_name = "scalar";
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+
+// The default FFmpeg layouts for the counts with a standard matrix, -1 ends
+static const int *layout_positions(int channels) {
+  static const int mono[] = {FC, -1};
+  static const int stereo[] = {FL, FR, -1};
+  static const int surround_5_1[] = {FL, FR, FC, LFE, SL, SR, -1};
+  static const int surround_7_1[] = {FL, FR, FC, LFE, BL, BR, SL, SR, -1};
+
+  switch (channels) {
+  case 1:
+    return mono;
+  case 2:
+    return stereo;
+  case 6:
+    return surround_5_1;
+  case 8:
+    return surround_7_1;
+  default:
+    return NULL;
+  }
+}
+
+// Where an input position goes when the output does not have it, in order of
+// preference, with its gain
+static void fold_position(float m[POSITION_COUNT][POSITION_COUNT],
+                          const int *has, int position) {
+  switch (position) {
+  case FC:
+    if (has[FL] && has[FR]) {
+      m[FL][FC] += MINUS_3DB;
+      m[FR][FC] += MINUS_3DB;
+    }
+    break;
+  case FL:
+  case FR:
+    if (has[FC])
+      m[FC][position] += MINUS_3DB;
+    break;
+  case BL:
+  case BR:
+  case SL:
+  case SR: {
+    int left = position == BL || position == SL;
+    int side = left ? SL : SR, front = left ? FL : FR;
+    if (position != side && has[side])
+      m[side][position] += MINUS_3DB;
+    else if (has[front])
+      m[front][position] += MINUS_3DB;
+    else if (has[FC])
+      m[FC][position] += MINUS_3DB * MINUS_3DB;
+    break;
+  }
+  default: // LFE
+    break;
+  }
+}
+
+oasis_result_t channel_matrix_standard(channel_matrix_t *matrix,
+                                       int in_channels, int out_channels) {
+  if (!matrix)
+    return OASIS_ERROR_INVALID_ARGUMENT;
+
+  const int *in = layout_positions(in_channels);
+  const int *out = layout_positions(out_channels);
+  memset(matrix, 0, sizeof(*matrix));
+  matrix->in_channels = in_channels;
+  matrix->out_channels = out_channels;
+
+  if (in_channels == out_channels &&
+      in_channels <= CHANNEL_MIX_MAX_CHANNELS && in_channels > 0) {
+    for (int c = 0; c < in_channels; c++)
+      matrix->coefficients[c][c] = 1.0f;
+    return OASIS_SUCCESS;
+  }
+  if (!in || !out) {
+    oasis_log(NULL, LOG_LEVEL_ERROR,
+              "No standard matrix from %d to %d channels", in_channels,
+              out_channels);
+    return OASIS_ERROR_UNSUPPORTED_FORMAT;
+  }
+
+  int has[POSITION_COUNT] = {0};
+  for (int o = 0; out[o] >= 0; o++)
+    has[out[o]] = 1;
+
+  float m[POSITION_COUNT][POSITION_COUNT] = {{0}};
+  for (int i = 0; in[i] >= 0; i++) {
+    if (has[in[i]])
+      m[in[i]][in[i]] += 1.0f;
+    else
+      fold_position(m, has, in[i]);
+  }
+
+  // A downmix is scaled down until the loudest output can not clip
+  float loudest = 0.0f;
+  for (int o = 0; out[o] >= 0; o++) {
+    float sum = 0.0f;
+    for (int i = 0; in[i] >= 0; i++)
+      sum += fabsf(m[out[o]][in[i]]);
+    loudest = sum > loudest ? sum : loudest;
+  }
+  float scale = out_channels < in_channels && loudest > 1.0f ? 1.0f / loudest
+                                                             : 1.0f;
+
+  for (int o = 0; out[o] >= 0; o++) {
+    for (int i = 0; in[i] >= 0; i++)
+      matrix->coefficients[o][i] = m[out[o]][in[i]] * scale;
+  }
+  return OASIS_SUCCESS;
+}
+
+static void mix_scalar(float *dst, const float *src, size_t frames,
+                       int in_channels, int out_channels,
+                       const float *columns) {
+  for (size_t f = 0; f < frames; f++) {
+    const float *in = src + f * in_channels;
+    float *out = dst + f * out_channels;
+    for (int o = 0; o < out_channels; o++) {
+      float sum = 0.0f;
+      for (int i = 0; i < in_channels; i++)
+        sum += in[i] * columns[i * CHANNEL_MIX_MAX_CHANNELS + o];
+      out[o] = sum;
+    }
+  }
+}
+
+#if CHANNEL_MIX_X86
+
+// A frame is the sum of its input samples, broadcast, times their columns.
+// The store writes a whole vector, what lands past the frame is written over
+// by the next one, so the last frames that would reach past the end of dst go
+// through the scalar loop.
+
+__attribute__((target("sse2"))) static void
+mix_sse2(float *dst, const float *src, size_t frames, int in_channels,
+         int out_channels, const float *columns) {
+  int wide = out_channels > 4;
+  size_t lanes = wide ? 8 : 4;
+  size_t f = 0;
+  for (; (frames - f) * out_channels >= lanes; f++) {
+    const float *in = src + f * in_channels;
+    __m128 lo = _mm_setzero_ps(), hi = _mm_setzero_ps();
+    for (int i = 0; i < in_channels; i++) {
+      __m128 x = _mm_set1_ps(in[i]);
+      const float *column = columns + i * CHANNEL_MIX_MAX_CHANNELS;
+      lo = _mm_add_ps(lo, _mm_mul_ps(x, _mm_loadu_ps(column)));
+      if (wide)
+        hi = _mm_add_ps(hi, _mm_mul_ps(x, _mm_loadu_ps(column + 4)));
+    }
+    _mm_storeu_ps(dst + f * out_channels, lo);
+    if (wide)
+      _mm_storeu_ps(dst + f * out_channels + 4, hi);
+  }
+  mix_scalar(dst + f * out_channels, src + f * in_channels, frames - f,
+             in_channels, out_channels, columns);
+}
+
+__attribute__((target("avx2"))) static void
+mix_avx2(float *dst, const float *src, size_t frames, int in_channels,
+         int out_channels, const float *columns) {
+  if (out_channels <= 4) {
+    mix_sse2(dst, src, frames, in_channels, out_channels, columns);
+    return;
+  }
+
+  size_t f = 0;
+  for (; (frames - f) * out_channels >= 8; f++) {
+    const float *in = src + f * in_channels;
+    __m256 sum = _mm256_setzero_ps();
+    for (int i = 0; i < in_channels; i++) {
+      __m256 column = _mm256_loadu_ps(columns + i * CHANNEL_MIX_MAX_CHANNELS);
+      sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_set1_ps(in[i]), column));
+    }
+    _mm256_storeu_ps(dst + f * out_channels, sum);
+  }
+  mix_scalar(dst + f * out_channels, src + f * in_channels, frames - f,
+             in_channels, out_channels, columns);
+}
+
+#endif
+
+static void select_kernels(void) {
+  mix_kernel = mix_scalar;
+
+#if CHANNEL_MIX_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse2")) {
+    mix_kernel = mix_sse2;
+    isa_name = "sse2";
+  }
+
+  if (__builtin_cpu_supports("avx2")) {
+    mix_kernel = mix_avx2;
+    isa_name = "avx2";
+  }
+#endif
+}
+
+oasis_result_t channel_mixer_init(channel_mixer_t *mixer,
+                                  const channel_matrix_t *matrix) {
+  if (!mixer || !matrix || matrix->in_channels <= 0 ||
+      matrix->out_channels <= 0 ||
+      matrix->in_channels > CHANNEL_MIX_MAX_CHANNELS ||
+      matrix->out_channels > CHANNEL_MIX_MAX_CHANNELS) {
+    oasis_log(NULL, LOG_LEVEL_ERROR, "Invalid arguments to channel mixer init");
+    return OASIS_ERROR_INVALID_ARGUMENT;
+  }
+
+  pthread_once(&kernels_once, select_kernels);
+  memset(mixer, 0, sizeof(*mixer));
+  mixer->in_channels = matrix->in_channels;
+  mixer->out_channels = matrix->out_channels;
+  mixer->kernel = mix_kernel;
+  mixer->identity = matrix->in_channels == matrix->out_channels;
+
+  for (int o = 0; o < matrix->out_channels; o++) {
+    for (int i = 0; i < matrix->in_channels; i++) {
+      float c = matrix->coefficients[o][i];
+      mixer->columns[i][o] = c;
+      if (c != (o == i ? 1.0f : 0.0f))
+        mixer->identity = 0;
+    }
+  }
+
+  oasis_log(NULL, LOG_LEVEL_DEBUG, "Remixing %d to %d channels (%s)",
+            mixer->in_channels, mixer->out_channels,
+            mixer->identity ? "identity" : isa_name);
+  return OASIS_SUCCESS;
+}
+
+void channel_mixer_run(const channel_mixer_t *mixer, float *dst,
+                       const float *src, size_t frames) {
+  if (mixer->identity) {
+    memcpy(dst, src, frames * mixer->in_channels * sizeof(*dst));
+    return;
+  }
+
+  mixer->kernel(dst, src, frames, mixer->in_channels, mixer->out_channels,
+                &mixer->columns[0][0]);
+}
+
+const char *channel_mix_get_isa_name(void) {
+  pthread_once(&kernels_once, select_kernels);
+  return isa_name;
+}
@@ -0,0 +1,185 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <oasis/audio/codec_pool.h>
+#include <oasis/utils.h>
+
+#include <string.h>
+
+static codec_pool_t default_pool;
+static pthread_once_t default_pool_once = PTHREAD_ONCE_INIT;
+
+static void default_pool_init(void) { codec_pool_init(&default_pool); }
+
+oasis_result_t codec_pool_init(codec_pool_t *pool) {
+  if (!pool) {
+    return OASIS_ERROR_INVALID_ARGUMENT;
+  }
+
+  memset(pool, 0, sizeof(*pool));
+  if (pthread_mutex_init(&pool->lock, NULL) != 0) {
+    oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to create codec pool lock");
+    return OASIS_ERROR;
+  }
+
+  return OASIS_SUCCESS;
+}
+
+void codec_pool_free(codec_pool_t *pool) {
+  if (!pool)
+    return;
+
+  for (size_t i = 0; i < pool->count; i++)
+    avcodec_free_context(&pool->contexts[i]);
+  pthread_mutex_destroy(&pool->lock);
+  memset(pool, 0, sizeof(*pool));
+}
+
+codec_pool_t *codec_pool_default(void) {
+  pthread_once(&default_pool_once, default_pool_init);
+  return &default_pool;
+}
+
+int codec_pool_matches(const AVCodecContext *codec_ctx,
+                       const AVCodecParameters *codecpar) {
+  return codec_ctx->codec_id == codecpar->codec_id &&
+         codec_ctx->sample_rate == codecpar->sample_rate &&
+         codec_ctx->ch_layout.nb_channels == codecpar->ch_layout.nb_channels &&
+         codec_ctx->bits_per_coded_sample == codecpar->bits_per_coded_sample &&
+         codec_ctx->block_align == codecpar->block_align &&
+         codec_ctx->extradata_size == codecpar->extradata_size &&
+         (codecpar->extradata_size == 0 ||
+          memcmp(codec_ctx->extradata, codecpar->extradata,
+                 codecpar->extradata_size) == 0);
+}
+
+static oasis_result_t open_codec(const AVCodecParameters *codecpar,
+                                 AVCodecContext **codec_ctx_out) {
+  AVCodecContext *codec_ctx = NULL;
+
+  oasis_log(NULL, LOG_LEVEL_DEBUG, "Finding decoder for codec %s",
+            avcodec_get_name(codecpar->codec_id));
+  const AVCodec *codec = avcodec_find_decoder(codecpar->codec_id);
+  if (!codec) {
+    oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to find decoder for codec %s",
+              avcodec_get_name(codecpar->codec_id));
+    return OASIS_ERROR_UNSUPPORTED_FORMAT;
+  }
+
+  codec_ctx = avcodec_alloc_context3(codec);
+  if (!codec_ctx) {
+    oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to allocate codec context");
+    return OASIS_ERROR_MEMORY_ALLOCATION;
+  }
+
+  if (avcodec_parameters_to_context(codec_ctx, codecpar) < 0) {
+    oasis_log(NULL, LOG_LEVEL_ERROR,
+              "Failed to copy codec parameters to decoder context");
+    avcodec_free_context(&codec_ctx);
+    return OASIS_ERROR;
+  }
+
+  if (avcodec_open2(codec_ctx, codec, NULL) < 0) {
+    oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to open codec");
+    avcodec_free_context(&codec_ctx);
+    return OASIS_ERROR_UNSUPPORTED_FORMAT;
+  }
+
+  *codec_ctx_out = codec_ctx;
+  return OASIS_SUCCESS;
+}
+
+oasis_result_t codec_pool_acquire(codec_pool_t *pool,
+                                  const AVCodecParameters *codecpar,
+                                  AVCodecContext **codec_ctx) {
+  if (!codecpar || !codec_ctx) {
+    return OASIS_ERROR_INVALID_ARGUMENT;
+  }
+  *codec_ctx = NULL;
+
+  if (pool) {
+    pthread_mutex_lock(&pool->lock);
+    // Most recently released first, it is the likeliest to be warm
+    size_t found = pool->count;
+    for (size_t i = 0; i < pool->count; i++) {
+      if (codec_pool_matches(pool->contexts[i], codecpar) &&
+          (found == pool->count || pool->released[i] > pool->released[found]))
+        found = i;
+    }
+
+    if (found < pool->count) {
+      *codec_ctx = pool->contexts[found];
+      pool->count--;
+      pool->contexts[found] = pool->contexts[pool->count];
+      pool->released[found] = pool->released[pool->count];
+      pool->stats.reuses++;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (*codec_ctx) {
+      avcodec_flush_buffers(*codec_ctx);
+      return OASIS_SUCCESS;
+    }
+  }
+
+  oasis_result_t result = open_codec(codecpar, codec_ctx);
+  if (result == OASIS_SUCCESS && pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->stats.opens++;
+    pthread_mutex_unlock(&pool->lock);
+  }
+  return result;
+}
+
+void codec_pool_release(codec_pool_t *pool, AVCodecContext **codec_ctx) {
+  if (!codec_ctx || !*codec_ctx)
+    return;
+  if (!pool) {
+    avcodec_free_context(codec_ctx);
+    return;
+  }
+
+  AVCodecContext *evicted = NULL;
+  pthread_mutex_lock(&pool->lock);
+  if (pool->count == CODEC_POOL_CAPACITY) {
+    size_t oldest = 0;
+    for (size_t i = 1; i < pool->count; i++) {
+      if (pool->released[i] < pool->released[oldest])
+        oldest = i;
+    }
+    evicted = pool->contexts[oldest];
+    pool->count--;
+    pool->contexts[oldest] = pool->contexts[pool->count];
+    pool->released[oldest] = pool->released[pool->count];
+    pool->stats.evictions++;
+  }
+
+  pool->contexts[pool->count] = *codec_ctx;
+  pool->released[pool->count] = ++pool->clock;
+  pool->count++;
+  pthread_mutex_unlock(&pool->lock);
+
+  *codec_ctx = NULL;
+  // Freed outside the lock, closing a codec is not free either
+  avcodec_free_context(&evicted);
+}
+
+void codec_pool_record_open(codec_pool_t *pool, double seconds,
+                            int stream_info_skipped) {
+  if (!pool)
+    return;
+
+  pthread_mutex_lock(&pool->lock);
+  pool->stats.tracks++;
+  pool->stats.open_seconds += seconds;
+  if (seconds > pool->stats.max_open_seconds)
+    pool->stats.max_open_seconds = seconds;
+  if (stream_info_skipped)
+    pool->stats.stream_info_skipped++;
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void codec_pool_get_stats(codec_pool_t *pool, codec_pool_stats_t *stats) {
+  pthread_mutex_lock(&pool->lock);
+  *stats = pool->stats;
+  pthread_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,82 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <oasis/audio/command_queue.h>
+#include <oasis/utils.h>
+
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+oasis_result_t command_queue_init(command_queue_t *queue) {
+  if (!queue) {
+    return OASIS_ERROR_INVALID_ARGUMENT;
+  }
+
+  memset(queue, 0, sizeof(*queue));
+  queue->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (queue->event_fd < 0) {
+    oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to create command queue event");
+    return OASIS_ERROR;
+  }
+
+  if (pthread_mutex_init(&queue->lock, NULL) != 0) {
+    oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to create command queue lock");
+    close(queue->event_fd);
+    queue->event_fd = -1;
+    return OASIS_ERROR;
+  }
+
+  return OASIS_SUCCESS;
+}
+
+void command_queue_free(command_queue_t *queue) {
+  if (!queue || queue->event_fd < 0)
+    return;
+
+  pthread_mutex_destroy(&queue->lock);
+  close(queue->event_fd);
+  queue->event_fd = -1;
+}
+
+oasis_result_t command_queue_push(command_queue_t *queue,
+                                  playback_command_type_t type, int64_t value) {
+  pthread_mutex_lock(&queue->lock);
+  if (queue->head - queue->tail == COMMAND_QUEUE_CAPACITY) {
+    pthread_mutex_unlock(&queue->lock);
+    oasis_log(NULL, LOG_LEVEL_WARN, "Command queue is full, dropping command");
+    return OASIS_ERROR;
+  }
+
+  playback_command_t *command =
+    &queue->commands[queue->head % COMMAND_QUEUE_CAPACITY];
+  command->type = type;
+  command->value = value;
+  queue->head++;
+  pthread_mutex_unlock(&queue->lock);
+
+  uint64_t one = 1;
+  if (write(queue->event_fd, &one, sizeof(one)) < 0) {
+    // Only fails once the counter is saturated, the engine is awake anyway
+  }
+  return OASIS_SUCCESS;
+}
+
+int command_queue_pop(command_queue_t *queue, playback_command_t *command) {
+  pthread_mutex_lock(&queue->lock);
+  if (queue->head == queue->tail) {
+    // Empty, so the fd should stop being readable until the next push
+    uint64_t count;
+    if (read(queue->event_fd, &count, sizeof(count)) < 0) {
+      // Already clear
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return 0;
+  }
+
+  *command = queue->commands[queue->tail % COMMAND_QUEUE_CAPACITY];
+  queue->tail++;
+  pthread_mutex_unlock(&queue->lock);
+  return 1;
+}
+
+int command_queue_get_fd(command_queue_t *queue) { return queue->event_fd; }
@@ -1,3 +1,5 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
 #include <libavutil/channel_layout.h>
@@ -7,9 +9,21 @@
 #include <oasis/utils.h>
 
 #include <bsd/string.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <sys/mman.h>
 #include <time.h>
 
+#include <oasis/audio/channel_mix.h>
+#include <oasis/audio/codec_pool.h>
 #include <oasis/audio/decode.h>
+#include <oasis/audio/interleave.h>
+#include <oasis/audio/mmap_input.h>
+#include <oasis/audio/pcm_store.h>
+#include <oasis/audio/resample.h>
 #include <oasis/utils.h>
 
 char *get_audio_codec_name(enum AVCodecID codec_id) {
@@ -30,179 +44,200 @@ char *get_sample_format_name(enum AVSampleFormat sample_format) {
   return sample_format_buf;
 }
 
-oasis_result_t decode_to_pcm(const char *filename, AVFrame ***frames,
-                             int *frame_count, audio_data_t *audio_data) {
-  oasis_log(NULL, LOG_LEVEL_DEBUG, "Decoding audio file %s", filename);
-  oasis_log(NULL, LOG_LEVEL_DEBUG, "Benchmarking...");
-  clock_t start = clock();
+static void close_audio_format(AVFormatContext **fmt_ctx,
+                               mmap_input_t *input) {
+  avformat_close_input(fmt_ctx);
+  mmap_input_close(input);
+}
 
-  if (!filename || !frames) {
-    oasis_log(NULL, LOG_LEVEL_ERROR,
-              "Invalid arguments, either filename or frames is NULL");
-    return OASIS_ERROR;
+static int stream_has_language(const AVStream *stream, const char *language) {
+  const AVDictionaryEntry *entry =
+    av_dict_get(stream->metadata, "language", NULL, 0);
+  return entry && strcasecmp(entry->value, language) == 0;
+}
+
+int decoder_find_stream(AVFormatContext *fmt_ctx,
+                        const audio_stream_selection_t *selection) {
+  if (selection && selection->stream_index >= 0) {
+    if ((unsigned)selection->stream_index >= fmt_ctx->nb_streams ||
+        fmt_ctx->streams[selection->stream_index]->codecpar->codec_type !=
+          AVMEDIA_TYPE_AUDIO) {
+      oasis_log(NULL, LOG_LEVEL_ERROR, "Stream %d is not an audio stream",
+                selection->stream_index);
+      return -1;
+    }
+    return selection->stream_index;
   }
-  *frames = NULL;
-  *frame_count = 0;
 
-  int initial_capacity = 64;
+  if (selection && selection->language) {
+    // The default stream of the language first, then any of it
+    int found = -1;
+    for (unsigned i = 0; i < fmt_ctx->nb_streams; i++) {
+      const AVStream *stream = fmt_ctx->streams[i];
+      if (stream->codecpar->codec_type != AVMEDIA_TYPE_AUDIO ||
+          !stream_has_language(stream, selection->language))
+        continue;
+      if (found < 0 || (stream->disposition & AV_DISPOSITION_DEFAULT))
+        found = i;
+      if (stream->disposition & AV_DISPOSITION_DEFAULT)
+        break;
+    }
 
-  AVFormatContext *fmt_ctx = NULL;
-  AVCodecContext *codec_ctx = NULL;
-  AVPacket *pkt = NULL;
-  AVFrame *frame = NULL;
-  int ret = 0, audio_stream_index = -1;
-  oasis_result_t final_result = OASIS_SUCCESS;
+    if (found >= 0)
+      return found;
+    oasis_log(NULL, LOG_LEVEL_WARN,
+              "No audio stream in language %s, picking the best one",
+              selection->language);
+  }
 
-  oasis_log(NULL, LOG_LEVEL_INFO, "Opening input file %s", filename);
-  if (avformat_open_input(&fmt_ctx, filename, NULL, NULL) != 0) {
-    oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to open input file %s", filename);
-    return OASIS_ERROR;
+  int ret = av_find_best_stream(fmt_ctx, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0);
+  return ret >= 0 ? ret : -1;
+}
+
+// The demuxer drops packets of discarded streams before they are even
+// returned, cover art, video and subtitles cost next to nothing
+static void discard_other_streams(AVFormatContext *fmt_ctx, int stream_index) {
+  for (unsigned i = 0; i < fmt_ctx->nb_streams; i++) {
+    fmt_ctx->streams[i]->discard =
+      (int)i == stream_index ? AVDISCARD_DEFAULT : AVDISCARD_ALL;
   }
+}
 
-  oasis_log(NULL, LOG_LEVEL_DEBUG, "Finding stream info");
-  if (avformat_find_stream_info(fmt_ctx, NULL) < 0) {
-    avformat_close_input(&fmt_ctx);
-    oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to find stream info");
-    return OASIS_ERROR;
+// Most music containers declare everything the decoder needs in their header,
+// which makes the stream info probe, decoding the first packets, redundant
+static int stream_header_complete(const AVFormatContext *fmt_ctx,
+                                  int stream_index) {
+  const AVStream *stream = fmt_ctx->streams[stream_index];
+  const AVCodecParameters *codecpar = stream->codecpar;
+
+  return !(fmt_ctx->ctx_flags & AVFMTCTX_NOHEADER) &&
+         codecpar->codec_id != AV_CODEC_ID_NONE && codecpar->sample_rate > 0 &&
+         codecpar->ch_layout.nb_channels > 0 &&
+         stream->duration != AV_NOPTS_VALUE;
+}
+
+static oasis_result_t
+open_audio_format(audio_decoder_t *decoder, const char *filename,
+                  const audio_stream_selection_t *selection) {
+  oasis_log(NULL, LOG_LEVEL_INFO, "Opening input file %s", filename);
+  oasis_result_t result =
+    mmap_input_open_format(&decoder->fmt_ctx, &decoder->input, filename);
+  if (result != OASIS_SUCCESS) {
+    oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to open input file %s", filename);
+    return result;
   }
 
-  oasis_log(NULL, LOG_LEVEL_DEBUG, "Finding audio stream");
-  for (unsigned i = 0; i < fmt_ctx->nb_streams; i++) {
-    if (fmt_ctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO) {
-      audio_stream_index = i;
-      break;
+  decoder->audio_stream_index =
+    decoder_find_stream(decoder->fmt_ctx, selection);
+  if (decoder->audio_stream_index >= 0 &&
+      stream_header_complete(decoder->fmt_ctx, decoder->audio_stream_index)) {
+    decoder->stream_info_skipped = 1;
+  } else {
+    oasis_log(NULL, LOG_LEVEL_DEBUG, "Finding stream info");
+    if (avformat_find_stream_info(decoder->fmt_ctx, NULL) < 0) {
+      close_audio_format(&decoder->fmt_ctx, &decoder->input);
+      oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to find stream info");
+      return OASIS_ERROR;
     }
+    decoder->audio_stream_index =
+      decoder_find_stream(decoder->fmt_ctx, selection);
   }
 
-  oasis_log(NULL, LOG_LEVEL_DEBUG, "Audio stream index: %d", audio_stream_index);
-  if (audio_stream_index == -1) {
+  oasis_log(NULL, LOG_LEVEL_DEBUG, "Audio stream index: %d",
+            decoder->audio_stream_index);
+  if (decoder->audio_stream_index == -1) {
     oasis_log(NULL, LOG_LEVEL_ERROR, "No audio stream found");
-    avformat_close_input(&fmt_ctx);
+    close_audio_format(&decoder->fmt_ctx, &decoder->input);
     return OASIS_ERROR_FILE_NOT_FOUND;
   }
 
-  oasis_log(NULL, LOG_LEVEL_DEBUG, "Finding decoder for codec %s",
-            get_audio_codec_name(
-              fmt_ctx->streams[audio_stream_index]->codecpar->codec_id));
-  AVCodecParameters *codecpar = fmt_ctx->streams[audio_stream_index]->codecpar;
-  const AVCodec *codec = avcodec_find_decoder(codecpar->codec_id);
-  if (!codec) {
-    oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to find decoder for codec %s",
-              get_audio_codec_name(codecpar->codec_id));
-    avformat_close_input(&fmt_ctx);
-    return OASIS_ERROR_UNSUPPORTED_FORMAT;
-  }
+  discard_other_streams(decoder->fmt_ctx, decoder->audio_stream_index);
+  return OASIS_SUCCESS;
+}
 
-  oasis_log(NULL, LOG_LEVEL_DEBUG, "Allocating codec context");
-  codec_ctx = avcodec_alloc_context3(codec);
-  if (!codec_ctx) {
-    oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to allocate codec context");
-    avcodec_free_context(&codec_ctx);
-    avformat_close_input(&fmt_ctx);
-    return OASIS_ERROR_MEMORY_ALLOCATION;
+static oasis_result_t open_audio_codec(audio_decoder_t *decoder) {
+  return codec_pool_acquire(
+    codec_pool_default(),
+    decoder->fmt_ctx->streams[decoder->audio_stream_index]->codecpar,
+    &decoder->codec_ctx);
+}
+
+static double now_seconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+static int decoder_receive_frame(audio_decoder_t *decoder);
+
+// Narrows a cloned frame to nb_samples samples from skip on, the buffers stay
+// shared with the decoder's frame
+static void trim_frame(AVFrame *frame, int skip, int nb_samples) {
+  int planar = av_sample_fmt_is_planar(frame->format);
+  int planes = planar ? frame->ch_layout.nb_channels : 1;
+  size_t offset = (size_t)skip * av_get_bytes_per_sample(frame->format) *
+                  (planar ? 1 : frame->ch_layout.nb_channels);
+
+  for (int p = 0; p < planes; p++) {
+    frame->extended_data[p] += offset;
+    if (frame->extended_data != frame->data && p < AV_NUM_DATA_POINTERS)
+      frame->data[p] += offset;
   }
+  frame->nb_samples = nb_samples;
+}
 
-  oasis_log(NULL, LOG_LEVEL_DEBUG,
-            "Copying codec parameters to decoder context");
-  if (avcodec_parameters_to_context(codec_ctx, codecpar) < 0) {
+oasis_result_t decode_to_pcm(const char *filename, AVFrame ***frames,
+                             int *frame_count, audio_data_t *audio_data) {
+  oasis_log(NULL, LOG_LEVEL_DEBUG, "Decoding audio file %s", filename);
+  oasis_log(NULL, LOG_LEVEL_DEBUG, "Benchmarking...");
+  clock_t start = clock();
+
+  if (!filename || !frames || !frame_count) {
     oasis_log(NULL, LOG_LEVEL_ERROR,
-              "Failed to copy codec parameters to decoder context");
-    avcodec_free_context(&codec_ctx);
-    avformat_close_input(&fmt_ctx);
+              "Invalid arguments, either filename or frames is NULL");
     return OASIS_ERROR;
   }
+  *frames = NULL;
+  *frame_count = 0;
 
-  oasis_log(NULL, LOG_LEVEL_DEBUG, "Opening codec");
-  if (avcodec_open2(codec_ctx, codec, NULL) < 0) {
-    oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to open codec");
-    avcodec_free_context(&codec_ctx);
-    avformat_close_input(&fmt_ctx);
-    return OASIS_ERROR_UNSUPPORTED_FORMAT;
-  }
-
-  oasis_log(NULL, LOG_LEVEL_DEBUG, "Allocating packet");
-  pkt = av_packet_alloc();
-  if (!pkt) {
-    oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to allocate packet");
-    avcodec_free_context(&codec_ctx);
-    avformat_close_input(&fmt_ctx);
-    return OASIS_ERROR_MEMORY_ALLOCATION;
-  }
+  int initial_capacity = 64;
 
-  oasis_log(NULL, LOG_LEVEL_DEBUG, "Allocating frame");
-  frame = av_frame_alloc();
-  if (!frame) {
-    oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to allocate frame");
-    av_packet_free(&pkt);
-    avcodec_free_context(&codec_ctx);
-    avformat_close_input(&fmt_ctx);
-    return OASIS_ERROR_MEMORY_ALLOCATION;
+  audio_decoder_t decoder;
+  int ret = 0;
+  oasis_result_t final_result = decoder_open(&decoder, filename);
+  if (final_result != OASIS_SUCCESS) {
+    return final_result;
   }
 
   oasis_log(NULL, LOG_LEVEL_DEBUG, "Allocating frame array");
   AVFrame **frame_arr = malloc(initial_capacity * sizeof(AVFrame *));
   if (!frame_arr) {
     oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to allocate frame array");
-    av_packet_free(&pkt);
-    av_frame_free(&frame);
-    avcodec_free_context(&codec_ctx);
-    avformat_close_input(&fmt_ctx);
+    decoder_close(&decoder);
     return OASIS_ERROR_MEMORY_ALLOCATION;
   }
 
+  // decoder_open leaves the current frame in decoder.frame, frame_offset
+  // samples into it once the encoder delay is dropped. Like
+  // decoder_read_samples, nothing past decoder.end is kept.
   oasis_log(NULL, LOG_LEVEL_DEBUG, "Reading frames");
   int count = 0;
-  while (av_read_frame(fmt_ctx, pkt) >= 0) {
-    if (pkt->stream_index == audio_stream_index) {
-      ret = avcodec_send_packet(codec_ctx, pkt);
-      if (ret < 0)
+  int64_t position = 0;
+  do {
+    int skip = decoder.frame_offset;
+    int64_t keep = decoder.frame->nb_samples - skip;
+    if (decoder.end > 0 && position + keep > decoder.end)
+      keep = decoder.end - position;
+    decoder.frame_offset = 0;
+    if (keep <= 0) {
+      if (decoder.end > 0 && position >= decoder.end) {
+        ret = AVERROR_EOF;
         break;
-
-      while (ret >= 0) {
-        ret = avcodec_receive_frame(codec_ctx, frame);
-        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
-          break;
-        else if (ret < 0) {
-          oasis_log(NULL, LOG_LEVEL_ERROR, "Error receiving frame: %s",
-                    av_err2str(ret));
-          goto clean_frames;
-        }
-
-        if (count >= initial_capacity) {
-          oasis_log(NULL, LOG_LEVEL_DEBUG, "Reallocating frame array");
-          initial_capacity *= 2;
-          AVFrame **new_frame_arr =
-            realloc(frame_arr, initial_capacity * sizeof(AVFrame *));
-          if (!new_frame_arr) {
-            oasis_log(NULL, LOG_LEVEL_ERROR,
-                      "Failed to reallocate frame array");
-            goto clean_frames;
-          }
-          frame_arr = new_frame_arr;
-        }
-
-        frame_arr[count] = av_frame_clone(frame);
-        if (!frame_arr[count]) {
-          oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to clone frame");
-          goto clean_frames;
-        };
-        count++;
       }
+      ret = decoder_receive_frame(&decoder);
+      continue;
     }
-    av_packet_unref(pkt);
-  }
 
-  oasis_log(NULL, LOG_LEVEL_DEBUG, "Sending NULL packet to flush decoder");
-  avcodec_send_packet(codec_ctx, NULL);
-  while (1) {
-    ret = avcodec_receive_frame(codec_ctx, frame);
-    if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
-      break;
-    else if (ret < 0) {
-      oasis_log(NULL, LOG_LEVEL_ERROR, "Error receiving frame: %s",
-                av_err2str(ret));
-      goto clean_frames;
-    }
     if (count >= initial_capacity) {
       oasis_log(NULL, LOG_LEVEL_DEBUG, "Reallocating frame array");
       initial_capacity *= 2;
@@ -214,75 +249,28 @@ oasis_result_t decode_to_pcm(const char *filename, AVFrame ***frames,
       }
       frame_arr = new_frame_arr;
     }
-    frame_arr[count] = av_frame_clone(frame);
+
+    frame_arr[count] = av_frame_clone(decoder.frame);
     if (!frame_arr[count]) {
       oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to clone frame");
       goto clean_frames;
     };
+    if (skip > 0 || keep < frame_arr[count]->nb_samples)
+      trim_frame(frame_arr[count], skip, (int)keep);
     count++;
-  }
+    position += keep;
 
+    ret = decoder_receive_frame(&decoder);
+  } while (ret >= 0);
 
-  /*
-   AV_SAMPLE_FMT_U8,          ///< unsigned 8 bits
-   AV_SAMPLE_FMT_S16,         ///< signed 16 bits
-   AV_SAMPLE_FMT_S32,         ///< signed 32 bits
-   AV_SAMPLE_FMT_FLT,         ///< float
-   AV_SAMPLE_FMT_DBL,         ///< double
-
-   AV_SAMPLE_FMT_U8P,         ///< unsigned 8 bits, planar
-   AV_SAMPLE_FMT_S16P,        ///< signed 16 bits, planar
-   AV_SAMPLE_FMT_S32P,        ///< signed 32 bits, planar
-   AV_SAMPLE_FMT_FLTP,        ///< float, planar
-   AV_SAMPLE_FMT_DBLP,        ///< double, planar
-   AV_SAMPLE_FMT_S64,         ///< signed 64 bits
-   AV_SAMPLE_FMT_S64P,
-   */
-
-  // Get codec id
-  switch (codec_ctx->sample_fmt) {
-  case AV_SAMPLE_FMT_U8:
-    audio_data->codec_id = AV_CODEC_ID_PCM_U8;
-    break;
-  case AV_SAMPLE_FMT_S16:
-    audio_data->codec_id = AV_CODEC_ID_PCM_S16LE;
-    break;
-  case AV_SAMPLE_FMT_S32:
-    audio_data->codec_id = AV_CODEC_ID_PCM_S32LE;
-    break;
-  case AV_SAMPLE_FMT_FLT:
-    audio_data->codec_id = AV_CODEC_ID_PCM_F32LE;
-    break;
-  case AV_SAMPLE_FMT_DBL:
-    audio_data->codec_id = AV_CODEC_ID_PCM_F64LE;
-    break;
-  case AV_SAMPLE_FMT_U8P:
-    audio_data->codec_id = AV_CODEC_ID_PCM_S8_PLANAR;
-    break;
-  case AV_SAMPLE_FMT_S16P:
-    audio_data->codec_id = AV_CODEC_ID_PCM_S16LE_PLANAR;
-    break;
-  case AV_SAMPLE_FMT_S32P:
-    audio_data->codec_id = AV_CODEC_ID_PCM_S32LE_PLANAR;
-    break;
-  case AV_SAMPLE_FMT_FLTP:
-    audio_data->codec_id = fmt_ctx->streams[audio_stream_index]->codecpar->codec_id;
-    break;
-  case AV_SAMPLE_FMT_DBLP:
-    audio_data->codec_id = fmt_ctx->streams[audio_stream_index]->codecpar->codec_id;
-    break;
-  case AV_SAMPLE_FMT_S64:
-    audio_data->codec_id = AV_CODEC_ID_PCM_S64LE;
-    break;
-  case AV_SAMPLE_FMT_S64P:
-    audio_data->codec_id = fmt_ctx->streams[audio_stream_index]->codecpar->codec_id;
-    break;
-  default:
-    oasis_log(NULL, LOG_LEVEL_ERROR, "Unsupported sample format");
-    final_result = OASIS_ERROR_UNSUPPORTED_FORMAT;
+  if (ret != AVERROR_EOF) {
+    oasis_log(NULL, LOG_LEVEL_ERROR, "Error receiving frame: %s",
+              av_err2str(ret));
     goto clean_frames;
   }
 
+  // The frames end up interleaved, so the PCM codec is the packed one
+  audio_data->codec_id = decoder.codec_id;
 
   *frames = frame_arr;
   *frame_count = count;
@@ -295,13 +283,11 @@ clean_frames:
     }
     free(frame_arr);
   }
-  final_result = OASIS_ERROR;
+  if (final_result == OASIS_SUCCESS)
+    final_result = OASIS_ERROR;
 
 done:
-  av_packet_free(&pkt);
-  av_frame_free(&frame);
-  avcodec_free_context(&codec_ctx);
-  avformat_close_input(&fmt_ctx);
+  decoder_close(&decoder);
 
   clock_t end = clock();
   double elapsed_time = (double)(end - start) / CLOCKS_PER_SEC;
@@ -310,6 +296,20 @@ done:
   return final_result;
 }
 
+static oasis_result_t copy_frame_interleaved(const AVFrame *frame, int offset,
+                                             int nb_samples, int channels,
+                                             int bytes_per_sample,
+                                             uint8_t *dst) {
+  if (av_sample_fmt_is_planar(frame->format))
+    return interleave_samples(dst, frame->extended_data, offset, nb_samples,
+                              channels, bytes_per_sample);
+
+  int frame_stride = bytes_per_sample * channels;
+  memcpy(dst, frame->extended_data[0] + offset * frame_stride,
+         nb_samples * frame_stride);
+  return OASIS_SUCCESS;
+}
+
 oasis_result_t append_frames_to_pcm(AVFrame **frames, int frame_count,
                                     audio_data_t *audio_data) {
   clock_t start = clock();
@@ -322,9 +322,10 @@ oasis_result_t append_frames_to_pcm(AVFrame **frames, int frame_count,
     return OASIS_ERROR;
   }
 
-  int total_samples = 0, bytes_per_sample = 0,
-      channels = frames[0]->ch_layout.nb_channels;
-  enum AVSampleFormat sample_format = frames[0]->format;
+  int64_t total_samples = 0;
+  int bytes_per_sample = 0, channels = frames[0]->ch_layout.nb_channels;
+  enum AVSampleFormat sample_format =
+    av_get_packed_sample_fmt(frames[0]->format); // Interleaved below
 
   audio_data->channels = channels;
   audio_data->sample_rate = frames[0]->sample_rate;
@@ -344,37 +345,35 @@ oasis_result_t append_frames_to_pcm(AVFrame **frames, int frame_count,
   oasis_log(NULL, LOG_LEVEL_DEBUG, "Bytes per sample: %d", bytes_per_sample);
 
   oasis_log(NULL, LOG_LEVEL_DEBUG, "Calculating total bytes");
-  int total_bytes = total_samples * bytes_per_sample * channels;
-  audio_data->pcm_data = malloc(total_bytes);
+  uint64_t total_bytes = (uint64_t)total_samples * bytes_per_sample * channels;
+  if (total_bytes > SIZE_MAX) {
+    oasis_log(NULL, LOG_LEVEL_ERROR,
+              "PCM too large for one buffer, use decode_file_to_store");
+    return OASIS_ERROR_MEMORY_ALLOCATION;
+  }
+  audio_data->pcm_data = malloc((size_t)total_bytes);
   if (!audio_data->pcm_data) {
     oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to allocate memory for PCM");
     return OASIS_ERROR;
   }
 
   oasis_log(NULL, LOG_LEVEL_DEBUG, "Copying frames to PCM");
-  int offset = 0;
+  size_t offset = 0;
   for (int i = 0; i < frame_count; i++) {
-    AVFrame *frame = frames[i];
-    int samples = frame->nb_samples;
-
-    if (av_sample_fmt_is_planar(sample_format)) {
-      for (int sample = 0; sample < samples; sample++) {
-        for (int channel = 0; channel < channels; channel++) {
-          memcpy(audio_data->pcm_data + offset,
-                 frame->extended_data[channel] + sample * bytes_per_sample,
-                 bytes_per_sample);
-          offset += bytes_per_sample;
-        }
-      }
-    } else {
-      int frame_bytes = samples * bytes_per_sample * channels;
-      memcpy(audio_data->pcm_data + offset, frame->extended_data[0],
-             frame_bytes);
-      offset += frame_bytes;
+    int samples = frames[i]->nb_samples;
+
+    oasis_result_t result =
+      copy_frame_interleaved(frames[i], 0, samples, channels,
+                             bytes_per_sample, audio_data->pcm_data + offset);
+    if (result != OASIS_SUCCESS) {
+      free(audio_data->pcm_data);
+      audio_data->pcm_data = NULL;
+      return result;
     }
+    offset += (size_t)samples * bytes_per_sample * channels;
   }
 
-  oasis_log(NULL, LOG_LEVEL_DEBUG, "PCM size: %d", audio_data->pcm_size);
+  oasis_log(NULL, LOG_LEVEL_DEBUG, "PCM size: %zu", (size_t)total_bytes);
   oasis_log(NULL, LOG_LEVEL_DEBUG, "Finished appending frames to PCM");
 
   clock_t end = clock();
@@ -384,6 +383,819 @@ oasis_result_t append_frames_to_pcm(AVFrame **frames, int frame_count,
             "seconds",
             elapsed_time);
 
-  audio_data->pcm_size = total_bytes;
+  audio_data->pcm_size = (size_t)total_bytes;
+  return OASIS_SUCCESS;
+}
+
+static int decoder_receive_frame(audio_decoder_t *decoder) {
+  int ret;
+
+  while (1) {
+    ret = avcodec_receive_frame(decoder->codec_ctx, decoder->frame);
+    if (ret != AVERROR(EAGAIN))
+      return ret;
+
+    if (decoder->eof)
+      return AVERROR_EOF;
+
+    ret = av_read_frame(decoder->fmt_ctx, decoder->pkt);
+    if (ret == AVERROR_EOF) {
+      decoder->eof = 1;
+      if (decoder->sequential && decoder->seek_index.interval)
+        decoder->seek_index.complete = 1; // Saw every packet on the way
+      avcodec_send_packet(decoder->codec_ctx, NULL);
+      continue;
+    } else if (ret < 0) {
+      return ret;
+    }
+
+    if (decoder->pkt->stream_index == decoder->audio_stream_index) {
+      if (av_packet_get_side_data(decoder->pkt, AV_PKT_DATA_SKIP_SAMPLES,
+                                  NULL))
+        decoder->padding_handled = 1;
+      seek_index_add_packet(
+        &decoder->seek_index,
+        decoder->fmt_ctx->streams[decoder->audio_stream_index], decoder->pkt);
+      ret = avcodec_send_packet(decoder->codec_ctx, decoder->pkt);
+      if (ret < 0 && ret != AVERROR(EAGAIN)) {
+        av_packet_unref(decoder->pkt);
+        return ret;
+      }
+    }
+    av_packet_unref(decoder->pkt);
+  }
+}
+
+// Drops samples from the start of what the decoder would hand out next
+static int decoder_drop_samples(audio_decoder_t *decoder, int64_t count) {
+  while (count > 0) {
+    int available = decoder->frame->nb_samples - decoder->frame_offset;
+    if (count <= available) {
+      decoder->frame_offset += (int)count;
+      return 0;
+    }
+    count -= available;
+
+    int ret = decoder_receive_frame(decoder);
+    if (ret < 0)
+      return ret;
+    decoder->frame_offset = 0;
+  }
+  return 0;
+}
+
+// libavformat already has libavcodec drop what it finds in LAME/Xing headers,
+// MP4 edit lists and Opus headers, and marks those packets with skip samples
+// side data, everything else that declares padding is trimmed by the reader.
+// iTunSMPB also gives the exact length.
+void decoder_find_gapless(AVFormatContext *fmt_ctx, int stream_index,
+                          int sample_rate, int padding_handled,
+                          int64_t duration, int64_t *trim_start,
+                          int64_t *end) {
+  AVStream *stream = fmt_ctx->streams[stream_index];
+  int64_t delay = stream->codecpar->initial_padding;
+  int64_t padding = stream->codecpar->trailing_padding;
+  int64_t length = 0;
+
+  const AVDictionaryEntry *tag = av_dict_get(stream->metadata, "iTunSMPB",
+                                             NULL, 0);
+  if (!tag)
+    tag = av_dict_get(fmt_ctx->metadata, "iTunSMPB", NULL, 0);
+  unsigned long long smpb_delay, smpb_padding, smpb_length;
+  if (tag && sscanf(tag->value, "%*x %llx %llx %llx", &smpb_delay,
+                    &smpb_padding, &smpb_length) == 3 &&
+      smpb_delay < (unsigned long long)sample_rate &&
+      smpb_padding < (unsigned long long)sample_rate) {
+    delay = (int64_t)smpb_delay;
+    padding = (int64_t)smpb_padding;
+    length = (int64_t)smpb_length;
+  }
+
+  *trim_start = !padding_handled && delay > 0 ? delay : 0;
+  *end = 0;
+  if (length > 0) {
+    *end = length;
+  } else if (!padding_handled && padding > 0 && duration > delay + padding) {
+    *end = duration - delay - padding;
+  }
+}
+
+// Leaves out encoder delay and padding the decoder is not already dropping
+static void decoder_setup_gapless(audio_decoder_t *decoder) {
+  int64_t trim_start, end;
+  decoder_find_gapless(decoder->fmt_ctx, decoder->audio_stream_index,
+                       decoder->sample_rate, decoder->padding_handled,
+                       decoder->duration, &trim_start, &end);
+
+  if (trim_start > 0) {
+    int ret = decoder_drop_samples(decoder, trim_start);
+    if (ret < 0 && ret != AVERROR_EOF) {
+      oasis_log(NULL, LOG_LEVEL_WARN, "Failed to skip encoder delay: %s",
+                av_err2str(ret));
+    }
+    decoder->trim_start = trim_start;
+  }
+  decoder->end = end;
+
+  if (decoder->end > 0)
+    decoder->duration = decoder->end;
+  else if (decoder->duration > decoder->trim_start)
+    decoder->duration -= decoder->trim_start;
+
+  if (decoder->trim_start > 0 || decoder->end > 0) {
+    oasis_log(NULL, LOG_LEVEL_DEBUG,
+              "Trimmed %lld samples of encoder delay, %lld samples long",
+              (long long)decoder->trim_start, (long long)decoder->end);
+  }
+}
+
+// Sets up everything past the contexts for a freshly opened file
+static oasis_result_t decoder_start(audio_decoder_t *decoder,
+                                    const char *filename, double start) {
+  decoder->filename = malloc(strlen(filename) + 1);
+  if (!decoder->filename) {
+    oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to allocate filename");
+    decoder_close(decoder);
+    return OASIS_ERROR_MEMORY_ALLOCATION;
+  }
+  memcpy(decoder->filename, filename, strlen(filename) + 1);
+
+  // Without a sample rate up front the index stays empty and seeks go
+  // through the demuxer alone. The persisted index is only valid for the
+  // stream picked by default, so other streams go without one too.
+  if (!decoder->stream_selected &&
+      seek_index_init(&decoder->seek_index, decoder->codec_ctx->sample_rate) ==
+        OASIS_SUCCESS) {
+    seek_index_load(&decoder->seek_index, filename);
+  }
+  decoder->sequential = 1;
+
+  // Prime the first frame, the decoder may only settle on its output format
+  // once it has seen actual data
+  int ret = decoder_receive_frame(decoder);
+  if (ret < 0) {
+    oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to decode first frame of %s: %s",
+              filename, av_err2str(ret));
+    decoder_close(decoder);
+    return OASIS_ERROR_FILE_NOT_MEDIA;
+  }
+
+  decoder->sample_rate = decoder->frame->sample_rate;
+  decoder->channels = decoder->frame->ch_layout.nb_channels;
+  decoder->source_channels = decoder->channels;
+  decoder->sample_format = av_get_packed_sample_fmt(decoder->frame->format);
+  decoder->codec_id = av_get_pcm_codec(decoder->sample_format, 0);
+  decoder->source_rate = decoder->sample_rate;
+  decoder->source_format = decoder->sample_format;
+  if (decoder->codec_id == AV_CODEC_ID_NONE) {
+    oasis_log(NULL, LOG_LEVEL_ERROR, "Unsupported sample format %s",
+              get_sample_format_name(decoder->sample_format));
+    decoder_close(decoder);
+    return OASIS_ERROR_UNSUPPORTED_FORMAT;
+  }
+
+  AVStream *stream = decoder->fmt_ctx->streams[decoder->audio_stream_index];
+  if (stream->duration != AV_NOPTS_VALUE) {
+    decoder->duration = av_rescale_q(stream->duration, stream->time_base,
+                                     (AVRational){1, decoder->sample_rate});
+  } else if (decoder->fmt_ctx->duration != AV_NOPTS_VALUE) {
+    decoder->duration =
+      av_rescale(decoder->fmt_ctx->duration, decoder->sample_rate,
+                 AV_TIME_BASE);
+  }
+  decoder_setup_gapless(decoder);
+
+  decoder->open_seconds = now_seconds() - start;
+  codec_pool_record_open(codec_pool_default(), decoder->open_seconds,
+                         decoder->stream_info_skipped);
+
+  oasis_log(NULL, LOG_LEVEL_DEBUG,
+            "Opened decoder in %.2f ms%s: %d Hz, %d channels, %s, %lld samples",
+            decoder->open_seconds * 1000.0,
+            decoder->stream_info_skipped ? " from the header" : "",
+            decoder->sample_rate, decoder->channels,
+            get_sample_format_name(decoder->sample_format),
+            (long long)decoder->duration);
+  return OASIS_SUCCESS;
+}
+
+oasis_result_t decoder_open(audio_decoder_t *decoder, const char *filename) {
+  return decoder_open_stream(decoder, filename, NULL);
+}
+
+oasis_result_t decoder_open_stream(audio_decoder_t *decoder,
+                                   const char *filename,
+                                   const audio_stream_selection_t *selection) {
+  if (!decoder || !filename) {
+    oasis_log(NULL, LOG_LEVEL_ERROR,
+              "Invalid arguments, either decoder or filename is NULL");
+    return OASIS_ERROR_INVALID_ARGUMENT;
+  }
+  memset(decoder, 0, sizeof(*decoder));
+  double start = now_seconds();
+  decoder->stream_selected =
+    selection && (selection->stream_index >= 0 || selection->language);
+
+  oasis_result_t result = open_audio_format(decoder, filename, selection);
+  if (result != OASIS_SUCCESS) {
+    return result;
+  }
+
+  result = open_audio_codec(decoder);
+  if (result != OASIS_SUCCESS) {
+    decoder_close(decoder);
+    return result;
+  }
+
+  decoder->pkt = av_packet_alloc();
+  decoder->frame = av_frame_alloc();
+  if (!decoder->pkt || !decoder->frame) {
+    oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to allocate packet or frame");
+    decoder_close(decoder);
+    return OASIS_ERROR_FFMPEG_MEMORY_ALLOCATION;
+  }
+
+  return decoder_start(decoder, filename, start);
+}
+
+oasis_result_t decoder_reopen(audio_decoder_t *decoder, const char *filename) {
+  if (!decoder || !filename) {
+    oasis_log(NULL, LOG_LEVEL_ERROR,
+              "Invalid arguments, either decoder or filename is NULL");
+    return OASIS_ERROR_INVALID_ARGUMENT;
+  }
+
+  if (!decoder->pkt || !decoder->frame)
+    return decoder_open(decoder, filename);
+  double start = now_seconds();
+
+  // Done with the previous file, its codec context goes back to the pool and
+  // comes straight back out if the next file uses the same codec
+  if (decoder->seek_index.dirty && decoder->filename &&
+      seek_index_persist_enabled())
+    seek_index_save(&decoder->seek_index, decoder->filename);
+  seek_index_free(&decoder->seek_index);
+  free(decoder->filename);
+  resampler_free(&decoder->resampler);
+  free(decoder->remix_block);
+  codec_pool_release(codec_pool_default(), &decoder->codec_ctx);
+  close_audio_format(&decoder->fmt_ctx, &decoder->input);
+  av_packet_unref(decoder->pkt);
+  av_frame_unref(decoder->frame);
+
+  AVPacket *pkt = decoder->pkt;
+  AVFrame *frame = decoder->frame;
+  memset(decoder, 0, sizeof(*decoder));
+  decoder->pkt = pkt;
+  decoder->frame = frame;
+
+  oasis_result_t result = open_audio_format(decoder, filename, NULL);
+  if (result == OASIS_SUCCESS)
+    result = open_audio_codec(decoder);
+  if (result != OASIS_SUCCESS) {
+    decoder_close(decoder);
+    return result;
+  }
+
+  return decoder_start(decoder, filename, start);
+}
+
+oasis_result_t decoder_set_output_format(audio_decoder_t *decoder,
+                                         int sample_rate,
+                                         enum AVSampleFormat sample_format) {
+  if (!decoder || !decoder->codec_ctx) {
+    oasis_log(NULL, LOG_LEVEL_ERROR, "Invalid arguments, decoder is not open");
+    return OASIS_ERROR_INVALID_ARGUMENT;
+  }
+  if (sample_rate <= 0)
+    sample_rate = decoder->source_rate;
+
+  enum AVCodecID codec_id = av_get_pcm_codec(sample_format, 0);
+  if (codec_id == AV_CODEC_ID_NONE ||
+      (decoder->remix_block && sample_format != AV_SAMPLE_FMT_FLT)) {
+    oasis_log(NULL, LOG_LEVEL_ERROR, "Unsupported sample format %s",
+              get_sample_format_name(sample_format));
+    return OASIS_ERROR_UNSUPPORTED_FORMAT;
+  }
+
+  // Planar sources go to the resampler plane by plane, as decoded
+  enum AVSampleFormat in_format =
+    decoder->frame->format >= 0 ? (enum AVSampleFormat)decoder->frame->format
+                                : decoder->source_format;
+  oasis_result_t result = resampler_configure(
+    &decoder->resampler, decoder->source_rate, decoder->source_channels,
+    in_format,
+    sample_rate, sample_format);
+  if (result != OASIS_SUCCESS)
+    return result;
+
+  decoder->position =
+    av_rescale(decoder->position, sample_rate, decoder->sample_rate);
+  decoder->duration =
+    av_rescale(decoder->duration, sample_rate, decoder->sample_rate);
+  decoder->end = av_rescale(decoder->end, sample_rate, decoder->sample_rate);
+  decoder->sample_rate = sample_rate;
+  decoder->sample_format = sample_format;
+  decoder->codec_id = codec_id;
+  return OASIS_SUCCESS;
+}
+
+oasis_result_t decoder_set_output_channels(audio_decoder_t *decoder,
+                                           int channels,
+                                           const channel_matrix_t *matrix) {
+  if (!decoder || !decoder->codec_ctx || channels <= 0) {
+    oasis_log(NULL, LOG_LEVEL_ERROR, "Invalid arguments, decoder is not open");
+    return OASIS_ERROR_INVALID_ARGUMENT;
+  }
+  if (decoder->sample_format != AV_SAMPLE_FMT_FLT) {
+    oasis_log(NULL, LOG_LEVEL_ERROR, "Channels are only remixed in %s, not %s",
+              get_sample_format_name(AV_SAMPLE_FMT_FLT),
+              get_sample_format_name(decoder->sample_format));
+    return OASIS_ERROR_UNSUPPORTED_FORMAT;
+  }
+
+  channel_matrix_t standard;
+  if (!matrix) {
+    oasis_result_t result =
+      channel_matrix_standard(&standard, decoder->source_channels, channels);
+    if (result != OASIS_SUCCESS)
+      return result;
+    matrix = &standard;
+  }
+  if (matrix->in_channels != decoder->source_channels ||
+      matrix->out_channels != channels) {
+    oasis_log(NULL, LOG_LEVEL_ERROR,
+              "A %d to %d channel matrix does not fit %d to %d channels",
+              matrix->in_channels, matrix->out_channels,
+              decoder->source_channels, channels);
+    return OASIS_ERROR_INVALID_ARGUMENT;
+  }
+
+  channel_mixer_t remix;
+  oasis_result_t result = channel_mixer_init(&remix, matrix);
+  if (result != OASIS_SUCCESS)
+    return result;
+
+  if (remix.identity) {
+    free(decoder->remix_block);
+    decoder->remix_block = NULL;
+  } else if (!decoder->remix_block) {
+    decoder->remix_block = malloc((size_t)CHANNEL_MIX_BLOCK_FRAMES *
+                                  decoder->source_channels * sizeof(float));
+    if (!decoder->remix_block) {
+      oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to allocate remix block");
+      return OASIS_ERROR_MEMORY_ALLOCATION;
+    }
+  }
+
+  decoder->remix = remix;
+  decoder->channels = channels;
+  return OASIS_SUCCESS;
+}
+
+// Reads samples with the channels they were decoded with
+static oasis_result_t read_source_samples(audio_decoder_t *decoder,
+                                          uint8_t *buffer, int nb_samples,
+                                          int *samples_read) {
+  // Nothing past the encoder padding
+  if (decoder->end > 0 && decoder->position + nb_samples > decoder->end) {
+    nb_samples = decoder->position < decoder->end
+                   ? (int)(decoder->end - decoder->position)
+                   : 0;
+  }
+
+  int bytes_per_sample = av_get_bytes_per_sample(decoder->sample_format);
+  int stride = bytes_per_sample * decoder->source_channels;
+  int read = 0;
+  resampler_t *resampler = decoder->resampler.swr ? &decoder->resampler : NULL;
+
+  while (read < nb_samples) {
+    // The resampler keeps what did not fit last time, that comes first
+    if (resampler) {
+      int converted = resampler_convert(resampler, buffer + (size_t)read * stride,
+                                        nb_samples - read, NULL, 0, 0);
+      if (converted < 0)
+        goto convert_error;
+      read += converted;
+      if (read == nb_samples)
+        break;
+    }
+
+    if (decoder->frame_offset >= decoder->frame->nb_samples) {
+      int ret = decoder_receive_frame(decoder);
+      if (ret == AVERROR_EOF) {
+        int flushed = resampler ? resampler_flush(
+                                    resampler, buffer + (size_t)read * stride,
+                                    nb_samples - read)
+                                : 0;
+        if (flushed > 0) {
+          read += flushed;
+          continue;
+        }
+        break;
+      } else if (ret < 0) {
+        oasis_log(NULL, LOG_LEVEL_ERROR, "Error receiving frame: %s",
+                  av_err2str(ret));
+        *samples_read = read;
+        return OASIS_ERROR;
+      }
+      decoder->frame_offset = 0;
+
+      if (decoder->frame->ch_layout.nb_channels != decoder->source_channels ||
+          av_get_packed_sample_fmt(decoder->frame->format) !=
+            decoder->source_format) {
+        oasis_log(NULL, LOG_LEVEL_ERROR,
+                  "Audio format changed mid-stream, not supported");
+        *samples_read = read;
+        return OASIS_ERROR_UNSUPPORTED_FORMAT;
+      }
+    }
+
+    int available = decoder->frame->nb_samples - decoder->frame_offset;
+    if (resampler) {
+      // The whole frame goes in, whatever does not fit stays in the resampler
+      int converted = resampler_convert(
+        resampler, buffer + (size_t)read * stride, nb_samples - read,
+        decoder->frame->extended_data, decoder->frame_offset, available);
+      if (converted < 0)
+        goto convert_error;
+      decoder->frame_offset = decoder->frame->nb_samples;
+      read += converted;
+      continue;
+    }
+
+    int count =
+      (available < nb_samples - read) ? available : nb_samples - read;
+
+    // Only the format changes, the conversion goes frame for frame
+    if (decoder->resampler.converter.kernel) {
+      resampler_convert(&decoder->resampler, buffer + (size_t)read * stride,
+                        count, decoder->frame->extended_data,
+                        decoder->frame_offset, count);
+    } else if (copy_frame_interleaved(
+                 decoder->frame, decoder->frame_offset, count,
+                 decoder->source_channels, bytes_per_sample,
+                 buffer + (size_t)read * stride) != OASIS_SUCCESS) {
+      goto convert_error;
+    }
+    decoder->frame_offset += count;
+    read += count;
+  }
+
+  decoder->position += read;
+  *samples_read = read;
+  return OASIS_SUCCESS;
+
+convert_error:
+  oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to convert samples");
+  decoder->position += read;
+  *samples_read = read;
+  return OASIS_ERROR;
+}
+
+oasis_result_t decoder_read_samples(audio_decoder_t *decoder, uint8_t *buffer,
+                                    int nb_samples, int *samples_read) {
+  if (!decoder || !decoder->codec_ctx || !buffer || !samples_read) {
+    oasis_log(NULL, LOG_LEVEL_ERROR, "Invalid arguments to decoder read");
+    return OASIS_ERROR_INVALID_ARGUMENT;
+  }
+  if (!decoder->remix_block)
+    return read_source_samples(decoder, buffer, nb_samples, samples_read);
+
+  // Remixed a block at a time, through a buffer of source frames
+  size_t stride = sizeof(float) * decoder->channels;
+  oasis_result_t result = OASIS_SUCCESS;
+  int read = 0;
+  while (read < nb_samples) {
+    int block = nb_samples - read;
+    if (block > CHANNEL_MIX_BLOCK_FRAMES)
+      block = CHANNEL_MIX_BLOCK_FRAMES;
+
+    int got = 0;
+    result = read_source_samples(decoder, (uint8_t *)decoder->remix_block,
+                                 block, &got);
+    channel_mixer_run(&decoder->remix,
+                      (float *)(buffer + (size_t)read * stride),
+                      decoder->remix_block, got);
+    read += got;
+    if (result != OASIS_SUCCESS || got < block)
+      break;
+  }
+
+  *samples_read = read;
+  return result;
+}
+
+// Decodes forward from wherever the demuxer was moved to until the frame that
+// holds target, first_sample is where the first frame starts when its
+// timestamp is missing, -1 if unknown
+static oasis_result_t decoder_skip_to(audio_decoder_t *decoder, int64_t target,
+                                      int64_t first_sample) {
+  AVStream *stream = decoder->fmt_ctx->streams[decoder->audio_stream_index];
+  int64_t start = stream->start_time != AV_NOPTS_VALUE ? stream->start_time : 0;
+  int64_t next = first_sample;
+
+  while (1) {
+    int ret = decoder_receive_frame(decoder);
+    if (ret == AVERROR_EOF) {
+      decoder->position = target;
+      return OASIS_SUCCESS;
+    } else if (ret < 0) {
+      oasis_log(NULL, LOG_LEVEL_ERROR, "Error receiving frame: %s",
+                av_err2str(ret));
+      return OASIS_ERROR;
+    }
+
+    int64_t frame_start;
+    int64_t pts = decoder->frame->best_effort_timestamp;
+    if (pts != AV_NOPTS_VALUE) {
+      frame_start = av_rescale_q(pts - start, stream->time_base,
+                                 (AVRational){1, decoder->source_rate});
+    } else if (next >= 0) {
+      frame_start = next;
+    } else {
+      // Nothing to count from, the position is only as good as the demuxer
+      decoder->frame_offset = 0;
+      decoder->position = target;
+      return OASIS_SUCCESS;
+    }
+    next = frame_start + decoder->frame->nb_samples;
+
+    if (frame_start > target) {
+      oasis_log(NULL, LOG_LEVEL_DEBUG, "Seek landed %lld samples late",
+                (long long)(frame_start - target));
+      decoder->frame_offset = 0;
+      decoder->position = frame_start;
+      return OASIS_SUCCESS;
+    }
+
+    if (target < next) {
+      decoder->frame_offset = (int)(target - frame_start);
+      decoder->position = target;
+      return OASIS_SUCCESS;
+    }
+  }
+}
+
+oasis_result_t decoder_seek(audio_decoder_t *decoder, int64_t sample) {
+  if (!decoder || !decoder->fmt_ctx) {
+    oasis_log(NULL, LOG_LEVEL_ERROR, "Invalid arguments, decoder is NULL");
+    return OASIS_ERROR_INVALID_ARGUMENT;
+  }
+
+  if (sample < 0)
+    sample = 0;
+  if (decoder->duration > 0 && sample > decoder->duration)
+    sample = decoder->duration;
+
+  clock_t start = clock();
+  AVStream *stream = decoder->fmt_ctx->streams[decoder->audio_stream_index];
+
+  // Everything below counts in stream samples at the source rate, encoder
+  // delay included
+  if (decoder->resampler.swr)
+    sample = av_rescale(sample, decoder->source_rate, decoder->sample_rate);
+  sample += decoder->trim_start;
+  const seek_point_t *point = seek_index_find(&decoder->seek_index, sample);
+  int ret = -1;
+
+  // Jumping straight to the indexed packet spares the demuxer its own search
+  if (point && point->pos >= 0 &&
+      !(decoder->fmt_ctx->iformat->flags & AVFMT_NO_BYTE_SEEK)) {
+    ret = av_seek_frame(decoder->fmt_ctx, decoder->audio_stream_index,
+                        point->pos, AVSEEK_FLAG_BYTE);
+  }
+
+  if (ret < 0) {
+    int64_t timestamp;
+    if (point) {
+      timestamp = point->timestamp;
+    } else {
+      timestamp = av_rescale_q(sample, (AVRational){1, decoder->source_rate},
+                               stream->time_base);
+      if (stream->start_time != AV_NOPTS_VALUE)
+        timestamp += stream->start_time;
+    }
+
+    ret = av_seek_frame(decoder->fmt_ctx, decoder->audio_stream_index,
+                        timestamp, AVSEEK_FLAG_BACKWARD);
+  }
+
+  if (ret < 0) {
+    oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to seek to sample %lld: %s",
+              (long long)sample, av_err2str(ret));
+    return OASIS_ERROR;
+  }
+
+  avcodec_flush_buffers(decoder->codec_ctx);
+  av_frame_unref(decoder->frame);
+  decoder->frame_offset = 0;
+  decoder->eof = 0;
+  decoder->sequential = 0;
+
+  oasis_result_t result =
+    decoder_skip_to(decoder, sample, point ? point->sample : -1);
+  decoder->position -= decoder->trim_start;
+  if (decoder->resampler.swr) {
+    decoder->position =
+      av_rescale(decoder->position, decoder->sample_rate, decoder->source_rate);
+    resampler_reset(&decoder->resampler);
+  }
+
+  oasis_log(NULL, LOG_LEVEL_DEBUG, "Seeked to sample %lld (%s) in %.2f ms",
+            (long long)decoder->position, point ? "indexed" : "unindexed",
+            (double)(clock() - start) * 1000.0 / CLOCKS_PER_SEC);
+  return result;
+}
+
+void decoder_close(audio_decoder_t *decoder) {
+  if (!decoder)
+    return;
+
+  if (decoder->seek_index.dirty && decoder->filename &&
+      seek_index_persist_enabled())
+    seek_index_save(&decoder->seek_index, decoder->filename);
+  seek_index_free(&decoder->seek_index);
+  free(decoder->filename);
+  resampler_free(&decoder->resampler);
+  free(decoder->remix_block);
+
+  av_packet_free(&decoder->pkt);
+  av_frame_free(&decoder->frame);
+  codec_pool_release(codec_pool_default(), &decoder->codec_ctx);
+  close_audio_format(&decoder->fmt_ctx, &decoder->input);
+  memset(decoder, 0, sizeof(*decoder));
+}
+
+void audio_data_free(audio_data_t *audio_data) {
+  if (!audio_data)
+    return;
+
+  if (audio_data->mapping) {
+    munmap(audio_data->mapping, audio_data->mapping_size);
+  } else {
+    free(audio_data->pcm_data);
+  }
+
+  audio_data->pcm_data = NULL;
+  audio_data->pcm_size = 0;
+  audio_data->mapping = NULL;
+  audio_data->mapping_size = 0;
+}
+
+oasis_result_t decoder_read_all(audio_decoder_t *decoder,
+                                audio_data_t *audio_data) {
+  if (!decoder || !decoder->codec_ctx || !audio_data) {
+    oasis_log(NULL, LOG_LEVEL_ERROR, "Invalid arguments to decoder read");
+    return OASIS_ERROR_INVALID_ARGUMENT;
+  }
+
+  oasis_result_t result;
+  size_t stride = (size_t)av_get_bytes_per_sample(decoder->sample_format) *
+                  decoder->channels;
+
+  // Presize from the container duration when it is known, a little headroom
+  // avoids a reallocation when the estimate is slightly short
+  size_t capacity =
+    decoder->duration > 0
+      ? (size_t)(decoder->duration - decoder->position +
+                 decoder->sample_rate / 10)
+      : (size_t)decoder->sample_rate * 60;
+  size_t size = 0;
+  uint8_t *pcm = malloc(capacity * stride);
+  if (!pcm) {
+    oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to allocate memory for PCM");
+    return OASIS_ERROR_MEMORY_ALLOCATION;
+  }
+
+  while (1) {
+    if (size == capacity) {
+      size_t new_capacity = capacity + capacity / 2;
+      uint8_t *new_pcm = realloc(pcm, new_capacity * stride);
+      if (!new_pcm) {
+        oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to grow PCM buffer");
+        free(pcm);
+        return OASIS_ERROR_MEMORY_ALLOCATION;
+      }
+      pcm = new_pcm;
+      capacity = new_capacity;
+    }
+
+    size_t wanted = capacity - size;
+    if (wanted > INT_MAX / 2)
+      wanted = INT_MAX / 2;
+
+    int samples_read = 0;
+    result = decoder_read_samples(decoder, pcm + size * stride, (int)wanted,
+                                  &samples_read);
+    if (result != OASIS_SUCCESS) {
+      free(pcm);
+      return result;
+    }
+
+    size += samples_read;
+    if ((size_t)samples_read < wanted)
+      break; // End of stream
+  }
+
+  audio_data->pcm_data = pcm;
+  audio_data->pcm_size = size * stride;
+  audio_data->pcm_position = 0;
+  audio_data->sample_rate = decoder->sample_rate;
+  audio_data->channels = decoder->channels;
+  audio_data->sample_format = decoder->sample_format;
+  audio_data->codec_id = decoder->codec_id;
+  return OASIS_SUCCESS;
+}
+
+oasis_result_t decoder_read_to_store(audio_decoder_t *decoder,
+                                     pcm_store_t *store) {
+  if (!decoder || !decoder->codec_ctx || !store) {
+    oasis_log(NULL, LOG_LEVEL_ERROR, "Invalid arguments to decoder read");
+    return OASIS_ERROR_INVALID_ARGUMENT;
+  }
+
+  oasis_result_t result =
+    pcm_store_init(store, decoder->sample_rate, decoder->channels,
+                   decoder->sample_format, 0);
+  if (result != OASIS_SUCCESS)
+    return result;
+
+  // Decoded straight into the chunks, nothing is ever copied twice
+  while (1) {
+    size_t available;
+    uint8_t *dst = pcm_store_write_pointer(store, &available);
+    if (!dst) {
+      pcm_store_free(store);
+      return OASIS_ERROR_MEMORY_ALLOCATION;
+    }
+
+    int wanted = (int)(available / store->stride);
+    int samples_read = 0;
+    result = decoder_read_samples(decoder, dst, wanted, &samples_read);
+    if (result != OASIS_SUCCESS) {
+      pcm_store_free(store);
+      return result;
+    }
+
+    pcm_store_commit(store, (size_t)samples_read * store->stride);
+    if (samples_read < wanted)
+      break; // End of stream
+  }
+
+  return OASIS_SUCCESS;
+}
+
+oasis_result_t decode_file_to_store(const char *filename, pcm_store_t *store) {
+  audio_decoder_t decoder;
+
+  if (!filename || !store) {
+    oasis_log(NULL, LOG_LEVEL_ERROR,
+              "Invalid arguments, either filename or store is NULL");
+    return OASIS_ERROR_INVALID_ARGUMENT;
+  }
+
+  oasis_result_t result = decoder_open(&decoder, filename);
+  if (result != OASIS_SUCCESS)
+    return result;
+
+  result = decoder_read_to_store(&decoder, store);
+  decoder_close(&decoder);
+  if (result == OASIS_SUCCESS) {
+    oasis_log(NULL, LOG_LEVEL_DEBUG, "Decoded %llu bytes of PCM in %llu chunks",
+              (unsigned long long)store->size,
+              (unsigned long long)store->count);
+  }
+  return result;
+}
+
+oasis_result_t decode_file_to_pcm(const char *filename,
+                                  audio_data_t *audio_data) {
+  oasis_log(NULL, LOG_LEVEL_DEBUG, "Decoding audio file %s", filename);
+  clock_t start = clock();
+
+  if (!filename || !audio_data) {
+    oasis_log(NULL, LOG_LEVEL_ERROR,
+              "Invalid arguments, either filename or audio_data is NULL");
+    return OASIS_ERROR_INVALID_ARGUMENT;
+  }
+
+  audio_decoder_t decoder;
+  oasis_result_t result = decoder_open(&decoder, filename);
+  if (result != OASIS_SUCCESS) {
+    return result;
+  }
+
+  result = decoder_read_all(&decoder, audio_data);
+  decoder_close(&decoder);
+  if (result != OASIS_SUCCESS) {
+    return result;
+  }
+
+  clock_t end = clock();
+  double elapsed_time = (double)(end - start) / CLOCKS_PER_SEC;
+  oasis_log(NULL, LOG_LEVEL_INFO,
+            "Decoded %zu bytes of PCM in a single pass in %f seconds",
+            audio_data->pcm_size, elapsed_time);
   return OASIS_SUCCESS;
 }
@@ -0,0 +1,472 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <oasis/audio/dsp.h>
+
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#  define DSP_X86 1
+#  include <immintrin.h>
+#else
+#  define DSP_X86 0
+#endif
+
+#define DSP_DENORMAL 1e-20f // Filter state below this is flushed to 0
+#define DSP_PI 3.14159265358979323846
+
+/**
+ * Runs a block through a cascade of biquads, transposed direct form II.
+ *
+ * @param lanes The block, a row of DSP_MAX_CHANNELS floats per frame.
+ * @param frames The number of frames.
+ * @param channels The number of channels in use in a row.
+ * @param eq The bands and their state.
+ */
+typedef void (*eq_kernel_fn)(float (*lanes)[DSP_MAX_CHANNELS], size_t frames,
+                             int channels, dsp_eq_t *eq);
+
+static eq_kernel_fn eq_kernel;
+static const char *isa_name = "scalar";
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+
+static uint64_t monotonic_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+oasis_result_t dsp_chain_init(dsp_chain_t *chain, int channels) {
+  if (!chain || channels <= 0 || channels > DSP_MAX_CHANNELS) {
+    oasis_log(NULL, LOG_LEVEL_ERROR, "Invalid arguments to DSP chain init");
+    return OASIS_ERROR_INVALID_ARGUMENT;
+  }
+
+  memset(chain, 0, sizeof(*chain));
+  chain->channels = channels;
+  return OASIS_SUCCESS;
+}
+
+oasis_result_t dsp_chain_add(dsp_chain_t *chain, dsp_node_t *node) {
+  if (!chain || !node || !node->process) {
+    oasis_log(NULL, LOG_LEVEL_ERROR, "Invalid arguments to DSP chain add");
+    return OASIS_ERROR_INVALID_ARGUMENT;
+  }
+  if (chain->count == DSP_MAX_NODES || node->channels != chain->channels) {
+    oasis_log(NULL, LOG_LEVEL_ERROR,
+              "Can not add %s to a chain of %d nodes on %d channels",
+              node->name, chain->count, chain->channels);
+    return OASIS_ERROR_INVALID_ARGUMENT;
+  }
+
+  chain->nodes[chain->count++] = node;
+  return OASIS_SUCCESS;
+}
+
+void dsp_chain_process(dsp_chain_t *chain, float *samples, size_t frames) {
+  for (size_t done = 0; done < frames; done += DSP_BLOCK_FRAMES) {
+    size_t count =
+      frames - done < DSP_BLOCK_FRAMES ? frames - done : DSP_BLOCK_FRAMES;
+    float *block = samples + done * chain->channels;
+
+    for (int i = 0; i < chain->count; i++) {
+      dsp_node_t *node = chain->nodes[i];
+      if (__atomic_load_n(&node->bypass, __ATOMIC_RELAXED))
+        continue;
+      if (!chain->profile) {
+        node->process(node, block, count);
+        continue;
+      }
+
+      uint64_t start = monotonic_ns();
+      node->process(node, block, count);
+      node->ns += monotonic_ns() - start;
+      node->blocks++;
+    }
+  }
+}
+
+void dsp_chain_reset(dsp_chain_t *chain) {
+  for (int i = 0; i < chain->count; i++) {
+    if (chain->nodes[i]->reset)
+      chain->nodes[i]->reset(chain->nodes[i]);
+  }
+}
+
+void dsp_chain_log_profile(const dsp_chain_t *chain) {
+  for (int i = 0; i < chain->count; i++) {
+    const dsp_node_t *node = chain->nodes[i];
+    if (node->blocks == 0)
+      continue;
+    oasis_log(NULL, LOG_LEVEL_INFO, "DSP %s: %llu blocks, %.0f ns per block",
+              node->name, (unsigned long long)node->blocks,
+              (double)node->ns / node->blocks);
+  }
+}
+
+void dsp_node_set_bypass(dsp_node_t *node, int bypass) {
+  __atomic_store_n(&node->bypass, bypass != 0, __ATOMIC_RELAXED);
+}
+
+static float db_to_gain(float db) {
+  return db <= DSP_VOLUME_MUTE_DB ? 0.0f : powf(10.0f, db / 20.0f);
+}
+
+static void scale(float *samples, size_t count, float gain) {
+  for (size_t i = 0; i < count; i++)
+    samples[i] *= gain;
+}
+
+static void gain_process(dsp_node_t *node, float *block, size_t frames) {
+  dsp_gain_t *gain = (dsp_gain_t *)node;
+  if (gain->gain != 1.0f)
+    scale(block, frames * node->channels, gain->gain);
+}
+
+void dsp_gain_init(dsp_gain_t *gain, int channels) {
+  memset(gain, 0, sizeof(*gain));
+  gain->node.name = "gain";
+  gain->node.process = gain_process;
+  gain->node.channels = channels;
+  gain->gain = 1.0f;
+}
+
+void dsp_gain_set_db(dsp_gain_t *gain, float db) {
+  gain->gain = db_to_gain(db);
+}
+
+// A tag of a number, "-6.50 dB" and the like, 0 if it is not there
+static int read_tag(const AVDictionary *metadata, const char *key,
+                    double *value) {
+  const AVDictionaryEntry *tag = av_dict_get(metadata, key, NULL, 0);
+  if (!tag || !tag->value)
+    return 0;
+
+  char *end;
+  *value = strtod(tag->value, &end);
+  return end != tag->value;
+}
+
+static int read_mode_gain(const AVDictionary *metadata,
+                          dsp_replaygain_mode_t mode, double *db,
+                          double *peak) {
+  int album = mode == DSP_REPLAYGAIN_ALBUM;
+  double r128;
+
+  *peak = 0.0;
+  if (read_tag(metadata,
+               album ? "REPLAYGAIN_ALBUM_GAIN" : "REPLAYGAIN_TRACK_GAIN", db)) {
+    read_tag(metadata,
+             album ? "REPLAYGAIN_ALBUM_PEAK" : "REPLAYGAIN_TRACK_PEAK", peak);
+    return 1;
+  }
+
+  // Q7.8 fixed point, relative to -23 LUFS
+  if (read_tag(metadata, album ? "R128_ALBUM_GAIN" : "R128_TRACK_GAIN",
+               &r128)) {
+    *db = r128 / 256.0 + DSP_R128_REFERENCE_DB;
+    return 1;
+  }
+  return 0;
+}
+
+int dsp_replaygain_from_tags(const AVDictionary *metadata,
+                             dsp_replaygain_mode_t mode, float preamp_db,
+                             float *db) {
+  if (!metadata || !db || mode == DSP_REPLAYGAIN_OFF)
+    return 0;
+
+  double gain, peak;
+  dsp_replaygain_mode_t other = mode == DSP_REPLAYGAIN_ALBUM
+                                  ? DSP_REPLAYGAIN_TRACK
+                                  : DSP_REPLAYGAIN_ALBUM;
+  if (!read_mode_gain(metadata, mode, &gain, &peak) &&
+      !read_mode_gain(metadata, other, &gain, &peak))
+    return 0;
+
+  gain += preamp_db;
+  if (peak > 0.0 && gain > -20.0 * log10(peak))
+    gain = -20.0 * log10(peak);
+  *db = (float)gain;
+  return 1;
+}
+
+static void volume_process(dsp_node_t *node, float *block, size_t frames) {
+  dsp_volume_t *volume = (dsp_volume_t *)node;
+  int channels = node->channels;
+  float target;
+  __atomic_load(&volume->target, &target, __ATOMIC_RELAXED);
+
+  if (target != volume->ramp_to) {
+    volume->ramp_to = target;
+    volume->step = (target - volume->gain) / (float)volume->ramp_frames;
+    if (volume->step == 0.0f)
+      volume->gain = target;
+  }
+
+  size_t f = 0;
+  for (; f < frames && volume->gain != target; f++) {
+    volume->gain += volume->step;
+    if ((volume->step > 0.0f && volume->gain > target) ||
+        (volume->step < 0.0f && volume->gain < target))
+      volume->gain = target;
+    for (int c = 0; c < channels; c++)
+      block[f * channels + c] *= volume->gain;
+  }
+
+  if (f < frames && volume->gain != 1.0f) {
+    scale(block + f * channels, (frames - f) * channels, volume->gain);
+  }
+}
+
+void dsp_volume_init(dsp_volume_t *volume, int channels, int sample_rate,
+                     float db) {
+  memset(volume, 0, sizeof(*volume));
+  volume->node.name = "volume";
+  volume->node.process = volume_process;
+  volume->node.channels = channels;
+  volume->target = volume->gain = volume->ramp_to = db_to_gain(db);
+  volume->ramp_frames = sample_rate * DSP_VOLUME_RAMP_MS / 1000;
+  if (volume->ramp_frames < 1)
+    volume->ramp_frames = 1;
+}
+
+void dsp_volume_set_db(dsp_volume_t *volume, float db) {
+  float gain = db_to_gain(db);
+  __atomic_store(&volume->target, &gain, __ATOMIC_RELAXED);
+}
+
+float dsp_volume_get_db(dsp_volume_t *volume) {
+  float gain;
+  __atomic_load(&volume->target, &gain, __ATOMIC_RELAXED);
+  return gain > 0.0f ? 20.0f * log10f(gain) : DSP_VOLUME_MUTE_DB;
+}
+
+static void eq_scalar(float (*lanes)[DSP_MAX_CHANNELS], size_t frames,
+                      int channels, dsp_eq_t *eq) {
+  for (int b = 0; b < eq->band_count; b++) {
+    const float *k = eq->coefficients[b];
+    for (int c = 0; c < channels; c++) {
+      float z1 = eq->z1[b][c], z2 = eq->z2[b][c];
+      for (size_t f = 0; f < frames; f++) {
+        float x = lanes[f][c];
+        float y = k[0] * x + z1;
+        z1 = k[1] * x - k[3] * y + z2;
+        z2 = k[2] * x - k[4] * y;
+        lanes[f][c] = y;
+      }
+      eq->z1[b][c] = z1;
+      eq->z2[b][c] = z2;
+    }
+  }
+}
+
+#if DSP_X86
+
+// A frame is one vector of channels, the lanes past the last channel are
+// zeros that stay zeros. Every band goes over the whole block before the
+// next, the state of a band is in registers for all of it.
+
+__attribute__((target("sse2"))) static void
+eq_sse2(float (*lanes)[DSP_MAX_CHANNELS], size_t frames, int channels,
+        dsp_eq_t *eq) {
+  for (int half = 0; half < (channels > 4 ? 2 : 1); half++) {
+    int lane = half * 4;
+    for (int b = 0; b < eq->band_count; b++) {
+      const float *k = eq->coefficients[b];
+      __m128 b0 = _mm_set1_ps(k[0]), b1 = _mm_set1_ps(k[1]);
+      __m128 b2 = _mm_set1_ps(k[2]), a1 = _mm_set1_ps(k[3]);
+      __m128 a2 = _mm_set1_ps(k[4]);
+      __m128 z1 = _mm_loadu_ps(&eq->z1[b][lane]);
+      __m128 z2 = _mm_loadu_ps(&eq->z2[b][lane]);
+      for (size_t f = 0; f < frames; f++) {
+        __m128 x = _mm_loadu_ps(&lanes[f][lane]);
+        __m128 y = _mm_add_ps(_mm_mul_ps(b0, x), z1);
+        z1 = _mm_add_ps(_mm_sub_ps(_mm_mul_ps(b1, x), _mm_mul_ps(a1, y)), z2);
+        z2 = _mm_sub_ps(_mm_mul_ps(b2, x), _mm_mul_ps(a2, y));
+        _mm_storeu_ps(&lanes[f][lane], y);
+      }
+      _mm_storeu_ps(&eq->z1[b][lane], z1);
+      _mm_storeu_ps(&eq->z2[b][lane], z2);
+    }
+  }
+}
+
+__attribute__((target("avx2"))) static void
+eq_avx2(float (*lanes)[DSP_MAX_CHANNELS], size_t frames, int channels,
+        dsp_eq_t *eq) {
+  if (channels <= 4) {
+    eq_sse2(lanes, frames, channels, eq);
+    return;
+  }
+
+  for (int b = 0; b < eq->band_count; b++) {
+    const float *k = eq->coefficients[b];
+    __m256 b0 = _mm256_set1_ps(k[0]), b1 = _mm256_set1_ps(k[1]);
+    __m256 b2 = _mm256_set1_ps(k[2]), a1 = _mm256_set1_ps(k[3]);
+    __m256 a2 = _mm256_set1_ps(k[4]);
+    __m256 z1 = _mm256_loadu_ps(eq->z1[b]);
+    __m256 z2 = _mm256_loadu_ps(eq->z2[b]);
+    for (size_t f = 0; f < frames; f++) {
+      __m256 x = _mm256_loadu_ps(lanes[f]);
+      __m256 y = _mm256_add_ps(_mm256_mul_ps(b0, x), z1);
+      z1 = _mm256_add_ps(
+        _mm256_sub_ps(_mm256_mul_ps(b1, x), _mm256_mul_ps(a1, y)), z2);
+      z2 = _mm256_sub_ps(_mm256_mul_ps(b2, x), _mm256_mul_ps(a2, y));
+      _mm256_storeu_ps(lanes[f], y);
+    }
+    _mm256_storeu_ps(eq->z1[b], z1);
+    _mm256_storeu_ps(eq->z2[b], z2);
+  }
+}
+
+#endif
+
+static void select_kernels(void) {
+  eq_kernel = eq_scalar;
+
+#if DSP_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse2")) {
+    eq_kernel = eq_sse2;
+    isa_name = "sse2";
+  }
+
+  if (__builtin_cpu_supports("avx2")) {
+    eq_kernel = eq_avx2;
+    isa_name = "avx2";
+  }
+#endif
+}
+
+static void eq_process(dsp_node_t *node, float *block, size_t frames) {
+  dsp_eq_t *eq = (dsp_eq_t *)node;
+  int channels = node->channels;
+
+  for (size_t f = 0; f < frames; f++) {
+    for (int c = 0; c < channels; c++)
+      eq->lanes[f][c] = block[f * channels + c];
+  }
+
+  eq_kernel(eq->lanes, frames, channels, eq);
+
+  for (size_t f = 0; f < frames; f++) {
+    for (int c = 0; c < channels; c++)
+      block[f * channels + c] = eq->lanes[f][c];
+  }
+
+  // A decaying tail would otherwise end up in denormals, which are slow
+  for (int b = 0; b < eq->band_count; b++) {
+    for (int c = 0; c < channels; c++) {
+      if (fabsf(eq->z1[b][c]) < DSP_DENORMAL)
+        eq->z1[b][c] = 0.0f;
+      if (fabsf(eq->z2[b][c]) < DSP_DENORMAL)
+        eq->z2[b][c] = 0.0f;
+    }
+  }
+}
+
+static void eq_reset(dsp_node_t *node) {
+  dsp_eq_t *eq = (dsp_eq_t *)node;
+  memset(eq->z1, 0, sizeof(eq->z1));
+  memset(eq->z2, 0, sizeof(eq->z2));
+}
+
+// The Audio EQ Cookbook, normalized by a0
+static void eq_band_coefficients(const dsp_eq_band_t *band, int sample_rate,
+                                 float *k) {
+  double a = pow(10.0, band->gain_db / 40.0);
+  double w0 = 2.0 * DSP_PI * band->frequency / sample_rate;
+  double cosw = cos(w0);
+  double alpha = sin(w0) / (2.0 * band->q);
+  double shelf = 2.0 * sqrt(a) * alpha;
+  double b0, b1, b2, a0, a1, a2;
+
+  switch (band->type) {
+  case DSP_EQ_LOW_SHELF:
+    b0 = a * ((a + 1) - (a - 1) * cosw + shelf);
+    b1 = 2 * a * ((a - 1) - (a + 1) * cosw);
+    b2 = a * ((a + 1) - (a - 1) * cosw - shelf);
+    a0 = (a + 1) + (a - 1) * cosw + shelf;
+    a1 = -2 * ((a - 1) + (a + 1) * cosw);
+    a2 = (a + 1) + (a - 1) * cosw - shelf;
+    break;
+  case DSP_EQ_HIGH_SHELF:
+    b0 = a * ((a + 1) + (a - 1) * cosw + shelf);
+    b1 = -2 * a * ((a - 1) + (a + 1) * cosw);
+    b2 = a * ((a + 1) + (a - 1) * cosw - shelf);
+    a0 = (a + 1) - (a - 1) * cosw + shelf;
+    a1 = 2 * ((a - 1) - (a + 1) * cosw);
+    a2 = (a + 1) - (a - 1) * cosw - shelf;
+    break;
+  case DSP_EQ_LOW_PASS:
+    b0 = b2 = (1 - cosw) / 2;
+    b1 = 1 - cosw;
+    a0 = 1 + alpha;
+    a1 = -2 * cosw;
+    a2 = 1 - alpha;
+    break;
+  case DSP_EQ_HIGH_PASS:
+    b0 = b2 = (1 + cosw) / 2;
+    b1 = -(1 + cosw);
+    a0 = 1 + alpha;
+    a1 = -2 * cosw;
+    a2 = 1 - alpha;
+    break;
+  default: // DSP_EQ_PEAK
+    b0 = 1 + alpha * a;
+    b1 = -2 * cosw;
+    b2 = 1 - alpha * a;
+    a0 = 1 + alpha / a;
+    a1 = -2 * cosw;
+    a2 = 1 - alpha / a;
+    break;
+  }
+
+  k[0] = (float)(b0 / a0);
+  k[1] = (float)(b1 / a0);
+  k[2] = (float)(b2 / a0);
+  k[3] = (float)(a1 / a0);
+  k[4] = (float)(a2 / a0);
+}
+
+oasis_result_t dsp_eq_init(dsp_eq_t *eq, int channels, int sample_rate,
+                           const dsp_eq_band_t *bands, int band_count) {
+  if (!eq || channels <= 0 || channels > DSP_MAX_CHANNELS ||
+      (!bands && band_count > 0) || band_count < 0 ||
+      band_count > DSP_EQ_MAX_BANDS || sample_rate <= 0) {
+    oasis_log(NULL, LOG_LEVEL_ERROR, "Invalid arguments to EQ init");
+    return OASIS_ERROR_INVALID_ARGUMENT;
+  }
+  for (int b = 0; b < band_count; b++) {
+    if (bands[b].frequency <= 0.0 || bands[b].frequency >= sample_rate / 2.0 ||
+        bands[b].q <= 0.0) {
+      oasis_log(NULL, LOG_LEVEL_ERROR,
+                "EQ band %d at %.0f Hz, Q %.2f does not fit %d Hz", b,
+                bands[b].frequency, bands[b].q, sample_rate);
+      return OASIS_ERROR_INVALID_ARGUMENT;
+    }
+  }
+
+  pthread_once(&kernels_once, select_kernels);
+  memset(eq, 0, sizeof(*eq));
+  eq->node.name = "eq";
+  eq->node.process = eq_process;
+  eq->node.reset = eq_reset;
+  eq->node.channels = channels;
+  eq->band_count = band_count;
+  for (int b = 0; b < band_count; b++)
+    eq_band_coefficients(&bands[b], sample_rate, eq->coefficients[b]);
+
+  oasis_log(NULL, LOG_LEVEL_DEBUG, "EQ of %d bands on %d channels (%s)",
+            band_count, channels, isa_name);
+  return OASIS_SUCCESS;
+}
+
+const char *dsp_get_isa_name(void) {
+  pthread_once(&kernels_once, select_kernels);
+  return isa_name;
+}
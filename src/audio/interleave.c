@@ -0,0 +1,340 @@
+#include <oasis/audio/interleave.h>
+#include <oasis/utils.h>
+
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#  define INTERLEAVE_X86 1
+#  include <immintrin.h>
+#else
+#  define INTERLEAVE_X86 0
+#endif
+
+typedef void (*interleave_fn)(uint8_t *dst, uint8_t *const *src, int offset,
+                              int nb_samples, int channels);
+
+enum { WIDTH_8, WIDTH_16, WIDTH_32, WIDTH_64, WIDTH_COUNT };
+enum {
+  LAYOUT_MONO,
+  LAYOUT_STEREO,
+  LAYOUT_5POINT1,
+  LAYOUT_7POINT1,
+  LAYOUT_GENERIC,
+  LAYOUT_COUNT
+};
+
+static interleave_fn kernels[WIDTH_COUNT][LAYOUT_COUNT];
+static const char *isa_name = "scalar";
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+
+// Samples are only moved around, never interpreted, so every width is copied
+// as an unsigned integer of the same size.
+
+#define DEFINE_MONO_KERNEL(name, type)                                         \
+  static void name(uint8_t *dst, uint8_t *const *src, int offset,              \
+                   int nb_samples, int channels) {                             \
+    memcpy(dst, (const type *)src[0] + offset, nb_samples * sizeof(type));     \
+  }
+
+#define DEFINE_FIXED_KERNEL(name, type, fixed_channels)                        \
+  static void name(uint8_t *dst, uint8_t *const *src, int offset,              \
+                   int nb_samples, int channels) {                             \
+    const type *in[fixed_channels];                                            \
+    type *out = (type *)dst;                                                   \
+    for (int c = 0; c < fixed_channels; c++)                                   \
+      in[c] = (const type *)src[c] + offset;                                   \
+    for (int i = 0; i < nb_samples; i++) {                                     \
+      for (int c = 0; c < fixed_channels; c++)                                 \
+        out[c] = in[c][i];                                                     \
+      out += fixed_channels;                                                   \
+    }                                                                          \
+  }
+
+#define DEFINE_GENERIC_KERNEL(name, type)                                      \
+  static void name(uint8_t *dst, uint8_t *const *src, int offset,              \
+                   int nb_samples, int channels) {                             \
+    for (int c = 0; c < channels; c++) {                                       \
+      const type *in = (const type *)src[c] + offset;                          \
+      type *out = (type *)dst + c;                                             \
+      for (int i = 0; i < nb_samples; i++)                                     \
+        out[(size_t)i * channels] = in[i];                                     \
+    }                                                                          \
+  }
+
+DEFINE_MONO_KERNEL(interleave_mono_8, uint8_t)
+DEFINE_MONO_KERNEL(interleave_mono_16, uint16_t)
+DEFINE_MONO_KERNEL(interleave_mono_32, uint32_t)
+DEFINE_MONO_KERNEL(interleave_mono_64, uint64_t)
+
+DEFINE_FIXED_KERNEL(interleave_stereo_8, uint8_t, 2)
+DEFINE_FIXED_KERNEL(interleave_stereo_16, uint16_t, 2)
+DEFINE_FIXED_KERNEL(interleave_stereo_32, uint32_t, 2)
+DEFINE_FIXED_KERNEL(interleave_stereo_64, uint64_t, 2)
+
+DEFINE_FIXED_KERNEL(interleave_5point1_8, uint8_t, 6)
+DEFINE_FIXED_KERNEL(interleave_5point1_16, uint16_t, 6)
+DEFINE_FIXED_KERNEL(interleave_5point1_32, uint32_t, 6)
+DEFINE_FIXED_KERNEL(interleave_5point1_64, uint64_t, 6)
+
+DEFINE_FIXED_KERNEL(interleave_7point1_8, uint8_t, 8)
+DEFINE_FIXED_KERNEL(interleave_7point1_16, uint16_t, 8)
+DEFINE_FIXED_KERNEL(interleave_7point1_32, uint32_t, 8)
+DEFINE_FIXED_KERNEL(interleave_7point1_64, uint64_t, 8)
+
+DEFINE_GENERIC_KERNEL(interleave_generic_8, uint8_t)
+DEFINE_GENERIC_KERNEL(interleave_generic_16, uint16_t)
+DEFINE_GENERIC_KERNEL(interleave_generic_32, uint32_t)
+DEFINE_GENERIC_KERNEL(interleave_generic_64, uint64_t)
+
+#if INTERLEAVE_X86
+
+// Stereo is a plain unpack of the two planes, 8 channels are interleaved by
+// transposing blocks of samples, the tails fall back to scalar code.
+
+#  define DEFINE_SSE2_STEREO_KERNEL(name, type, unpacklo, unpackhi)            \
+    __attribute__((target("sse2"))) static void name(                          \
+      uint8_t *dst, uint8_t *const *src, int offset, int nb_samples,           \
+      int channels) {                                                          \
+      const int lanes = sizeof(__m128i) / sizeof(type);                        \
+      const type *left = (const type *)src[0] + offset;                        \
+      const type *right = (const type *)src[1] + offset;                       \
+      type *out = (type *)dst;                                                 \
+      int i = 0;                                                               \
+      for (; i + lanes <= nb_samples; i += lanes) {                            \
+        __m128i l = _mm_loadu_si128((const __m128i *)(left + i));              \
+        __m128i r = _mm_loadu_si128((const __m128i *)(right + i));             \
+        _mm_storeu_si128((__m128i *)(out + 2 * i), unpacklo(l, r));            \
+        _mm_storeu_si128((__m128i *)(out + 2 * i + lanes), unpackhi(l, r));    \
+      }                                                                        \
+      for (; i < nb_samples; i++) {                                            \
+        out[2 * i] = left[i];                                                  \
+        out[2 * i + 1] = right[i];                                             \
+      }                                                                        \
+    }
+
+#  define DEFINE_AVX2_STEREO_KERNEL(name, type, unpacklo, unpackhi)            \
+    __attribute__((target("avx2"))) static void name(                          \
+      uint8_t *dst, uint8_t *const *src, int offset, int nb_samples,           \
+      int channels) {                                                          \
+      const int lanes = sizeof(__m256i) / sizeof(type);                        \
+      const type *left = (const type *)src[0] + offset;                        \
+      const type *right = (const type *)src[1] + offset;                       \
+      type *out = (type *)dst;                                                 \
+      int i = 0;                                                               \
+      for (; i + lanes <= nb_samples; i += lanes) {                            \
+        __m256i l = _mm256_loadu_si256((const __m256i *)(left + i));           \
+        __m256i r = _mm256_loadu_si256((const __m256i *)(right + i));          \
+        /* The unpacks work per 128 bit lane, put the lanes back in order */   \
+        __m256i lo = unpacklo(l, r);                                           \
+        __m256i hi = unpackhi(l, r);                                           \
+        _mm256_storeu_si256((__m256i *)(out + 2 * i),                          \
+                            _mm256_permute2x128_si256(lo, hi, 0x20));          \
+        _mm256_storeu_si256((__m256i *)(out + 2 * i + lanes),                  \
+                            _mm256_permute2x128_si256(lo, hi, 0x31));          \
+      }                                                                        \
+      for (; i < nb_samples; i++) {                                            \
+        out[2 * i] = left[i];                                                  \
+        out[2 * i + 1] = right[i];                                             \
+      }                                                                        \
+    }
+
+DEFINE_SSE2_STEREO_KERNEL(interleave_stereo_8_sse2, uint8_t, _mm_unpacklo_epi8,
+                          _mm_unpackhi_epi8)
+DEFINE_SSE2_STEREO_KERNEL(interleave_stereo_16_sse2, uint16_t,
+                          _mm_unpacklo_epi16, _mm_unpackhi_epi16)
+DEFINE_SSE2_STEREO_KERNEL(interleave_stereo_32_sse2, uint32_t,
+                          _mm_unpacklo_epi32, _mm_unpackhi_epi32)
+DEFINE_SSE2_STEREO_KERNEL(interleave_stereo_64_sse2, uint64_t,
+                          _mm_unpacklo_epi64, _mm_unpackhi_epi64)
+
+DEFINE_AVX2_STEREO_KERNEL(interleave_stereo_8_avx2, uint8_t,
+                          _mm256_unpacklo_epi8, _mm256_unpackhi_epi8)
+DEFINE_AVX2_STEREO_KERNEL(interleave_stereo_16_avx2, uint16_t,
+                          _mm256_unpacklo_epi16, _mm256_unpackhi_epi16)
+DEFINE_AVX2_STEREO_KERNEL(interleave_stereo_32_avx2, uint32_t,
+                          _mm256_unpacklo_epi32, _mm256_unpackhi_epi32)
+DEFINE_AVX2_STEREO_KERNEL(interleave_stereo_64_avx2, uint64_t,
+                          _mm256_unpacklo_epi64, _mm256_unpackhi_epi64)
+
+__attribute__((target("sse2"))) static void
+interleave_7point1_16_sse2(uint8_t *dst, uint8_t *const *src, int offset,
+                           int nb_samples, int channels) {
+  const uint16_t *in[8];
+  uint16_t *out = (uint16_t *)dst;
+  for (int c = 0; c < 8; c++)
+    in[c] = (const uint16_t *)src[c] + offset;
+
+  int i = 0;
+  for (; i + 8 <= nb_samples; i += 8) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(in[0] + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(in[1] + i));
+    __m128i c = _mm_loadu_si128((const __m128i *)(in[2] + i));
+    __m128i d = _mm_loadu_si128((const __m128i *)(in[3] + i));
+    __m128i e = _mm_loadu_si128((const __m128i *)(in[4] + i));
+    __m128i f = _mm_loadu_si128((const __m128i *)(in[5] + i));
+    __m128i g = _mm_loadu_si128((const __m128i *)(in[6] + i));
+    __m128i h = _mm_loadu_si128((const __m128i *)(in[7] + i));
+
+    // 8x8 transpose, channels become samples
+    __m128i s0 = _mm_unpacklo_epi16(a, b);
+    __m128i s1 = _mm_unpacklo_epi16(c, d);
+    __m128i s2 = _mm_unpacklo_epi16(e, f);
+    __m128i s3 = _mm_unpacklo_epi16(g, h);
+    __m128i s4 = _mm_unpackhi_epi16(a, b);
+    __m128i s5 = _mm_unpackhi_epi16(c, d);
+    __m128i s6 = _mm_unpackhi_epi16(e, f);
+    __m128i s7 = _mm_unpackhi_epi16(g, h);
+
+    __m128i t0 = _mm_unpacklo_epi32(s0, s1);
+    __m128i t1 = _mm_unpackhi_epi32(s0, s1);
+    __m128i t2 = _mm_unpacklo_epi32(s2, s3);
+    __m128i t3 = _mm_unpackhi_epi32(s2, s3);
+    __m128i t4 = _mm_unpacklo_epi32(s4, s5);
+    __m128i t5 = _mm_unpackhi_epi32(s4, s5);
+    __m128i t6 = _mm_unpacklo_epi32(s6, s7);
+    __m128i t7 = _mm_unpackhi_epi32(s6, s7);
+
+    __m128i *row = (__m128i *)(out + (size_t)i * 8);
+    _mm_storeu_si128(row + 0, _mm_unpacklo_epi64(t0, t2));
+    _mm_storeu_si128(row + 1, _mm_unpackhi_epi64(t0, t2));
+    _mm_storeu_si128(row + 2, _mm_unpacklo_epi64(t1, t3));
+    _mm_storeu_si128(row + 3, _mm_unpackhi_epi64(t1, t3));
+    _mm_storeu_si128(row + 4, _mm_unpacklo_epi64(t4, t6));
+    _mm_storeu_si128(row + 5, _mm_unpackhi_epi64(t4, t6));
+    _mm_storeu_si128(row + 6, _mm_unpacklo_epi64(t5, t7));
+    _mm_storeu_si128(row + 7, _mm_unpackhi_epi64(t5, t7));
+  }
+
+  for (; i < nb_samples; i++) {
+    for (int c = 0; c < 8; c++)
+      out[(size_t)i * 8 + c] = in[c][i];
+  }
+}
+
+__attribute__((target("sse2"))) static void
+interleave_7point1_32_sse2(uint8_t *dst, uint8_t *const *src, int offset,
+                           int nb_samples, int channels) {
+  const uint32_t *in[8];
+  uint32_t *out = (uint32_t *)dst;
+  for (int c = 0; c < 8; c++)
+    in[c] = (const uint32_t *)src[c] + offset;
+
+  int i = 0;
+  for (; i + 4 <= nb_samples; i += 4) {
+    // Two 4x4 transposes, channels 0-3 and 4-7 of the same 4 samples
+    for (int half = 0; half < 2; half++) {
+      const uint32_t *const *planes = in + half * 4;
+      __m128i a = _mm_loadu_si128((const __m128i *)(planes[0] + i));
+      __m128i b = _mm_loadu_si128((const __m128i *)(planes[1] + i));
+      __m128i c = _mm_loadu_si128((const __m128i *)(planes[2] + i));
+      __m128i d = _mm_loadu_si128((const __m128i *)(planes[3] + i));
+
+      __m128i t0 = _mm_unpacklo_epi32(a, b);
+      __m128i t1 = _mm_unpacklo_epi32(c, d);
+      __m128i t2 = _mm_unpackhi_epi32(a, b);
+      __m128i t3 = _mm_unpackhi_epi32(c, d);
+
+      uint32_t *base = out + (size_t)i * 8 + half * 4;
+      _mm_storeu_si128((__m128i *)(base + 0), _mm_unpacklo_epi64(t0, t1));
+      _mm_storeu_si128((__m128i *)(base + 8), _mm_unpackhi_epi64(t0, t1));
+      _mm_storeu_si128((__m128i *)(base + 16), _mm_unpacklo_epi64(t2, t3));
+      _mm_storeu_si128((__m128i *)(base + 24), _mm_unpackhi_epi64(t2, t3));
+    }
+  }
+
+  for (; i < nb_samples; i++) {
+    for (int c = 0; c < 8; c++)
+      out[(size_t)i * 8 + c] = in[c][i];
+  }
+}
+
+#endif
+
+static void select_kernels(void) {
+  static const interleave_fn scalar[WIDTH_COUNT][LAYOUT_COUNT] = {
+    {interleave_mono_8, interleave_stereo_8, interleave_5point1_8,
+     interleave_7point1_8, interleave_generic_8},
+    {interleave_mono_16, interleave_stereo_16, interleave_5point1_16,
+     interleave_7point1_16, interleave_generic_16},
+    {interleave_mono_32, interleave_stereo_32, interleave_5point1_32,
+     interleave_7point1_32, interleave_generic_32},
+    {interleave_mono_64, interleave_stereo_64, interleave_5point1_64,
+     interleave_7point1_64, interleave_generic_64},
+  };
+  memcpy(kernels, scalar, sizeof(kernels));
+
+#if INTERLEAVE_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse2")) {
+    kernels[WIDTH_8][LAYOUT_STEREO] = interleave_stereo_8_sse2;
+    kernels[WIDTH_16][LAYOUT_STEREO] = interleave_stereo_16_sse2;
+    kernels[WIDTH_32][LAYOUT_STEREO] = interleave_stereo_32_sse2;
+    kernels[WIDTH_64][LAYOUT_STEREO] = interleave_stereo_64_sse2;
+    kernels[WIDTH_16][LAYOUT_7POINT1] = interleave_7point1_16_sse2;
+    kernels[WIDTH_32][LAYOUT_7POINT1] = interleave_7point1_32_sse2;
+    isa_name = "sse2";
+  }
+
+  if (__builtin_cpu_supports("avx2")) {
+    kernels[WIDTH_8][LAYOUT_STEREO] = interleave_stereo_8_avx2;
+    kernels[WIDTH_16][LAYOUT_STEREO] = interleave_stereo_16_avx2;
+    kernels[WIDTH_32][LAYOUT_STEREO] = interleave_stereo_32_avx2;
+    kernels[WIDTH_64][LAYOUT_STEREO] = interleave_stereo_64_avx2;
+    isa_name = "avx2";
+  }
+#endif
+}
+
+oasis_result_t interleave_samples(uint8_t *dst, uint8_t *const *src,
+                                  int offset, int nb_samples, int channels,
+                                  int bytes_per_sample) {
+  int width, layout;
+
+  pthread_once(&kernels_once, select_kernels);
+
+  switch (bytes_per_sample) {
+  case 1:
+    width = WIDTH_8;
+    break;
+  case 2:
+    width = WIDTH_16;
+    break;
+  case 4:
+    width = WIDTH_32;
+    break;
+  case 8:
+    width = WIDTH_64;
+    break;
+  default:
+    oasis_log(NULL, LOG_LEVEL_ERROR, "No interleave kernel for %d byte samples",
+              bytes_per_sample);
+    return OASIS_ERROR_UNSUPPORTED_FORMAT;
+  }
+
+  switch (channels) {
+  case 1:
+    layout = LAYOUT_MONO;
+    break;
+  case 2:
+    layout = LAYOUT_STEREO;
+    break;
+  case 6:
+    layout = LAYOUT_5POINT1;
+    break;
+  case 8:
+    layout = LAYOUT_7POINT1;
+    break;
+  default:
+    layout = LAYOUT_GENERIC;
+    break;
+  }
+
+  kernels[width][layout](dst, src, offset, nb_samples, channels);
+  return OASIS_SUCCESS;
+}
+
+const char *interleave_get_isa_name(void) {
+  pthread_once(&kernels_once, select_kernels);
+  return isa_name;
+}
@@ -0,0 +1,473 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <oasis/audio/mixer.h>
+#include <oasis/utils.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#  define MIXER_X86 1
+#  include <immintrin.h>
+#else
+#  define MIXER_X86 0
+#endif
+
+typedef void (*mix_fn)(float *accumulator, const float *samples, size_t frames,
+                       int channels, float gain, float step);
+typedef void (*clamp_fn)(float *samples, size_t count);
+
+static mix_fn mix_kernel;
+static clamp_fn clamp_kernel;
+static const char *isa_name = "scalar";
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+
+static void mix_scalar(float *accumulator, const float *samples, size_t frames,
+                       int channels, float gain, float step) {
+  for (size_t i = 0; i < frames; i++) {
+    float g = gain + step * (float)i;
+    for (int c = 0; c < channels; c++)
+      accumulator[i * channels + c] += samples[i * channels + c] * g;
+  }
+}
+
+// The sum is clamped to full scale before it is converted back, so a hot mix
+// saturates the same way in float formats as in integer ones
+static void clamp_scalar(float *samples, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    float x = samples[i];
+    samples[i] = x < -1.0f ? -1.0f : (x > 1.0f ? 1.0f : x);
+  }
+}
+
+#if MIXER_X86
+
+// The ramp is evaluated per vector from the frame index rather than summed up
+// step by step, so long fades do not drift. A vector holds whole frames only
+// when the channel count divides the lane count, anything else is scalar.
+
+__attribute__((target("sse2"))) static void
+mix_sse2(float *accumulator, const float *samples, size_t frames, int channels,
+         float gain, float step) {
+  if (4 % channels != 0) {
+    mix_scalar(accumulator, samples, frames, channels, gain, step);
+    return;
+  }
+
+  size_t count = frames * channels;
+  __m128 lane = _mm_setr_ps(0.0f, step * (float)(1 / channels),
+                            step * (float)(2 / channels),
+                            step * (float)(3 / channels));
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128 g = _mm_add_ps(_mm_set1_ps(gain + step * (float)(i / channels)),
+                          lane);
+    __m128 sum = _mm_add_ps(_mm_loadu_ps(accumulator + i),
+                            _mm_mul_ps(_mm_loadu_ps(samples + i), g));
+    _mm_storeu_ps(accumulator + i, sum);
+  }
+
+  size_t done = i / channels;
+  mix_scalar(accumulator + i, samples + i, frames - done, channels,
+             gain + step * (float)done, step);
+}
+
+__attribute__((target("avx2"))) static void
+mix_avx2(float *accumulator, const float *samples, size_t frames, int channels,
+         float gain, float step) {
+  if (8 % channels != 0) {
+    mix_scalar(accumulator, samples, frames, channels, gain, step);
+    return;
+  }
+
+  size_t count = frames * channels;
+  __m256 lane = _mm256_setr_ps(
+    0.0f, step * (float)(1 / channels), step * (float)(2 / channels),
+    step * (float)(3 / channels), step * (float)(4 / channels),
+    step * (float)(5 / channels), step * (float)(6 / channels),
+    step * (float)(7 / channels));
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256 g = _mm256_add_ps(
+      _mm256_set1_ps(gain + step * (float)(i / channels)), lane);
+    __m256 sum = _mm256_add_ps(_mm256_loadu_ps(accumulator + i),
+                               _mm256_mul_ps(_mm256_loadu_ps(samples + i), g));
+    _mm256_storeu_ps(accumulator + i, sum);
+  }
+
+  size_t done = i / channels;
+  mix_scalar(accumulator + i, samples + i, frames - done, channels,
+             gain + step * (float)done, step);
+}
+
+__attribute__((target("sse2"))) static void clamp_sse2(float *samples,
+                                                       size_t count) {
+  const __m128 low = _mm_set1_ps(-1.0f), high = _mm_set1_ps(1.0f);
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128 x = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(samples + i), low), high);
+    _mm_storeu_ps(samples + i, x);
+  }
+  clamp_scalar(samples + i, count - i);
+}
+
+#endif
+
+static void select_kernels(void) {
+  mix_kernel = mix_scalar;
+  clamp_kernel = clamp_scalar;
+
+#if MIXER_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse2")) {
+    mix_kernel = mix_sse2;
+    clamp_kernel = clamp_sse2;
+    isa_name = "sse2";
+  }
+
+  if (__builtin_cpu_supports("avx2")) {
+    mix_kernel = mix_avx2;
+    isa_name = "avx2";
+  }
+#endif
+}
+
+oasis_result_t mixer_init(mixer_t *mixer, int sample_rate, int channels,
+                          enum AVSampleFormat sample_format) {
+  if (!mixer || channels <= 0) {
+    oasis_log(NULL, LOG_LEVEL_ERROR, "Invalid arguments to mixer init");
+    return OASIS_ERROR_INVALID_ARGUMENT;
+  }
+  sample_convert_fn to_float =
+    sample_convert_get_kernel(sample_format, AV_SAMPLE_FMT_FLT, 0);
+  sample_convert_fn from_float =
+    sample_convert_get_kernel(AV_SAMPLE_FMT_FLT, sample_format, 0);
+  if (av_sample_fmt_is_planar(sample_format) || !to_float || !from_float) {
+    oasis_log(NULL, LOG_LEVEL_ERROR, "The mixer can not mix %s",
+              av_get_sample_fmt_name(sample_format));
+    return OASIS_ERROR_UNSUPPORTED_FORMAT;
+  }
+
+  pthread_once(&kernels_once, select_kernels);
+  memset(mixer, 0, sizeof(*mixer));
+  mixer->sample_rate = sample_rate;
+  mixer->channels = channels;
+  mixer->sample_format = sample_format;
+  mixer->to_float = to_float;
+  mixer->from_float = from_float;
+  mixer->stride = (size_t)av_get_bytes_per_sample(sample_format) * channels;
+
+  size_t count = (size_t)MIXER_BLOCK_FRAMES * channels;
+  mixer->accumulator = malloc(count * sizeof(float));
+  mixer->samples = malloc(count * sizeof(float));
+  mixer->scratch = malloc(MIXER_BLOCK_FRAMES * mixer->stride);
+  if (!mixer->accumulator || !mixer->samples || !mixer->scratch) {
+    oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to allocate mixer buffers");
+    mixer_free(mixer);
+    return OASIS_ERROR_MEMORY_ALLOCATION;
+  }
+
+  if (pthread_mutex_init(&mixer->lock, NULL) != 0) {
+    oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to create mixer lock");
+    free(mixer->accumulator);
+    free(mixer->samples);
+    free(mixer->scratch);
+    memset(mixer, 0, sizeof(*mixer));
+    return OASIS_ERROR;
+  }
+
+  oasis_log(NULL, LOG_LEVEL_DEBUG, "Mixer kernels: %s", isa_name);
+  return OASIS_SUCCESS;
+}
+
+void mixer_free(mixer_t *mixer) {
+  if (!mixer)
+    return;
+
+  if (mixer->accumulator && mixer->samples && mixer->scratch)
+    pthread_mutex_destroy(&mixer->lock);
+  free(mixer->accumulator);
+  free(mixer->samples);
+  free(mixer->scratch);
+  memset(mixer, 0, sizeof(*mixer));
+}
+
+// Queues a change for the next pull, with the lock held
+static int push_command(mixer_t *mixer, const mixer_command_t *command) {
+  uint64_t head = mixer->command_head;
+  uint64_t tail = __atomic_load_n(&mixer->command_tail, __ATOMIC_ACQUIRE);
+  if (head - tail >= MIXER_COMMAND_CAPACITY)
+    return 0;
+
+  mixer->commands[head % MIXER_COMMAND_CAPACITY] = *command;
+  __atomic_store_n(&mixer->command_head, head + 1, __ATOMIC_SEQ_CST);
+  return 1;
+}
+
+// Waits until a pull that could still see the stream is over, a pull starting
+// after the command was queued applies it before pulling any source
+static void wait_for_command(mixer_t *mixer, uint64_t index) {
+  while (__atomic_load_n(&mixer->command_tail, __ATOMIC_ACQUIRE) <= index &&
+         __atomic_load_n(&mixer->pulling, __ATOMIC_SEQ_CST)) {
+    nanosleep((const struct timespec[]){{0, 100000}}, NULL);
+  }
+}
+
+int mixer_add_stream(mixer_t *mixer, output_pull_callback pull,
+                     void *user_data, float gain) {
+  int id = -1;
+  int queue_full = 0;
+
+  pthread_mutex_lock(&mixer->lock);
+  for (int i = 0; i < MIXER_MAX_STREAMS; i++) {
+    if (__atomic_load_n(&mixer->streams[i].active, __ATOMIC_ACQUIRE))
+      continue;
+
+    unsigned serial = mixer->serials[i] + 1 ? mixer->serials[i] + 1 : 1;
+    mixer_command_t command = {
+      .type = MIXER_COMMAND_ADD,
+      .id = i,
+      .serial = serial,
+      .pull = pull,
+      .user_data = user_data,
+      .gain = gain,
+    };
+    if (push_command(mixer, &command)) {
+      mixer->serials[i] = serial;
+      __atomic_store_n(&mixer->streams[i].active, serial, __ATOMIC_RELEASE);
+      id = i;
+    } else {
+      queue_full = 1;
+    }
+    break;
+  }
+  pthread_mutex_unlock(&mixer->lock);
+
+  if (queue_full)
+    oasis_log(NULL, LOG_LEVEL_WARN,
+              "Mixer command queue is full, the stream was not added");
+  else if (id < 0)
+    oasis_log(NULL, LOG_LEVEL_WARN, "Every mixer stream is taken");
+  return id;
+}
+
+// Queues a change to a stream, a removal also takes it out of the mix
+static void queue_change(mixer_t *mixer, mixer_command_type_t type, int id,
+                         float gain, int64_t frames) {
+  if (id < 0 || id >= MIXER_MAX_STREAMS)
+    return;
+
+  int removed = type == MIXER_COMMAND_REMOVE ||
+                (type == MIXER_COMMAND_FADE_OUT && frames <= 0);
+
+  pthread_mutex_lock(&mixer->lock);
+  mixer_command_t command = {
+    .type = type,
+    .id = id,
+    .serial = mixer->serials[id],
+    .gain = gain,
+    .frames = frames,
+  };
+  uint64_t index = mixer->command_head;
+  int queued = push_command(mixer, &command);
+  if (queued && removed) {
+    unsigned serial = mixer->serials[id];
+    __atomic_compare_exchange_n(&mixer->streams[id].active, &serial, 0, 0,
+                                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+    wait_for_command(mixer, index);
+  }
+  pthread_mutex_unlock(&mixer->lock);
+
+  if (!queued)
+    oasis_log(NULL, LOG_LEVEL_WARN, "Too many mixer changes waiting");
+}
+
+void mixer_remove_stream(mixer_t *mixer, int id) {
+  queue_change(mixer, MIXER_COMMAND_REMOVE, id, 0.0f, 0);
+}
+
+void mixer_set_gain(mixer_t *mixer, int id, float gain, int64_t frames) {
+  queue_change(mixer, MIXER_COMMAND_GAIN, id, gain, frames);
+}
+
+void mixer_fade_out(mixer_t *mixer, int id, int64_t frames) {
+  queue_change(mixer, MIXER_COMMAND_FADE_OUT, id, 0.0f, frames);
+}
+
+int mixer_stream_active(mixer_t *mixer, int id) {
+  if (id < 0 || id >= MIXER_MAX_STREAMS)
+    return 0;
+
+  return __atomic_load_n(&mixer->streams[id].active, __ATOMIC_ACQUIRE) != 0;
+}
+
+static void set_ramp(mixer_stream_t *stream, float gain, int64_t frames) {
+  stream->target = gain;
+  if (frames <= 0) {
+    stream->gain = gain;
+    stream->step = 0.0f;
+    stream->ramp_frames = 0;
+  } else {
+    stream->step = (gain - stream->gain) / (float)frames;
+    stream->ramp_frames = frames;
+  }
+}
+
+// Takes a stream out of the mix, unless the control side already reused its
+// slot
+static void stop_stream(mixer_stream_t *stream) {
+  unsigned serial = stream->serial;
+  stream->playing = 0;
+  __atomic_compare_exchange_n(&stream->active, &serial, 0, 0, __ATOMIC_ACQ_REL,
+                              __ATOMIC_ACQUIRE);
+}
+
+static void apply_command(mixer_t *mixer, const mixer_command_t *command) {
+  mixer_stream_t *stream = &mixer->streams[command->id];
+
+  if (command->type == MIXER_COMMAND_ADD) {
+    stream->pull = command->pull;
+    stream->user_data = command->user_data;
+    stream->serial = command->serial;
+    stream->playing = 1;
+    stream->remove_when_silent = 0;
+    stream->gain = command->gain;
+    stream->target = command->gain;
+    stream->step = 0.0f;
+    stream->ramp_frames = 0;
+    return;
+  }
+  if (!stream->playing || stream->serial != command->serial)
+    return; // Left the mix already
+
+  switch (command->type) {
+  case MIXER_COMMAND_REMOVE:
+    stream->playing = 0;
+    break;
+  case MIXER_COMMAND_GAIN:
+    set_ramp(stream, command->gain, command->frames);
+    stream->remove_when_silent = 0;
+    break;
+  case MIXER_COMMAND_FADE_OUT:
+    set_ramp(stream, 0.0f, command->frames);
+    stream->remove_when_silent = 1;
+    if (command->frames <= 0)
+      stream->playing = 0;
+    break;
+  default:
+    break;
+  }
+}
+
+static void apply_commands(mixer_t *mixer) {
+  uint64_t tail = mixer->command_tail;
+  uint64_t head = __atomic_load_n(&mixer->command_head, __ATOMIC_SEQ_CST);
+
+  for (; tail < head; tail++) {
+    apply_command(mixer, &mixer->commands[tail % MIXER_COMMAND_CAPACITY]);
+    __atomic_store_n(&mixer->command_tail, tail + 1, __ATOMIC_RELEASE);
+  }
+}
+
+// Accumulates frames of a stream, the ramp part first, then the constant part
+static void mix_stream(mixer_t *mixer, mixer_stream_t *stream, size_t frames) {
+  int channels = mixer->channels;
+  size_t done = 0;
+
+  if (stream->ramp_frames > 0) {
+    done = frames < (size_t)stream->ramp_frames ? frames
+                                                : (size_t)stream->ramp_frames;
+    mix_kernel(mixer->accumulator, mixer->samples, done, channels,
+               stream->gain, stream->step);
+    stream->ramp_frames -= (int64_t)done;
+    stream->gain = stream->ramp_frames > 0
+                     ? stream->gain + stream->step * (float)done
+                     : stream->target;
+  }
+
+  if (done < frames && stream->gain != 0.0f) {
+    mix_kernel(mixer->accumulator + done * channels,
+               mixer->samples + done * channels, frames - done, channels,
+               stream->gain, 0.0f);
+  }
+
+  if (stream->remove_when_silent && stream->ramp_frames == 0 &&
+      stream->gain == 0.0f)
+    stop_stream(stream);
+}
+
+// Mixes up to MIXER_BLOCK_FRAMES into the accumulator, returns what the
+// fullest stream gave
+static size_t mix_block(mixer_t *mixer, size_t frames) {
+  size_t longest = 0;
+
+  memset(mixer->accumulator, 0,
+         frames * mixer->channels * sizeof(*mixer->accumulator));
+
+  for (int i = 0; i < MIXER_MAX_STREAMS; i++) {
+    mixer_stream_t *stream = &mixer->streams[i];
+    if (!stream->playing)
+      continue;
+
+    int end_of_stream = 0;
+    size_t got =
+      stream->pull(stream->user_data, mixer->scratch, frames, &end_of_stream);
+    if (got > frames)
+      got = frames;
+
+    mixer->to_float((uint8_t *)mixer->samples, mixer->scratch,
+                    got * mixer->channels, NULL);
+    mix_stream(mixer, stream, got);
+
+    if (got > longest)
+      longest = got;
+    if (end_of_stream && stream->playing)
+      stop_stream(stream);
+  }
+
+  return longest;
+}
+
+size_t mixer_pull(void *user_data, uint8_t *buffer, size_t frames,
+                  int *end_of_stream) {
+  mixer_t *mixer = user_data;
+  size_t done = 0;
+
+  __atomic_store_n(&mixer->pulling, 1, __ATOMIC_SEQ_CST);
+  apply_commands(mixer);
+  while (done < frames) {
+    size_t block = frames - done;
+    if (block > MIXER_BLOCK_FRAMES)
+      block = MIXER_BLOCK_FRAMES;
+
+    size_t mixed = mix_block(mixer, block);
+    clamp_kernel(mixer->accumulator, mixed * mixer->channels);
+    mixer->from_float(buffer + done * mixer->stride,
+                      (const uint8_t *)mixer->accumulator,
+                      mixed * mixer->channels, NULL);
+    done += mixed;
+    if (mixed < block)
+      break;
+  }
+
+  int active = 0;
+  for (int i = 0; i < MIXER_MAX_STREAMS; i++)
+    active |= mixer->streams[i].playing;
+  __atomic_store_n(&mixer->pulling, 0, __ATOMIC_SEQ_CST);
+
+  if (!active)
+    *end_of_stream = 1;
+  return done;
+}
+
+void mixer_mix_float(float *accumulator, const float *samples, size_t frames,
+                     int channels, float gain, float step) {
+  pthread_once(&kernels_once, select_kernels);
+  mix_kernel(accumulator, samples, frames, channels, gain, step);
+}
+
+const char *mixer_get_isa_name(void) {
+  pthread_once(&kernels_once, select_kernels);
+  return isa_name;
+}
@@ -0,0 +1,164 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <oasis/audio/mmap_input.h>
+#include <oasis/utils.h>
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <libavutil/mem.h>
+
+static int mmap_input_read(void *opaque, uint8_t *buffer, int size) {
+  mmap_input_t *input = opaque;
+  size_t left = input->size - input->position;
+
+  if (left == 0)
+    return AVERROR_EOF;
+  if ((size_t)size > left)
+    size = (int)left;
+
+  memcpy(buffer, input->data + input->position, size);
+  input->position += size;
+  return size;
+}
+
+static int64_t mmap_input_seek(void *opaque, int64_t offset, int whence) {
+  mmap_input_t *input = opaque;
+  int64_t position;
+
+  switch (whence & ~AVSEEK_FORCE) {
+  case AVSEEK_SIZE:
+    return (int64_t)input->size;
+  case SEEK_SET:
+    position = offset;
+    break;
+  case SEEK_CUR:
+    position = (int64_t)input->position + offset;
+    break;
+  case SEEK_END:
+    position = (int64_t)input->size + offset;
+    break;
+  default:
+    return AVERROR(EINVAL);
+  }
+
+  if (position < 0 || position > (int64_t)input->size)
+    return AVERROR(EINVAL);
+
+  // Sequential readahead does not follow a jump, fault in what comes next
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  size_t start = (size_t)position / page * page;
+  size_t length = input->size - start;
+  if (length > MMAP_INPUT_READAHEAD)
+    length = MMAP_INPUT_READAHEAD;
+  if (length > 0)
+    posix_madvise(input->data + start, length, POSIX_MADV_WILLNEED);
+
+  input->position = (size_t)position;
+  return position;
+}
+
+oasis_result_t mmap_input_open(mmap_input_t *input, const char *filename) {
+  struct stat st;
+
+  if (!input || !filename) {
+    return OASIS_ERROR_INVALID_ARGUMENT;
+  }
+  memset(input, 0, sizeof(*input));
+
+  const char *disabled = getenv("OASIS_NO_MMAP");
+  if (disabled && disabled[0] && disabled[0] != '0')
+    return OASIS_ERROR_UNSUPPORTED_OPERATION;
+
+  // Protocols such as http:// or pipe: are libavformat's business
+  if (strstr(filename, "://") || strncmp(filename, "pipe:", 5) == 0)
+    return OASIS_ERROR_UNSUPPORTED_OPERATION;
+
+  int fd = open(filename, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return OASIS_ERROR_FILE_NOT_FOUND;
+
+  // Pipes, devices and empty files can not be mapped
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+    close(fd);
+    return OASIS_ERROR_UNSUPPORTED_OPERATION;
+  }
+
+  void *data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    oasis_log(NULL, LOG_LEVEL_DEBUG, "Failed to map %s, reading it instead",
+              filename);
+    return OASIS_ERROR_UNSUPPORTED_OPERATION;
+  }
+
+  posix_madvise(data, (size_t)st.st_size, POSIX_MADV_SEQUENTIAL);
+  posix_madvise(data, (size_t)st.st_size < MMAP_INPUT_READAHEAD
+                        ? (size_t)st.st_size
+                        : MMAP_INPUT_READAHEAD,
+                POSIX_MADV_WILLNEED);
+
+  input->data = data;
+  input->size = (size_t)st.st_size;
+
+  uint8_t *buffer = av_malloc(MMAP_INPUT_BUFFER_SIZE);
+  if (buffer) {
+    input->avio = avio_alloc_context(buffer, MMAP_INPUT_BUFFER_SIZE, 0, input,
+                                     mmap_input_read, NULL, mmap_input_seek);
+  }
+  if (!input->avio) {
+    oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to allocate IO context");
+    av_free(buffer);
+    mmap_input_close(input);
+    return OASIS_ERROR_FFMPEG_MEMORY_ALLOCATION;
+  }
+
+  return OASIS_SUCCESS;
+}
+
+void mmap_input_close(mmap_input_t *input) {
+  if (!input)
+    return;
+
+  if (input->avio) {
+    av_freep(&input->avio->buffer);
+    avio_context_free(&input->avio);
+  }
+  if (input->data)
+    munmap(input->data, input->size);
+  memset(input, 0, sizeof(*input));
+}
+
+oasis_result_t mmap_input_open_format(AVFormatContext **fmt_ctx,
+                                      mmap_input_t *input,
+                                      const char *filename) {
+  if (!fmt_ctx || !input || !filename) {
+    return OASIS_ERROR_INVALID_ARGUMENT;
+  }
+  *fmt_ctx = NULL;
+
+  oasis_result_t result = mmap_input_open(input, filename);
+  if (result == OASIS_SUCCESS) {
+    *fmt_ctx = avformat_alloc_context();
+    if (!*fmt_ctx) {
+      mmap_input_close(input);
+      return OASIS_ERROR_FFMPEG_MEMORY_ALLOCATION;
+    }
+    (*fmt_ctx)->pb = input->avio;
+    (*fmt_ctx)->flags |= AVFMT_FLAG_CUSTOM_IO;
+  } else if (result != OASIS_ERROR_UNSUPPORTED_OPERATION) {
+    return result;
+  }
+
+  // On failure the context is freed, the custom IO is left to us
+  if (avformat_open_input(fmt_ctx, filename, NULL, NULL) != 0) {
+    mmap_input_close(input);
+    return OASIS_ERROR;
+  }
+
+  return OASIS_SUCCESS;
+}
@@ -0,0 +1,659 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <oasis/audio/decode.h>
+#include <oasis/audio/output.h>
+#include <oasis/audio/realtime.h>
+#include <oasis/utils.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <libavdevice/avdevice.h>
+
+#define OUTPUT_PAUSE_TIMEOUT_MS 1000
+
+/**
+ * The libavdevice backend, writes one period per packet on its own thread,
+ * the blocking writes pace it.
+ *
+ * Every period is rendered from the ring into one reused buffer and handed to
+ * the muxer through one reused packet without a reference, so the muxer
+ * neither refs nor allocates for the payload. The render out of the ring is
+ * the only copy on our side. In real-time mode the thread also runs at
+ * SCHED_FIFO and the period is locked in memory.
+ */
+typedef struct {
+  AVFormatContext *fmt_ctx;
+  AVPacket *packet;
+  uint8_t *period;
+  size_t period_bytes;
+  pthread_t thread;
+  sem_t wake; // Posted on resume and close
+  int running;
+  int stop;
+  int64_t pts;
+} avdevice_output_t;
+
+static const char *get_audio_device_name(const char *format_name) {
+  if (strcmp(format_name, "oss") == 0) {
+    return "/dev/dsp"; // OSS uses device files
+  }
+  return NULL;
+}
+
+oasis_result_t output_open(audio_output_t *output, const output_config_t *config,
+                           output_pull_callback pull, void *user_data) {
+  if (!output || !config || !pull || config->sample_rate <= 0 ||
+      config->channels <= 0 || av_sample_fmt_is_planar(config->sample_format)) {
+    oasis_log(NULL, LOG_LEVEL_ERROR, "Invalid output configuration");
+    return OASIS_ERROR_INVALID_ARGUMENT;
+  }
+
+  memset(output, 0, sizeof(*output));
+  output->config = *config;
+  output->pull = pull;
+  output->user_data = user_data;
+  output->stride = (size_t)av_get_bytes_per_sample(config->sample_format) *
+                   config->channels;
+
+  if (output->config.period_size <= 0) {
+    output->config.period_size =
+      config->sample_rate * OUTPUT_DEFAULT_PERIOD_MS / 1000;
+  }
+
+  switch (config->backend) {
+  case OUTPUT_BACKEND_MINIAUDIO:
+    output->ops = &output_backend_miniaudio;
+    break;
+  case OUTPUT_BACKEND_AVDEVICE:
+    output->ops = &output_backend_avdevice;
+    break;
+  case OUTPUT_BACKEND_NULL:
+    output->ops = &output_backend_null;
+    break;
+  case OUTPUT_BACKEND_FILE:
+    output->ops = &output_backend_file;
+    break;
+  default:
+    oasis_log(NULL, LOG_LEVEL_ERROR, "Unknown output backend %d",
+              config->backend);
+    return OASIS_ERROR_INVALID_ARGUMENT;
+  }
+
+  if (sem_init(&output->pause_ack, 0, 0) != 0) {
+    oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to create output semaphore");
+    return OASIS_ERROR;
+  }
+
+  if (config->realtime)
+    realtime_reset_violations();
+
+  if (output->ops->discover)
+    output->ops->discover();
+
+  oasis_result_t result = output->ops->open(output);
+  if (result != OASIS_SUCCESS) {
+    sem_destroy(&output->pause_ack);
+    output->ops = NULL;
+    return result;
+  }
+
+  oasis_log(NULL, LOG_LEVEL_INFO,
+            "Opened %s output: %d Hz, %d channels, %s, %d frame periods, "
+            "%.1f ms latency",
+            output->ops->name, config->sample_rate, config->channels,
+            get_sample_format_name(config->sample_format),
+            output->config.period_size, output->latency_ms);
+  return OASIS_SUCCESS;
+}
+
+void output_discover(void) {
+  const output_backend_ops_t *backends[] = {
+    &output_backend_miniaudio,
+    &output_backend_avdevice,
+    &output_backend_null,
+    &output_backend_file,
+  };
+
+  for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+    if (backends[i]->discover)
+      backends[i]->discover();
+  }
+}
+
+static void *output_discover_main(void *arg) {
+  output_discover();
+  return NULL;
+}
+
+void output_discover_async(void) {
+  pthread_t thread;
+  sigset_t signals, old_signals;
+
+  // The thread outlives the call, SIGINT and SIGTERM must only ever reach the
+  // playback engine's signalfd
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &signals, &old_signals);
+  int ret = pthread_create(&thread, NULL, output_discover_main, NULL);
+  pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+
+  if (ret != 0) {
+    oasis_log(NULL, LOG_LEVEL_WARN, "Failed to start device discovery");
+    return;
+  }
+  pthread_detach(thread);
+}
+
+void output_set_source(audio_output_t *output, output_pull_callback pull,
+                       void *user_data) {
+  output_pause(output);
+  output->pull = pull;
+  output->user_data = user_data;
+  __atomic_store_n(&output->finished, 0, __ATOMIC_RELEASE);
+}
+
+// Whether an open output can stand in for one opened with config
+static int output_fits(const audio_output_t *output,
+                       const output_config_t *config) {
+  const output_config_t *open = &output->config;
+  int period_size = config->period_size > 0
+                      ? config->period_size
+                      : config->sample_rate * OUTPUT_DEFAULT_PERIOD_MS / 1000;
+  int same_path = open->path == config->path ||
+                  (open->path && config->path &&
+                   strcmp(open->path, config->path) == 0);
+
+  return open->backend == config->backend &&
+         open->sample_rate == config->sample_rate &&
+         open->channels == config->channels &&
+         open->sample_format == config->sample_format &&
+         output->config.period_size == period_size &&
+         open->null_device == config->null_device &&
+         open->realtime == config->realtime && open->speed == config->speed &&
+         same_path;
+}
+
+oasis_result_t output_session_acquire(output_session_t *session,
+                                      const output_config_t *config,
+                                      output_pull_callback pull,
+                                      void *user_data,
+                                      audio_output_t **output) {
+  if (!session || !config || !output)
+    return OASIS_ERROR_INVALID_ARGUMENT;
+
+  if (session->open &&
+      !__atomic_load_n(&session->output.failed, __ATOMIC_ACQUIRE) &&
+      output_fits(&session->output, config)) {
+    output_set_source(&session->output, pull, user_data);
+    oasis_log(NULL, LOG_LEVEL_DEBUG, "Reusing the %s output",
+              session->output.ops->name);
+    *output = &session->output;
+    return OASIS_SUCCESS;
+  }
+
+  output_session_close(session);
+  oasis_result_t result =
+    output_open(&session->output, config, pull, user_data);
+  if (result != OASIS_SUCCESS)
+    return result;
+
+  session->open = 1;
+  *output = &session->output;
+  return OASIS_SUCCESS;
+}
+
+void output_session_release(output_session_t *session) {
+  if (session && session->open)
+    output_pause(&session->output);
+}
+
+void output_session_close(output_session_t *session) {
+  if (!session || !session->open)
+    return;
+
+  output_close(&session->output);
+  session->open = 0;
+}
+
+void output_config_from_env(output_config_t *config) {
+  static const struct {
+    const char *name;
+    output_backend_t backend;
+  } backends[] = {
+    {"miniaudio", OUTPUT_BACKEND_MINIAUDIO},
+    {"avdevice", OUTPUT_BACKEND_AVDEVICE},
+    {"null", OUTPUT_BACKEND_NULL},
+    {"file", OUTPUT_BACKEND_FILE},
+  };
+
+  const char *backend = getenv("OASIS_OUTPUT");
+  if (backend && *backend) {
+    size_t i = 0;
+    for (; i < sizeof(backends) / sizeof(backends[0]); i++) {
+      if (strcmp(backend, backends[i].name) == 0) {
+        config->backend = backends[i].backend;
+        break;
+      }
+    }
+    if (i == sizeof(backends) / sizeof(backends[0])) {
+      oasis_log(NULL, LOG_LEVEL_WARN, "Unknown output '%s' in OASIS_OUTPUT",
+                backend);
+    }
+  }
+
+  const char *path = getenv("OASIS_OUTPUT_PATH");
+  if (path && *path)
+    config->path = path;
+
+  const char *speed = getenv("OASIS_OUTPUT_SPEED");
+  if (speed && *speed)
+    config->speed = strtod(speed, NULL);
+}
+
+oasis_result_t output_start(audio_output_t *output) {
+  if (!output || !output->ops)
+    return OASIS_ERROR_INVALID_ARGUMENT;
+  if (output->started)
+    return OASIS_SUCCESS;
+
+  oasis_result_t result = output->ops->start(output);
+  if (result == OASIS_SUCCESS)
+    output->started = 1;
+  return result;
+}
+
+void output_pause(audio_output_t *output) {
+  // Already out of the source, and a backend sleeping through the pause would
+  // not acknowledge again
+  if (__atomic_load_n(&output->paused, __ATOMIC_SEQ_CST) &&
+      __atomic_load_n(&output->pause_acked, __ATOMIC_SEQ_CST))
+    return;
+
+  __atomic_store_n(&output->pause_acked, 0, __ATOMIC_SEQ_CST);
+  while (sem_trywait(&output->pause_ack) == 0)
+    ;
+  __atomic_store_n(&output->paused, 1, __ATOMIC_SEQ_CST);
+
+  if (!output->started || __atomic_load_n(&output->failed, __ATOMIC_ACQUIRE))
+    return;
+
+  // A backend asleep at the end of the stream has to come round to see it
+  if (__atomic_load_n(&output->finished, __ATOMIC_ACQUIRE) &&
+      output->ops->resume)
+    output->ops->resume(output);
+
+  // Wait for the output thread to see the flag, once it has it is done with
+  // the source until we resume
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += OUTPUT_PAUSE_TIMEOUT_MS / 1000;
+  deadline.tv_nsec += (OUTPUT_PAUSE_TIMEOUT_MS % 1000) * 1000000L;
+  if (deadline.tv_nsec >= 1000000000L) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000L;
+  }
+
+  int ret;
+  while ((ret = sem_timedwait(&output->pause_ack, &deadline)) != 0 &&
+         errno == EINTR)
+    ;
+  if (ret != 0 && !__atomic_load_n(&output->failed, __ATOMIC_ACQUIRE)) {
+    oasis_log(NULL, LOG_LEVEL_WARN, "Output did not acknowledge the pause");
+  }
+}
+
+void output_resume(audio_output_t *output) {
+  __atomic_store_n(&output->paused, 0, __ATOMIC_RELEASE);
+  if (output->ops && output->ops->resume)
+    output->ops->resume(output);
+}
+
+int output_finished(audio_output_t *output) {
+  return __atomic_load_n(&output->finished, __ATOMIC_ACQUIRE);
+}
+
+void output_drain(audio_output_t *output) {
+  if (!output->started || output->latency_ms <= 0)
+    return;
+
+  long ns = (long)(output->latency_ms * 1000000.0);
+  struct timespec ts = {ns / 1000000000L, ns % 1000000000L};
+  nanosleep(&ts, NULL);
+}
+
+void output_close(audio_output_t *output) {
+  if (!output || !output->ops)
+    return;
+
+  output->ops->close(output);
+  sem_destroy(&output->pause_ack);
+
+  oasis_log(NULL, LOG_LEVEL_DEBUG,
+            "Output: %llu frames rendered, %llu frames of underrun silence",
+            (unsigned long long)output->frames_rendered,
+            (unsigned long long)output->silence_frames);
+
+  const char *first = NULL;
+  uint64_t violations = realtime_get_violations(&first);
+  if (output->config.realtime && violations > 0) {
+    oasis_log(NULL, LOG_LEVEL_WARN,
+              "The audio thread made %llu calls it should not have, the "
+              "first was %s",
+              (unsigned long long)violations, first ? first : "unknown");
+  }
+  output->ops = NULL;
+}
+
+size_t output_render(audio_output_t *output, uint8_t *buffer, size_t frames) {
+  if (__atomic_load_n(&output->paused, __ATOMIC_ACQUIRE)) {
+    if (!__atomic_exchange_n(&output->pause_acked, 1, __ATOMIC_SEQ_CST))
+      sem_post(&output->pause_ack);
+    return 0;
+  }
+
+  if (__atomic_load_n(&output->finished, __ATOMIC_RELAXED))
+    return 0;
+
+  int end_of_stream = 0;
+  size_t rendered =
+    output->pull(output->user_data, buffer, frames, &end_of_stream);
+
+  output->frames_rendered += rendered;
+  if (end_of_stream) {
+    __atomic_store_n(&output->finished, 1, __ATOMIC_RELEASE);
+  } else if (rendered < frames && !output->unpaced) {
+    output->silence_frames += frames - rendered;
+  }
+
+  return rendered;
+}
+
+static void *avdevice_output_main(void *arg) {
+  audio_output_t *output = arg;
+  avdevice_output_t *dev = output->backend_data;
+  AVPacket *packet = dev->packet;
+  int period = output->config.period_size;
+  int realtime = output->config.realtime;
+  const char *error = NULL;
+  int ret = 0;
+
+  // Logging is only safe again once we have left real-time mode
+  if (realtime) {
+    realtime_promote_thread(REALTIME_PRIORITY);
+    realtime_enter();
+  }
+
+  while (!__atomic_load_n(&dev->stop, __ATOMIC_ACQUIRE)) {
+    uint8_t *data = dev->period;
+    size_t rendered = output_render(output, data, (size_t)period);
+
+    if (rendered == 0 && (__atomic_load_n(&output->paused, __ATOMIC_ACQUIRE) ||
+                          output_finished(output))) {
+      // Sleep until resumed or given a new source rather than poll the flags,
+      // the device stays open
+      if (realtime)
+        realtime_leave();
+      while (sem_wait(&dev->wake) != 0 && errno == EINTR)
+        ;
+      if (realtime)
+        realtime_enter();
+      continue;
+    }
+
+    // Keep the device fed through underruns, like a callback device would
+    int frames = period;
+    if (rendered < (size_t)period && !output_finished(output)) {
+      uint8_t *planes[1] = {data};
+      av_samples_set_silence(planes, (int)rendered, period - (int)rendered,
+                             output->config.channels,
+                             output->config.sample_format);
+    } else {
+      frames = (int)rendered;
+    }
+
+    // Without a reference the muxer writes the period as it is
+    packet->data = data;
+    packet->size = frames * (int)output->stride;
+    packet->stream_index = 0;
+    packet->pts = dev->pts;
+    packet->dts = dev->pts;
+    packet->duration = frames;
+    dev->pts += frames;
+
+    // A single stream has nothing to interleave with. The device write is
+    // the one call allowed to block, what the device library does inside it
+    // is not ours to check.
+    if (realtime)
+      realtime_leave();
+    ret = av_write_frame(dev->fmt_ctx, packet);
+    if (realtime)
+      realtime_enter();
+    av_packet_unref(packet);
+    if (ret < 0) {
+      error = "Error writing PCM frame";
+      break;
+    }
+  }
+
+  if (realtime)
+    realtime_leave();
+  if (error && ret < 0) {
+    char errbuf[AV_ERROR_MAX_STRING_SIZE];
+    av_strerror(ret, errbuf, sizeof(errbuf));
+    oasis_log(NULL, LOG_LEVEL_ERROR, "%s: %s", error, errbuf);
+  } else if (error) {
+    oasis_log(NULL, LOG_LEVEL_ERROR, "%s", error);
+  }
+
+  // Let anyone waiting on us carry on
+  if (error)
+    __atomic_store_n(&output->failed, 1, __ATOMIC_RELEASE);
+  __atomic_store_n(&output->finished, 1, __ATOMIC_RELEASE);
+  sem_post(&output->pause_ack);
+  return NULL;
+}
+
+static pthread_once_t avdevice_once = PTHREAD_ONCE_INIT;
+static const AVOutputFormat *avdevice_format; // NULL if none was found
+static const char *avdevice_format_name;
+
+static void avdevice_find_format(void) {
+  const char *try_output_formats[] = {"pulse", "alsa", "oss", NULL};
+
+  avdevice_register_all();
+  for (int i = 0; try_output_formats[i] != NULL; i++) {
+    avdevice_format = av_guess_format(try_output_formats[i], NULL, NULL);
+    if (avdevice_format) {
+      avdevice_format_name = try_output_formats[i];
+      oasis_log(NULL, LOG_LEVEL_INFO, "Using audio output: %s",
+                avdevice_format_name);
+      return;
+    }
+  }
+}
+
+// Registering the devices and walking the muxers is done once per process
+static void avdevice_output_discover(void) {
+  pthread_once(&avdevice_once, avdevice_find_format);
+}
+
+static oasis_result_t avdevice_output_open(audio_output_t *output) {
+  const output_config_t *config = &output->config;
+  avdevice_output_t *dev = NULL;
+  AVStream *out_stream = NULL;
+  oasis_result_t result = OASIS_ERROR;
+  int ret;
+
+  if (config->null_device) {
+    oasis_log(NULL, LOG_LEVEL_ERROR, "The avdevice output has no null device");
+    return OASIS_ERROR_UNSUPPORTED_OPERATION;
+  }
+
+  dev = calloc(1, sizeof(*dev));
+  if (!dev) {
+    oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to allocate avdevice output");
+    return OASIS_ERROR_MEMORY_ALLOCATION;
+  }
+
+  if (sem_init(&dev->wake, 0, 0) != 0) {
+    oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to create output semaphore");
+    free(dev);
+    return OASIS_ERROR;
+  }
+
+  dev->period_bytes = (size_t)config->period_size * output->stride +
+                      AV_INPUT_BUFFER_PADDING_SIZE;
+  dev->period = av_mallocz(dev->period_bytes);
+  dev->packet = av_packet_alloc();
+  if (!dev->period || !dev->packet) {
+    oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to allocate packet buffers");
+    result = OASIS_ERROR_FFMPEG_MEMORY_ALLOCATION;
+    goto fail;
+  }
+  if (config->realtime)
+    realtime_lock_memory(dev->period, dev->period_bytes);
+
+  const AVOutputFormat *output_format = avdevice_format;
+  const char *output_format_name = avdevice_format_name;
+  if (!output_format) {
+    oasis_log(NULL, LOG_LEVEL_ERROR, "No supported audio output format found");
+    goto fail;
+  }
+
+  const char *output_device_name = get_audio_device_name(output_format_name);
+
+  ret = avformat_alloc_output_context2(&dev->fmt_ctx, output_format,
+                                       output_format_name, output_device_name);
+  if (ret < 0 || !dev->fmt_ctx) {
+    char errbuf[AV_ERROR_MAX_STRING_SIZE];
+    av_strerror(ret, errbuf, sizeof(errbuf));
+    oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to allocate output context: %s",
+              errbuf);
+    goto fail;
+  }
+
+  out_stream = avformat_new_stream(dev->fmt_ctx, NULL);
+  if (!out_stream) {
+    oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to create output stream");
+    goto fail;
+  }
+
+  out_stream->codecpar->codec_type = AVMEDIA_TYPE_AUDIO;
+  out_stream->codecpar->codec_id = av_get_pcm_codec(config->sample_format, 0);
+  out_stream->codecpar->sample_rate = config->sample_rate;
+  out_stream->codecpar->format = config->sample_format;
+  out_stream->codecpar->frame_size = 0; // Let pulseaudio decide the frame size
+
+  if (config->channels == 1) {
+    av_channel_layout_from_mask(&out_stream->codecpar->ch_layout,
+                                AV_CH_LAYOUT_MONO);
+  } else if (config->channels == 2) {
+    av_channel_layout_from_mask(&out_stream->codecpar->ch_layout,
+                                AV_CH_LAYOUT_STEREO);
+  } else {
+    av_channel_layout_default(&out_stream->codecpar->ch_layout,
+                              config->channels);
+  }
+
+  out_stream->codecpar->bit_rate = (int64_t)config->sample_rate *
+                                   config->channels *
+                                   av_get_bytes_per_sample(config->sample_format) *
+                                   8;
+
+  oasis_log(NULL, LOG_LEVEL_DEBUG, "Setting codec ID to %s",
+            get_audio_codec_name(out_stream->codecpar->codec_id));
+
+  AVDictionary *device_options = NULL;
+  av_dict_set(&device_options, "device", "default", 0);
+
+  if (output_device_name != NULL) {
+    ret = avio_open(&dev->fmt_ctx->pb, output_device_name, AVIO_FLAG_WRITE);
+    if (ret < 0) {
+      char errbuf[AV_ERROR_MAX_STRING_SIZE];
+      av_strerror(ret, errbuf, sizeof(errbuf));
+      oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to open output device: %s",
+                errbuf);
+      av_dict_free(&device_options);
+      goto fail;
+    }
+  }
+
+  ret = avformat_write_header(dev->fmt_ctx, &device_options);
+  av_dict_free(&device_options);
+  if (ret < 0) {
+    char errbuf[AV_ERROR_MAX_STRING_SIZE];
+    av_strerror(ret, errbuf, sizeof(errbuf));
+    oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to write header: %s", errbuf);
+    avio_closep(&dev->fmt_ctx->pb);
+    goto fail;
+  }
+
+  // The muxers do not report their buffering, a period is what we control
+  output->latency_ms = config->period_size * 1000.0 / config->sample_rate;
+  output->backend_data = dev;
+  return OASIS_SUCCESS;
+
+fail:
+  if (dev->fmt_ctx)
+    avformat_free_context(dev->fmt_ctx);
+  realtime_unlock_memory(dev->period, dev->period_bytes);
+  av_freep(&dev->period);
+  av_packet_free(&dev->packet);
+  sem_destroy(&dev->wake);
+  free(dev);
+  return result;
+}
+
+static oasis_result_t avdevice_output_start(audio_output_t *output) {
+  avdevice_output_t *dev = output->backend_data;
+
+  if (pthread_create(&dev->thread, NULL, avdevice_output_main, output) != 0) {
+    oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to start output thread");
+    return OASIS_ERROR;
+  }
+
+  dev->running = 1;
+  return OASIS_SUCCESS;
+}
+
+static void avdevice_output_close(audio_output_t *output) {
+  avdevice_output_t *dev = output->backend_data;
+  if (!dev)
+    return;
+
+  if (dev->running) {
+    __atomic_store_n(&dev->stop, 1, __ATOMIC_RELEASE);
+    sem_post(&dev->wake);
+    pthread_join(dev->thread, NULL);
+  }
+
+  av_write_trailer(dev->fmt_ctx);
+  avio_closep(&dev->fmt_ctx->pb);
+  avformat_free_context(dev->fmt_ctx);
+  realtime_unlock_memory(dev->period, dev->period_bytes);
+  av_freep(&dev->period);
+  av_packet_free(&dev->packet);
+  sem_destroy(&dev->wake);
+  free(dev);
+  output->backend_data = NULL;
+}
+
+static void avdevice_output_resume(audio_output_t *output) {
+  avdevice_output_t *dev = output->backend_data;
+  sem_post(&dev->wake);
+}
+
+const output_backend_ops_t output_backend_avdevice = {
+  .name = "avdevice",
+  .discover = avdevice_output_discover,
+  .open = avdevice_output_open,
+  .start = avdevice_output_start,
+  .resume = avdevice_output_resume,
+  .close = avdevice_output_close,
+};
@@ -0,0 +1,206 @@
+#define MINIAUDIO_IMPLEMENTATION
+#define MA_NO_DECODING
+#define MA_NO_ENCODING
+#define MA_NO_GENERATION
+#define MA_NO_RESOURCE_MANAGER
+#define MA_NO_NODE_GRAPH
+#define MA_NO_ENGINE
+
+// miniaudio is not written against -pedantic -std=c99
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#pragma GCC diagnostic ignored "-Wunused-function"
+#pragma GCC diagnostic ignored "-Wunused-variable"
+#pragma GCC diagnostic ignored "-Wsign-compare"
+#include <miniaudio.h>
+#pragma GCC diagnostic pop
+
+#include <oasis/audio/output.h>
+#include <oasis/audio/realtime.h>
+#include <oasis/utils.h>
+
+#include <pthread.h>
+#include <stdlib.h>
+
+/**
+ * The miniaudio backend, the device thread pulls from the source in its data
+ * callback. miniaudio always asks for a real-time device thread, real-time
+ * mode only adds the checks on what the callback calls.
+ */
+typedef struct {
+  ma_context null_context; // Only for null_device
+  ma_context *context;
+  ma_device device;
+} miniaudio_output_t;
+
+// Enumerating the backends and devices is slow, it is done once and kept
+static pthread_once_t shared_context_once = PTHREAD_ONCE_INIT;
+static ma_context shared_context;
+static ma_result shared_context_result = MA_ERROR;
+
+static ma_result init_context(ma_backend *backends, ma_uint32 backend_count,
+                              ma_context *context) {
+  ma_context_config context_config = ma_context_config_init();
+  context_config.threadPriority = ma_thread_priority_realtime;
+  return ma_context_init(backends, backend_count, &context_config, context);
+}
+
+static void init_shared_context(void) {
+  shared_context_result = init_context(NULL, 0, &shared_context);
+  if (shared_context_result != MA_SUCCESS)
+    return;
+
+  ma_device_info *devices;
+  ma_uint32 device_count;
+  if (ma_context_get_devices(&shared_context, &devices, &device_count, NULL,
+                             NULL) == MA_SUCCESS) {
+    oasis_log(NULL, LOG_LEVEL_DEBUG, "Found %u %s playback devices",
+              device_count, ma_get_backend_name(shared_context.backend));
+  }
+}
+
+static void miniaudio_output_discover(void) {
+  pthread_once(&shared_context_once, init_shared_context);
+}
+
+static ma_format to_ma_format(enum AVSampleFormat sample_format) {
+  switch (sample_format) {
+  case AV_SAMPLE_FMT_U8:
+    return ma_format_u8;
+  case AV_SAMPLE_FMT_S16:
+    return ma_format_s16;
+  case AV_SAMPLE_FMT_S32:
+    return ma_format_s32;
+  case AV_SAMPLE_FMT_FLT:
+    return ma_format_f32;
+  default:
+    return ma_format_unknown;
+  }
+}
+
+static void miniaudio_data_callback(ma_device *device, void *out,
+                                    const void *in, ma_uint32 frame_count) {
+  audio_output_t *output = device->pUserData;
+  uint8_t *buffer = out;
+
+  if (output->config.realtime)
+    realtime_enter();
+
+  size_t rendered = output_render(output, buffer, frame_count);
+  if (rendered < frame_count) {
+    ma_silence_pcm_frames(buffer + rendered * output->stride,
+                          frame_count - rendered, device->playback.format,
+                          device->playback.channels);
+  }
+
+  if (output->config.realtime)
+    realtime_leave();
+}
+
+static oasis_result_t miniaudio_output_open(audio_output_t *output) {
+  const output_config_t *config = &output->config;
+  ma_result ret;
+
+  ma_format format = to_ma_format(config->sample_format);
+  if (format == ma_format_unknown) {
+    oasis_log(NULL, LOG_LEVEL_ERROR,
+              "Sample format %s is not supported by the miniaudio output",
+              av_get_sample_fmt_name(config->sample_format));
+    return OASIS_ERROR_UNSUPPORTED_FORMAT;
+  }
+
+  miniaudio_output_t *ma = calloc(1, sizeof(*ma));
+  if (!ma) {
+    oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to allocate miniaudio output");
+    return OASIS_ERROR_MEMORY_ALLOCATION;
+  }
+
+  // The null backend is paced like a real device, which is what the tests want
+  if (config->null_device) {
+    ma_backend null_backend[] = {ma_backend_null};
+    ret = init_context(null_backend, 1, &ma->null_context);
+    ma->context = &ma->null_context;
+  } else {
+    ret = shared_context_result;
+    ma->context = &shared_context;
+  }
+  if (ret != MA_SUCCESS) {
+    oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to create audio context: %s",
+              ma_result_description(ret));
+    free(ma);
+    return OASIS_ERROR;
+  }
+
+  ma_device_config device_config =
+    ma_device_config_init(ma_device_type_playback);
+  device_config.playback.format = format;
+  device_config.playback.channels = (ma_uint32)config->channels;
+  device_config.sampleRate = (ma_uint32)config->sample_rate;
+  device_config.periodSizeInFrames = (ma_uint32)config->period_size;
+  device_config.performanceProfile = ma_performance_profile_low_latency;
+  device_config.noPreSilencedOutputBuffer = MA_TRUE; // We silence the rest
+  device_config.noClip = MA_TRUE;
+  device_config.dataCallback = miniaudio_data_callback;
+  device_config.pUserData = output;
+
+  ret = ma_device_init(ma->context, &device_config, &ma->device);
+  if (ret != MA_SUCCESS) {
+    oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to open audio device: %s",
+              ma_result_description(ret));
+    if (config->null_device)
+      ma_context_uninit(&ma->null_context);
+    free(ma);
+    return OASIS_ERROR;
+  }
+
+  // What the device actually gave us, which may differ from what we asked for
+  ma_uint32 internal_rate = ma->device.playback.internalSampleRate;
+  if (internal_rate == 0)
+    internal_rate = (ma_uint32)config->sample_rate;
+  output->latency_ms = (double)ma->device.playback.internalPeriodSizeInFrames *
+                       ma->device.playback.internalPeriods * 1000.0 /
+                       internal_rate;
+
+  oasis_log(NULL, LOG_LEVEL_DEBUG,
+            "Using audio device %s (%s), %u x %u frame periods at %u Hz",
+            ma->device.playback.name, ma_get_backend_name(ma->context->backend),
+            ma->device.playback.internalPeriods,
+            ma->device.playback.internalPeriodSizeInFrames, internal_rate);
+
+  output->backend_data = ma;
+  return OASIS_SUCCESS;
+}
+
+static oasis_result_t miniaudio_output_start(audio_output_t *output) {
+  miniaudio_output_t *ma = output->backend_data;
+
+  ma_result ret = ma_device_start(&ma->device);
+  if (ret != MA_SUCCESS) {
+    oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to start audio device: %s",
+              ma_result_description(ret));
+    return OASIS_ERROR;
+  }
+
+  return OASIS_SUCCESS;
+}
+
+static void miniaudio_output_close(audio_output_t *output) {
+  miniaudio_output_t *ma = output->backend_data;
+  if (!ma)
+    return;
+
+  // Uninit stops the device and waits for the callback to return
+  ma_device_uninit(&ma->device);
+  if (ma->context == &ma->null_context)
+    ma_context_uninit(&ma->null_context);
+  free(ma);
+  output->backend_data = NULL;
+}
+
+const output_backend_ops_t output_backend_miniaudio = {
+  .name = "miniaudio",
+  .discover = miniaudio_output_discover,
+  .open = miniaudio_output_open,
+  .start = miniaudio_output_start,
+  .close = miniaudio_output_close,
+};
@@ -0,0 +1,283 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <oasis/audio/output.h>
+#include <oasis/audio/realtime.h>
+#include <oasis/utils.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#define SINK_IDLE_NS 1000000L // Wait for a source that ran dry while unpaced
+#define WAV_HEADER_BYTES 44
+
+/**
+ * The null and file backends, render periods on their own thread with no
+ * device behind them. A simulated clock paces them at speed times real time,
+ * padding underruns with silence like a device would, or with speed 0 they
+ * take whatever the source has as fast as it gives it.
+ */
+typedef struct {
+  FILE *file; // NULL for the null sink
+  int wav;    // The header is finished on close
+  uint64_t bytes_written;
+  uint8_t *period;
+  pthread_t thread;
+  sem_t wake; // Posted on resume and close
+  int running;
+  int stop;
+} sink_output_t;
+
+static uint64_t monotonic_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void sleep_until_ns(uint64_t deadline) {
+  struct timespec ts = {(time_t)(deadline / 1000000000ULL),
+                        (long)(deadline % 1000000000ULL)};
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+    ;
+}
+
+static void put_le(uint8_t *dst, uint32_t value, int bytes) {
+  for (int i = 0; i < bytes; i++)
+    dst[i] = (uint8_t)(value >> (8 * i));
+}
+
+// The canonical 44 byte header, sizes are filled in once they are known
+static int write_wav_header(FILE *file, const output_config_t *config,
+                            uint64_t data_bytes) {
+  uint8_t header[WAV_HEADER_BYTES];
+  int bytes_per_sample = av_get_bytes_per_sample(config->sample_format);
+  int is_float = config->sample_format == AV_SAMPLE_FMT_FLT ||
+                 config->sample_format == AV_SAMPLE_FMT_DBL;
+  uint32_t block_align = (uint32_t)(bytes_per_sample * config->channels);
+  uint32_t data_size =
+    data_bytes > UINT32_MAX - 36 ? UINT32_MAX - 36 : (uint32_t)data_bytes;
+
+  memcpy(header, "RIFF", 4);
+  put_le(header + 4, 36 + data_size, 4);
+  memcpy(header + 8, "WAVEfmt ", 8);
+  put_le(header + 16, 16, 4);
+  put_le(header + 20, is_float ? 3 : 1, 2); // IEEE float or PCM
+  put_le(header + 22, (uint32_t)config->channels, 2);
+  put_le(header + 24, (uint32_t)config->sample_rate, 4);
+  put_le(header + 28, (uint32_t)config->sample_rate * block_align, 4);
+  put_le(header + 32, block_align, 2);
+  put_le(header + 34, (uint32_t)bytes_per_sample * 8, 2);
+  memcpy(header + 36, "data", 4);
+  put_le(header + 40, data_size, 4);
+
+  return fwrite(header, sizeof(header), 1, file) == 1 ? 0 : -1;
+}
+
+static void *sink_output_main(void *arg) {
+  audio_output_t *output = arg;
+  sink_output_t *sink = output->backend_data;
+  size_t period = (size_t)output->config.period_size;
+  double speed = output->config.speed;
+  int realtime = output->config.realtime;
+  int failed = 0;
+
+  // The clock runs from the start, frames_played of it have been heard
+  uint64_t start = monotonic_ns();
+  uint64_t frames_played = 0;
+  double ns_per_frame =
+    speed > 0 ? 1e9 / (output->config.sample_rate * speed) : 0.0;
+
+  while (!__atomic_load_n(&sink->stop, __ATOMIC_ACQUIRE)) {
+    if (realtime)
+      realtime_enter();
+    size_t rendered = output_render(output, sink->period, period);
+    if (realtime)
+      realtime_leave();
+
+    if (rendered == 0 && (__atomic_load_n(&output->paused, __ATOMIC_ACQUIRE) ||
+                          output_finished(output))) {
+      while (sem_wait(&sink->wake) != 0 && errno == EINTR)
+        ;
+      // The clock stood still in the meantime
+      start = monotonic_ns();
+      frames_played = 0;
+      continue;
+    }
+
+    size_t frames = rendered;
+    if (speed > 0 && rendered < period && !output_finished(output)) {
+      uint8_t *planes[1] = {sink->period};
+      av_samples_set_silence(planes, (int)rendered, (int)(period - rendered),
+                             output->config.channels,
+                             output->config.sample_format);
+      frames = period;
+    } else if (frames == 0) {
+      nanosleep((const struct timespec[]){{0, SINK_IDLE_NS}}, NULL);
+      continue;
+    }
+
+    if (sink->file &&
+        fwrite(sink->period, output->stride, frames, sink->file) != frames) {
+      failed = 1;
+      break;
+    }
+    sink->bytes_written += frames * output->stride;
+
+    if (speed > 0) {
+      frames_played += frames;
+      sleep_until_ns(start + (uint64_t)(frames_played * ns_per_frame));
+    }
+  }
+
+  if (failed) {
+    oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to write to %s: %s",
+              output->config.path, strerror(errno));
+    __atomic_store_n(&output->failed, 1, __ATOMIC_RELEASE);
+  }
+
+  // Let anyone waiting on us carry on
+  __atomic_store_n(&output->finished, 1, __ATOMIC_RELEASE);
+  sem_post(&output->pause_ack);
+  return NULL;
+}
+
+static oasis_result_t sink_output_open(audio_output_t *output, int to_file) {
+  const output_config_t *config = &output->config;
+  oasis_result_t result = OASIS_ERROR;
+
+  if (to_file && !config->path) {
+    oasis_log(NULL, LOG_LEVEL_ERROR, "The file output needs a path");
+    return OASIS_ERROR_INVALID_ARGUMENT;
+  }
+
+  sink_output_t *sink = calloc(1, sizeof(*sink));
+  if (!sink) {
+    oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to allocate the output sink");
+    return OASIS_ERROR_MEMORY_ALLOCATION;
+  }
+
+  sink->period = malloc((size_t)config->period_size * output->stride);
+  if (!sink->period) {
+    oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to allocate the period buffer");
+    free(sink);
+    return OASIS_ERROR_MEMORY_ALLOCATION;
+  }
+
+  if (sem_init(&sink->wake, 0, 0) != 0) {
+    oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to create output semaphore");
+    goto free_sink;
+  }
+
+  if (to_file) {
+    const char *extension = strrchr(config->path, '.');
+    sink->wav = extension && strcasecmp(extension, ".wav") == 0;
+    if (sink->wav && config->sample_format == AV_SAMPLE_FMT_S64) {
+      oasis_log(NULL, LOG_LEVEL_ERROR, "WAV files can not hold %s samples",
+                av_get_sample_fmt_name(config->sample_format));
+      result = OASIS_ERROR_UNSUPPORTED_FORMAT;
+      goto destroy_wake;
+    }
+
+    sink->file = fopen(config->path, "wb");
+    if (!sink->file) {
+      oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to open %s: %s", config->path,
+                strerror(errno));
+      result = OASIS_ERROR_FILE_NOT_FOUND;
+      goto destroy_wake;
+    }
+    if (sink->wav && write_wav_header(sink->file, config, 0) != 0) {
+      oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to write to %s", config->path);
+      fclose(sink->file);
+      goto destroy_wake;
+    }
+  }
+
+  // Unpaced there is nothing buffered to wait for
+  output->unpaced = config->speed <= 0;
+  output->latency_ms = output->unpaced ? 0.0
+                                       : config->period_size * 1000.0 /
+                                           (config->sample_rate * config->speed);
+  output->backend_data = sink;
+  return OASIS_SUCCESS;
+
+destroy_wake:
+  sem_destroy(&sink->wake);
+free_sink:
+  free(sink->period);
+  free(sink);
+  return result;
+}
+
+static oasis_result_t null_output_open(audio_output_t *output) {
+  return sink_output_open(output, 0);
+}
+
+static oasis_result_t file_output_open(audio_output_t *output) {
+  return sink_output_open(output, 1);
+}
+
+static oasis_result_t sink_output_start(audio_output_t *output) {
+  sink_output_t *sink = output->backend_data;
+
+  if (pthread_create(&sink->thread, NULL, sink_output_main, output) != 0) {
+    oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to start output thread");
+    return OASIS_ERROR;
+  }
+
+  sink->running = 1;
+  return OASIS_SUCCESS;
+}
+
+static void sink_output_close(audio_output_t *output) {
+  sink_output_t *sink = output->backend_data;
+  if (!sink)
+    return;
+
+  if (sink->running) {
+    __atomic_store_n(&sink->stop, 1, __ATOMIC_RELEASE);
+    sem_post(&sink->wake);
+    pthread_join(sink->thread, NULL);
+  }
+
+  if (sink->file) {
+    // A pipe can not go back to the header, its sizes stay at 0
+    if (sink->wav && fseek(sink->file, 0, SEEK_SET) == 0)
+      write_wav_header(sink->file, &output->config, sink->bytes_written);
+    if (fclose(sink->file) != 0) {
+      oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to finish %s",
+                output->config.path);
+    }
+  }
+
+  oasis_log(NULL, LOG_LEVEL_DEBUG, "%s output: %llu bytes", output->ops->name,
+            (unsigned long long)sink->bytes_written);
+  sem_destroy(&sink->wake);
+  free(sink->period);
+  free(sink);
+  output->backend_data = NULL;
+}
+
+static void sink_output_resume(audio_output_t *output) {
+  sink_output_t *sink = output->backend_data;
+  sem_post(&sink->wake);
+}
+
+const output_backend_ops_t output_backend_null = {
+  .name = "null",
+  .open = null_output_open,
+  .start = sink_output_start,
+  .resume = sink_output_resume,
+  .close = sink_output_close,
+};
+
+const output_backend_ops_t output_backend_file = {
+  .name = "file",
+  .open = file_output_open,
+  .start = sink_output_start,
+  .resume = sink_output_resume,
+  .close = sink_output_close,
+};
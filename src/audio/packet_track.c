@@ -0,0 +1,390 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <oasis/audio/codec_pool.h>
+#include <oasis/audio/decode.h>
+#include <oasis/audio/interleave.h>
+#include <oasis/audio/mmap_input.h>
+#include <oasis/audio/packet_track.h>
+#include <oasis/utils.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+static oasis_result_t add_packet(packet_track_t *track, AVPacket *packet,
+                                 int64_t start) {
+  if (track->count == track->capacity) {
+    size_t capacity = track->capacity ? track->capacity * 2 : 1024;
+    AVPacket **packets =
+      realloc(track->packets, capacity * sizeof(*track->packets));
+    if (!packets)
+      return OASIS_ERROR_MEMORY_ALLOCATION;
+    track->packets = packets;
+
+    int64_t *starts =
+      realloc(track->packet_starts, capacity * sizeof(*track->packet_starts));
+    if (!starts)
+      return OASIS_ERROR_MEMORY_ALLOCATION;
+    track->packet_starts = starts;
+    track->capacity = capacity;
+  }
+
+  track->packets[track->count] = packet;
+  track->packet_starts[track->count] = start;
+  track->count++;
+  track->packet_bytes += packet->size + sizeof(*packet);
+  return OASIS_SUCCESS;
+}
+
+// Reads every packet of the audio stream, the file is closed afterwards
+static oasis_result_t demux_track(packet_track_t *track,
+                                  const char *filename) {
+  AVFormatContext *fmt_ctx = NULL;
+  mmap_input_t input;
+  AVPacket *packet = NULL;
+  oasis_result_t result = mmap_input_open_format(&fmt_ctx, &input, filename);
+  if (result != OASIS_SUCCESS) {
+    oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to open input file %s", filename);
+    return result;
+  }
+
+  if (avformat_find_stream_info(fmt_ctx, NULL) < 0) {
+    oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to find stream info");
+    result = OASIS_ERROR;
+    goto done;
+  }
+
+  int stream_index = decoder_find_stream(fmt_ctx, NULL);
+  if (stream_index < 0) {
+    oasis_log(NULL, LOG_LEVEL_ERROR, "No audio stream found");
+    result = OASIS_ERROR_FILE_NOT_FOUND;
+    goto done;
+  }
+  for (unsigned i = 0; i < fmt_ctx->nb_streams; i++) {
+    if ((int)i != stream_index)
+      fmt_ctx->streams[i]->discard = AVDISCARD_ALL;
+  }
+
+  AVStream *stream = fmt_ctx->streams[stream_index];
+  track->codecpar = avcodec_parameters_alloc();
+  if (!track->codecpar ||
+      avcodec_parameters_copy(track->codecpar, stream->codecpar) < 0) {
+    result = OASIS_ERROR_FFMPEG_MEMORY_ALLOCATION;
+    goto done;
+  }
+  track->time_base = stream->time_base;
+  track->start_time =
+    stream->start_time != AV_NOPTS_VALUE ? stream->start_time : 0;
+  track->sample_rate = stream->codecpar->sample_rate;
+
+  // Packets without a timestamp start where the previous one ended
+  int64_t next = 0;
+  int padding_handled = 0;
+  while (1) {
+    packet = av_packet_alloc();
+    if (!packet) {
+      result = OASIS_ERROR_FFMPEG_MEMORY_ALLOCATION;
+      goto done;
+    }
+
+    int ret = av_read_frame(fmt_ctx, packet);
+    if (ret == AVERROR_EOF)
+      break;
+    if (ret < 0) {
+      oasis_log(NULL, LOG_LEVEL_ERROR, "Error reading packet: %s",
+                av_err2str(ret));
+      result = OASIS_ERROR;
+      goto done;
+    }
+    if (packet->stream_index != stream_index) {
+      av_packet_free(&packet);
+      continue;
+    }
+
+    AVRational samples = {1, track->sample_rate};
+    int64_t start = packet->pts != AV_NOPTS_VALUE
+                      ? av_rescale_q(packet->pts - track->start_time,
+                                     track->time_base, samples)
+                      : next;
+    next = start + av_rescale_q(packet->duration, track->time_base, samples);
+    if (av_packet_get_side_data(packet, AV_PKT_DATA_SKIP_SAMPLES, NULL))
+      padding_handled = 1;
+
+    result = add_packet(track, packet, start);
+    if (result != OASIS_SUCCESS)
+      goto done;
+    packet = NULL;
+  }
+
+  if (stream->duration != AV_NOPTS_VALUE) {
+    track->duration = av_rescale_q(stream->duration, track->time_base,
+                                   (AVRational){1, track->sample_rate});
+  } else {
+    track->duration = next;
+  }
+
+  // Positions leave out the same encoder delay and padding a decoder does
+  decoder_find_gapless(fmt_ctx, stream_index, track->sample_rate,
+                       padding_handled, track->duration, &track->trim_start,
+                       &track->end);
+  if (track->end > 0)
+    track->duration = track->end;
+  else if (track->duration > track->trim_start)
+    track->duration -= track->trim_start;
+
+done:
+  av_packet_free(&packet);
+  avformat_close_input(&fmt_ctx);
+  mmap_input_close(&input);
+  return result;
+}
+
+// Restarts decoding from the last packet that leaves room for the preroll
+static void reposition(packet_track_t *track, int64_t position) {
+  int64_t target = position -
+                   (int64_t)track->sample_rate * PACKET_TRACK_PREROLL_MS / 1000 -
+                   track->codecpar->seek_preroll;
+  size_t low = 0, high = track->count;
+
+  while (low < high) {
+    size_t mid = low + (high - low) / 2;
+    if (track->packet_starts[mid] <= target)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+
+  track->next_packet = low > 0 ? low - 1 : 0;
+  track->next_sample =
+    track->count ? track->packet_starts[track->next_packet] : 0;
+  track->draining = 0;
+  track->window_frames = 0;
+  avcodec_flush_buffers(track->codec_ctx);
+}
+
+static oasis_result_t setup_window(packet_track_t *track) {
+  track->sample_rate = track->frame->sample_rate;
+  track->channels = track->frame->ch_layout.nb_channels;
+  track->sample_format = av_get_packed_sample_fmt(track->frame->format);
+  track->stride =
+    (size_t)av_get_bytes_per_sample(track->sample_format) * track->channels;
+  if (track->stride == 0)
+    return OASIS_ERROR_UNSUPPORTED_FORMAT;
+
+  track->window_capacity =
+    (size_t)track->sample_rate * PACKET_TRACK_WINDOW_MS / 1000;
+  track->window = malloc(track->window_capacity * track->stride);
+  return track->window ? OASIS_SUCCESS : OASIS_ERROR_MEMORY_ALLOCATION;
+}
+
+static oasis_result_t append_frame(packet_track_t *track) {
+  AVFrame *frame = track->frame;
+  size_t frames = (size_t)frame->nb_samples;
+
+  if (!track->window) {
+    oasis_result_t result = setup_window(track);
+    if (result != OASIS_SUCCESS)
+      return result;
+  }
+
+  int64_t start = track->next_sample;
+  if (frame->best_effort_timestamp != AV_NOPTS_VALUE) {
+    start = av_rescale_q(frame->best_effort_timestamp - track->start_time,
+                         track->time_base,
+                         (AVRational){1, track->sample_rate});
+  }
+  track->next_sample = start + (int64_t)frames;
+
+  // A frame that does not follow on starts a new window
+  if (track->window_frames == 0 ||
+      start != track->window_start + (int64_t)track->window_frames) {
+    track->window_start = start;
+    track->window_frames = 0;
+  }
+
+  if (frames > track->window_capacity) {
+    uint8_t *window = realloc(track->window, frames * track->stride);
+    if (!window)
+      return OASIS_ERROR_MEMORY_ALLOCATION;
+    track->window = window;
+    track->window_capacity = frames;
+  }
+
+  // Slide, the oldest frames are the least likely to be read again
+  if (track->window_frames + frames > track->window_capacity) {
+    size_t drop = track->window_frames + frames - track->window_capacity;
+    memmove(track->window, track->window + drop * track->stride,
+            (track->window_frames - drop) * track->stride);
+    track->window_start += (int64_t)drop;
+    track->window_frames -= drop;
+  }
+
+  uint8_t *dst = track->window + track->window_frames * track->stride;
+  int bytes_per_sample = av_get_bytes_per_sample(track->sample_format);
+  if (av_sample_fmt_is_planar(frame->format)) {
+    oasis_result_t result =
+      interleave_samples(dst, frame->extended_data, 0, (int)frames,
+                         track->channels, bytes_per_sample);
+    if (result != OASIS_SUCCESS)
+      return result;
+  } else {
+    memcpy(dst, frame->extended_data[0], frames * track->stride);
+  }
+  track->window_frames += frames;
+  return OASIS_SUCCESS;
+}
+
+// Decodes the next frame into the window, AVERROR_EOF past the last packet
+static int decode_next_frame(packet_track_t *track) {
+  while (1) {
+    int ret = avcodec_receive_frame(track->codec_ctx, track->frame);
+    if (ret == 0) {
+      oasis_result_t result = append_frame(track);
+      av_frame_unref(track->frame);
+      return result == OASIS_SUCCESS ? 0 : AVERROR(ENOMEM);
+    }
+    if (ret != AVERROR(EAGAIN))
+      return ret;
+
+    if (track->next_packet < track->count) {
+      ret = avcodec_send_packet(track->codec_ctx,
+                                track->packets[track->next_packet++]);
+    } else if (!track->draining) {
+      track->draining = 1;
+      ret = avcodec_send_packet(track->codec_ctx, NULL);
+    } else {
+      return AVERROR_EOF;
+    }
+
+    // A damaged packet costs its own samples, not the track
+    if (ret < 0 && ret != AVERROR(EAGAIN) && ret != AVERROR_EOF) {
+      oasis_log(NULL, LOG_LEVEL_WARN, "Skipping packet: %s", av_err2str(ret));
+    }
+  }
+}
+
+oasis_result_t packet_track_load(packet_track_t *track, const char *filename) {
+  if (!track || !filename) {
+    oasis_log(NULL, LOG_LEVEL_ERROR, "Invalid arguments to packet track load");
+    return OASIS_ERROR_INVALID_ARGUMENT;
+  }
+  memset(track, 0, sizeof(*track));
+
+  oasis_result_t result = demux_track(track, filename);
+  if (result == OASIS_SUCCESS)
+    result = codec_pool_acquire(codec_pool_default(), track->codecpar,
+                                &track->codec_ctx);
+  if (result == OASIS_SUCCESS) {
+    track->frame = av_frame_alloc();
+    if (!track->frame)
+      result = OASIS_ERROR_FFMPEG_MEMORY_ALLOCATION;
+  }
+
+  // The output format is only certain once a frame has been decoded
+  if (result == OASIS_SUCCESS) {
+    reposition(track, 0);
+    int ret = decode_next_frame(track);
+    if (ret < 0) {
+      oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to decode first frame of %s: %s",
+                filename, av_err2str(ret));
+      result = OASIS_ERROR_FILE_NOT_MEDIA;
+    }
+  }
+
+  if (result != OASIS_SUCCESS) {
+    packet_track_free(track);
+    return result;
+  }
+
+  uint64_t pcm_bytes = (uint64_t)track->duration * track->stride;
+  oasis_log(NULL, LOG_LEVEL_DEBUG,
+            "Loaded %zu packets of %s, %llu bytes for %llu bytes of PCM",
+            track->count, filename,
+            (unsigned long long)packet_track_get_memory(track),
+            (unsigned long long)pcm_bytes);
+  return OASIS_SUCCESS;
+}
+
+void packet_track_free(packet_track_t *track) {
+  if (!track)
+    return;
+
+  for (size_t i = 0; i < track->count; i++)
+    av_packet_free(&track->packets[i]);
+  free(track->packets);
+  free(track->packet_starts);
+  free(track->window);
+  av_frame_free(&track->frame);
+  codec_pool_release(codec_pool_default(), &track->codec_ctx);
+  avcodec_parameters_free(&track->codecpar);
+  memset(track, 0, sizeof(*track));
+}
+
+oasis_result_t packet_track_read(packet_track_t *track, int64_t position,
+                                 uint8_t *buffer, int frames,
+                                 int *frames_read) {
+  if (!track || !track->window || !buffer || !frames_read || position < 0) {
+    oasis_log(NULL, LOG_LEVEL_ERROR, "Invalid arguments to packet track read");
+    return OASIS_ERROR_INVALID_ARGUMENT;
+  }
+
+  // Nothing past the encoder padding, and the delay is not part of the track
+  if (track->end > 0 && position + frames > track->end)
+    frames = position < track->end ? (int)(track->end - position) : 0;
+  position += track->trim_start;
+
+  int read = 0;
+  int repositioned = 0;
+  while (read < frames) {
+    int64_t at = position + read;
+    int64_t window_end = track->window_start + (int64_t)track->window_frames;
+
+    if (track->window_frames > 0 && at >= track->window_start &&
+        at < window_end) {
+      size_t count = (size_t)(window_end - at);
+      if (count > (size_t)(frames - read))
+        count = (size_t)(frames - read);
+      memcpy(buffer + (size_t)read * track->stride,
+             track->window + (size_t)(at - track->window_start) * track->stride,
+             count * track->stride);
+      read += (int)count;
+      repositioned = 0;
+      continue;
+    }
+
+    // Landed past the position, nothing before the first sample to give
+    if (repositioned && track->window_frames > 0 && at < track->window_start) {
+      size_t gap = (size_t)(track->window_start - at);
+      if (gap > (size_t)(frames - read))
+        gap = (size_t)(frames - read);
+      memset(buffer + (size_t)read * track->stride, 0, gap * track->stride);
+      read += (int)gap;
+      continue;
+    }
+
+    // Behind the window or too far ahead to decode up to, jump
+    if (!repositioned &&
+        (track->window_frames == 0 || at < track->window_start ||
+         at > window_end + (int64_t)track->window_capacity)) {
+      reposition(track, at);
+      repositioned = 1;
+    }
+
+    int ret = decode_next_frame(track);
+    if (ret == AVERROR_EOF)
+      break;
+    if (ret < 0) {
+      oasis_log(NULL, LOG_LEVEL_ERROR, "Error decoding packet track: %s",
+                av_err2str(ret));
+      return OASIS_ERROR;
+    }
+  }
+
+  *frames_read = read;
+  return OASIS_SUCCESS;
+}
+
+uint64_t packet_track_get_memory(const packet_track_t *track) {
+  return track->packet_bytes +
+         track->capacity * (sizeof(AVPacket *) + sizeof(int64_t)) +
+         track->window_capacity * track->stride;
+}
@@ -0,0 +1,323 @@
+#define _XOPEN_SOURCE 700
+
+#include <oasis/audio/cache_path.h>
+#include <oasis/audio/decode.h>
+#include <oasis/audio/pcm_cache.h>
+#include <oasis/utils.h>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PCM_CACHE_MAGIC "OASISPCM"
+#define PCM_CACHE_VERSION 1
+#define PCM_CACHE_ALIGNMENT 64 // Samples start on a cache line
+#define PCM_CACHE_STALE_SECONDS 3600 // No store takes this long to write
+
+/**
+ * The header of a cache entry, followed by the path of the decoded file and
+ * padding up to data_offset, where the interleaved samples start.
+ */
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t sample_rate;
+  uint32_t channels;
+  int32_t sample_format; // enum AVSampleFormat
+  int32_t codec_id;      // enum AVCodecID
+  uint32_t path_length;
+  int64_t file_size;
+  int64_t file_mtime;
+  int64_t file_mtime_nsec;
+  uint64_t pcm_size;
+  uint64_t data_offset;
+} pcm_cache_header_t;
+
+/**
+ * A cache entry seen while evicting, or a stale temp file left by a store that
+ * never finished.
+ */
+typedef struct {
+  char name[32];
+  off_t size;
+  struct timespec used;
+} pcm_cache_entry_t;
+
+oasis_result_t pcm_cache_open(pcm_cache_t *cache, const char *dir,
+                              uint64_t max_bytes) {
+  if (!cache) {
+    return OASIS_ERROR_INVALID_ARGUMENT;
+  }
+
+  memset(cache, 0, sizeof(*cache));
+  cache->max_bytes = max_bytes ? max_bytes : PCM_CACHE_DEFAULT_MAX_BYTES;
+
+  if (!dir)
+    return cache_path_get_dir("pcm", cache->dir, sizeof(cache->dir), 1);
+
+  snprintf(cache->dir, sizeof(cache->dir), "%s", dir);
+  if (cache_path_make_dirs(cache->dir) != 0) {
+    oasis_log(NULL, LOG_LEVEL_WARN, "Failed to create cache directory %s",
+              cache->dir);
+    return OASIS_ERROR_DIRECTORY_NOT_FOUND;
+  }
+  return OASIS_SUCCESS;
+}
+
+oasis_result_t pcm_cache_lookup(pcm_cache_t *cache, const char *filename,
+                                audio_data_t *audio_data) {
+  char path[PATH_MAX + 32];
+  char key[PATH_MAX];
+  struct stat st, entry_st;
+
+  if (!cache || !filename || !audio_data) {
+    return OASIS_ERROR_INVALID_ARGUMENT;
+  }
+  if (stat(filename, &st) != 0)
+    return OASIS_ERROR_FILE_NOT_FOUND;
+
+  cache_path_get_entry(cache->dir, filename, "pcm", path, sizeof(path), key);
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return OASIS_ERROR_FILE_NOT_FOUND;
+
+  if (fstat(fd, &entry_st) != 0 ||
+      (size_t)entry_st.st_size < sizeof(pcm_cache_header_t)) {
+    close(fd);
+    return OASIS_ERROR_FILE_NOT_FOUND;
+  }
+
+  // Private and writable so callers can work on the PCM in place, pages are
+  // only copied once written to
+  size_t mapping_size = (size_t)entry_st.st_size;
+  void *mapping = mmap(NULL, mapping_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                       fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    oasis_log(NULL, LOG_LEVEL_WARN, "Failed to map cache entry %s", path);
+    return OASIS_ERROR_FILE_NOT_FOUND;
+  }
+
+  // A stale, foreign or truncated entry is treated like a missing one
+  const pcm_cache_header_t *header = mapping;
+  if (memcmp(header->magic, PCM_CACHE_MAGIC, sizeof(header->magic)) != 0 ||
+      header->version != PCM_CACHE_VERSION ||
+      header->file_size != (int64_t)st.st_size ||
+      header->file_mtime != (int64_t)st.st_mtim.tv_sec ||
+      header->file_mtime_nsec != (int64_t)st.st_mtim.tv_nsec ||
+      header->data_offset < sizeof(*header) + header->path_length ||
+      header->data_offset > mapping_size ||
+      header->pcm_size > mapping_size - header->data_offset ||
+      header->path_length != strlen(key) ||
+      memcmp((const char *)mapping + sizeof(*header), key,
+             header->path_length) != 0) {
+    munmap(mapping, mapping_size);
+    return OASIS_ERROR_FILE_NOT_FOUND;
+  }
+
+  posix_madvise(mapping, mapping_size, POSIX_MADV_SEQUENTIAL);
+  posix_madvise(mapping, mapping_size, POSIX_MADV_WILLNEED);
+
+  memset(audio_data, 0, sizeof(*audio_data));
+  audio_data->pcm_data = (uint8_t *)mapping + header->data_offset;
+  audio_data->pcm_size = header->pcm_size;
+  audio_data->sample_rate = (int)header->sample_rate;
+  audio_data->channels = (int)header->channels;
+  audio_data->sample_format = (enum AVSampleFormat)header->sample_format;
+  audio_data->codec_id = (enum AVCodecID)header->codec_id;
+  audio_data->mapping = mapping;
+  audio_data->mapping_size = mapping_size;
+
+  // The entry's modification time is its last use for eviction
+  utimensat(AT_FDCWD, path, NULL, 0);
+
+  oasis_log(NULL, LOG_LEVEL_DEBUG, "PCM cache hit for %s, %zu bytes mapped",
+            filename, audio_data->pcm_size);
+  return OASIS_SUCCESS;
+}
+
+static int write_all(int fd, const void *data, size_t size) {
+  const uint8_t *bytes = data;
+
+  while (size > 0) {
+    ssize_t written = write(fd, bytes, size);
+    if (written < 0)
+      return -1;
+    bytes += written;
+    size -= (size_t)written;
+  }
+
+  return 0;
+}
+
+oasis_result_t pcm_cache_store(pcm_cache_t *cache, const char *filename,
+                               const audio_data_t *audio_data) {
+  char path[PATH_MAX + 32];
+  char temp_path[PATH_MAX + 48];
+  char key[PATH_MAX];
+  struct stat st;
+
+  if (!cache || !filename || !audio_data || !audio_data->pcm_data) {
+    return OASIS_ERROR_INVALID_ARGUMENT;
+  }
+  if (stat(filename, &st) != 0)
+    return OASIS_ERROR_FILE_NOT_FOUND;
+
+  cache_path_get_entry(cache->dir, filename, "pcm", path, sizeof(path), key);
+
+  size_t path_length = strlen(key);
+  uint64_t data_offset =
+    (sizeof(pcm_cache_header_t) + path_length + PCM_CACHE_ALIGNMENT - 1) /
+    PCM_CACHE_ALIGNMENT * PCM_CACHE_ALIGNMENT;
+  pcm_cache_header_t header = {
+    .version = PCM_CACHE_VERSION,
+    .sample_rate = (uint32_t)audio_data->sample_rate,
+    .channels = (uint32_t)audio_data->channels,
+    .sample_format = (int32_t)audio_data->sample_format,
+    .codec_id = (int32_t)audio_data->codec_id,
+    .path_length = (uint32_t)path_length,
+    .file_size = (int64_t)st.st_size,
+    .file_mtime = (int64_t)st.st_mtim.tv_sec,
+    .file_mtime_nsec = (int64_t)st.st_mtim.tv_nsec,
+    .pcm_size = audio_data->pcm_size,
+    .data_offset = data_offset,
+  };
+  memcpy(header.magic, PCM_CACHE_MAGIC, sizeof(header.magic));
+
+  // Written aside and renamed so a reader never maps half an entry
+  snprintf(temp_path, sizeof(temp_path), "%s.XXXXXX", path);
+  int fd = mkstemp(temp_path);
+  if (fd < 0) {
+    oasis_log(NULL, LOG_LEVEL_WARN, "Failed to write cache entry %s", path);
+    return OASIS_ERROR;
+  }
+
+  static const uint8_t padding[PCM_CACHE_ALIGNMENT] = {0};
+  int ok = write_all(fd, &header, sizeof(header)) == 0 &&
+           write_all(fd, key, path_length) == 0 &&
+           write_all(fd, padding,
+                     data_offset - sizeof(header) - path_length) == 0 &&
+           write_all(fd, audio_data->pcm_data, audio_data->pcm_size) == 0;
+  ok = (close(fd) == 0) && ok;
+
+  if (!ok || rename(temp_path, path) != 0) {
+    oasis_log(NULL, LOG_LEVEL_WARN, "Failed to write cache entry %s", path);
+    unlink(temp_path);
+    return OASIS_ERROR;
+  }
+
+  oasis_log(NULL, LOG_LEVEL_DEBUG, "Cached %zu bytes of PCM for %s",
+            audio_data->pcm_size, filename);
+  return pcm_cache_evict(cache);
+}
+
+static int compare_entries(const void *a, const void *b) {
+  const pcm_cache_entry_t *left = a, *right = b;
+
+  if (left->used.tv_sec != right->used.tv_sec)
+    return left->used.tv_sec < right->used.tv_sec ? -1 : 1;
+  if (left->used.tv_nsec != right->used.tv_nsec)
+    return left->used.tv_nsec < right->used.tv_nsec ? -1 : 1;
+  return 0;
+}
+
+oasis_result_t pcm_cache_evict(pcm_cache_t *cache) {
+  char path[PATH_MAX + 32];
+  pcm_cache_entry_t *entries = NULL;
+  size_t count = 0, capacity = 0;
+  uint64_t total = 0;
+  oasis_result_t result = OASIS_SUCCESS;
+
+  if (!cache) {
+    return OASIS_ERROR_INVALID_ARGUMENT;
+  }
+
+  DIR *dir = opendir(cache->dir);
+  if (!dir)
+    return OASIS_ERROR_DIRECTORY_NOT_FOUND;
+
+  time_t now = time(NULL);
+  struct dirent *dirent;
+  while ((dirent = readdir(dir)) != NULL) {
+    // An entry is <key>.pcm, a store in progress writes <key>.pcm.XXXXXX
+    size_t length = strlen(dirent->d_name);
+    const char *suffix = strstr(dirent->d_name, ".pcm");
+    int temp = suffix && suffix[4] == '.' && strlen(suffix) == 11;
+    if (length < 5 || length >= sizeof(entries->name) || !suffix ||
+        (suffix[4] != '\0' && !temp))
+      continue;
+
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/%s", cache->dir, dirent->d_name);
+    if (stat(path, &st) != 0)
+      continue;
+
+    // A temp file may still be written to, only one old enough to have been
+    // abandoned by an interrupted store is counted and removed, first of all
+    if (temp && now - st.st_mtime < PCM_CACHE_STALE_SECONDS)
+      continue;
+
+    if (count == capacity) {
+      size_t new_capacity = capacity ? capacity * 2 : 64;
+      pcm_cache_entry_t *new_entries =
+        realloc(entries, new_capacity * sizeof(*entries));
+      if (!new_entries) {
+        oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to grow cache entry list");
+        result = OASIS_ERROR_MEMORY_ALLOCATION;
+        goto done;
+      }
+      entries = new_entries;
+      capacity = new_capacity;
+    }
+
+    memcpy(entries[count].name, dirent->d_name, length + 1);
+    entries[count].size = st.st_size;
+    entries[count].used = st.st_mtim;
+    if (temp)
+      entries[count].used.tv_sec = entries[count].used.tv_nsec = 0;
+    total += (uint64_t)st.st_size;
+    count++;
+  }
+
+  if (total <= cache->max_bytes)
+    goto done;
+
+  qsort(entries, count, sizeof(*entries), compare_entries);
+  for (size_t i = 0; i < count && total > cache->max_bytes; i++) {
+    snprintf(path, sizeof(path), "%s/%s", cache->dir, entries[i].name);
+    if (unlink(path) == 0) {
+      total -= (uint64_t)entries[i].size;
+      oasis_log(NULL, LOG_LEVEL_DEBUG, "Evicted cache entry %s", path);
+    }
+  }
+
+  if (total > cache->max_bytes)
+    result = OASIS_ERROR;
+
+done:
+  closedir(dir);
+  free(entries);
+  return result;
+}
+
+oasis_result_t pcm_cache_decode(pcm_cache_t *cache, const char *filename,
+                                audio_data_t *audio_data) {
+  oasis_result_t result = pcm_cache_lookup(cache, filename, audio_data);
+  if (result != OASIS_ERROR_FILE_NOT_FOUND)
+    return result;
+
+  memset(audio_data, 0, sizeof(*audio_data));
+  result = decode_file_to_pcm(filename, audio_data);
+  if (result != OASIS_SUCCESS)
+    return result;
+
+  // The decoded PCM is good either way, a failed store only costs the next run
+  pcm_cache_store(cache, filename, audio_data);
+  return OASIS_SUCCESS;
+}
@@ -0,0 +1,140 @@
+#include <oasis/audio/pcm_store.h>
+#include <oasis/utils.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+oasis_result_t pcm_store_init(pcm_store_t *store, int sample_rate,
+                              int channels, enum AVSampleFormat sample_format,
+                              size_t chunk_size) {
+  if (!store || channels <= 0 || av_sample_fmt_is_planar(sample_format) ||
+      av_get_bytes_per_sample(sample_format) <= 0) {
+    return OASIS_ERROR_INVALID_ARGUMENT;
+  }
+
+  memset(store, 0, sizeof(*store));
+  store->sample_rate = sample_rate;
+  store->channels = channels;
+  store->sample_format = sample_format;
+  store->stride = (size_t)av_get_bytes_per_sample(sample_format) * channels;
+
+  if (chunk_size == 0)
+    chunk_size = PCM_STORE_DEFAULT_CHUNK_BYTES;
+  store->chunk_size = chunk_size / store->stride * store->stride;
+  if (store->chunk_size == 0)
+    store->chunk_size = store->stride;
+  return OASIS_SUCCESS;
+}
+
+void pcm_store_free(pcm_store_t *store) {
+  if (!store)
+    return;
+
+  for (uint64_t i = 0; i < store->count; i++)
+    free(store->chunks[i]);
+  free(store->chunks);
+  memset(store, 0, sizeof(*store));
+}
+
+uint8_t *pcm_store_write_pointer(pcm_store_t *store, size_t *available) {
+  uint64_t index = store->size / store->chunk_size;
+  size_t used = (size_t)(store->size % store->chunk_size);
+
+  if (index == store->capacity) {
+    uint64_t capacity = store->capacity ? store->capacity * 2 : 64;
+    uint8_t **chunks = realloc(store->chunks, capacity * sizeof(*chunks));
+    if (!chunks) {
+      oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to grow PCM chunk table");
+      return NULL;
+    }
+    memset(chunks + store->capacity, 0,
+           (capacity - store->capacity) * sizeof(*chunks));
+    store->chunks = chunks;
+    store->capacity = capacity;
+  }
+
+  if (!store->chunks[index]) {
+    store->chunks[index] = malloc(store->chunk_size);
+    if (!store->chunks[index]) {
+      oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to allocate PCM chunk");
+      return NULL;
+    }
+  }
+  if (index >= store->count)
+    store->count = index + 1;
+
+  *available = store->chunk_size - used;
+  return store->chunks[index] + used;
+}
+
+void pcm_store_commit(pcm_store_t *store, size_t bytes) {
+  store->size += bytes;
+}
+
+oasis_result_t pcm_store_append(pcm_store_t *store, const uint8_t *data,
+                                size_t bytes) {
+  while (bytes > 0) {
+    size_t available;
+    uint8_t *dst = pcm_store_write_pointer(store, &available);
+    if (!dst)
+      return OASIS_ERROR_MEMORY_ALLOCATION;
+
+    size_t copy = bytes < available ? bytes : available;
+    memcpy(dst, data, copy);
+    pcm_store_commit(store, copy);
+    data += copy;
+    bytes -= copy;
+  }
+
+  return OASIS_SUCCESS;
+}
+
+const uint8_t *pcm_store_at(const pcm_store_t *store, uint64_t offset,
+                            size_t *contiguous) {
+  if (offset >= store->size)
+    return NULL;
+
+  uint64_t index = offset / store->chunk_size;
+  size_t within = (size_t)(offset % store->chunk_size);
+  if (!store->chunks[index])
+    return NULL; // Released
+
+  size_t left = store->chunk_size - within;
+  if (store->size - offset < left)
+    left = (size_t)(store->size - offset);
+  *contiguous = left;
+  return store->chunks[index] + within;
+}
+
+size_t pcm_store_read(const pcm_store_t *store, uint64_t offset,
+                      uint8_t *buffer, size_t bytes) {
+  size_t copied = 0;
+
+  while (copied < bytes) {
+    size_t contiguous;
+    const uint8_t *src = pcm_store_at(store, offset + copied, &contiguous);
+    if (!src)
+      break;
+
+    size_t copy = bytes - copied < contiguous ? bytes - copied : contiguous;
+    memcpy(buffer + copied, src, copy);
+    copied += copy;
+  }
+
+  return copied;
+}
+
+void pcm_store_release(pcm_store_t *store, uint64_t offset) {
+  uint64_t end = offset / store->chunk_size;
+
+  // The chunk still being written to is never released
+  if (end > store->size / store->chunk_size)
+    end = store->size / store->chunk_size;
+
+  for (uint64_t i = store->released; i < end; i++) {
+    free(store->chunks[i]);
+    store->chunks[i] = NULL;
+  }
+  if (end > store->released)
+    store->released = end;
+}
@@ -1,386 +1,1372 @@
-#define _POSIX_C_SOURCE 199309L
+#define _POSIX_C_SOURCE 200809L
 
+#include <oasis/audio/command_queue.h>
 #include <oasis/audio/decode.h>
+#include <oasis/audio/dsp.h>
+#include <oasis/audio/mixer.h>
+#include <oasis/audio/output.h>
+#include <oasis/audio/resample.h>
 #include <oasis/audio/playback.h>
+#include <oasis/audio/realtime.h>
+#include <oasis/audio/ring_buffer.h>
 #include <oasis/utils.h>
 
+#include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
 
-#include <libavdevice/avdevice.h>
+#define DECODE_BLOCK_SAMPLES 4096
+#define CONTROL_TICK_MS 100
+#define PROGRESS_LOG_INTERVAL 20 // In control ticks
+#define SEEK_STEP_MS 5000
+#define VOLUME_STEP_DB 2
+#define VOLUME_MAX_DB 12.0f
 
-static const char *get_audio_device_name(const char *format_name) {
-  if (strcmp(format_name, "oss") == 0) {
-    return "/dev/dsp"; // OSS uses device files
+/**
+ * What the output pulls from, tracks the position of the next sample it will
+ * be handed.
+ */
+typedef struct {
+  ring_buffer_t *ring;
+  size_t stride;
+  int64_t played;   // Position in the track being heard
+  int64_t consumed; // Frames pulled since the ring was last reset
+  int64_t boundary; // consumed at which the next track starts, -1 if none
+  int tracks;       // Track changes heard so far
+} playback_source_t;
+
+/**
+ * What a track goes through on its way into the ring, the gain its tags ask
+ * for. Run by the decode worker, which sets the gain at every new track.
+ */
+typedef struct {
+  dsp_chain_t chain;
+  dsp_gain_t replaygain;
+  dsp_replaygain_mode_t mode;
+  float preamp_db;
+} track_dsp_t;
+
+/**
+ * What the output pulls through, after the lanes are mixed.
+ */
+typedef struct {
+  output_pull_callback pull;
+  void *user_data;
+  dsp_chain_t chain;
+  dsp_volume_t volume;
+  dsp_eq_t eq;
+} output_dsp_t;
+
+/**
+ * Decodes on its own thread into the ring buffer the output side drains. At
+ * the end of a track it carries on with the next one the engine handed over,
+ * so both end up back to back in the ring.
+ */
+typedef struct {
+  audio_decoder_t *decoder;
+  ring_buffer_t *ring;
+  playback_source_t *source;
+  audio_decoder_t *next; // Decoder to carry on with, set by the engine
+  int last;              // Nothing follows the current decoder
+  track_dsp_t *dsp;      // NULL if tracks go in as they are decoded
+  int64_t written;       // Frames written since the ring was last reset
+  pthread_t thread;
+  sem_t wake; // Posted when next, last or stop change while it runs
+  int running;
+  int stop;
+  oasis_result_t result;
+} decode_worker_t;
+
+/**
+ * A track on its way to the output, decoded on its own thread into a ring
+ * the output pulls from, directly or through the mixer.
+ */
+typedef struct {
+  ring_buffer_t ring;
+  decode_worker_t worker;
+  playback_source_t source;
+  track_dsp_t dsp;
+  int stream; // Mixer stream, -1 without a mixer
+} playback_lane_t;
+
+/**
+ * The files to play and the decoders for the track being heard and the one
+ * after it. The next file is opened on its own thread.
+ */
+typedef struct {
+  const char *const *filenames;
+  size_t count;
+  size_t index;      // File being heard
+  size_t next_index; // Next file to open
+  const audio_stream_selection_t *stream;
+  int sample_rate; // Every track is converted to this rate, 0 until known
+  int channels;    // Every track is remixed to this many, 0 until known
+  const channel_matrix_t *matrix; // For the tracks it fits, NULL if none
+
+  audio_decoder_t decoders[2]; // Never moved while open
+  audio_decoder_t *loading;    // Being opened by the preload thread
+  size_t loading_index;
+  audio_decoder_t *upcoming; // Opened for the next track, NULL if none
+  size_t upcoming_index;
+  int upcoming_offered; // Handed to the worker, same format as the output
+
+  pthread_t preload_thread;
+  int preloading;
+  int preload_threaded; // preload_thread has to be joined
+  int preload_done;
+  oasis_result_t preload_result;
+} play_queue_t;
+
+/**
+ * The control side of playback. Transport commands go through the command
+ * queue, the engine sleeps in epoll on the queue, stdin, a signalfd and a tick
+ * timer that is only armed while playing, so a paused player never wakes up.
+ */
+typedef struct {
+  audio_decoder_t *decoder; // Track being heard
+  decode_worker_t *worker;   // Of the lane being heard
+  playback_source_t *source; // Of the lane being heard
+  audio_output_t *output;
+  command_queue_t *commands;
+  play_queue_t *queue;
+
+  // Crossfades play the next track on the other lane, both go through the
+  // mixer until the fade is over
+  playback_lane_t *lanes; // Two of them
+  int lane;               // Lane being heard
+  mixer_t *mixer;         // NULL when tracks are not crossfaded
+  int64_t crossfade_frames;
+  output_dsp_t *dsp;      // NULL when the output pulls straight from the mix
+  float volume_db;        // Kept from one output to the next
+  audio_decoder_t *fading; // Track fading out on the other lane, or NULL
+
+  int epoll_fd;
+  int timer_fd;
+  int signal_fd;
+  int stdin_open;
+
+  int playing;
+  int paused;
+  int stopped; // Stopped by the user, nothing left to play out
+  int ticks;
+  int tracks; // Track changes caught up on
+} playback_engine_t;
+
+// The device outlives a playback, the next one reuses it if its format fits
+static output_session_t output_session;
+
+// Waits for the engine to hand over the next track, 0 if none will come
+static int decode_worker_next(decode_worker_t *worker) {
+  while (!__atomic_load_n(&worker->stop, __ATOMIC_ACQUIRE)) {
+    audio_decoder_t *next =
+      __atomic_exchange_n(&worker->next, NULL, __ATOMIC_ACQ_REL);
+    if (next) {
+      worker->decoder = next;
+      __atomic_store_n(&worker->source->boundary, worker->written,
+                       __ATOMIC_RELEASE);
+      return 1;
+    }
+    if (__atomic_load_n(&worker->last, __ATOMIC_ACQUIRE))
+      return 0;
+
+    // The flags are checked again after every post, a stale one only costs
+    // a loop
+    while (sem_wait(&worker->wake) != 0 && errno == EINTR)
+      ;
+  }
+  return 0;
+}
+
+// A worker that is not running checks the flags as soon as it starts
+static void decode_worker_wake(decode_worker_t *worker) {
+  if (worker->running)
+    sem_post(&worker->wake);
+}
+
+static void decode_worker_set_next(decode_worker_t *worker,
+                                   audio_decoder_t *next) {
+  __atomic_store_n(&worker->next, next, __ATOMIC_RELEASE);
+  decode_worker_wake(worker);
+}
+
+// The engine refreshes this often, the worker only hears about changes
+static void decode_worker_set_last(decode_worker_t *worker, int last) {
+  if (__atomic_exchange_n(&worker->last, last, __ATOMIC_ACQ_REL) != last)
+    decode_worker_wake(worker);
+}
+
+// Tags can be on the stream or the container depending on the format
+static void decode_worker_set_gain(decode_worker_t *worker) {
+  track_dsp_t *dsp = worker->dsp;
+  AVFormatContext *fmt_ctx = worker->decoder->fmt_ctx;
+  float db = 0.0f;
+
+  if (!dsp)
+    return;
+  if (!dsp_replaygain_from_tags(
+        fmt_ctx->streams[worker->decoder->audio_stream_index]->metadata,
+        dsp->mode, dsp->preamp_db, &db) &&
+      !dsp_replaygain_from_tags(fmt_ctx->metadata, dsp->mode, dsp->preamp_db,
+                                &db)) {
+    oasis_log(NULL, LOG_LEVEL_DEBUG, "%s has no ReplayGain tags",
+              worker->decoder->filename);
+  }
+  dsp_gain_set_db(&dsp->replaygain, db);
+}
+
+static void *decode_worker_main(void *arg) {
+  decode_worker_t *worker = arg;
+  audio_decoder_t *decoder = worker->decoder;
+  ring_buffer_t *ring = worker->ring;
+  size_t stride =
+    (size_t)av_get_bytes_per_sample(decoder->sample_format) * decoder->channels;
+
+  decode_worker_set_gain(worker);
+
+  while (!__atomic_load_n(&worker->stop, __ATOMIC_ACQUIRE)) {
+    if (ring_buffer_fill(ring) >= ring->high_watermark) {
+      ring_buffer_wait_for_space(ring);
+      continue;
+    }
+
+    uint8_t *region;
+    size_t available = ring_buffer_begin_write(ring, &region) / stride;
+    int wanted = available < DECODE_BLOCK_SAMPLES ? (int)available
+                                                  : DECODE_BLOCK_SAMPLES;
+
+    int samples_read = 0;
+    oasis_result_t result =
+      decoder_read_samples(decoder, region, wanted, &samples_read);
+    if (worker->dsp && samples_read > 0)
+      dsp_chain_process(&worker->dsp->chain, (float *)region,
+                        (size_t)samples_read);
+    ring_buffer_end_write(ring, samples_read * stride);
+    worker->written += samples_read;
+
+    if (result != OASIS_SUCCESS) {
+      worker->result = result;
+      ring_buffer_set_eof(ring);
+      break;
+    }
+    if (samples_read < wanted) {
+      // The next track picks up right after the last sample of this one
+      if (decode_worker_next(worker)) {
+        decoder = worker->decoder;
+        decode_worker_set_gain(worker);
+        continue;
+      }
+      ring_buffer_set_eof(ring); // End of stream
+      break;
+    }
   }
+
   return NULL;
 }
 
-oasis_result_t playback_play(const char *filename) {
-  oasis_result_t final_result = OASIS_SUCCESS;
-  static struct termios oldt, newt;
+static oasis_result_t decode_worker_start(decode_worker_t *worker) {
+  worker->stop = 0;
+  worker->result = OASIS_SUCCESS;
 
-  audio_data_t audio_data;
+  if (sem_init(&worker->wake, 0, 0) != 0) {
+    oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to create decode semaphore");
+    return OASIS_ERROR;
+  }
+  if (pthread_create(&worker->thread, NULL, decode_worker_main, worker) != 0) {
+    oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to start decode thread");
+    sem_destroy(&worker->wake);
+    return OASIS_ERROR;
+  }
 
-  AVFormatContext *output_format_ctx = NULL;
-  AVStream *out_stream = NULL;
-  int ret;
+  worker->running = 1;
+  return OASIS_SUCCESS;
+}
 
-  if (!filename) {
-    oasis_log(NULL, LOG_LEVEL_ERROR, "Invalid arguments, filename is NULL");
+static void decode_worker_stop(decode_worker_t *worker) {
+  if (!worker->running)
+    return;
+
+  __atomic_store_n(&worker->stop, 1, __ATOMIC_RELEASE);
+  sem_post(&worker->wake);
+  ring_buffer_wake_producer(worker->ring);
+  pthread_join(worker->thread, NULL);
+  sem_destroy(&worker->wake);
+  worker->running = 0;
+}
+
+// Waits until the decoder has buffered up to the low watermark, so output does
+// not start on an almost empty ring
+static void decode_worker_prebuffer(decode_worker_t *worker) {
+  while (ring_buffer_fill(worker->ring) < worker->ring->low_watermark &&
+         !ring_buffer_drained(worker->ring)) {
+    nanosleep((const struct timespec[]){{0, 1000000}}, NULL);
+  }
+}
+
+// Starts over on an empty ring from wherever the decoder is
+static oasis_result_t decode_worker_restart(decode_worker_t *worker) {
+  decode_worker_stop(worker);
+
+  ring_buffer_reset(worker->ring);
+  worker->written = 0;
+  worker->source->consumed = 0;
+  __atomic_store_n(&worker->source->boundary, -1, __ATOMIC_RELEASE);
+  if (decode_worker_start(worker) != OASIS_SUCCESS)
+    return OASIS_ERROR;
+
+  decode_worker_prebuffer(worker);
+  return OASIS_SUCCESS;
+}
+
+// Sets landed to where the decoder ended up, read before the worker owns the
+// decoder again
+static oasis_result_t decode_worker_seek(decode_worker_t *worker,
+                                         int64_t sample, int64_t *landed) {
+  decode_worker_stop(worker);
+
+  oasis_result_t result = decoder_seek(worker->decoder, sample);
+  *landed = worker->decoder->position;
+  if (decode_worker_restart(worker) != OASIS_SUCCESS)
     return OASIS_ERROR;
+  return result;
+}
+
+
+static size_t ms_to_bytes(int ms, int sample_rate, size_t stride) {
+  return (size_t)((int64_t)ms * sample_rate / 1000) * stride;
+}
+
+// Called on the output thread
+static size_t pull_from_ring(void *user_data, uint8_t *buffer, size_t frames,
+                             int *end_of_stream) {
+  playback_source_t *source = user_data;
+
+  size_t bytes =
+    ring_buffer_read(source->ring, buffer, frames * source->stride);
+  size_t frames_read = bytes / source->stride;
+
+  // Crossing into the next track restarts the position at its first sample
+  source->consumed += (int64_t)frames_read;
+  int64_t boundary = __atomic_load_n(&source->boundary, __ATOMIC_ACQUIRE);
+  if (boundary >= 0 && source->consumed >= boundary) {
+    __atomic_store_n(&source->played, source->consumed - boundary,
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&source->boundary, -1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&source->tracks, 1, __ATOMIC_RELEASE);
+  } else {
+    __atomic_fetch_add(&source->played, (int64_t)frames_read,
+                       __ATOMIC_RELAXED);
   }
 
-  struct stat st;
-  if (stat(filename, &st) == -1) {
-    oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to stat file %s, does it exist?",
-              filename);
+  if (frames_read < frames && ring_buffer_drained(source->ring))
+    *end_of_stream = 1;
+
+  return frames_read;
+}
+
+// Called on the output thread
+static size_t pull_through_dsp(void *user_data, uint8_t *buffer, size_t frames,
+                               int *end_of_stream) {
+  output_dsp_t *dsp = user_data;
+
+  size_t pulled = dsp->pull(dsp->user_data, buffer, frames, end_of_stream);
+  dsp_chain_process(&dsp->chain, (float *)buffer, pulled);
+  return pulled;
+}
+
+static void engine_set_ticking(playback_engine_t *engine, int ticking) {
+  struct itimerspec spec = {0};
+  if (ticking) {
+    spec.it_interval.tv_nsec = CONTROL_TICK_MS * 1000000L;
+    spec.it_value = spec.it_interval;
+  }
+  timerfd_settime(engine->timer_fd, 0, &spec, NULL);
+}
+
+static int engine_watch(playback_engine_t *engine, int fd) {
+  struct epoll_event event = {.events = EPOLLIN, .data.fd = fd};
+  return epoll_ctl(engine->epoll_fd, EPOLL_CTL_ADD, fd, &event);
+}
+
+static void engine_close(playback_engine_t *engine) {
+  if (engine->signal_fd >= 0)
+    close(engine->signal_fd);
+  if (engine->timer_fd >= 0)
+    close(engine->timer_fd);
+  if (engine->epoll_fd >= 0)
+    close(engine->epoll_fd);
+}
+
+// SIGINT and SIGTERM have to be blocked in every thread by now
+static oasis_result_t engine_init(playback_engine_t *engine,
+                                  const sigset_t *signals) {
+  engine->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  engine->timer_fd =
+    timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  engine->signal_fd = signalfd(-1, signals, SFD_NONBLOCK | SFD_CLOEXEC);
+
+  if (engine->epoll_fd < 0 || engine->timer_fd < 0 || engine->signal_fd < 0 ||
+      engine_watch(engine, engine->timer_fd) != 0 ||
+      engine_watch(engine, engine->signal_fd) != 0 ||
+      engine_watch(engine, command_queue_get_fd(engine->commands)) != 0) {
+    oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to set up playback controls");
+    engine_close(engine);
     return OASIS_ERROR;
   }
 
-  AVFrame **frames = NULL;
-  int frame_count = 0;
+  // Regular files can not be watched, playback just goes on without keys
+  engine->stdin_open = engine_watch(engine, STDIN_FILENO) == 0;
+  engine->playing = 1;
+  engine_set_ticking(engine, 1);
+  return OASIS_SUCCESS;
+}
+
+// Opens a file of the queue, converted to the internal format and rate and
+// remixed to the channels of the output so every track can follow the first
+// one in the same output
+static oasis_result_t play_queue_open(play_queue_t *queue,
+                                      audio_decoder_t *decoder, size_t index) {
   oasis_result_t result =
-    decode_to_pcm(filename, &frames, &frame_count, &audio_data);
+    decoder_open_stream(decoder, queue->filenames[index], queue->stream);
+  if (result != OASIS_SUCCESS)
+    return result;
+
+  if (queue->sample_rate <= 0)
+    queue->sample_rate = decoder->source_rate;
+  result = decoder_set_output_format(decoder, queue->sample_rate,
+                                     AUDIO_INTERNAL_SAMPLE_FORMAT);
   if (result != OASIS_SUCCESS) {
+    decoder_close(decoder);
     return result;
   }
 
-  result = append_frames_to_pcm(frames, frame_count, &audio_data);
-  if (result != OASIS_SUCCESS) {
-    final_result = result;
-    goto free_pcm;
+  if (queue->channels <= 0)
+    queue->channels = decoder->source_channels;
+  const channel_matrix_t *matrix = queue->matrix;
+  if (matrix && (matrix->in_channels != decoder->source_channels ||
+                 matrix->out_channels != queue->channels))
+    matrix = NULL;
+
+  // Layouts without a standard matrix play as they are, on an output of their
+  // own
+  result = decoder_set_output_channels(decoder, queue->channels, matrix);
+  if (result == OASIS_ERROR_UNSUPPORTED_FORMAT) {
+    oasis_log(NULL, LOG_LEVEL_WARN, "Playing the %d channels of %s as they are",
+              decoder->source_channels, queue->filenames[index]);
+    result = OASIS_SUCCESS;
   }
+  if (result != OASIS_SUCCESS)
+    decoder_close(decoder);
+  return result;
+}
 
-  avdevice_register_all();
+static void *preload_main(void *arg) {
+  play_queue_t *queue = arg;
 
-  const char *try_output_formats[] = {"pulse", "alsa", "oss", NULL};
-  const char *output_format_name = NULL;
-  const AVOutputFormat *output_format = NULL;
+  queue->preload_result =
+    play_queue_open(queue, queue->loading, queue->loading_index);
+  __atomic_store_n(&queue->preload_done, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
 
-  for (int i = 0; try_output_formats[i] != NULL; i++) {
-    output_format = av_guess_format(try_output_formats[i], NULL, NULL);
-    if (output_format) {
-      output_format_name = try_output_formats[i];
-      oasis_log(NULL, LOG_LEVEL_INFO, "Using audio output: %s",
-                output_format_name);
-      break;
-    }
+// Opens the next file in the background into the decoder not being heard
+static void engine_preload(playback_engine_t *engine) {
+  play_queue_t *queue = engine->queue;
+  if (queue->preloading || queue->upcoming ||
+      queue->next_index >= queue->count || engine->fading)
+    return;
+
+  queue->loading = engine->decoder == &queue->decoders[0]
+                     ? &queue->decoders[1]
+                     : &queue->decoders[0];
+  queue->loading_index = queue->next_index++;
+  queue->preload_done = 0;
+  queue->preloading = 1;
+  queue->preload_threaded =
+    pthread_create(&queue->preload_thread, NULL, preload_main, queue) == 0;
+  if (!queue->preload_threaded) {
+    oasis_log(NULL, LOG_LEVEL_WARN, "Failed to start preload thread");
+    preload_main(queue);
   }
+}
 
-  if (!output_format) {
-    oasis_log(NULL, LOG_LEVEL_ERROR, "No supported audio output format found");
-    return OASIS_ERROR;
+// Tracks of one output all have the format of the first one
+static int engine_fits_output(playback_engine_t *engine,
+                              const audio_decoder_t *decoder) {
+  return decoder->sample_rate == engine->decoder->sample_rate &&
+         decoder->channels == engine->decoder->channels &&
+         decoder->sample_format == engine->decoder->sample_format;
+}
+
+// Crossfading needs to know when the current track ends
+static int engine_crossfades(playback_engine_t *engine) {
+  return engine->mixer && engine->decoder->duration > 0;
+}
+
+// Picks up a finished preload, or waits for it. The opened decoder is handed
+// to the worker to follow gaplessly if the output can play it as is and it is
+// not going to be crossfaded.
+static void engine_collect_preload(playback_engine_t *engine, int wait) {
+  play_queue_t *queue = engine->queue;
+  if (!queue->preloading ||
+      (!wait && !__atomic_load_n(&queue->preload_done, __ATOMIC_ACQUIRE)))
+    return;
+
+  if (queue->preload_threaded)
+    pthread_join(queue->preload_thread, NULL);
+  queue->preloading = 0;
+
+  const char *filename = queue->filenames[queue->loading_index];
+  if (queue->preload_result != OASIS_SUCCESS) {
+    oasis_log(NULL, LOG_LEVEL_WARN, "Skipping %s, it could not be opened",
+              filename);
+    return;
   }
 
-  const char *output_device_name = get_audio_device_name(output_format_name);
+  audio_decoder_t *next = queue->loading;
+  queue->upcoming = next;
+  queue->upcoming_index = queue->loading_index;
+  queue->loading = NULL;
 
-  ret = avformat_alloc_output_context2(&output_format_ctx, output_format,
-                                       output_format_name, output_device_name);
-  if (ret < 0 || !output_format_ctx) {
-    char errbuf[AV_ERROR_MAX_STRING_SIZE];
-    av_strerror(ret, errbuf, sizeof(errbuf));
-    oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to allocate output context: %s",
-              errbuf);
-    return OASIS_ERROR;
+  if (!engine->worker || !engine_fits_output(engine, next)) {
+    oasis_log(NULL, LOG_LEVEL_DEBUG,
+              "%s has another format, the output is reopened for it",
+              filename);
+  } else if (!engine_crossfades(engine)) {
+    queue->upcoming_offered = 1;
+    decode_worker_set_next(engine->worker, next);
   }
+}
 
-  out_stream = avformat_new_stream(output_format_ctx, NULL);
-  if (!out_stream) {
-    oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to create output stream");
-    avformat_free_context(output_format_ctx);
-    return OASIS_ERROR;
+static void engine_offer_upcoming(playback_engine_t *engine) {
+  play_queue_t *queue = engine->queue;
+
+  queue->upcoming_offered = 1;
+  decode_worker_set_next(engine->worker, queue->upcoming);
+}
+
+// Lets the worker end the stream once nothing else can follow in this output
+static void engine_update_last(playback_engine_t *engine) {
+  play_queue_t *queue = engine->queue;
+  int last = !queue->preloading && !queue->upcoming_offered &&
+             (queue->upcoming || queue->next_index >= queue->count);
+
+  decode_worker_set_last(engine->worker, last);
+}
+
+// Makes the upcoming track the one being heard, the finished one is closed
+// unless it is still fading out
+static void engine_take_upcoming(playback_engine_t *engine) {
+  play_queue_t *queue = engine->queue;
+
+  if (engine->decoder != engine->fading)
+    decoder_close(engine->decoder);
+  engine->decoder = queue->upcoming;
+  queue->index = queue->upcoming_index;
+  queue->upcoming = NULL;
+  queue->upcoming_offered = 0;
+
+  oasis_log(NULL, LOG_LEVEL_INFO, "Playing audio file %s (%zu of %zu)",
+            queue->filenames[queue->index], queue->index + 1, queue->count);
+}
+
+// Catches up with the output having crossed into the next track
+static void engine_advance(playback_engine_t *engine) {
+  int tracks = __atomic_load_n(&engine->source->tracks, __ATOMIC_ACQUIRE);
+  if (tracks == engine->tracks)
+    return;
+
+  engine->tracks = tracks;
+  engine_take_upcoming(engine);
+}
+
+// Starts the next track on the other lane, fading in as the current one fades
+// out, the current lane ends with its track
+static void engine_start_crossfade(playback_engine_t *engine, int64_t frames) {
+  play_queue_t *queue = engine->queue;
+  playback_lane_t *from = &engine->lanes[engine->lane];
+  playback_lane_t *to = &engine->lanes[!engine->lane];
+
+  to->source = (playback_source_t){
+    .ring = &to->ring,
+    .stride = from->source.stride,
+    .boundary = -1,
+  };
+  to->worker = (decode_worker_t){
+    .decoder = queue->upcoming,
+    .ring = &to->ring,
+    .source = &to->source,
+    .last = 1,
+    .dsp = from->worker.dsp ? &to->dsp : NULL,
+  };
+  ring_buffer_reset(&to->ring);
+  if (decode_worker_start(&to->worker) != OASIS_SUCCESS) {
+    engine_offer_upcoming(engine); // Gapless at least
+    return;
+  }
+  decode_worker_prebuffer(&to->worker);
+
+  to->stream = mixer_add_stream(engine->mixer, pull_from_ring, &to->source,
+                                0.0f);
+  if (to->stream < 0) {
+    decode_worker_stop(&to->worker);
+    engine_offer_upcoming(engine);
+    return;
+  }
+
+  oasis_log(NULL, LOG_LEVEL_DEBUG, "Crossfading over %.2f seconds",
+            (double)frames / engine->decoder->sample_rate);
+  mixer_set_gain(engine->mixer, to->stream, 1.0f, frames);
+  mixer_fade_out(engine->mixer, from->stream, frames);
+  decode_worker_set_last(&from->worker, 1);
+
+  engine->fading = engine->decoder;
+  engine_take_upcoming(engine);
+  engine->lane = !engine->lane;
+  engine->worker = &to->worker;
+  engine->source = &to->source;
+  engine->tracks = 0;
+}
+
+// Closes the lane that faded out once it is silent, or right away
+static void engine_finish_crossfade(playback_engine_t *engine, int now) {
+  if (!engine->fading)
+    return;
+
+  playback_lane_t *from = &engine->lanes[!engine->lane];
+  if (!now && mixer_stream_active(engine->mixer, from->stream))
+    return;
+
+  mixer_remove_stream(engine->mixer, from->stream);
+  from->stream = -1;
+  decode_worker_stop(&from->worker);
+  decoder_close(engine->fading);
+  engine->fading = NULL;
+}
+
+// Seeks without touching the output device, it just stops pulling while the
+// decoder is repositioned
+static void engine_seek(playback_engine_t *engine, int64_t sample) {
+  decode_worker_t *worker = engine->worker;
+  output_pause(engine->output);
+  decode_worker_stop(worker);
+  if (engine->dsp)
+    dsp_chain_reset(&engine->dsp->chain);
+
+  // The next track may already be in the ring, it follows again from its start
+  if (worker->decoder != engine->decoder) {
+    decoder_seek(worker->decoder, 0);
+    decode_worker_set_next(worker, worker->decoder);
+    worker->decoder = engine->decoder;
   }
+  engine->tracks = __atomic_load_n(&engine->source->tracks, __ATOMIC_ACQUIRE);
+
+  int64_t landed = 0;
+  if (decode_worker_seek(worker, sample, &landed) != OASIS_SUCCESS) {
+    oasis_log(NULL, LOG_LEVEL_WARN, "Failed to seek, continuing");
+  }
+  __atomic_store_n(&engine->source->played, landed, __ATOMIC_RELAXED);
+
+  if (!engine->paused)
+    output_resume(engine->output);
+}
+
+// Skips to the start of the next track, opening it right away if needed
+static void engine_next(playback_engine_t *engine) {
+  play_queue_t *queue = engine->queue;
+  decode_worker_t *worker = engine->worker;
+
+  engine_collect_preload(engine, 1);
+  while (!queue->upcoming && queue->next_index < queue->count) {
+    engine_preload(engine);
+    engine_collect_preload(engine, 1);
+  }
+  if (!queue->upcoming) {
+    oasis_log(NULL, LOG_LEVEL_INFO, "No next track, stopping playback");
+    engine->playing = 0;
+    engine->stopped = 1;
+    return;
+  }
+
+  output_pause(engine->output);
+  decode_worker_stop(worker);
+  if (engine->dsp)
+    dsp_chain_reset(&engine->dsp->chain);
+  if (!engine_fits_output(engine, queue->upcoming)) {
+    engine->playing = 0; // Needs another output, playback goes on in it
+    return;
+  }
+
+  // Already partly decoded into the ring behind the current track
+  if (worker->decoder == queue->upcoming)
+    decoder_seek(queue->upcoming, 0);
+  decode_worker_set_next(worker, NULL);
+
+  engine_take_upcoming(engine);
+  worker->decoder = engine->decoder;
+  if (decode_worker_restart(worker) != OASIS_SUCCESS)
+    oasis_log(NULL, LOG_LEVEL_WARN, "Failed to restart decoding");
+  __atomic_store_n(&engine->source->played, 0, __ATOMIC_RELAXED);
+  engine->tracks = __atomic_load_n(&engine->source->tracks, __ATOMIC_ACQUIRE);
+  engine_update_last(engine);
+
+  if (!engine->paused)
+    output_resume(engine->output);
+}
 
-  // Set up stream parameters based on your PCM data
-  out_stream->codecpar->codec_type = AVMEDIA_TYPE_AUDIO;
-  out_stream->codecpar->codec_id = audio_data.codec_id;
-  oasis_log(NULL, LOG_LEVEL_DEBUG, "Setting codec ID to %s",
-            get_audio_codec_name(audio_data.codec_id));
-  out_stream->codecpar->sample_rate = audio_data.sample_rate;
-  oasis_log(NULL, LOG_LEVEL_DEBUG, "Setting sample rate to %d",
-            audio_data.sample_rate);
-
-  out_stream->codecpar->ch_layout.nb_channels = audio_data.channels;
-  if (audio_data.channels == 1) {
-    av_channel_layout_from_mask(&out_stream->codecpar->ch_layout,
-                                AV_CH_LAYOUT_MONO);
-    oasis_log(NULL, LOG_LEVEL_DEBUG, "Setting channel layout to mono");
-  } else if (audio_data.channels == 2) {
-    av_channel_layout_from_mask(&out_stream->codecpar->ch_layout,
-                                AV_CH_LAYOUT_STEREO);
-    oasis_log(NULL, LOG_LEVEL_DEBUG, "Setting channel layout to stereo");
+static void engine_set_paused(playback_engine_t *engine, int paused) {
+  if (paused == engine->paused)
+    return;
+
+  if (paused) {
+    oasis_log(NULL, LOG_LEVEL_DEBUG, "Pausing playback");
+    output_pause(engine->output);
   } else {
-    av_channel_layout_default(&out_stream->codecpar->ch_layout,
-                              audio_data.channels);
-    oasis_log(NULL, LOG_LEVEL_DEBUG, "Setting channel layout to %d",
-              audio_data.channels);
+    oasis_log(NULL, LOG_LEVEL_DEBUG, "Resuming playback");
+    output_resume(engine->output);
   }
 
-  out_stream->codecpar->format = audio_data.sample_format;
-  oasis_log(NULL, LOG_LEVEL_DEBUG, "Setting sample format to %s",
-            get_sample_format_name(audio_data.sample_format));
+  engine->paused = paused;
+  engine_set_ticking(engine, !paused);
+}
 
-  int bytes_per_sample = av_get_bytes_per_sample(audio_data.sample_format);
-  out_stream->codecpar->frame_size = 0; // Let pulseaudio decide the frame size
+static void engine_set_volume(playback_engine_t *engine, float db) {
+  if (db > VOLUME_MAX_DB)
+    db = VOLUME_MAX_DB;
+  if (db < DSP_VOLUME_MUTE_DB)
+    db = DSP_VOLUME_MUTE_DB;
 
-  int64_t bit_rate =
-    audio_data.sample_rate * audio_data.channels * bytes_per_sample * 8;
+  oasis_log(NULL, LOG_LEVEL_DEBUG, "Volume at %.1f dB", db);
+  engine->volume_db = db;
+  if (engine->dsp)
+    dsp_volume_set_db(&engine->dsp->volume, db);
+}
 
-  out_stream->codecpar->bit_rate = bit_rate;
-  oasis_log(NULL, LOG_LEVEL_DEBUG, "Setting bit rate to %d", bit_rate);
+static void engine_apply(playback_engine_t *engine,
+                         const playback_command_t *command) {
+  // The volume goes through the output and leaves the tracks alone
+  if (command->type == PLAYBACK_COMMAND_VOLUME ||
+      command->type == PLAYBACK_COMMAND_VOLUME_RELATIVE) {
+    float db = (float)command->value / 100.0f;
+    if (command->type == PLAYBACK_COMMAND_VOLUME_RELATIVE)
+      db += engine->volume_db;
+    engine_set_volume(engine, db);
+    return;
+  }
 
-  AVDictionary *options = NULL;
-  av_dict_set(&options, "device", "default", 0);
+  // Commands apply to the track being heard, which may just have changed,
+  // and cut a crossfade short
+  engine_advance(engine);
+  engine_finish_crossfade(engine, 1);
 
-  if (output_device_name != NULL) {
-    ret =
-      avio_open(&output_format_ctx->pb, output_device_name, AVIO_FLAG_WRITE);
-    if (ret < 0) {
-      char errbuf[AV_ERROR_MAX_STRING_SIZE];
-      av_strerror(ret, errbuf, sizeof(errbuf));
-      oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to open output device: %s",
-                errbuf);
-      avformat_free_context(output_format_ctx);
-      return OASIS_ERROR;
+  audio_decoder_t *decoder = engine->decoder;
+  int64_t played = __atomic_load_n(&engine->source->played, __ATOMIC_RELAXED);
+  int64_t target;
+
+  switch (command->type) {
+  case PLAYBACK_COMMAND_PLAY:
+    engine_set_paused(engine, 0);
+    break;
+  case PLAYBACK_COMMAND_PAUSE:
+    engine_set_paused(engine, 1);
+    break;
+  case PLAYBACK_COMMAND_TOGGLE_PAUSE:
+    engine_set_paused(engine, !engine->paused);
+    break;
+  case PLAYBACK_COMMAND_RESTART:
+    oasis_log(NULL, LOG_LEVEL_DEBUG, "Restarting playback");
+    engine_seek(engine, 0);
+    break;
+  case PLAYBACK_COMMAND_SEEK:
+  case PLAYBACK_COMMAND_SEEK_RELATIVE:
+    target = command->value * decoder->sample_rate / 1000;
+    if (command->type == PLAYBACK_COMMAND_SEEK_RELATIVE)
+      target += played;
+
+    oasis_log(NULL, LOG_LEVEL_DEBUG, "Seeking to %.2f seconds",
+              (double)target / decoder->sample_rate);
+    if (decoder->duration > 0 && target >= decoder->duration) {
+      oasis_log(NULL, LOG_LEVEL_DEBUG, "Reached end of audio data");
+      engine_next(engine); // Stops playback after the last track
+      break;
     }
+    if (target < 0) {
+      oasis_log(NULL, LOG_LEVEL_DEBUG, "Cannot skip backward beyond start");
+    }
+    // decoder_seek clamps to the start of the stream
+    engine_seek(engine, target);
+    break;
+  case PLAYBACK_COMMAND_STOP:
+    oasis_log(NULL, LOG_LEVEL_INFO, "Stopping playback");
+    engine->playing = 0;
+    engine->stopped = 1;
+    break;
+  case PLAYBACK_COMMAND_NEXT:
+    oasis_log(NULL, LOG_LEVEL_DEBUG, "Skipping to the next track");
+    engine_next(engine);
+    break;
+  case PLAYBACK_COMMAND_VOLUME:
+  case PLAYBACK_COMMAND_VOLUME_RELATIVE:
+    break;
   }
+}
 
-  ret = avformat_write_header(output_format_ctx, &options);
-  av_dict_free(&options);
-  if (ret < 0) {
-    char errbuf[AV_ERROR_MAX_STRING_SIZE];
-    av_strerror(ret, errbuf, sizeof(errbuf));
-    oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to write header: %s", errbuf);
-    avio_closep(&output_format_ctx->pb);
-    avformat_free_context(output_format_ctx);
-    final_result = OASIS_ERROR;
-    goto free_pcm;
+static void engine_handle_key(playback_engine_t *engine, char ch) {
+  command_queue_t *commands = engine->commands;
+
+  switch (ch) {
+  case 'q':
+  case 'Q':
+    command_queue_push(commands, PLAYBACK_COMMAND_STOP, 0);
+    break;
+  case 'p':
+  case 'P':
+    command_queue_push(commands, PLAYBACK_COMMAND_TOGGLE_PAUSE, 0);
+    break;
+  case 'r':
+  case 'R':
+    command_queue_push(commands, PLAYBACK_COMMAND_RESTART, 0);
+    break;
+  case 's':
+  case 'S':
+    command_queue_push(commands, PLAYBACK_COMMAND_SEEK_RELATIVE, SEEK_STEP_MS);
+    break;
+  case 'b':
+  case 'B':
+    command_queue_push(commands, PLAYBACK_COMMAND_SEEK_RELATIVE,
+                       -SEEK_STEP_MS);
+    break;
+  case 'n':
+  case 'N':
+    command_queue_push(commands, PLAYBACK_COMMAND_NEXT, 0);
+    break;
+  case '+':
+  case '=':
+    command_queue_push(commands, PLAYBACK_COMMAND_VOLUME_RELATIVE,
+                       VOLUME_STEP_DB * 100);
+    break;
+  case '-':
+    command_queue_push(commands, PLAYBACK_COMMAND_VOLUME_RELATIVE,
+                       -VOLUME_STEP_DB * 100);
+    break;
+  case 'h':
+  case 'H':
+    oasis_log(NULL, LOG_LEVEL_INFO,
+              "Playback controls:\n"
+              "  q/Q: Quit playback\n"
+              "  p/P: Pause/Resume playback\n"
+              "  r/R: Restart playback\n"
+              "  s/S: Skip forward 5 seconds\n"
+              "  b/B: Skip backward 5 seconds\n"
+              "  n/N: Skip to the next track\n"
+              "  +/-: Turn the volume up or down 2 dB\n"
+              "  h/H: Show this help message");
+    break;
+  case '\n':
+  case '\r':
+    // Ignore newline characters
+    break;
+  default:
+    oasis_log(NULL, LOG_LEVEL_WARN, "Unknown command '%c', ignoring", ch);
+    break;
   }
+}
 
-  oasis_log(NULL, LOG_LEVEL_INFO, "Playing audio file %s, press 'q' to stop",
-            filename);
+static void engine_read_input(playback_engine_t *engine) {
+  char keys[32];
+  ssize_t n = read(STDIN_FILENO, keys, sizeof(keys));
 
-  tcgetattr(STDIN_FILENO, &oldt);
-  /*now the settings will be copied*/
-  newt = oldt;
+  if (n == 0) {
+    // No more input, keep playing without it
+    epoll_ctl(engine->epoll_fd, EPOLL_CTL_DEL, STDIN_FILENO, NULL);
+    engine->stdin_open = 0;
+    return;
+  }
 
-  newt.c_lflag &= ~(ICANON | ECHO);
+  for (ssize_t i = 0; i < n; i++)
+    engine_handle_key(engine, keys[i]);
+}
 
-  /*Those new settings will be set to STDIN
-  TCSANOW tells tcsetattr to change attributes immediately. */
-  tcsetattr(STDIN_FILENO, TCSANOW, &newt);
-  fcntl(STDIN_FILENO, F_SETFL, fcntl(STDIN_FILENO, F_GETFL) | O_NONBLOCK);
+static void engine_tick(playback_engine_t *engine) {
+  uint64_t expirations;
+  if (read(engine->timer_fd, &expirations, sizeof(expirations)) < 0)
+    return;
+
+  engine_advance(engine);
+  audio_decoder_t *decoder = engine->decoder;
+  int64_t played = __atomic_load_n(&engine->source->played, __ATOMIC_RELAXED);
+  if (++engine->ticks % PROGRESS_LOG_INTERVAL == 0 && decoder->duration > 0) {
+    oasis_log(NULL, LOG_LEVEL_DEBUG, "Progress: %.1f%% (buffer %zu bytes)",
+              (double)played / decoder->duration * 100.0,
+              ring_buffer_fill(engine->worker->ring));
+  }
 
-  int frame_size = out_stream->codecpar->frame_size;
-  if (frame_size <= 0) {
-    frame_size = 1024; // Default frame size
+  // Open the next file early enough that it is ready before this one ends,
+  // right away when the length is unknown or a headless sink is not paced.
+  // A sink on a fast clock gets through the window in fewer ticks.
+  engine_finish_crossfade(engine, 0);
+  engine_collect_preload(engine, 0);
+  const audio_output_t *output = engine->output;
+  int64_t remaining = decoder->duration - played;
+  int64_t window = (int64_t)PLAYBACK_PRELOAD_MS * decoder->sample_rate / 1000;
+  if (output->config.speed > 1.0)
+    window = (int64_t)(window * output->config.speed);
+  if (decoder->duration <= 0 || output->unpaced ||
+      remaining < window + engine->crossfade_frames)
+    engine_preload(engine);
+
+  // The fade is as long as what is left, if that is already short
+  play_queue_t *queue = engine->queue;
+  if (queue->upcoming && !queue->upcoming_offered && !engine->fading &&
+      engine_crossfades(engine) && engine_fits_output(engine, queue->upcoming) &&
+      remaining <= engine->crossfade_frames) {
+    int64_t frames = remaining > engine->crossfade_frames / 4
+                       ? remaining
+                       : engine->crossfade_frames / 4;
+    engine_start_crossfade(engine, frames);
   }
+  engine_update_last(engine);
+}
 
-  int chunk_size = frame_size * audio_data.channels * bytes_per_sample;
+static oasis_result_t engine_run(playback_engine_t *engine) {
+  struct epoll_event events[4];
 
-  int playing = 1;
-  audio_data.pcm_position = 0;
-  int64_t pts = 0;
-  int packets_written = 0;
+  // The output paces itself, this only wakes up for input, signals, queued
+  // commands and the tick that notices the end of the stream
+  while (engine->playing) {
+    if (output_finished(engine->output))
+      break; // End of stream
 
-  while (playing && audio_data.pcm_position < audio_data.pcm_size) {
-    AVPacket *packet = av_packet_alloc();
-    if (!packet) {
-      oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to allocate packet");
-      break;
+    int count = epoll_wait(engine->epoll_fd, events, 4, -1);
+    if (count < 0) {
+      if (errno == EINTR)
+        continue;
+      oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to wait for playback events");
+      return OASIS_ERROR;
     }
 
-    int remaining = audio_data.pcm_size - audio_data.pcm_position;
-    int current_chunk = (remaining < chunk_size) ? remaining : chunk_size;
+    for (int i = 0; i < count; i++) {
+      int fd = events[i].data.fd;
 
-    // Allocate packet data
-    ret = av_new_packet(packet, current_chunk);
-    if (ret < 0) {
-      char errbuf[AV_ERROR_MAX_STRING_SIZE];
-      av_strerror(ret, errbuf, sizeof(errbuf));
-      oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to allocate packet: %s", errbuf);
-      av_packet_free(&packet);
-      break;
+      if (fd == engine->timer_fd) {
+        engine_tick(engine);
+      } else if (fd == engine->signal_fd) {
+        struct signalfd_siginfo info;
+        if (read(engine->signal_fd, &info, sizeof(info)) == sizeof(info)) {
+          oasis_log(NULL, LOG_LEVEL_DEBUG, "Caught signal %u", info.ssi_signo);
+          command_queue_push(engine->commands, PLAYBACK_COMMAND_STOP, 0);
+        }
+      } else if (fd == STDIN_FILENO) {
+        engine_read_input(engine);
+      }
     }
 
-    // Copy PCM data to packet
-    memcpy(packet->data, audio_data.pcm_data + audio_data.pcm_position,
-           current_chunk);
-
-    // Set packet parameters correctly
-    packet->stream_index = 0;
-    packet->pts = pts;
-    packet->dts = pts;
-
-    // Calculate duration in samples
-    int samples_in_chunk =
-      current_chunk / (audio_data.channels * bytes_per_sample);
-    packet->duration = samples_in_chunk;
-
-    // Update PTS for next packet
-    pts += samples_in_chunk;
-
-    // Write packet
-    ret = av_interleaved_write_frame(output_format_ctx, packet);
-    if (ret < 0) {
-      char errbuf[AV_ERROR_MAX_STRING_SIZE];
-      av_strerror(ret, errbuf, sizeof(errbuf));
-      oasis_log(NULL, LOG_LEVEL_ERROR, "Error writing PCM frame: %s", errbuf);
-      av_packet_free(&packet);
-      playing = 0;
-      break;
+    playback_command_t command;
+    while (engine->playing && command_queue_pop(engine->commands, &command))
+      engine_apply(engine, &command);
+  }
+
+  return OASIS_SUCCESS;
+}
+
+void playback_close_output(void) {
+  output_session_close(&output_session);
+}
+
+oasis_result_t playback_play(const char *filename) {
+  return playback_play_with_options(filename, NULL);
+}
+
+oasis_result_t playback_play_with_options(const char *filename,
+                                          const playback_options_t *options) {
+  if (!filename) {
+    oasis_log(NULL, LOG_LEVEL_ERROR, "Invalid arguments, filename is NULL");
+    return OASIS_ERROR;
+  }
+
+  struct stat st;
+  if (stat(filename, &st) == -1) {
+    oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to stat file %s, does it exist?",
+              filename);
+    return OASIS_ERROR;
+  }
+
+  return playback_play_queue(&filename, 1, options);
+}
+
+// Keeps what the output thread touches in RAM, or lets it go again
+static void lock_output_memory(playback_lane_t *lanes, mixer_t *mixer,
+                               int lock) {
+  struct {
+    const void *address;
+    size_t size;
+  } regions[5] = {{lanes[0].ring.data, lanes[0].ring.capacity}};
+
+  if (mixer) {
+    size_t count = (size_t)MIXER_BLOCK_FRAMES * mixer->channels;
+    regions[1].address = lanes[1].ring.data;
+    regions[1].size = lanes[1].ring.capacity;
+    regions[2].address = mixer->accumulator;
+    regions[2].size = count * sizeof(float);
+    regions[3].address = mixer->samples;
+    regions[3].size = count * sizeof(float);
+    regions[4].address = mixer->scratch;
+    regions[4].size = MIXER_BLOCK_FRAMES * mixer->stride;
+  }
+
+  for (int i = 0; i < 5 && regions[i].address; i++) {
+    if (!lock) {
+      realtime_unlock_memory(regions[i].address, regions[i].size);
+    } else if (realtime_lock_memory(regions[i].address, regions[i].size) !=
+               OASIS_SUCCESS) {
+      break; // Over RLIMIT_MEMLOCK, the rest would fail too
     }
+  }
+}
+
+static oasis_result_t track_dsp_init(track_dsp_t *dsp, int channels,
+                                     const playback_options_t *opts) {
+  oasis_result_t result = dsp_chain_init(&dsp->chain, channels);
+  if (result != OASIS_SUCCESS)
+    return result;
 
-    packets_written++;
+  dsp->chain.profile = opts->dsp_profile;
+  dsp->mode = opts->replaygain;
+  dsp->preamp_db = opts->replaygain_preamp_db;
+  dsp_gain_init(&dsp->replaygain, channels);
+  return dsp_chain_add(&dsp->chain, &dsp->replaygain.node);
+}
+
+static oasis_result_t output_dsp_init(output_dsp_t *dsp,
+                                      const audio_decoder_t *decoder,
+                                      float volume_db,
+                                      const playback_options_t *opts) {
+  oasis_result_t result = dsp_chain_init(&dsp->chain, decoder->channels);
+  if (result != OASIS_SUCCESS)
+    return result;
+
+  dsp->chain.profile = opts->dsp_profile;
+  dsp_volume_init(&dsp->volume, decoder->channels, decoder->sample_rate,
+                  volume_db);
+  result = dsp_chain_add(&dsp->chain, &dsp->volume.node);
+  if (result != OASIS_SUCCESS || opts->eq_band_count <= 0)
+    return result;
 
-    // Log progress every 50 packets
-    if (packets_written % 50 == 0) {
-      double progress =
-        (double)audio_data.pcm_position / audio_data.pcm_size * 100.0;
-      oasis_log(NULL, LOG_LEVEL_DEBUG, "Progress: %.1f%% (%d packets written)",
-                progress, packets_written);
+  result = dsp_eq_init(&dsp->eq, decoder->channels, decoder->sample_rate,
+                       opts->eq_bands, opts->eq_band_count);
+  if (result != OASIS_SUCCESS)
+    return result;
+  return dsp_chain_add(&dsp->chain, &dsp->eq.node);
+}
+
+// Plays from the decoder being heard for as long as the tracks that follow
+// fit the same output
+static oasis_result_t play_segment(playback_engine_t *engine,
+                                   const playback_options_t *opts) {
+  oasis_result_t final_result = OASIS_SUCCESS;
+  audio_decoder_t *decoder = engine->decoder;
+  playback_lane_t lanes[2] = {{.stream = -1}, {.stream = -1}};
+  mixer_t mixer;
+  output_dsp_t dsp;
+  audio_output_t *output;
+
+  // The chains are set up before anything that would need undoing
+  engine->dsp = NULL;
+  if (decoder->channels > DSP_MAX_CHANNELS) {
+    oasis_log(NULL, LOG_LEVEL_WARN, "Playing %d channels without DSP",
+              decoder->channels);
+  } else {
+    oasis_result_t result =
+      output_dsp_init(&dsp, decoder, engine->volume_db, opts);
+    if (result == OASIS_SUCCESS && opts->replaygain != DSP_REPLAYGAIN_OFF) {
+      for (int i = 0; i < 2 && result == OASIS_SUCCESS; i++)
+        result = track_dsp_init(&lanes[i].dsp, decoder->channels, opts);
+      lanes[0].worker.dsp = &lanes[0].dsp;
     }
+    if (result != OASIS_SUCCESS)
+      return result;
+    engine->dsp = &dsp;
+  }
 
-    av_packet_free(&packet);
-    audio_data.pcm_position += current_chunk;
-
-    // Check for quit input (non-blocking)
-    char ch = 0;
-    if (read(STDIN_FILENO, &ch, 1) > 0) {
-      switch (ch) {
-      case 'q':
-      case 'Q':
-        oasis_log(NULL, LOG_LEVEL_INFO, "Stopping playback");
-        playing = 0;
-        break;
-      case 'p':
-      case 'P':
-        oasis_log(NULL, LOG_LEVEL_DEBUG, "Pausing playback");
-        while (1) {
-          char pause_ch = 0;
-          if (read(STDIN_FILENO, &pause_ch, 1) > 0) {
-            if (pause_ch == 'p' || pause_ch == 'P') {
-              oasis_log(NULL, LOG_LEVEL_DEBUG, "Resuming playback");
-              break; // Resume playback
-            } else if (pause_ch == 'q' || pause_ch == 'Q') {
-              oasis_log(NULL, LOG_LEVEL_DEBUG, "Stopping playback");
-              playing = 0;
-              break; // Stop playback
-            }
-          }
-        }
-        break;
-      case 'r':
-      case 'R':
-        oasis_log(NULL, LOG_LEVEL_DEBUG, "Restarting playback");
-        audio_data.pcm_position = 0;
-        packets_written = 0;
-        pts = 0; // Reset PTS
-        av_write_trailer(output_format_ctx);
-        ret = avformat_write_header(output_format_ctx, NULL);
-        if (ret < 0) {
-          char errbuf[AV_ERROR_MAX_STRING_SIZE];
-          av_strerror(ret, errbuf, sizeof(errbuf));
-          oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to write header: %s", errbuf);
-          final_result = OASIS_ERROR;
-          playing = 0;
-          break;
-        }
-        break;
-      case 's':
-      case 'S':
-        oasis_log(NULL, LOG_LEVEL_DEBUG, "Skipping forward 5 seconds");
-        audio_data.pcm_position += 5 * audio_data.sample_rate *
-                                    audio_data.channels * bytes_per_sample;
-        if (audio_data.pcm_position >= audio_data.pcm_size) {
-          oasis_log(NULL, LOG_LEVEL_DEBUG, "Reached end of audio data");
-          audio_data.pcm_position = audio_data.pcm_size; // Clamp to end
-          playing = 0; // Stop playback if we reach the end
-        }
-        pts = audio_data.pcm_position / (audio_data.channels * bytes_per_sample);
-        packets_written = 0; // Reset packet count after skipping
-        av_write_trailer(output_format_ctx);
-        ret = avformat_write_header(output_format_ctx, NULL);
-        if (ret < 0) {
-          char errbuf[AV_ERROR_MAX_STRING_SIZE];
-          av_strerror(ret, errbuf, sizeof(errbuf));
-          oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to write header: %s", errbuf);
-          final_result = OASIS_ERROR;
-          playing = 0;
-          break;
-        }
-        break;
-      case 'b':
-      case 'B':
-        oasis_log(NULL, LOG_LEVEL_DEBUG, "Skipping backward 5 seconds");
-        if (audio_data.pcm_position < (size_t)5 * audio_data.sample_rate *
-                                        audio_data.channels * bytes_per_sample) {
-          oasis_log(NULL, LOG_LEVEL_DEBUG, "Cannot skip backward beyond start");
-          audio_data.pcm_position = 0; // Clamp to start
-        } else {
-          audio_data.pcm_position -= 5 * audio_data.sample_rate *
-                                    audio_data.channels * bytes_per_sample;
-        }
+  size_t stride =
+    (size_t)av_get_bytes_per_sample(decoder->sample_format) * decoder->channels;
+  size_t capacity = ms_to_bytes(opts->buffer_ms, decoder->sample_rate, stride);
+  size_t low = ms_to_bytes(opts->low_watermark_ms, decoder->sample_rate, stride);
+  size_t high =
+    ms_to_bytes(opts->high_watermark_ms, decoder->sample_rate, stride);
+  oasis_result_t result = ring_buffer_init(&lanes[0].ring, capacity, low, high);
+  if (result != OASIS_SUCCESS)
+    return result;
 
-        if (audio_data.pcm_position == 0) {
-          oasis_log(NULL, LOG_LEVEL_DEBUG, "Reached start of audio data");
-          audio_data.pcm_position = 0; // Clamp to start
-        }
+  // The second lane and the mixer are only needed to overlap tracks
+  engine->mixer = NULL;
+  if (opts->crossfade_ms > 0) {
+    if (ring_buffer_init(&lanes[1].ring, capacity, low, high) !=
+        OASIS_SUCCESS) {
+      oasis_log(NULL, LOG_LEVEL_WARN, "Playing without crossfades");
+    } else if (mixer_init(&mixer, decoder->sample_rate, decoder->channels,
+                          decoder->sample_format) != OASIS_SUCCESS) {
+      oasis_log(NULL, LOG_LEVEL_WARN, "Playing without crossfades");
+      ring_buffer_free(&lanes[1].ring);
+    } else {
+      engine->mixer = &mixer;
+    }
+  }
 
-        pts = audio_data.pcm_position / (audio_data.channels * bytes_per_sample);
-        packets_written = 0; // Reset packet count after skipping
-        av_write_trailer(output_format_ctx);
-        ret = avformat_write_header(output_format_ctx, NULL);
-        if (ret < 0) {
-          char errbuf[AV_ERROR_MAX_STRING_SIZE];
-          av_strerror(ret, errbuf, sizeof(errbuf));
-          oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to write header: %s", errbuf);
-          final_result = OASIS_ERROR;
-          playing = 0;
-          break;
-        }
-        break;
-      case 'h':
-      case 'H':
-        oasis_log(NULL, LOG_LEVEL_INFO,
-                  "Playback controls:\n"
-                  "  q/Q: Quit playback\n"
-                  "  p/P: Pause/Resume playback\n"
-                  "  r/R: Restart playback\n"
-                  "  s/S: Skip forward 5 seconds\n"
-                  "  b/B: Skip backward 5 seconds\n"
-                  "  h/H: Show this help message");
-        break;
-      case '\n':
-      case '\r':
-        // Ignore newline characters
-        break;
-      default:
-        oasis_log(NULL, LOG_LEVEL_WARN, "Unknown command '%c', ignoring", ch);
-        break;
-      }
+  // A real-time consumer never wakes the decoder, it checks back on its own
+  if (opts->realtime) {
+    ring_buffer_set_poll_ms(&lanes[0].ring, PLAYBACK_REALTIME_POLL_MS);
+    if (engine->mixer)
+      ring_buffer_set_poll_ms(&lanes[1].ring, PLAYBACK_REALTIME_POLL_MS);
+    lock_output_memory(lanes, engine->mixer, 1);
+  }
+
+  playback_lane_t *lane = &lanes[0];
+  lane->source.ring = &lane->ring;
+  lane->source.stride = stride;
+  lane->source.boundary = -1;
+  lane->worker.decoder = decoder;
+  lane->worker.ring = &lane->ring;
+  lane->worker.source = &lane->source;
+  engine->lanes = lanes;
+  engine->lane = 0;
+  engine->crossfade_frames =
+    (int64_t)opts->crossfade_ms * decoder->sample_rate / 1000;
+  engine->worker = &lane->worker;
+  engine->source = &lane->source;
+  engine->tracks = 0;
+  engine_update_last(engine);
+
+  output_pull_callback pull = pull_from_ring;
+  void *pull_data = &lane->source;
+  if (engine->mixer) {
+    lane->stream =
+      mixer_add_stream(engine->mixer, pull_from_ring, &lane->source, 1.0f);
+    pull = mixer_pull;
+    pull_data = engine->mixer;
+  }
+  if (engine->dsp) {
+    dsp.pull = pull;
+    dsp.user_data = pull_data;
+    pull = pull_through_dsp;
+    pull_data = &dsp;
+  }
+
+  result = decode_worker_start(&lane->worker);
+  if (result != OASIS_SUCCESS) {
+    final_result = result;
+    goto free_lanes;
+  }
+
+  output_config_t output_config = {
+    .backend = opts->output_backend,
+    .sample_rate = decoder->sample_rate,
+    .channels = decoder->channels,
+    .sample_format = decoder->sample_format,
+    .period_size = opts->period_size,
+    .null_device = opts->null_output,
+    .realtime = opts->realtime,
+    .path = opts->output_path,
+    .speed = opts->output_speed,
+  };
+  output_config_from_env(&output_config);
+
+  result = output_session_acquire(&output_session, &output_config, pull,
+                                  pull_data, &output);
+  if (result != OASIS_SUCCESS &&
+      output_config.backend == OUTPUT_BACKEND_MINIAUDIO &&
+      !output_config.null_device) {
+    oasis_log(NULL, LOG_LEVEL_WARN, "Falling back to the avdevice output");
+    output_config.backend = OUTPUT_BACKEND_AVDEVICE;
+    result = output_session_acquire(&output_session, &output_config, pull,
+                                    pull_data, &output);
+  }
+  if (result != OASIS_SUCCESS) {
+    final_result = result;
+    goto stop_workers;
+  }
+  engine->output = output;
+
+  decode_worker_prebuffer(&lane->worker);
+
+  // A reused output is already running, paused since the last playback
+  result = output_start(output);
+  if (result != OASIS_SUCCESS) {
+    final_result = result;
+    output_session_close(&output_session);
+    goto stop_workers;
+  }
+  output_resume(output);
+
+  engine->playing = 1;
+  engine->paused = 0;
+  engine_set_ticking(engine, 1);
+  final_result = engine_run(engine);
+  engine_advance(engine);
+
+  // Let the device play out what it has buffered
+  if (!engine->stopped && output_finished(output))
+    output_drain(output);
+
+  lane = &lanes[engine->lane];
+  if (lane->worker.result != OASIS_SUCCESS && final_result == OASIS_SUCCESS)
+    final_result = lane->worker.result;
+  oasis_log(NULL, LOG_LEVEL_DEBUG, "Ring buffer: %llu reads, %llu underruns",
+            (unsigned long long)lane->ring.reads,
+            (unsigned long long)lane->ring.underruns);
+  if (opts->dsp_profile && engine->dsp) {
+    dsp_chain_log_profile(&lanes[0].dsp.chain);
+    dsp_chain_log_profile(&lanes[1].dsp.chain);
+    dsp_chain_log_profile(&dsp.chain);
+  }
+
+  // The session holds on to the device, a file is finished right away
+  output_session_release(&output_session);
+  if (output->config.backend == OUTPUT_BACKEND_FILE)
+    output_session_close(&output_session);
+
+stop_workers:
+  if (engine->mixer)
+    engine_finish_crossfade(engine, 1);
+  decode_worker_stop(&lanes[0].worker);
+  decode_worker_stop(&lanes[1].worker);
+
+free_lanes:
+  if (opts->realtime)
+    lock_output_memory(lanes, engine->mixer, 0);
+  ring_buffer_free(&lanes[0].ring);
+  if (engine->mixer) {
+    ring_buffer_free(&lanes[1].ring);
+    mixer_free(engine->mixer);
+  }
+  engine->mixer = NULL;
+  engine->dsp = NULL;
+  engine->lanes = NULL;
+  engine->worker = NULL;
+  engine->source = NULL;
+  engine->output = NULL;
+  return final_result;
+}
+
+oasis_result_t playback_play_queue(const char *const *filenames, size_t count,
+                                   const playback_options_t *options) {
+  oasis_result_t final_result = OASIS_SUCCESS;
+  static struct termios oldt, newt;
+
+  play_queue_t queue = {0};
+  command_queue_t local_commands;
+  playback_engine_t engine = {.epoll_fd = -1, .timer_fd = -1, .signal_fd = -1};
+  playback_options_t opts = {0};
+  sigset_t signals, old_signals;
+
+  if (!filenames || count == 0) {
+    oasis_log(NULL, LOG_LEVEL_ERROR, "Invalid arguments, nothing to play");
+    return OASIS_ERROR_INVALID_ARGUMENT;
+  }
+
+  if (options)
+    opts = *options;
+  if (opts.buffer_ms <= 0)
+    opts.buffer_ms = PLAYBACK_DEFAULT_BUFFER_MS;
+  if (opts.high_watermark_ms <= 0 || opts.high_watermark_ms > opts.buffer_ms)
+    opts.high_watermark_ms = opts.buffer_ms - opts.buffer_ms / 10;
+  if (opts.low_watermark_ms <= 0 ||
+      opts.low_watermark_ms > opts.high_watermark_ms)
+    opts.low_watermark_ms = opts.high_watermark_ms / 2;
+
+  queue.filenames = filenames;
+  queue.count = count;
+  queue.stream = opts.stream;
+  queue.sample_rate = opts.sample_rate;
+  queue.channels = opts.channels;
+  queue.matrix = opts.channel_matrix;
+  engine.volume_db = opts.volume_db;
+
+  // The first file that opens starts playback
+  oasis_result_t result = OASIS_ERROR;
+  while (queue.next_index < count && result != OASIS_SUCCESS) {
+    queue.index = queue.next_index++;
+    result = play_queue_open(&queue, &queue.decoders[0], queue.index);
+    if (result != OASIS_SUCCESS && count > 1) {
+      oasis_log(NULL, LOG_LEVEL_WARN, "Skipping %s, it could not be opened",
+                filenames[queue.index]);
     }
+  }
+  if (result != OASIS_SUCCESS)
+    return result;
+  engine.decoder = &queue.decoders[0];
+  engine.queue = &queue;
+
+  // Block these before any thread is started so they all inherit the mask and
+  // the signals only ever show up on the engine's signalfd
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &signals, &old_signals);
+
+  engine.commands = opts.commands;
+  if (!engine.commands) {
+    result = command_queue_init(&local_commands);
+    if (result != OASIS_SUCCESS) {
+      final_result = result;
+      goto close_decoders;
+    }
+    engine.commands = &local_commands;
+  }
+
+  result = engine_init(&engine, &signals);
+  if (result != OASIS_SUCCESS) {
+    final_result = result;
+    goto free_commands;
+  }
+
+  oasis_log(NULL, LOG_LEVEL_INFO, "Playing audio file %s, press 'q' to stop",
+            filenames[queue.index]);
+
+  tcgetattr(STDIN_FILENO, &oldt);
+  /*now the settings will be copied*/
+  newt = oldt;
 
-    // Reduce the delay - 10ms might be too much
-    nanosleep((const struct timespec[]){{0, 1000000}},
-              NULL); // 1ms instead of 10ms
+  newt.c_lflag &= ~(ICANON | ECHO);
+
+  /*Those new settings will be set to STDIN
+  TCSANOW tells tcsetattr to change attributes immediately. */
+  tcsetattr(STDIN_FILENO, TCSANOW, &newt);
+  fcntl(STDIN_FILENO, F_SETFL, fcntl(STDIN_FILENO, F_GETFL) | O_NONBLOCK);
+
+  // Every pass plays as many tracks as fit one output format
+  while (1) {
+    final_result = play_segment(&engine, &opts);
+    if (final_result != OASIS_SUCCESS || engine.stopped)
+      break;
+
+    engine_collect_preload(&engine, 1);
+    if (!queue.upcoming)
+      break;
+    engine_take_upcoming(&engine);
   }
+
   tcsetattr(STDIN_FILENO, TCSANOW, &oldt);
   fcntl(STDIN_FILENO, F_SETFL, fcntl(STDIN_FILENO, F_GETFL) & ~O_NONBLOCK);
+  engine_close(&engine);
 
-  av_write_trailer(output_format_ctx);
-  avio_closep(&output_format_ctx->pb);
-  avformat_free_context(output_format_ctx);
+free_commands:
+  if (engine.commands == &local_commands)
+    command_queue_free(&local_commands);
 
-free_pcm:
-  free(audio_data.pcm_data);
-  for (int i = 0; i < frame_count; i++) {
-    av_frame_free(&frames[i]);
-  }
-  free(frames);
+close_decoders:
+  engine_collect_preload(&engine, 1);
+  pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+  decoder_close(&queue.decoders[0]);
+  decoder_close(&queue.decoders[1]);
   return final_result;
 }
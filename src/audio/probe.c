@@ -0,0 +1,94 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <oasis/audio/decode.h>
+#include <oasis/audio/probe.h>
+#include <oasis/utils.h>
+
+#include <errno.h>
+#include <libavformat/avformat.h>
+#include <libavutil/dict.h>
+#include <string.h>
+
+// Only the header is wanted, the defaults let the probe read megabytes
+static AVDictionary *probe_options(void) {
+  AVDictionary *options = NULL;
+
+  av_dict_set_int(&options, "probesize", AUDIO_PROBE_SIZE, 0);
+  av_dict_set_int(&options, "analyzeduration", AUDIO_PROBE_ANALYZE_US, 0);
+  av_dict_set_int(&options, "formatprobesize", AUDIO_PROBE_SIZE, 0);
+  return options;
+}
+
+static void probe_duration(AVFormatContext *fmt_ctx, const AVStream *stream,
+                           audio_probe_t *probe) {
+  if (probe->sample_rate <= 0)
+    return;
+
+  if (stream->duration != AV_NOPTS_VALUE && stream->duration > 0) {
+    probe->duration = av_rescale_q(stream->duration, stream->time_base,
+                                   (AVRational){1, probe->sample_rate});
+    return;
+  }
+
+  if (fmt_ctx->duration != AV_NOPTS_VALUE && fmt_ctx->duration > 0) {
+    probe->duration =
+      av_rescale(fmt_ctx->duration, probe->sample_rate, AV_TIME_BASE);
+    return;
+  }
+
+  // Headerless streams such as plain MP3 only give away their bit rate
+  int64_t size = fmt_ctx->pb ? avio_size(fmt_ctx->pb) : -1;
+  if (probe->bit_rate > 0 && size > 0) {
+    probe->duration =
+      av_rescale(size * 8, probe->sample_rate, probe->bit_rate);
+    probe->duration_estimated = 1;
+  }
+}
+
+oasis_result_t audio_probe(const char *filename, audio_probe_t *probe) {
+  AVFormatContext *fmt_ctx = NULL;
+
+  if (!filename || !probe) {
+    oasis_log(NULL, LOG_LEVEL_ERROR, "Invalid arguments to audio probe");
+    return OASIS_ERROR_INVALID_ARGUMENT;
+  }
+
+  memset(probe, 0, sizeof(*probe));
+  probe->sample_format = AV_SAMPLE_FMT_NONE;
+  probe->codec_id = AV_CODEC_ID_NONE;
+  probe->stream_index = -1;
+
+  // No avformat_find_stream_info, it opens decoders and feeds them packets
+  AVDictionary *options = probe_options();
+  int ret = avformat_open_input(&fmt_ctx, filename, NULL, &options);
+  av_dict_free(&options);
+  if (ret < 0) {
+    char errbuf[AV_ERROR_MAX_STRING_SIZE];
+    av_strerror(ret, errbuf, sizeof(errbuf));
+    oasis_log(NULL, LOG_LEVEL_DEBUG, "Failed to probe %s: %s", filename,
+              errbuf);
+    return ret == AVERROR(ENOENT) ? OASIS_ERROR_FILE_NOT_FOUND
+                                  : OASIS_ERROR_FILE_NOT_MEDIA;
+  }
+
+  probe->stream_index = decoder_find_stream(fmt_ctx, NULL);
+
+  if (probe->stream_index < 0) {
+    oasis_log(NULL, LOG_LEVEL_DEBUG, "No audio stream in %s", filename);
+    avformat_close_input(&fmt_ctx);
+    return OASIS_ERROR_FILE_NOT_MEDIA;
+  }
+
+  const AVStream *stream = fmt_ctx->streams[probe->stream_index];
+  const AVCodecParameters *codecpar = stream->codecpar;
+  probe->sample_rate = codecpar->sample_rate;
+  probe->channels = codecpar->ch_layout.nb_channels;
+  probe->sample_format = codecpar->format;
+  probe->codec_id = codecpar->codec_id;
+  probe->bit_rate =
+    codecpar->bit_rate > 0 ? codecpar->bit_rate : fmt_ctx->bit_rate;
+  probe_duration(fmt_ctx, stream, probe);
+
+  avformat_close_input(&fmt_ctx);
+  return OASIS_SUCCESS;
+}
@@ -0,0 +1,161 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <oasis/audio/realtime.h>
+#include <oasis/utils.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+// Debug builds count allocations made on real-time threads. ASan owns the
+// allocator and lets us hook it, without it we wrap the glibc one.
+#if defined(DEBUG) && defined(__SANITIZE_ADDRESS__)
+#  define REALTIME_ALLOCATOR_HOOKS 1
+#elif defined(DEBUG) && defined(__GLIBC__)
+#  define REALTIME_ALLOCATOR_WRAP 1
+#endif
+
+static __thread int realtime_depth;
+static uint64_t violations;
+static const char *first_violation;
+
+oasis_result_t realtime_promote_thread(int priority) {
+  int max = sched_get_priority_max(SCHED_FIFO);
+  int min = sched_get_priority_min(SCHED_FIFO);
+  struct sched_param param = {
+    .sched_priority = priority > max ? max : (priority < min ? min : priority),
+  };
+
+  int ret = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+  if (ret != 0) {
+    oasis_log(NULL, LOG_LEVEL_WARN,
+              "Could not move the audio thread to SCHED_FIFO: %s",
+              strerror(ret));
+    return OASIS_ERROR_UNSUPPORTED_OPERATION;
+  }
+
+  oasis_log(NULL, LOG_LEVEL_DEBUG, "Audio thread at SCHED_FIFO priority %d",
+            param.sched_priority);
+  return OASIS_SUCCESS;
+}
+
+oasis_result_t realtime_lock_memory(const void *address, size_t size) {
+  if (!address || size == 0)
+    return OASIS_ERROR_INVALID_ARGUMENT;
+
+  if (mlock(address, size) != 0) {
+    oasis_log(NULL, LOG_LEVEL_WARN, "Could not lock %zu bytes of audio buffers",
+              size);
+    return OASIS_ERROR;
+  }
+  return OASIS_SUCCESS;
+}
+
+void realtime_unlock_memory(const void *address, size_t size) {
+  if (address && size > 0)
+    munlock(address, size);
+}
+
+void realtime_enter(void) {
+  realtime_depth++;
+}
+
+void realtime_leave(void) {
+  if (realtime_depth > 0)
+    realtime_depth--;
+}
+
+int realtime_active(void) {
+  return realtime_depth > 0;
+}
+
+void realtime_violation(const char *call) {
+  const char *none = NULL;
+  __atomic_compare_exchange_n(&first_violation, &none, call, 0,
+                              __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&violations, 1, __ATOMIC_RELEASE);
+}
+
+uint64_t realtime_get_violations(const char **first) {
+  uint64_t count = __atomic_load_n(&violations, __ATOMIC_ACQUIRE);
+  if (first)
+    *first = __atomic_load_n(&first_violation, __ATOMIC_RELAXED);
+  return count;
+}
+
+void realtime_reset_violations(void) {
+  __atomic_store_n(&first_violation, NULL, __ATOMIC_RELAXED);
+  __atomic_store_n(&violations, 0, __ATOMIC_RELEASE);
+}
+
+#if REALTIME_ALLOCATOR_HOOKS
+
+// From sanitizer/allocator_interface.h, which not every toolchain ships
+int __sanitizer_install_malloc_and_free_hooks(
+  void (*malloc_hook)(const volatile void *ptr, size_t size),
+  void (*free_hook)(const volatile void *ptr));
+
+static void malloc_hook(const volatile void *ptr, size_t size) {
+  if (realtime_depth > 0)
+    realtime_violation("malloc");
+}
+
+static void free_hook(const volatile void *ptr) {
+  if (realtime_depth > 0)
+    realtime_violation("free");
+}
+
+__attribute__((constructor)) static void install_allocator_hooks(void) {
+  __sanitizer_install_malloc_and_free_hooks(malloc_hook, free_hook);
+}
+
+#elif REALTIME_ALLOCATOR_WRAP
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void __libc_free(void *ptr);
+
+void *malloc(size_t size) {
+  if (realtime_depth > 0)
+    realtime_violation("malloc");
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+  if (realtime_depth > 0)
+    realtime_violation("calloc");
+  return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+  if (realtime_depth > 0)
+    realtime_violation("realloc");
+  return __libc_realloc(ptr, size);
+}
+
+// What av_malloc allocates with
+int posix_memalign(void **ptr, size_t alignment, size_t size) {
+  if (realtime_depth > 0)
+    realtime_violation("posix_memalign");
+  if (alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)) != 0)
+    return EINVAL;
+
+  void *memory = __libc_memalign(alignment, size);
+  if (!memory)
+    return ENOMEM;
+  *ptr = memory;
+  return 0;
+}
+
+void free(void *ptr) {
+  if (realtime_depth > 0 && ptr)
+    realtime_violation("free");
+  __libc_free(ptr);
+}
+
+#endif
@@ -0,0 +1,253 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <oasis/audio/interleave.h>
+#include <oasis/audio/resample.h>
+#include <oasis/utils.h>
+
+#include <libavutil/channel_layout.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * An idle conversion context and what it was set up for.
+ */
+typedef struct {
+  SwrContext *swr;
+  int in_rate;
+  int channels;
+  enum AVSampleFormat in_format;
+  int out_rate;
+  enum AVSampleFormat out_format;
+  uint64_t released;
+} resampler_cache_entry_t;
+
+static resampler_cache_entry_t cache[RESAMPLER_CACHE_CAPACITY];
+static size_t cache_count;
+static uint64_t cache_clock;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int cache_entry_matches(const resampler_cache_entry_t *entry,
+                               const resampler_t *resampler) {
+  return entry->in_rate == resampler->in_rate &&
+         entry->channels == resampler->channels &&
+         entry->in_format == resampler->in_format &&
+         entry->out_rate == resampler->out_rate &&
+         entry->out_format == resampler->out_format;
+}
+
+// Takes the context set up for exactly this conversion out of the cache, or
+// failing that the most recently released one to set up again
+static SwrContext *cache_take(const resampler_t *resampler, int *matches) {
+  SwrContext *swr = NULL;
+
+  pthread_mutex_lock(&cache_lock);
+  size_t found = cache_count;
+  *matches = 0;
+  for (size_t i = 0; i < cache_count; i++) {
+    int same = cache_entry_matches(&cache[i], resampler);
+    if (same < *matches)
+      continue;
+    if (found == cache_count || same > *matches ||
+        cache[i].released > cache[found].released) {
+      found = i;
+      *matches = same;
+    }
+  }
+
+  if (found < cache_count) {
+    swr = cache[found].swr;
+    cache[found] = cache[--cache_count];
+  }
+  pthread_mutex_unlock(&cache_lock);
+  return swr;
+}
+
+static void cache_put(const resampler_t *resampler) {
+  SwrContext *evicted = NULL;
+
+  pthread_mutex_lock(&cache_lock);
+  if (cache_count == RESAMPLER_CACHE_CAPACITY) {
+    size_t oldest = 0;
+    for (size_t i = 1; i < cache_count; i++) {
+      if (cache[i].released < cache[oldest].released)
+        oldest = i;
+    }
+    evicted = cache[oldest].swr;
+    cache[oldest] = cache[--cache_count];
+  }
+
+  cache[cache_count++] = (resampler_cache_entry_t){
+    .swr = resampler->swr,
+    .in_rate = resampler->in_rate,
+    .channels = resampler->channels,
+    .in_format = resampler->in_format,
+    .out_rate = resampler->out_rate,
+    .out_format = resampler->out_format,
+    .released = ++cache_clock,
+  };
+  pthread_mutex_unlock(&cache_lock);
+
+  swr_free(&evicted);
+}
+
+static void release_context(resampler_t *resampler) {
+  if (resampler->swr) {
+    cache_put(resampler);
+    resampler->swr = NULL;
+  }
+}
+
+oasis_result_t resampler_configure(resampler_t *resampler, int in_rate,
+                                   int channels, enum AVSampleFormat in_format,
+                                   int out_rate,
+                                   enum AVSampleFormat out_format) {
+  if (!resampler || in_rate <= 0 || out_rate <= 0 || channels <= 0 ||
+      av_sample_fmt_is_planar(out_format) ||
+      av_get_bytes_per_sample(in_format) <= 0 ||
+      av_get_bytes_per_sample(out_format) <= 0) {
+    oasis_log(NULL, LOG_LEVEL_ERROR, "Invalid arguments to resampler setup");
+    return OASIS_ERROR_INVALID_ARGUMENT;
+  }
+
+  release_context(resampler);
+  sample_converter_free(&resampler->converter);
+  if (channels != resampler->channels) {
+    const uint8_t **planes = realloc(resampler->planes,
+                                     (size_t)channels * sizeof(*planes));
+    if (!planes) {
+      oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to allocate resampler planes");
+      return OASIS_ERROR_MEMORY_ALLOCATION;
+    }
+    resampler->planes = planes;
+  }
+
+  resampler->in_rate = in_rate;
+  resampler->channels = channels;
+  resampler->in_format = in_format;
+  resampler->out_rate = out_rate;
+  resampler->out_format = out_format;
+  resampler->passthrough =
+    in_rate == out_rate && av_get_packed_sample_fmt(in_format) == out_format;
+  if (resampler->passthrough)
+    return OASIS_SUCCESS;
+
+  // Only the sample format changes, the conversion kernels do that without a
+  // context or anything held back
+  if (in_rate == out_rate) {
+    oasis_log(NULL, LOG_LEVEL_DEBUG, "Converting %s to %s at %d Hz",
+              av_get_sample_fmt_name(in_format),
+              av_get_sample_fmt_name(out_format), in_rate);
+    return sample_converter_init(&resampler->converter, in_format, out_format,
+                                 channels, 0);
+  }
+
+  int matches;
+  SwrContext *swr = cache_take(resampler, &matches);
+  if (!matches) {
+    AVChannelLayout layout;
+    av_channel_layout_default(&layout, channels);
+    int ret = swr_alloc_set_opts2(&swr, &layout, out_format, out_rate,
+                                  &layout, in_format, in_rate, 0, NULL);
+    av_channel_layout_uninit(&layout);
+    if (ret < 0) {
+      char errbuf[AV_ERROR_MAX_STRING_SIZE];
+      av_strerror(ret, errbuf, sizeof(errbuf));
+      oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to set up resampler: %s",
+                errbuf);
+      swr_free(&swr);
+      return OASIS_ERROR_FFMPEG_MEMORY_ALLOCATION;
+    }
+  }
+
+  // A context from the cache keeps its filters when the rates are the same,
+  // this only clears what it still held from the last source
+  int ret = swr_init(swr);
+  if (ret < 0) {
+    char errbuf[AV_ERROR_MAX_STRING_SIZE];
+    av_strerror(ret, errbuf, sizeof(errbuf));
+    oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to initialize resampler: %s",
+              errbuf);
+    swr_free(&swr);
+    return OASIS_ERROR_UNSUPPORTED_FORMAT;
+  }
+
+  resampler->swr = swr;
+  oasis_log(NULL, LOG_LEVEL_DEBUG, "Converting %d Hz %s to %d Hz %s%s",
+            in_rate, av_get_sample_fmt_name(in_format), out_rate,
+            av_get_sample_fmt_name(out_format),
+            matches ? " with a cached context" : "");
+  return OASIS_SUCCESS;
+}
+
+int resampler_convert(resampler_t *resampler, uint8_t *dst, int dst_frames,
+                      uint8_t *const *src, int offset, int src_frames) {
+  int bytes_per_sample = av_get_bytes_per_sample(resampler->in_format);
+  int planar = av_sample_fmt_is_planar(resampler->in_format);
+
+  if (resampler->passthrough) {
+    if (!src)
+      return 0;
+    int frames = src_frames < dst_frames ? src_frames : dst_frames;
+    if (planar) {
+      if (interleave_samples(dst, src, offset, frames, resampler->channels,
+                             bytes_per_sample) != OASIS_SUCCESS)
+        return AVERROR(EINVAL);
+    } else {
+      size_t stride = (size_t)bytes_per_sample * resampler->channels;
+      memcpy(dst, src[0] + (size_t)offset * stride, (size_t)frames * stride);
+    }
+    return frames;
+  }
+
+  if (resampler->converter.kernel) {
+    if (!src)
+      return 0;
+    int frames = src_frames < dst_frames ? src_frames : dst_frames;
+    sample_converter_run(&resampler->converter, &dst, src, offset, frames);
+    return frames;
+  }
+
+  // A source pointer with no frames hands out what is buffered without
+  // flushing, a NULL one would flush
+  int planes = planar ? resampler->channels : 1;
+  size_t step = planar ? (size_t)bytes_per_sample
+                       : (size_t)bytes_per_sample * resampler->channels;
+  for (int i = 0; i < planes; i++)
+    resampler->planes[i] = src ? src[i] + (size_t)offset * step : dst;
+
+  return swr_convert(resampler->swr, &dst, dst_frames, resampler->planes,
+                     src ? src_frames : 0);
+}
+
+int resampler_flush(resampler_t *resampler, uint8_t *dst, int dst_frames) {
+  if (!resampler->swr)
+    return 0;
+
+  int ret = swr_convert(resampler->swr, &dst, dst_frames, NULL, 0);
+  return ret > 0 ? ret : 0;
+}
+
+void resampler_reset(resampler_t *resampler) {
+  if (!resampler->swr)
+    return;
+
+  int ret = swr_init(resampler->swr);
+  if (ret < 0) {
+    char errbuf[AV_ERROR_MAX_STRING_SIZE];
+    av_strerror(ret, errbuf, sizeof(errbuf));
+    oasis_log(NULL, LOG_LEVEL_WARN, "Failed to reset resampler: %s", errbuf);
+  }
+}
+
+void resampler_free(resampler_t *resampler) {
+  if (!resampler)
+    return;
+
+  release_context(resampler);
+  sample_converter_free(&resampler->converter);
+  free(resampler->planes);
+  memset(resampler, 0, sizeof(*resampler));
+}
@@ -0,0 +1,198 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <oasis/audio/ring_buffer.h>
+#include <oasis/utils.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+oasis_result_t ring_buffer_init(ring_buffer_t *rb, size_t capacity,
+                                size_t low_watermark, size_t high_watermark) {
+  if (!rb || capacity == 0 || low_watermark > high_watermark ||
+      high_watermark > capacity) {
+    oasis_log(NULL, LOG_LEVEL_ERROR, "Invalid ring buffer configuration");
+    return OASIS_ERROR_INVALID_ARGUMENT;
+  }
+
+  memset(rb, 0, sizeof(*rb));
+  rb->data = malloc(capacity);
+  if (!rb->data) {
+    oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to allocate ring buffer");
+    return OASIS_ERROR_MEMORY_ALLOCATION;
+  }
+
+  if (sem_init(&rb->space_available, 0, 0) != 0) {
+    oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to create ring buffer semaphore");
+    free(rb->data);
+    rb->data = NULL;
+    return OASIS_ERROR;
+  }
+
+  rb->capacity = capacity;
+  rb->low_watermark = low_watermark;
+  rb->high_watermark = high_watermark;
+  return OASIS_SUCCESS;
+}
+
+void ring_buffer_free(ring_buffer_t *rb) {
+  if (!rb || !rb->data)
+    return;
+
+  sem_destroy(&rb->space_available);
+  free(rb->data);
+  rb->data = NULL;
+}
+
+void ring_buffer_reset(ring_buffer_t *rb) {
+  __atomic_store_n(&rb->head, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&rb->tail, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&rb->eof, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&rb->producer_waiting, 0, __ATOMIC_RELAXED);
+
+  // Drop any wakeup nobody waited for
+  while (sem_trywait(&rb->space_available) == 0)
+    ;
+
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+size_t ring_buffer_fill(ring_buffer_t *rb) {
+  uint64_t head = __atomic_load_n(&rb->head, __ATOMIC_ACQUIRE);
+  uint64_t tail = __atomic_load_n(&rb->tail, __ATOMIC_ACQUIRE);
+  return (size_t)(head - tail);
+}
+
+size_t ring_buffer_space(ring_buffer_t *rb) {
+  return rb->capacity - ring_buffer_fill(rb);
+}
+
+size_t ring_buffer_begin_write(ring_buffer_t *rb, uint8_t **region) {
+  uint64_t head = __atomic_load_n(&rb->head, __ATOMIC_RELAXED);
+  uint64_t tail = __atomic_load_n(&rb->tail, __ATOMIC_ACQUIRE);
+  size_t offset = (size_t)(head % rb->capacity);
+  size_t space = rb->capacity - (size_t)(head - tail);
+  size_t contiguous = rb->capacity - offset;
+
+  *region = rb->data + offset;
+  return space < contiguous ? space : contiguous;
+}
+
+void ring_buffer_end_write(ring_buffer_t *rb, size_t bytes) {
+  __atomic_fetch_add(&rb->head, bytes, __ATOMIC_RELEASE);
+}
+
+size_t ring_buffer_begin_read(ring_buffer_t *rb, uint8_t **region) {
+  uint64_t tail = __atomic_load_n(&rb->tail, __ATOMIC_RELAXED);
+  uint64_t head = __atomic_load_n(&rb->head, __ATOMIC_ACQUIRE);
+  size_t offset = (size_t)(tail % rb->capacity);
+  size_t fill = (size_t)(head - tail);
+  size_t contiguous = rb->capacity - offset;
+
+  *region = rb->data + offset;
+  return fill < contiguous ? fill : contiguous;
+}
+
+void ring_buffer_end_read(ring_buffer_t *rb, size_t bytes) {
+  __atomic_fetch_add(&rb->tail, bytes, __ATOMIC_RELEASE);
+
+  if (__atomic_load_n(&rb->producer_waiting, __ATOMIC_SEQ_CST) &&
+      ring_buffer_fill(rb) <= rb->low_watermark &&
+      __atomic_exchange_n(&rb->producer_waiting, 0, __ATOMIC_SEQ_CST)) {
+    sem_post(&rb->space_available);
+  }
+}
+
+size_t ring_buffer_write(ring_buffer_t *rb, const uint8_t *src, size_t bytes) {
+  size_t written = 0;
+
+  while (written < bytes) {
+    uint8_t *region;
+    size_t available = ring_buffer_begin_write(rb, &region);
+    if (available == 0)
+      break;
+
+    size_t count =
+      (bytes - written < available) ? bytes - written : available;
+    memcpy(region, src + written, count);
+    ring_buffer_end_write(rb, count);
+    written += count;
+  }
+
+  return written;
+}
+
+size_t ring_buffer_read(ring_buffer_t *rb, uint8_t *dst, size_t bytes) {
+  size_t read = 0;
+
+  while (read < bytes) {
+    uint8_t *region;
+    size_t available = ring_buffer_begin_read(rb, &region);
+    if (available == 0)
+      break;
+
+    size_t count = (bytes - read < available) ? bytes - read : available;
+    memcpy(dst + read, region, count);
+    ring_buffer_end_read(rb, count);
+    read += count;
+  }
+
+  rb->reads++;
+  if (read < bytes && !__atomic_load_n(&rb->eof, __ATOMIC_ACQUIRE))
+    rb->underruns++;
+
+  return read;
+}
+
+void ring_buffer_set_poll_ms(ring_buffer_t *rb, int poll_ms) {
+  rb->poll_ms = poll_ms > 0 ? poll_ms : 0;
+}
+
+// Never raises producer_waiting, so the consumer never posts
+static void wait_polling(ring_buffer_t *rb) {
+  while (ring_buffer_fill(rb) > rb->low_watermark) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += (long)rb->poll_ms * 1000000L;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+    deadline.tv_nsec %= 1000000000L;
+
+    if (sem_timedwait(&rb->space_available, &deadline) == 0)
+      return; // Woken up
+  }
+}
+
+void ring_buffer_wait_for_space(ring_buffer_t *rb) {
+  if (rb->poll_ms > 0) {
+    wait_polling(rb);
+    return;
+  }
+
+  __atomic_store_n(&rb->producer_waiting, 1, __ATOMIC_SEQ_CST);
+
+  if (ring_buffer_fill(rb) <= rb->low_watermark &&
+      __atomic_exchange_n(&rb->producer_waiting, 0, __ATOMIC_SEQ_CST)) {
+    return; // Drained while we were getting ready to sleep
+  }
+
+  // Either still full, or the consumer already cleared the flag and posted
+  while (sem_wait(&rb->space_available) != 0 && errno == EINTR)
+    ;
+}
+
+void ring_buffer_wake_producer(ring_buffer_t *rb) {
+  // Post unconditionally, a producer that is just about to wait must not miss
+  // this, at worst it wakes up once for nothing
+  __atomic_store_n(&rb->producer_waiting, 0, __ATOMIC_SEQ_CST);
+  sem_post(&rb->space_available);
+}
+
+void ring_buffer_set_eof(ring_buffer_t *rb) {
+  __atomic_store_n(&rb->eof, 1, __ATOMIC_RELEASE);
+}
+
+int ring_buffer_drained(ring_buffer_t *rb) {
+  return __atomic_load_n(&rb->eof, __ATOMIC_ACQUIRE) &&
+         ring_buffer_fill(rb) == 0;
+}
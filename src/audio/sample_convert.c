@@ -0,0 +1,821 @@
+#include <oasis/audio/interleave.h>
+#include <oasis/audio/sample_convert.h>
+#include <oasis/utils.h>
+
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#  define SAMPLE_CONVERT_X86 1
+#  include <immintrin.h>
+#else
+#  define SAMPLE_CONVERT_X86 0
+#endif
+
+enum {
+  FORMAT_U8,
+  FORMAT_S16,
+  FORMAT_S32,
+  FORMAT_S64,
+  FORMAT_FLT,
+  FORMAT_DBL,
+  FORMAT_COUNT
+};
+
+static sample_convert_fn kernels[FORMAT_COUNT][FORMAT_COUNT];
+static sample_convert_fn dither_kernels[FORMAT_COUNT][FORMAT_COUNT];
+static const char *isa_name = "scalar";
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+
+static int format_index(enum AVSampleFormat sample_format) {
+  switch (av_get_packed_sample_fmt(sample_format)) {
+  case AV_SAMPLE_FMT_U8:
+    return FORMAT_U8;
+  case AV_SAMPLE_FMT_S16:
+    return FORMAT_S16;
+  case AV_SAMPLE_FMT_S32:
+    return FORMAT_S32;
+  case AV_SAMPLE_FMT_S64:
+    return FORMAT_S64;
+  case AV_SAMPLE_FMT_FLT:
+    return FORMAT_FLT;
+  case AV_SAMPLE_FMT_DBL:
+    return FORMAT_DBL;
+  default:
+    return -1;
+  }
+}
+
+// Bits of precision of every format, floats count as more than any integer
+static const int format_bits[FORMAT_COUNT] = {8, 16, 32, 64, 128, 128};
+
+// Floats are rounded to the nearest integer and clamped, so +1.0 saturates
+// instead of wrapping. A NaN comes out as silence.
+
+static uint8_t double_to_u8(double x) {
+  double y = x * 128.0;
+  y = y < -128.0 ? -128.0 : (y > 127.0 ? 127.0 : y);
+  return (uint8_t)(lrint(y) + 128);
+}
+
+static int16_t float_to_s16(float x) {
+  float y = isnan(x) ? 0.0f : x * 32768.0f;
+  y = y < -32768.0f ? -32768.0f : (y > 32767.0f ? 32767.0f : y);
+  return (int16_t)lrintf(y);
+}
+
+static int16_t double_to_s16(double x) {
+  double y = x * 32768.0;
+  y = y < -32768.0 ? -32768.0 : (y > 32767.0 ? 32767.0 : y);
+  return (int16_t)lrint(y);
+}
+
+static int32_t double_to_s32(double x) {
+  double y = x * 2147483648.0;
+  y = y < -2147483648.0 ? -2147483648.0 : (y > 2147483647.0 ? 2147483647.0 : y);
+  return (int32_t)lrint(y);
+}
+
+static int64_t double_to_s64(double x) {
+  double y = x * 9223372036854775808.0;
+  // 2^63 - 1 rounds up to 2^63 as a double, which does not fit
+  if (y >= 9223372036854775808.0)
+    return INT64_MAX;
+  if (y <= -9223372036854775808.0)
+    return INT64_MIN;
+  return (int64_t)llrint(y);
+}
+
+#define DEFINE_COPY_KERNEL(name, type)                                         \
+  static void name(uint8_t *dst, const uint8_t *src, size_t count,             \
+                   sample_dither_t *dither) {                                  \
+    memcpy(dst, src, count * sizeof(type));                                    \
+  }
+
+#define DEFINE_KERNEL(name, src_type, dst_type, expression)                    \
+  static void name(uint8_t *dst, const uint8_t *src, size_t count,             \
+                   sample_dither_t *dither) {                                  \
+    const src_type *in = (const src_type *)src;                                \
+    dst_type *out = (dst_type *)dst;                                           \
+    for (size_t i = 0; i < count; i++) {                                       \
+      src_type x = in[i];                                                      \
+      out[i] = (dst_type)(expression);                                         \
+    }                                                                          \
+  }
+
+DEFINE_COPY_KERNEL(copy_8, uint8_t)
+DEFINE_COPY_KERNEL(copy_16, int16_t)
+DEFINE_COPY_KERNEL(copy_32, int32_t)
+DEFINE_COPY_KERNEL(copy_64, int64_t)
+
+DEFINE_KERNEL(u8_to_s16, uint8_t, int16_t, (x - 128) * 256)
+DEFINE_KERNEL(u8_to_s32, uint8_t, int32_t, (x - 128) * 16777216)
+DEFINE_KERNEL(u8_to_s64, uint8_t, int64_t,
+              (int64_t)(x - 128) * (INT64_C(1) << 56))
+DEFINE_KERNEL(u8_to_flt, uint8_t, float, (x - 128) * (1.0f / 128.0f))
+DEFINE_KERNEL(u8_to_dbl, uint8_t, double, (x - 128) * (1.0 / 128.0))
+
+DEFINE_KERNEL(s16_to_u8, int16_t, uint8_t, (x >> 8) + 128)
+DEFINE_KERNEL(s16_to_s32, int16_t, int32_t, (int32_t)x * 65536)
+DEFINE_KERNEL(s16_to_s64, int16_t, int64_t, (int64_t)x * (INT64_C(1) << 48))
+DEFINE_KERNEL(s16_to_flt, int16_t, float, x * (1.0f / 32768.0f))
+DEFINE_KERNEL(s16_to_dbl, int16_t, double, x * (1.0 / 32768.0))
+
+DEFINE_KERNEL(s32_to_u8, int32_t, uint8_t, (x >> 24) + 128)
+DEFINE_KERNEL(s32_to_s16, int32_t, int16_t, x >> 16)
+DEFINE_KERNEL(s32_to_s64, int32_t, int64_t, (int64_t)x * (INT64_C(1) << 32))
+DEFINE_KERNEL(s32_to_flt, int32_t, float, (float)x * (1.0f / 2147483648.0f))
+DEFINE_KERNEL(s32_to_dbl, int32_t, double, x * (1.0 / 2147483648.0))
+
+DEFINE_KERNEL(s64_to_u8, int64_t, uint8_t, (x >> 56) + 128)
+DEFINE_KERNEL(s64_to_s16, int64_t, int16_t, x >> 48)
+DEFINE_KERNEL(s64_to_s32, int64_t, int32_t, x >> 32)
+DEFINE_KERNEL(s64_to_flt, int64_t, float,
+              (float)x * (1.0f / 9223372036854775808.0f))
+DEFINE_KERNEL(s64_to_dbl, int64_t, double,
+              (double)x * (1.0 / 9223372036854775808.0))
+
+DEFINE_KERNEL(flt_to_u8, float, uint8_t, double_to_u8(x))
+DEFINE_KERNEL(flt_to_s16, float, int16_t, float_to_s16(x))
+DEFINE_KERNEL(flt_to_s32, float, int32_t, double_to_s32(x))
+DEFINE_KERNEL(flt_to_s64, float, int64_t, double_to_s64(x))
+DEFINE_KERNEL(flt_to_dbl, float, double, x)
+
+DEFINE_KERNEL(dbl_to_u8, double, uint8_t, double_to_u8(x))
+DEFINE_KERNEL(dbl_to_s16, double, int16_t, double_to_s16(x))
+DEFINE_KERNEL(dbl_to_s32, double, int32_t, double_to_s32(x))
+DEFINE_KERNEL(dbl_to_s64, double, int64_t, double_to_s64(x))
+DEFINE_KERNEL(dbl_to_flt, double, float, x)
+
+// TPDF dither is the difference of two uniform draws, the two halves of one
+// xorshift step, one LSB of the target depth at most either way. It is added
+// at the target depth, the result is rounded and clamped there and then
+// shifted up to the width of the format.
+
+static uint32_t xorshift(uint32_t *state) {
+  uint32_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return *state = x;
+}
+
+static double tpdf(sample_dither_t *dither) {
+  uint32_t x = xorshift(&dither->state[0]);
+  return ((double)(x >> 16) - (double)(x & 0xffff)) * (1.0 / 65536.0);
+}
+
+#define READ_U8(x) (((int)(x) - 128) * (1.0 / 128.0))
+#define READ_S16(x) ((x) * (1.0 / 32768.0))
+#define READ_S32(x) ((x) * (1.0 / 2147483648.0))
+#define READ_S64(x) ((double)(x) * (1.0 / 9223372036854775808.0))
+#define READ_FLT(x) ((double)(x))
+#define READ_DBL(x) (x)
+
+#define DEFINE_DITHER_KERNEL(name, src_type, read, dst_type, dst_bits, bias)  \
+  static void name(uint8_t *dst, const uint8_t *src, size_t count,             \
+                   sample_dither_t *dither) {                                  \
+    const src_type *in = (const src_type *)src;                                \
+    dst_type *out = (dst_type *)dst;                                           \
+    double scale = ldexp(1.0, dither->bits - 1);                               \
+    int64_t unit = INT64_C(1) << ((dst_bits) - dither->bits);                  \
+    for (size_t i = 0; i < count; i++) {                                       \
+      double y = rint(read(in[i]) * scale + tpdf(dither));                     \
+      y = y < -scale ? -scale : (y > scale - 1.0 ? scale - 1.0 : y);           \
+      out[i] = (dst_type)((int64_t)y * unit + (bias));                         \
+    }                                                                          \
+  }
+
+#define DEFINE_DITHER_KERNELS(src_name, src_type, read)                        \
+  DEFINE_DITHER_KERNEL(src_name##_to_u8_dither, src_type, read, uint8_t, 8,    \
+                       128)                                                    \
+  DEFINE_DITHER_KERNEL(src_name##_to_s16_dither, src_type, read, int16_t, 16,  \
+                       0)                                                      \
+  DEFINE_DITHER_KERNEL(src_name##_to_s32_dither, src_type, read, int32_t, 32,  \
+                       0)                                                      \
+  DEFINE_DITHER_KERNEL(src_name##_to_s64_dither, src_type, read, int64_t, 64,  \
+                       0)
+
+DEFINE_DITHER_KERNELS(u8, uint8_t, READ_U8)
+DEFINE_DITHER_KERNELS(s16, int16_t, READ_S16)
+DEFINE_DITHER_KERNELS(s32, int32_t, READ_S32)
+DEFINE_DITHER_KERNELS(s64, int64_t, READ_S64)
+DEFINE_DITHER_KERNELS(flt, float, READ_FLT)
+DEFINE_DITHER_KERNELS(dbl, double, READ_DBL)
+
+#if SAMPLE_CONVERT_X86
+
+// Integers are widened and narrowed with unpacks, shifts and saturating packs,
+// floats are clamped before they are converted so +1.0 saturates. The tails
+// go through the scalar kernels.
+
+__attribute__((target("sse2"))) static void
+s16_to_flt_sse2(uint8_t *dst, const uint8_t *src, size_t count,
+                sample_dither_t *dither) {
+  const int16_t *in = (const int16_t *)src;
+  float *out = (float *)dst;
+  const __m128 scale = _mm_set1_ps(1.0f / 32768.0f);
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(in + i));
+    // Widen by putting each sample in the top half and shifting it back down
+    __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+    __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16);
+    _mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(lo), scale));
+    _mm_storeu_ps(out + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), scale));
+  }
+  s16_to_flt((uint8_t *)(out + i), (const uint8_t *)(in + i), count - i,
+             dither);
+}
+
+__attribute__((target("sse2"))) static void
+s32_to_flt_sse2(uint8_t *dst, const uint8_t *src, size_t count,
+                sample_dither_t *dither) {
+  const int32_t *in = (const int32_t *)src;
+  float *out = (float *)dst;
+  const __m128 scale = _mm_set1_ps(1.0f / 2147483648.0f);
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(in + i));
+    _mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(x), scale));
+  }
+  s32_to_flt((uint8_t *)(out + i), (const uint8_t *)(in + i), count - i,
+             dither);
+}
+
+__attribute__((target("sse2"))) static void
+flt_to_s16_sse2(uint8_t *dst, const uint8_t *src, size_t count,
+                sample_dither_t *dither) {
+  const float *in = (const float *)src;
+  int16_t *out = (int16_t *)dst;
+  const __m128 scale = _mm_set1_ps(32768.0f);
+  const __m128 low = _mm_set1_ps(-32768.0f);
+  const __m128 high = _mm_set1_ps(32767.0f);
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    // Clamped before the conversion, which would turn NaN and anything past
+    // int32 into INT_MIN. NaN is masked to 0 first, like the scalar kernel.
+    __m128 x = _mm_loadu_ps(in + i);
+    __m128 y = _mm_loadu_ps(in + i + 4);
+    x = _mm_mul_ps(_mm_and_ps(x, _mm_cmpord_ps(x, x)), scale);
+    y = _mm_mul_ps(_mm_and_ps(y, _mm_cmpord_ps(y, y)), scale);
+    x = _mm_min_ps(_mm_max_ps(x, low), high);
+    y = _mm_min_ps(_mm_max_ps(y, low), high);
+    _mm_storeu_si128((__m128i *)(out + i),
+                     _mm_packs_epi32(_mm_cvtps_epi32(x), _mm_cvtps_epi32(y)));
+  }
+  flt_to_s16((uint8_t *)(out + i), (const uint8_t *)(in + i), count - i,
+             dither);
+}
+
+__attribute__((target("sse2"))) static void
+flt_to_s32_sse2(uint8_t *dst, const uint8_t *src, size_t count,
+                sample_dither_t *dither) {
+  const float *in = (const float *)src;
+  int32_t *out = (int32_t *)dst;
+  const __m128 scale = _mm_set1_ps(2147483648.0f);
+  // 2^31 itself does not fit, the largest float below it does
+  const __m128 low = _mm_set1_ps(-2147483648.0f);
+  const __m128 high = _mm_set1_ps(2147483520.0f);
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128 x = _mm_mul_ps(_mm_loadu_ps(in + i), scale);
+    x = _mm_min_ps(_mm_max_ps(x, low), high);
+    _mm_storeu_si128((__m128i *)(out + i), _mm_cvtps_epi32(x));
+  }
+  flt_to_s32((uint8_t *)(out + i), (const uint8_t *)(in + i), count - i,
+             dither);
+}
+
+__attribute__((target("sse2"))) static void
+flt_to_dbl_sse2(uint8_t *dst, const uint8_t *src, size_t count,
+                sample_dither_t *dither) {
+  const float *in = (const float *)src;
+  double *out = (double *)dst;
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128 x = _mm_loadu_ps(in + i);
+    _mm_storeu_pd(out + i, _mm_cvtps_pd(x));
+    _mm_storeu_pd(out + i + 2, _mm_cvtps_pd(_mm_movehl_ps(x, x)));
+  }
+  flt_to_dbl((uint8_t *)(out + i), (const uint8_t *)(in + i), count - i,
+             dither);
+}
+
+__attribute__((target("sse2"))) static void
+dbl_to_flt_sse2(uint8_t *dst, const uint8_t *src, size_t count,
+                sample_dither_t *dither) {
+  const double *in = (const double *)src;
+  float *out = (float *)dst;
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128 lo = _mm_cvtpd_ps(_mm_loadu_pd(in + i));
+    __m128 hi = _mm_cvtpd_ps(_mm_loadu_pd(in + i + 2));
+    _mm_storeu_ps(out + i, _mm_movelh_ps(lo, hi));
+  }
+  dbl_to_flt((uint8_t *)(out + i), (const uint8_t *)(in + i), count - i,
+             dither);
+}
+
+__attribute__((target("sse2"))) static void
+s16_to_s32_sse2(uint8_t *dst, const uint8_t *src, size_t count,
+                sample_dither_t *dither) {
+  const int16_t *in = (const int16_t *)src;
+  int32_t *out = (int32_t *)dst;
+  const __m128i zero = _mm_setzero_si128();
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(in + i));
+    _mm_storeu_si128((__m128i *)(out + i), _mm_unpacklo_epi16(zero, x));
+    _mm_storeu_si128((__m128i *)(out + i + 4), _mm_unpackhi_epi16(zero, x));
+  }
+  s16_to_s32((uint8_t *)(out + i), (const uint8_t *)(in + i), count - i,
+             dither);
+}
+
+__attribute__((target("sse2"))) static void
+s32_to_s16_sse2(uint8_t *dst, const uint8_t *src, size_t count,
+                sample_dither_t *dither) {
+  const int32_t *in = (const int32_t *)src;
+  int16_t *out = (int16_t *)dst;
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m128i a = _mm_srai_epi32(_mm_loadu_si128((const __m128i *)(in + i)), 16);
+    __m128i b =
+      _mm_srai_epi32(_mm_loadu_si128((const __m128i *)(in + i + 4)), 16);
+    _mm_storeu_si128((__m128i *)(out + i), _mm_packs_epi32(a, b));
+  }
+  s32_to_s16((uint8_t *)(out + i), (const uint8_t *)(in + i), count - i,
+             dither);
+}
+
+// Four lanes of xorshift, shifts and xors are all SSE2 has to offer and all
+// it takes
+__attribute__((target("sse2"))) static __m128i xorshift_sse2(__m128i x) {
+  x = _mm_xor_si128(x, _mm_slli_epi32(x, 13));
+  x = _mm_xor_si128(x, _mm_srli_epi32(x, 17));
+  return _mm_xor_si128(x, _mm_slli_epi32(x, 5));
+}
+
+__attribute__((target("sse2"))) static __m128 tpdf_sse2(__m128i *state) {
+  const __m128 unit = _mm_set1_ps(1.0f / 65536.0f);
+  const __m128i half = _mm_set1_epi32(0xffff);
+  __m128i x = *state = xorshift_sse2(*state);
+  __m128 a = _mm_cvtepi32_ps(_mm_srli_epi32(x, 16));
+  __m128 b = _mm_cvtepi32_ps(_mm_and_si128(x, half));
+  return _mm_mul_ps(_mm_sub_ps(a, b), unit);
+}
+
+// Quantizes at the dither depth in float, exact up to 24 bits, and scales the
+// result up to the width of the format
+__attribute__((target("sse2"))) static __m128i
+dither_sse2(__m128 x, __m128i *state, __m128 scale, __m128 low, __m128 high,
+            __m128 unit) {
+  __m128 y = _mm_add_ps(_mm_mul_ps(x, scale), tpdf_sse2(state));
+  y = _mm_cvtepi32_ps(_mm_cvtps_epi32(y));
+  y = _mm_min_ps(_mm_max_ps(y, low), high);
+  return _mm_cvtps_epi32(_mm_mul_ps(y, unit));
+}
+
+__attribute__((target("sse2"))) static void
+flt_to_s16_dither_sse2(uint8_t *dst, const uint8_t *src, size_t count,
+                       sample_dither_t *dither) {
+  const float *in = (const float *)src;
+  int16_t *out = (int16_t *)dst;
+  float depth = ldexpf(1.0f, dither->bits - 1);
+  const __m128 scale = _mm_set1_ps(depth);
+  const __m128 low = _mm_set1_ps(-depth), high = _mm_set1_ps(depth - 1.0f);
+  const __m128 unit = _mm_set1_ps(ldexpf(1.0f, 16 - dither->bits));
+  __m128i state = _mm_loadu_si128((const __m128i *)dither->state);
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m128i a =
+      dither_sse2(_mm_loadu_ps(in + i), &state, scale, low, high, unit);
+    __m128i b =
+      dither_sse2(_mm_loadu_ps(in + i + 4), &state, scale, low, high, unit);
+    _mm_storeu_si128((__m128i *)(out + i), _mm_packs_epi32(a, b));
+  }
+  _mm_storeu_si128((__m128i *)dither->state, state);
+  flt_to_s16_dither((uint8_t *)(out + i), (const uint8_t *)(in + i),
+                    count - i, dither);
+}
+
+__attribute__((target("sse2"))) static void
+flt_to_s32_dither_sse2(uint8_t *dst, const uint8_t *src, size_t count,
+                       sample_dither_t *dither) {
+  if (dither->bits > 24) {
+    flt_to_s32_dither(dst, src, count, dither);
+    return;
+  }
+
+  const float *in = (const float *)src;
+  int32_t *out = (int32_t *)dst;
+  float depth = ldexpf(1.0f, dither->bits - 1);
+  const __m128 scale = _mm_set1_ps(depth);
+  const __m128 low = _mm_set1_ps(-depth), high = _mm_set1_ps(depth - 1.0f);
+  const __m128 unit = _mm_set1_ps(ldexpf(1.0f, 32 - dither->bits));
+  __m128i state = _mm_loadu_si128((const __m128i *)dither->state);
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    _mm_storeu_si128(
+      (__m128i *)(out + i),
+      dither_sse2(_mm_loadu_ps(in + i), &state, scale, low, high, unit));
+  }
+  _mm_storeu_si128((__m128i *)dither->state, state);
+  flt_to_s32_dither((uint8_t *)(out + i), (const uint8_t *)(in + i),
+                    count - i, dither);
+}
+
+__attribute__((target("avx2"))) static void
+s16_to_flt_avx2(uint8_t *dst, const uint8_t *src, size_t count,
+                sample_dither_t *dither) {
+  const int16_t *in = (const int16_t *)src;
+  float *out = (float *)dst;
+  const __m256 scale = _mm256_set1_ps(1.0f / 32768.0f);
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256i x =
+      _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)(in + i)));
+    _mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_cvtepi32_ps(x), scale));
+  }
+  s16_to_flt((uint8_t *)(out + i), (const uint8_t *)(in + i), count - i,
+             dither);
+}
+
+__attribute__((target("avx2"))) static void
+s32_to_flt_avx2(uint8_t *dst, const uint8_t *src, size_t count,
+                sample_dither_t *dither) {
+  const int32_t *in = (const int32_t *)src;
+  float *out = (float *)dst;
+  const __m256 scale = _mm256_set1_ps(1.0f / 2147483648.0f);
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)(in + i));
+    _mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_cvtepi32_ps(x), scale));
+  }
+  s32_to_flt((uint8_t *)(out + i), (const uint8_t *)(in + i), count - i,
+             dither);
+}
+
+__attribute__((target("avx2"))) static void
+flt_to_s16_avx2(uint8_t *dst, const uint8_t *src, size_t count,
+                sample_dither_t *dither) {
+  const float *in = (const float *)src;
+  int16_t *out = (int16_t *)dst;
+  const __m256 scale = _mm256_set1_ps(32768.0f);
+  const __m256 low = _mm256_set1_ps(-32768.0f);
+  const __m256 high = _mm256_set1_ps(32767.0f);
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    __m256 x = _mm256_loadu_ps(in + i);
+    __m256 y = _mm256_loadu_ps(in + i + 8);
+    x = _mm256_and_ps(x, _mm256_cmp_ps(x, x, _CMP_ORD_Q));
+    y = _mm256_and_ps(y, _mm256_cmp_ps(y, y, _CMP_ORD_Q));
+    x = _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(x, scale), low), high);
+    y = _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(y, scale), low), high);
+    __m256i a = _mm256_cvtps_epi32(x);
+    __m256i b = _mm256_cvtps_epi32(y);
+    // The pack works within 128 bit lanes, the permute puts them back in order
+    __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), 0xd8);
+    _mm256_storeu_si256((__m256i *)(out + i), packed);
+  }
+  flt_to_s16((uint8_t *)(out + i), (const uint8_t *)(in + i), count - i,
+             dither);
+}
+
+__attribute__((target("avx2"))) static void
+flt_to_s32_avx2(uint8_t *dst, const uint8_t *src, size_t count,
+                sample_dither_t *dither) {
+  const float *in = (const float *)src;
+  int32_t *out = (int32_t *)dst;
+  const __m256 scale = _mm256_set1_ps(2147483648.0f);
+  const __m256 low = _mm256_set1_ps(-2147483648.0f);
+  const __m256 high = _mm256_set1_ps(2147483520.0f);
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256 x = _mm256_mul_ps(_mm256_loadu_ps(in + i), scale);
+    x = _mm256_min_ps(_mm256_max_ps(x, low), high);
+    _mm256_storeu_si256((__m256i *)(out + i), _mm256_cvtps_epi32(x));
+  }
+  flt_to_s32((uint8_t *)(out + i), (const uint8_t *)(in + i), count - i,
+             dither);
+}
+
+__attribute__((target("avx2"))) static void
+flt_to_dbl_avx2(uint8_t *dst, const uint8_t *src, size_t count,
+                sample_dither_t *dither) {
+  const float *in = (const float *)src;
+  double *out = (double *)dst;
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4)
+    _mm256_storeu_pd(out + i, _mm256_cvtps_pd(_mm_loadu_ps(in + i)));
+  flt_to_dbl((uint8_t *)(out + i), (const uint8_t *)(in + i), count - i,
+             dither);
+}
+
+__attribute__((target("avx2"))) static void
+dbl_to_flt_avx2(uint8_t *dst, const uint8_t *src, size_t count,
+                sample_dither_t *dither) {
+  const double *in = (const double *)src;
+  float *out = (float *)dst;
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4)
+    _mm_storeu_ps(out + i, _mm256_cvtpd_ps(_mm256_loadu_pd(in + i)));
+  dbl_to_flt((uint8_t *)(out + i), (const uint8_t *)(in + i), count - i,
+             dither);
+}
+
+__attribute__((target("avx2"))) static __m256i xorshift_avx2(__m256i x) {
+  x = _mm256_xor_si256(x, _mm256_slli_epi32(x, 13));
+  x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 17));
+  return _mm256_xor_si256(x, _mm256_slli_epi32(x, 5));
+}
+
+__attribute__((target("avx2"))) static __m256i
+dither_avx2(__m256 x, __m256i *state, __m256 scale, __m256 low, __m256 high,
+            __m256 unit) {
+  const __m256 lsb = _mm256_set1_ps(1.0f / 65536.0f);
+  const __m256i half = _mm256_set1_epi32(0xffff);
+  __m256i r = *state = xorshift_avx2(*state);
+  __m256 noise = _mm256_mul_ps(
+    _mm256_sub_ps(_mm256_cvtepi32_ps(_mm256_srli_epi32(r, 16)),
+                  _mm256_cvtepi32_ps(_mm256_and_si256(r, half))),
+    lsb);
+
+  __m256 y = _mm256_add_ps(_mm256_mul_ps(x, scale), noise);
+  y = _mm256_round_ps(y, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+  y = _mm256_min_ps(_mm256_max_ps(y, low), high);
+  return _mm256_cvtps_epi32(_mm256_mul_ps(y, unit));
+}
+
+__attribute__((target("avx2"))) static void
+flt_to_s16_dither_avx2(uint8_t *dst, const uint8_t *src, size_t count,
+                       sample_dither_t *dither) {
+  const float *in = (const float *)src;
+  int16_t *out = (int16_t *)dst;
+  float depth = ldexpf(1.0f, dither->bits - 1);
+  const __m256 scale = _mm256_set1_ps(depth);
+  const __m256 low = _mm256_set1_ps(-depth);
+  const __m256 high = _mm256_set1_ps(depth - 1.0f);
+  const __m256 unit = _mm256_set1_ps(ldexpf(1.0f, 16 - dither->bits));
+  __m256i state = _mm256_loadu_si256((const __m256i *)dither->state);
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    __m256i a =
+      dither_avx2(_mm256_loadu_ps(in + i), &state, scale, low, high, unit);
+    __m256i b =
+      dither_avx2(_mm256_loadu_ps(in + i + 8), &state, scale, low, high, unit);
+    __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), 0xd8);
+    _mm256_storeu_si256((__m256i *)(out + i), packed);
+  }
+  _mm256_storeu_si256((__m256i *)dither->state, state);
+  flt_to_s16_dither((uint8_t *)(out + i), (const uint8_t *)(in + i),
+                    count - i, dither);
+}
+
+__attribute__((target("avx2"))) static void
+flt_to_s32_dither_avx2(uint8_t *dst, const uint8_t *src, size_t count,
+                       sample_dither_t *dither) {
+  if (dither->bits > 24) {
+    flt_to_s32_dither(dst, src, count, dither);
+    return;
+  }
+
+  const float *in = (const float *)src;
+  int32_t *out = (int32_t *)dst;
+  float depth = ldexpf(1.0f, dither->bits - 1);
+  const __m256 scale = _mm256_set1_ps(depth);
+  const __m256 low = _mm256_set1_ps(-depth);
+  const __m256 high = _mm256_set1_ps(depth - 1.0f);
+  const __m256 unit = _mm256_set1_ps(ldexpf(1.0f, 32 - dither->bits));
+  __m256i state = _mm256_loadu_si256((const __m256i *)dither->state);
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    _mm256_storeu_si256(
+      (__m256i *)(out + i),
+      dither_avx2(_mm256_loadu_ps(in + i), &state, scale, low, high, unit));
+  }
+  _mm256_storeu_si256((__m256i *)dither->state, state);
+  flt_to_s32_dither((uint8_t *)(out + i), (const uint8_t *)(in + i),
+                    count - i, dither);
+}
+
+#endif
+
+static void select_kernels(void) {
+  static const sample_convert_fn scalar[FORMAT_COUNT][FORMAT_COUNT] = {
+    {copy_8, u8_to_s16, u8_to_s32, u8_to_s64, u8_to_flt, u8_to_dbl},
+    {s16_to_u8, copy_16, s16_to_s32, s16_to_s64, s16_to_flt, s16_to_dbl},
+    {s32_to_u8, s32_to_s16, copy_32, s32_to_s64, s32_to_flt, s32_to_dbl},
+    {s64_to_u8, s64_to_s16, s64_to_s32, copy_64, s64_to_flt, s64_to_dbl},
+    {flt_to_u8, flt_to_s16, flt_to_s32, flt_to_s64, copy_32, flt_to_dbl},
+    {dbl_to_u8, dbl_to_s16, dbl_to_s32, dbl_to_s64, dbl_to_flt, copy_64},
+  };
+  static const sample_convert_fn dithered[FORMAT_COUNT][FORMAT_COUNT] = {
+    {u8_to_u8_dither, u8_to_s16_dither, u8_to_s32_dither, u8_to_s64_dither},
+    {s16_to_u8_dither, s16_to_s16_dither, s16_to_s32_dither,
+     s16_to_s64_dither},
+    {s32_to_u8_dither, s32_to_s16_dither, s32_to_s32_dither,
+     s32_to_s64_dither},
+    {s64_to_u8_dither, s64_to_s16_dither, s64_to_s32_dither,
+     s64_to_s64_dither},
+    {flt_to_u8_dither, flt_to_s16_dither, flt_to_s32_dither,
+     flt_to_s64_dither},
+    {dbl_to_u8_dither, dbl_to_s16_dither, dbl_to_s32_dither,
+     dbl_to_s64_dither},
+  };
+  memcpy(kernels, scalar, sizeof(kernels));
+  memcpy(dither_kernels, dithered, sizeof(dither_kernels));
+
+#if SAMPLE_CONVERT_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse2")) {
+    kernels[FORMAT_S16][FORMAT_FLT] = s16_to_flt_sse2;
+    kernels[FORMAT_S32][FORMAT_FLT] = s32_to_flt_sse2;
+    kernels[FORMAT_FLT][FORMAT_S16] = flt_to_s16_sse2;
+    kernels[FORMAT_FLT][FORMAT_S32] = flt_to_s32_sse2;
+    kernels[FORMAT_FLT][FORMAT_DBL] = flt_to_dbl_sse2;
+    kernels[FORMAT_DBL][FORMAT_FLT] = dbl_to_flt_sse2;
+    kernels[FORMAT_S16][FORMAT_S32] = s16_to_s32_sse2;
+    kernels[FORMAT_S32][FORMAT_S16] = s32_to_s16_sse2;
+    dither_kernels[FORMAT_FLT][FORMAT_S16] = flt_to_s16_dither_sse2;
+    dither_kernels[FORMAT_FLT][FORMAT_S32] = flt_to_s32_dither_sse2;
+    isa_name = "sse2";
+  }
+
+  if (__builtin_cpu_supports("avx2")) {
+    kernels[FORMAT_S16][FORMAT_FLT] = s16_to_flt_avx2;
+    kernels[FORMAT_S32][FORMAT_FLT] = s32_to_flt_avx2;
+    kernels[FORMAT_FLT][FORMAT_S16] = flt_to_s16_avx2;
+    kernels[FORMAT_FLT][FORMAT_S32] = flt_to_s32_avx2;
+    kernels[FORMAT_FLT][FORMAT_DBL] = flt_to_dbl_avx2;
+    kernels[FORMAT_DBL][FORMAT_FLT] = dbl_to_flt_avx2;
+    dither_kernels[FORMAT_FLT][FORMAT_S16] = flt_to_s16_dither_avx2;
+    dither_kernels[FORMAT_FLT][FORMAT_S32] = flt_to_s32_dither_avx2;
+    isa_name = "avx2";
+  }
+#endif
+}
+
+sample_convert_fn sample_convert_get_kernel(enum AVSampleFormat src_format,
+                                            enum AVSampleFormat dst_format,
+                                            int dither) {
+  int src = format_index(src_format), dst = format_index(dst_format);
+  if (src < 0 || dst < 0)
+    return NULL;
+
+  pthread_once(&kernels_once, select_kernels);
+  return dither ? dither_kernels[src][dst] : kernels[src][dst];
+}
+
+oasis_result_t sample_convert(uint8_t *dst, enum AVSampleFormat dst_format,
+                              const uint8_t *src,
+                              enum AVSampleFormat src_format, size_t count) {
+  sample_convert_fn kernel =
+    sample_convert_get_kernel(src_format, dst_format, 0);
+  if (!kernel)
+    return OASIS_ERROR_UNSUPPORTED_FORMAT;
+
+  kernel(dst, src, count, NULL);
+  return OASIS_SUCCESS;
+}
+
+oasis_result_t sample_converter_init(sample_converter_t *converter,
+                                     enum AVSampleFormat src_format,
+                                     enum AVSampleFormat dst_format,
+                                     int channels, int dither_bits) {
+  if (!converter || channels <= 0 || dither_bits < 0) {
+    oasis_log(NULL, LOG_LEVEL_ERROR, "Invalid arguments to converter init");
+    return OASIS_ERROR_INVALID_ARGUMENT;
+  }
+
+  int src = format_index(src_format), dst = format_index(dst_format);
+  if (src < 0 || dst < 0) {
+    oasis_log(NULL, LOG_LEVEL_ERROR, "Can not convert %s to %s",
+              av_get_sample_fmt_name(src_format),
+              av_get_sample_fmt_name(dst_format));
+    return OASIS_ERROR_UNSUPPORTED_FORMAT;
+  }
+
+  memset(converter, 0, sizeof(*converter));
+  converter->src_format = src_format;
+  converter->dst_format = dst_format;
+  converter->channels = channels;
+
+  // Dither only where precision is lost, never past 32 bits
+  int bits = dither_bits;
+  if (bits > format_bits[dst])
+    bits = format_bits[dst];
+  if (bits > 32)
+    bits = 32;
+  int dither = bits > 0 && dst <= FORMAT_S64 && bits < format_bits[src];
+  converter->dither.bits = dither ? bits : 0;
+  for (int i = 0; i < 8; i++)
+    converter->dither.state[i] = 0x9e3779b9u * (uint32_t)(i + 1);
+  converter->kernel = sample_convert_get_kernel(src_format, dst_format, dither);
+
+  // Planar to packed and back are staged through the scratch a block at a
+  // time, the channel pointers sit in front of the samples
+  if (av_sample_fmt_is_planar(src_format) !=
+      av_sample_fmt_is_planar(dst_format)) {
+    size_t planes = (size_t)channels * sizeof(uint8_t *);
+    size_t samples = (size_t)SAMPLE_CONVERT_BLOCK_FRAMES * channels *
+                     av_get_bytes_per_sample(dst_format);
+    converter->scratch = malloc(planes + samples);
+    if (!converter->scratch) {
+      oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to allocate converter scratch");
+      return OASIS_ERROR_MEMORY_ALLOCATION;
+    }
+  }
+
+  return OASIS_SUCCESS;
+}
+
+void sample_converter_free(sample_converter_t *converter) {
+  if (!converter)
+    return;
+
+  free(converter->scratch);
+  memset(converter, 0, sizeof(*converter));
+}
+
+static void deinterleave(uint8_t *const *dst, size_t dst_offset,
+                         const uint8_t *src, int frames, int channels,
+                         int bytes_per_sample) {
+  for (int c = 0; c < channels; c++) {
+    uint8_t *out = dst[c] + dst_offset * bytes_per_sample;
+    const uint8_t *in = src + (size_t)c * bytes_per_sample;
+    size_t stride = (size_t)channels * bytes_per_sample;
+    switch (bytes_per_sample) {
+    case 1:
+      for (int i = 0; i < frames; i++)
+        out[i] = in[i * stride];
+      break;
+    case 2:
+      for (int i = 0; i < frames; i++)
+        memcpy(out + i * 2, in + i * stride, 2);
+      break;
+    case 4:
+      for (int i = 0; i < frames; i++)
+        memcpy(out + i * 4, in + i * stride, 4);
+      break;
+    default:
+      for (int i = 0; i < frames; i++)
+        memcpy(out + i * 8, in + i * stride, 8);
+      break;
+    }
+  }
+}
+
+void sample_converter_run(sample_converter_t *converter, uint8_t *const *dst,
+                          uint8_t *const *src, int offset, int frames) {
+  int channels = converter->channels;
+  int src_bytes = av_get_bytes_per_sample(converter->src_format);
+  int dst_bytes = av_get_bytes_per_sample(converter->dst_format);
+  int src_planar = av_sample_fmt_is_planar(converter->src_format);
+  int dst_planar = av_sample_fmt_is_planar(converter->dst_format);
+  sample_convert_fn kernel = converter->kernel;
+  sample_dither_t *dither = &converter->dither;
+
+  if (!src_planar && !dst_planar) {
+    kernel(dst[0], src[0] + (size_t)offset * src_bytes * channels,
+           (size_t)frames * channels, dither);
+    return;
+  }
+
+  if (src_planar && dst_planar) {
+    for (int c = 0; c < channels; c++)
+      kernel(dst[c], src[c] + (size_t)offset * src_bytes, frames, dither);
+    return;
+  }
+
+  // The layout changes, the samples go through the scratch a block at a time
+  uint8_t **planes = (uint8_t **)converter->scratch;
+  uint8_t *samples = converter->scratch + (size_t)channels * sizeof(*planes);
+  size_t block = SAMPLE_CONVERT_BLOCK_FRAMES;
+  for (int c = 0; c < channels; c++)
+    planes[c] = samples + (size_t)c * block * dst_bytes;
+
+  for (int done = 0; done < frames; done += (int)block) {
+    int count = frames - done < (int)block ? frames - done : (int)block;
+    if (src_planar) {
+      for (int c = 0; c < channels; c++)
+        kernel(planes[c], src[c] + (size_t)(offset + done) * src_bytes, count,
+               dither);
+      interleave_samples(dst[0] + (size_t)done * dst_bytes * channels, planes,
+                         0, count, channels, dst_bytes);
+    } else {
+      kernel(samples,
+             src[0] + (size_t)(offset + done) * src_bytes * channels,
+             (size_t)count * channels, dither);
+      deinterleave(dst, (size_t)done, samples, count, channels, dst_bytes);
+    }
+  }
+}
+
+const char *sample_convert_get_isa_name(void) {
+  pthread_once(&kernels_once, select_kernels);
+  return isa_name;
+}
@@ -0,0 +1,302 @@
+#define _XOPEN_SOURCE 700
+
+#include <oasis/audio/cache_path.h>
+#include <oasis/audio/decode.h>
+#include <oasis/audio/seek_index.h>
+#include <oasis/utils.h>
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SEEK_INDEX_MAGIC "OASISIDX"
+#define SEEK_INDEX_VERSION 1
+
+/**
+ * The header of a persisted index, followed by the path of the indexed file
+ * and the points.
+ */
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t sample_rate;
+  int64_t file_size;
+  int64_t file_mtime;
+  uint64_t count;
+  uint32_t path_length;
+  uint32_t complete;
+} seek_index_header_t;
+
+oasis_result_t seek_index_init(seek_index_t *index, int sample_rate) {
+  if (!index || sample_rate <= 0) {
+    return OASIS_ERROR_INVALID_ARGUMENT;
+  }
+
+  memset(index, 0, sizeof(*index));
+  index->sample_rate = sample_rate;
+  index->interval = (int64_t)sample_rate * SEEK_INDEX_INTERVAL_MS / 1000;
+  return OASIS_SUCCESS;
+}
+
+void seek_index_free(seek_index_t *index) {
+  if (!index)
+    return;
+
+  free(index->points);
+  memset(index, 0, sizeof(*index));
+}
+
+// Index of the first point after sample
+static size_t upper_bound(const seek_index_t *index, int64_t sample) {
+  size_t low = 0, high = index->count;
+
+  while (low < high) {
+    size_t mid = low + (high - low) / 2;
+    if (index->points[mid].sample <= sample)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+
+  return low;
+}
+
+oasis_result_t seek_index_add(seek_index_t *index, const seek_point_t *point) {
+  size_t at = upper_bound(index, point->sample);
+
+  // Keep the table sparse, a point this close to a neighbour adds nothing
+  if (at > 0 && point->sample - index->points[at - 1].sample < index->interval)
+    return OASIS_SUCCESS;
+  if (at < index->count &&
+      index->points[at].sample - point->sample < index->interval)
+    return OASIS_SUCCESS;
+
+  if (index->count == index->capacity) {
+    size_t capacity = index->capacity ? index->capacity * 2 : 256;
+    seek_point_t *points = realloc(index->points, capacity * sizeof(*points));
+    if (!points) {
+      oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to grow seek index");
+      return OASIS_ERROR_MEMORY_ALLOCATION;
+    }
+    index->points = points;
+    index->capacity = capacity;
+  }
+
+  memmove(&index->points[at + 1], &index->points[at],
+          (index->count - at) * sizeof(*index->points));
+  index->points[at] = *point;
+  index->count++;
+  index->dirty = 1;
+  return OASIS_SUCCESS;
+}
+
+void seek_index_add_packet(seek_index_t *index, const AVStream *stream,
+                           const AVPacket *packet) {
+  if (!index->interval || !(packet->flags & AV_PKT_FLAG_KEY) ||
+      packet->pts == AV_NOPTS_VALUE)
+    return;
+
+  int64_t start = stream->start_time != AV_NOPTS_VALUE ? stream->start_time : 0;
+  seek_point_t point = {
+    .sample = av_rescale_q(packet->pts - start, stream->time_base,
+                           (AVRational){1, index->sample_rate}),
+    .timestamp = packet->pts,
+    .pos = packet->pos,
+  };
+
+  if (point.sample >= 0)
+    seek_index_add(index, &point);
+}
+
+const seek_point_t *seek_index_find(const seek_index_t *index,
+                                    int64_t sample) {
+  size_t at = upper_bound(index, sample);
+  return at > 0 ? &index->points[at - 1] : NULL;
+}
+
+static oasis_result_t get_index_path(const char *filename, char *path,
+                                     size_t size, char *key, int create_dirs) {
+  char dir[PATH_MAX];
+  oasis_result_t result =
+    cache_path_get_dir("seek", dir, sizeof(dir), create_dirs);
+  if (result != OASIS_SUCCESS)
+    return result;
+
+  cache_path_get_entry(dir, filename, "idx", path, size, key);
+  return OASIS_SUCCESS;
+}
+
+oasis_result_t seek_index_load(seek_index_t *index, const char *filename) {
+  char path[PATH_MAX];
+  struct stat st;
+  seek_index_header_t header;
+  oasis_result_t result = OASIS_ERROR_FILE_NOT_FOUND;
+
+  char key[PATH_MAX];
+  if (stat(filename, &st) != 0 ||
+      get_index_path(filename, path, sizeof(path), key, 0) != OASIS_SUCCESS)
+    return OASIS_ERROR_FILE_NOT_FOUND;
+
+  FILE *file = fopen(path, "rb");
+  if (!file)
+    return OASIS_ERROR_FILE_NOT_FOUND;
+
+  // A stale or foreign index is treated like a missing one
+  if (fread(&header, sizeof(header), 1, file) != 1 ||
+      memcmp(header.magic, SEEK_INDEX_MAGIC, sizeof(header.magic)) != 0 ||
+      header.version != SEEK_INDEX_VERSION ||
+      header.sample_rate != (uint32_t)index->sample_rate ||
+      header.file_size != (int64_t)st.st_size ||
+      header.file_mtime != (int64_t)st.st_mtime ||
+      header.path_length >= PATH_MAX)
+    goto done;
+
+  char indexed_path[PATH_MAX];
+  if (fread(indexed_path, 1, header.path_length, file) != header.path_length)
+    goto done;
+  indexed_path[header.path_length] = '\0';
+  if (strcmp(indexed_path, key) != 0)
+    goto done;
+
+  seek_point_t *points = malloc((header.count ? header.count : 1) *
+                                sizeof(*points));
+  if (!points) {
+    result = OASIS_ERROR_MEMORY_ALLOCATION;
+    goto done;
+  }
+  if (fread(points, sizeof(*points), header.count, file) != header.count) {
+    free(points);
+    goto done;
+  }
+
+  free(index->points);
+  index->points = points;
+  index->count = header.count;
+  index->capacity = header.count;
+  index->complete = header.complete;
+  index->dirty = 0;
+  result = OASIS_SUCCESS;
+
+  oasis_log(NULL, LOG_LEVEL_DEBUG, "Loaded %zu seek points for %s",
+            index->count, filename);
+
+done:
+  fclose(file);
+  return result;
+}
+
+int seek_index_persist_enabled(void) {
+  const char *enabled = getenv("OASIS_SEEK_INDEX");
+  return enabled && enabled[0] && enabled[0] != '0';
+}
+
+oasis_result_t seek_index_save(seek_index_t *index, const char *filename) {
+  char path[PATH_MAX];
+  char temp_path[PATH_MAX + 8];
+  char key[PATH_MAX];
+  struct stat st;
+
+  if (!index || !filename)
+    return OASIS_ERROR_INVALID_ARGUMENT;
+  if (stat(filename, &st) != 0)
+    return OASIS_ERROR_FILE_NOT_FOUND;
+
+  oasis_result_t result =
+    get_index_path(filename, path, sizeof(path), key, 1);
+  if (result != OASIS_SUCCESS)
+    return result;
+
+  seek_index_header_t header = {
+    .version = SEEK_INDEX_VERSION,
+    .sample_rate = (uint32_t)index->sample_rate,
+    .file_size = (int64_t)st.st_size,
+    .file_mtime = (int64_t)st.st_mtime,
+    .count = index->count,
+    .path_length = (uint32_t)strlen(key),
+    .complete = (uint32_t)index->complete,
+  };
+  memcpy(header.magic, SEEK_INDEX_MAGIC, sizeof(header.magic));
+
+  // Written aside under a unique name and renamed, so a reader never sees
+  // half an index and concurrent writers never share a temporary file
+  snprintf(temp_path, sizeof(temp_path), "%s.XXXXXX", path);
+  int fd = mkstemp(temp_path);
+  if (fd < 0) {
+    oasis_log(NULL, LOG_LEVEL_WARN, "Failed to write seek index %s", path);
+    return OASIS_ERROR;
+  }
+  FILE *file = fdopen(fd, "wb");
+  if (!file) {
+    oasis_log(NULL, LOG_LEVEL_WARN, "Failed to write seek index %s", path);
+    close(fd);
+    unlink(temp_path);
+    return OASIS_ERROR;
+  }
+
+  int ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+           fwrite(key, 1, header.path_length, file) == header.path_length &&
+           fwrite(index->points, sizeof(*index->points), index->count, file) ==
+             index->count;
+  ok = (fclose(file) == 0) && ok;
+
+  if (!ok || rename(temp_path, path) != 0) {
+    oasis_log(NULL, LOG_LEVEL_WARN, "Failed to write seek index %s", path);
+    unlink(temp_path);
+    return OASIS_ERROR;
+  }
+
+  index->dirty = 0;
+  return OASIS_SUCCESS;
+}
+
+oasis_result_t seek_index_scan(seek_index_t *index, const char *filename) {
+  AVFormatContext *fmt_ctx = NULL;
+  AVPacket *packet = NULL;
+  oasis_result_t result = OASIS_SUCCESS;
+  int stream_index = -1;
+
+  if (avformat_open_input(&fmt_ctx, filename, NULL, NULL) != 0) {
+    oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to open input file %s", filename);
+    return OASIS_ERROR;
+  }
+
+  // The same stream a decoder opens by default, the index is only used there
+  stream_index = decoder_find_stream(fmt_ctx, NULL);
+  for (unsigned i = 0; i < fmt_ctx->nb_streams; i++) {
+    if ((int)i != stream_index)
+      fmt_ctx->streams[i]->discard = AVDISCARD_ALL;
+  }
+
+  if (stream_index < 0) {
+    oasis_log(NULL, LOG_LEVEL_ERROR, "No audio stream found");
+    result = OASIS_ERROR_FILE_NOT_FOUND;
+    goto done;
+  }
+
+  packet = av_packet_alloc();
+  if (!packet) {
+    result = OASIS_ERROR_FFMPEG_MEMORY_ALLOCATION;
+    goto done;
+  }
+
+  AVStream *stream = fmt_ctx->streams[stream_index];
+  while (av_read_frame(fmt_ctx, packet) >= 0) {
+    if (packet->stream_index == stream_index)
+      seek_index_add_packet(index, stream, packet);
+    av_packet_unref(packet);
+  }
+
+  index->complete = 1;
+  index->dirty = 1;
+  oasis_log(NULL, LOG_LEVEL_DEBUG, "Scanned %zu seek points in %s",
+            index->count, filename);
+  seek_index_save(index, filename);
+
+done:
+  av_packet_free(&packet);
+  avformat_close_input(&fmt_ctx);
+  return result;
+}
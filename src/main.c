@@ -9,5 +9,10 @@
 int main(void) {
   /*return begin_ui_window(1024, 768, "Oasis",
                          FLAG_WINDOW_RESIZABLE | FLAG_MSAA_4X_HINT);*/
-  return playback_play("./resources/test.flac");
+  // Finding the audio devices takes a while, get it going right away
+  output_discover_async();
+
+  oasis_result_t result = playback_play("./resources/test.flac");
+  playback_close_output();
+  return result;
 }
@@ -4,6 +4,7 @@
 #include <string.h>
 #include <time.h>
 
+#include <oasis/audio/realtime.h>
 #include <oasis/utils.h>
 
 log_level deserialize_env_log_level(void) {
@@ -38,6 +39,12 @@ oasis_result_t oasis_log(FILE *file, log_level level, const char *format, ...) {
   char time_buffer[32];
   char prefix[32];
 
+  // getenv, localtime and stdio have no place on a real-time thread
+  if (realtime_active()) {
+    realtime_violation("oasis_log");
+    return OASIS_SUCCESS;
+  }
+
   time_t now = time(NULL);
   struct tm *time_info = localtime(&now);
   strftime(time_buffer, sizeof(time_buffer), "%Y-%m-%d %H:%M:%S", time_info);
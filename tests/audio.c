@@ -1,13 +1,38 @@
+#define _XOPEN_SOURCE 700
+
 // This include is necessary to prevent linker errors during compilation
 #include "oasis/utils.h"
 #define CLAY_IMPLEMENTATION
 #include <clay.h>
 
 #include <dirent.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 #include <bsd/string.h>
+#include <oasis/audio/batch_decode.h>
+#include <oasis/audio/cache_path.h>
+#include <oasis/audio/channel_mix.h>
+#include <oasis/audio/codec_pool.h>
+#include <oasis/audio/command_queue.h>
 #include <oasis/audio/decode.h>
+#include <oasis/audio/dsp.h>
+#include <oasis/audio/interleave.h>
+#include <oasis/audio/mixer.h>
+#include <oasis/audio/output.h>
+#include <oasis/audio/packet_track.h>
+#include <oasis/audio/pcm_cache.h>
+#include <oasis/audio/pcm_store.h>
+#include <oasis/audio/probe.h>
+#include <oasis/audio/resample.h>
 #include <oasis/audio/playback.h>
+#include <oasis/audio/realtime.h>
+#include <oasis/audio/sample_convert.h>
+#include <oasis/audio/ring_buffer.h>
+#include <oasis/audio/seek_index.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
 #include <unity/unity.h>
 
 char *base_path = "./resources/test_files/";
@@ -103,24 +128,49 @@ oasis_result_t test_decode_a_folder(const char *path) {
     }
 
     oasis_log(NULL, LOG_LEVEL_INFO, "Decoding file: %s", full_path);
-    AVFrame **frames = NULL;
-    int frame_count = 0;
     audio_data_t audio_data = {0};
-    oasis_result_t result =
-      decode_to_pcm(full_path, &frames, &frame_count, &audio_data);
+    oasis_result_t result = decode_file_to_pcm(full_path, &audio_data);
 
     if (result != OASIS_SUCCESS) {
       oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to decode %s: %s",
                 full_path, serialize_oasis_error_text(result));
+      continue;
+    }
+
+    // The frame based shim has to produce the same PCM as the single pass
+    AVFrame **frames = NULL;
+    int frame_count = 0;
+    audio_data_t shim_data = {0};
+    result = decode_to_pcm(full_path, &frames, &frame_count, &shim_data);
+    if (result == OASIS_SUCCESS)
+      result = append_frames_to_pcm(frames, frame_count, &shim_data);
+
+    int mismatch = 0;
+    if (result != OASIS_SUCCESS) {
+      oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to decode %s with frames: %s",
+                full_path, serialize_oasis_error_text(result));
+    } else if (shim_data.pcm_size != audio_data.pcm_size ||
+               memcmp(shim_data.pcm_data, audio_data.pcm_data,
+                      audio_data.pcm_size) != 0) {
+      oasis_log(NULL, LOG_LEVEL_ERROR, "PCM mismatch between decoders for %s",
+                full_path);
+      mismatch = 1;
     } else {
       oasis_log(NULL, LOG_LEVEL_INFO, "Successfully decoded %s", full_path);
       success_count++;
     }
     free(audio_data.pcm_data);
+    free(shim_data.pcm_data);
     for (int i = 0; i < frame_count; i++) {
       av_frame_free(&frames[i]);
     }
     free(frames);
+
+    // A file both decode but differently is a bug, not a file to skip
+    if (mismatch) {
+      closedir(dir);
+      TEST_FAIL_MESSAGE("PCM mismatch between decoders");
+    }
   }
 
   closedir(dir);
@@ -146,6 +196,12 @@ oasis_result_t test_playback_a_folder(const char *path) {
   struct stat path_stat;
   int success_count = 0;
 
+  // The whole pipeline runs, headless and at 100x real time
+  playback_options_t options = {
+    .output_backend = OUTPUT_BACKEND_NULL,
+    .output_speed = 100.0,
+  };
+
   while ((entry = readdir(dir)) != NULL) {
     if (entry->d_name[0] == '.')
       continue;
@@ -159,7 +215,7 @@ oasis_result_t test_playback_a_folder(const char *path) {
     }
 
     oasis_log(NULL, LOG_LEVEL_INFO, "Playing back file: %s", full_path);
-    if (playback_play(full_path) != OASIS_SUCCESS) {
+    if (playback_play_with_options(full_path, &options) != OASIS_SUCCESS) {
       oasis_log(NULL, LOG_LEVEL_ERROR, "Failed to play %s", full_path);
     } else {
       oasis_log(NULL, LOG_LEVEL_INFO, "Successfully played %s", full_path);
@@ -241,6 +297,389 @@ void test_audio_decode(void) {
   }
 }
 
+static void count_batch_file(batch_decode_result_t *result, void *user_data) {
+  if (result->result == OASIS_SUCCESS && result->audio_data.pcm_size > 0)
+    (*(int *)user_data)++;
+}
+
+// Every regular file in the test folders, for tests that take a list
+static char **collect_test_files(size_t *count_out) {
+  char **files = NULL;
+  size_t count = 0, capacity = 0;
+
+  for (int i = 0; i < amount_of_paths; i++) {
+    DIR *dir = opendir(paths[i]);
+    if (!dir)
+      continue;
+
+    struct dirent *entry;
+    struct stat path_stat;
+    while ((entry = readdir(dir)) != NULL) {
+      if (entry->d_name[0] == '.')
+        continue;
+
+      char full_path[512];
+      snprintf(full_path, sizeof(full_path), "%s/%s", paths[i], entry->d_name);
+      if (stat(full_path, &path_stat) != 0 || !S_ISREG(path_stat.st_mode))
+        continue;
+
+      if (count == capacity) {
+        capacity = capacity ? capacity * 2 : 16;
+        files = realloc(files, capacity * sizeof(*files));
+        TEST_ASSERT_NOT_NULL(files);
+      }
+      files[count++] = strdup(full_path);
+    }
+    closedir(dir);
+  }
+
+  *count_out = count;
+  return files;
+}
+
+static void free_test_files(char **files, size_t count) {
+  for (size_t i = 0; i < count; i++)
+    free(files[i]);
+  free(files);
+}
+
+// Like collect_test_files, the test is ignored when the folders are empty
+static char **require_test_files(size_t *count, const char *ignore_message) {
+  char **files = collect_test_files(count);
+  if (*count == 0) {
+    free(files);
+    TEST_IGNORE_MESSAGE(ignore_message);
+  }
+  return files;
+}
+
+/**
+ * Checks one test file.
+ *
+ * @return 1 if the file was checked, 0 if it did not apply.
+ */
+typedef int (*test_file_fn)(const char *filename, void *user_data);
+
+// Runs check on every test file and returns how many it checked
+static int for_each_test_file(const char *ignore_message, test_file_fn check,
+                              void *user_data) {
+  size_t count = 0;
+  char **files = require_test_files(&count, ignore_message);
+  int checked = 0;
+
+  for (size_t i = 0; i < count; i++)
+    checked += check(files[i], user_data);
+
+  free_test_files(files, count);
+  return checked;
+}
+
+void test_batch_decode(void) {
+  size_t count = 0;
+  char **files = require_test_files(&count, "No audio files to batch decode");
+
+  int decoded = 0;
+  batch_decode_options_t options = {
+    .threads = 4,
+    .on_complete = count_batch_file,
+    .user_data = &decoded,
+  };
+  batch_decode_stats_t stats = {0};
+  codec_pool_stats_t before, after;
+  codec_pool_get_stats(codec_pool_default(), &before);
+  batch_decode((const char *const *)files, count, &options, &stats);
+  codec_pool_get_stats(codec_pool_default(), &after);
+
+  TEST_ASSERT_EQUAL(count, stats.files);
+  TEST_ASSERT_EQUAL(stats.files - stats.failed, decoded);
+  TEST_ASSERT_TRUE(decoded > 0);
+  TEST_ASSERT_TRUE(after.tracks - before.tracks >= (uint64_t)decoded);
+  TEST_ASSERT_TRUE(stats.max_open_seconds > 0);
+
+  free_test_files(files, count);
+}
+
+typedef struct {
+  int files;
+  double seconds;
+} probe_test_stats_t;
+
+static int time_probe_test_file(const char *filename, void *user_data) {
+  probe_test_stats_t *stats = user_data;
+  audio_probe_t probe;
+  struct timespec start, end;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  oasis_result_t result = audio_probe(filename, &probe);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  stats->files++;
+  stats->seconds += (end.tv_sec - start.tv_sec) +
+                    (end.tv_nsec - start.tv_nsec) / 1e9;
+  return result == OASIS_SUCCESS;
+}
+
+// What the header declares has to agree with what the decoder produces
+static int check_probe_test_file(const char *filename, void *user_data) {
+  audio_probe_t probe;
+  audio_decoder_t decoder;
+  if (audio_probe(filename, &probe) != OASIS_SUCCESS ||
+      probe.sample_rate == 0 ||
+      decoder_open(&decoder, filename) != OASIS_SUCCESS)
+    return 0;
+
+  TEST_ASSERT_EQUAL(decoder.sample_rate, probe.sample_rate);
+  TEST_ASSERT_EQUAL(decoder.channels, probe.channels);
+  if (!probe.duration_estimated && probe.duration > 0)
+    TEST_ASSERT_TRUE(llabs(decoder.duration - probe.duration) <=
+                     probe.sample_rate);
+  decoder_close(&decoder);
+  return 1;
+}
+
+void test_audio_probe(void) {
+  probe_test_stats_t stats = {0};
+  int probed = for_each_test_file("No audio files to probe",
+                                  time_probe_test_file, &stats);
+  oasis_log(NULL, LOG_LEVEL_INFO, "Probed %d of %d files, %.0f files/s",
+            probed, stats.files,
+            stats.files / (stats.seconds > 0 ? stats.seconds : 1e-9));
+  TEST_ASSERT_TRUE(probed > 0);
+
+  for_each_test_file("No audio files to probe", check_probe_test_file, NULL);
+}
+
+static int check_packet_track_file(const char *filename, void *user_data) {
+  packet_track_t track;
+  audio_data_t audio_data = {0};
+  if (packet_track_load(&track, filename) != OASIS_SUCCESS)
+    return 0;
+  if (decode_file_to_pcm(filename, &audio_data) != OASIS_SUCCESS) {
+    packet_track_free(&track);
+    return 0;
+  }
+
+  // Reading from the start has to give what a full decode gives
+  int frames = track.sample_rate;
+  uint8_t *buffer = malloc((size_t)frames * track.stride);
+  TEST_ASSERT_NOT_NULL(buffer);
+  int frames_read = 0;
+  TEST_ASSERT_EQUAL(OASIS_SUCCESS,
+                    packet_track_read(&track, 0, buffer, frames,
+                                      &frames_read));
+  size_t bytes = (size_t)frames_read * track.stride;
+  if (bytes > audio_data.pcm_size)
+    bytes = audio_data.pcm_size;
+  TEST_ASSERT_EQUAL_MEMORY(audio_data.pcm_data, buffer, bytes);
+
+  // Jumping around only decodes from the nearest packet
+  int64_t length = (int64_t)(audio_data.pcm_size / track.stride);
+  for (int j = 1; j <= 4 && length > frames; j++) {
+    int64_t position = (length - frames) * (5 - j) / 4;
+    TEST_ASSERT_EQUAL(OASIS_SUCCESS,
+                      packet_track_read(&track, position, buffer, frames,
+                                        &frames_read));
+    TEST_ASSERT_EQUAL(frames, frames_read);
+  }
+
+  // The same samples as the decoder, encoder delay and padding left out
+  if (track.end > 0)
+    TEST_ASSERT_EQUAL(length, track.end);
+  TEST_ASSERT_EQUAL(OASIS_SUCCESS,
+                    packet_track_read(&track, length, buffer, frames,
+                                      &frames_read));
+  TEST_ASSERT_EQUAL(0, frames_read);
+
+  // Compressed, a long track costs a fraction of its PCM
+  uint64_t memory = packet_track_get_memory(&track);
+  const AVCodecDescriptor *descriptor =
+    avcodec_descriptor_get(track.codecpar->codec_id);
+  oasis_log(NULL, LOG_LEVEL_INFO, "%s: %llu bytes held for %zu bytes of PCM",
+            filename, (unsigned long long)memory, audio_data.pcm_size);
+  if (descriptor && (descriptor->props & AV_CODEC_PROP_LOSSY) &&
+      audio_data.pcm_size > 4 * track.window_capacity * track.stride)
+    TEST_ASSERT_TRUE(memory < audio_data.pcm_size / 2);
+
+  free(buffer);
+  audio_data_free(&audio_data);
+  packet_track_free(&track);
+  return 1;
+}
+
+void test_packet_track(void) {
+  int loaded = for_each_test_file("No audio files to load as packets",
+                                  check_packet_track_file, NULL);
+  TEST_ASSERT_TRUE(loaded > 0);
+}
+
+// Sample 0 is the same whether reached by opening or by seeking back, with or
+// without encoder delay to leave out
+static int check_gapless_file(const char *filename, void *user_data) {
+  audio_decoder_t decoder;
+  int checked = 0;
+  if (decoder_open(&decoder, filename) != OASIS_SUCCESS)
+    return 0;
+
+  int frames = 4096;
+  size_t stride = (size_t)av_get_bytes_per_sample(decoder.sample_format) *
+                  decoder.channels;
+  uint8_t *first = malloc(frames * stride);
+  uint8_t *again = malloc(frames * stride);
+  TEST_ASSERT_NOT_NULL(first);
+  TEST_ASSERT_NOT_NULL(again);
+
+  int first_read = 0, again_read = 0;
+  TEST_ASSERT_EQUAL(OASIS_SUCCESS, decoder_read_samples(&decoder, first,
+                                                        frames, &first_read));
+  if (decoder_seek(&decoder, 0) == OASIS_SUCCESS) {
+    TEST_ASSERT_EQUAL(0, decoder.position);
+    TEST_ASSERT_EQUAL(OASIS_SUCCESS,
+                      decoder_read_samples(&decoder, again, frames,
+                                           &again_read));
+    TEST_ASSERT_EQUAL(first_read, again_read);
+    TEST_ASSERT_EQUAL_MEMORY(first, again, (size_t)first_read * stride);
+    checked = 1;
+  }
+  if (decoder.end > 0)
+    TEST_ASSERT_EQUAL(decoder.end, decoder.duration);
+
+  free(first);
+  free(again);
+  decoder_close(&decoder);
+  return checked;
+}
+
+void test_decoder_gapless(void) {
+  int checked = for_each_test_file("No audio files to check for encoder delay",
+                                   check_gapless_file, NULL);
+  TEST_ASSERT_TRUE(checked > 0);
+}
+
+// A few files are enough to cover the conversion paths
+static int check_resample_file(const char *filename, void *user_data) {
+  int *seen = user_data;
+  if ((*seen)++ >= 4)
+    return 0;
+
+  audio_decoder_t native, converted, formatted;
+  if (decoder_open(&native, filename) != OASIS_SUCCESS)
+    return 0;
+  TEST_ASSERT_EQUAL(OASIS_SUCCESS, decoder_open(&converted, filename));
+  TEST_ASSERT_EQUAL(OASIS_SUCCESS, decoder_open(&formatted, filename));
+
+  // Asking for what the file already is converts nothing
+  TEST_ASSERT_EQUAL(OASIS_SUCCESS,
+                    decoder_set_output_format(&native, 0,
+                                              native.sample_format));
+  TEST_ASSERT_NULL(native.resampler.swr);
+
+  // Only changing the format takes the conversion kernels, not a context
+  TEST_ASSERT_EQUAL(OASIS_SUCCESS,
+                    decoder_set_output_format(&formatted, 0,
+                                              AV_SAMPLE_FMT_S32));
+  TEST_ASSERT_NULL(formatted.resampler.swr);
+  TEST_ASSERT_NOT_NULL(formatted.resampler.converter.kernel);
+
+  int rate = native.source_rate == 48000 ? 44100 : 48000;
+  TEST_ASSERT_EQUAL(OASIS_SUCCESS,
+                    decoder_set_output_format(&converted, rate,
+                                              AUDIO_INTERNAL_SAMPLE_FORMAT));
+  TEST_ASSERT_NOT_NULL(converted.resampler.swr);
+  TEST_ASSERT_EQUAL(rate, converted.sample_rate);
+  TEST_ASSERT_EQUAL(AV_SAMPLE_FMT_FLT, converted.sample_format);
+
+  // Remixed down to mono on top of that, the frames all still come out
+  channel_matrix_t matrix;
+  if (channel_matrix_standard(&matrix, converted.source_channels, 1) ==
+      OASIS_SUCCESS) {
+    TEST_ASSERT_EQUAL(OASIS_SUCCESS,
+                      decoder_set_output_channels(&converted, 1, NULL));
+    TEST_ASSERT_EQUAL(1, converted.channels);
+  }
+
+  // The whole track comes out, as long as it was at the new rate
+  audio_data_t before = {0}, after = {0}, widened = {0};
+  TEST_ASSERT_EQUAL(OASIS_SUCCESS, decoder_read_all(&native, &before));
+  TEST_ASSERT_EQUAL(OASIS_SUCCESS, decoder_read_all(&converted, &after));
+  TEST_ASSERT_EQUAL(OASIS_SUCCESS, decoder_read_all(&formatted, &widened));
+  TEST_ASSERT_EQUAL(before.pcm_size /
+                      av_get_bytes_per_sample(before.sample_format),
+                    widened.pcm_size / sizeof(int32_t));
+  int64_t expected =
+    (int64_t)(before.pcm_size /
+              ((size_t)av_get_bytes_per_sample(before.sample_format) *
+               before.channels)) *
+    rate / native.source_rate;
+  int64_t frames =
+    (int64_t)(after.pcm_size / (sizeof(float) * after.channels));
+  TEST_ASSERT_TRUE(llabs(frames - expected) <= rate / 100);
+
+  // Seeking counts at the new rate too
+  if (converted.duration > rate &&
+      decoder_seek(&converted, rate) == OASIS_SUCCESS) {
+    TEST_ASSERT_TRUE(llabs(converted.position - rate) <= rate / 100);
+  }
+
+  audio_data_free(&before);
+  audio_data_free(&after);
+  audio_data_free(&widened);
+  decoder_close(&native);
+  decoder_close(&converted);
+  decoder_close(&formatted);
+  return 1;
+}
+
+void test_decoder_resample(void) {
+  int seen = 0;
+  for_each_test_file("No audio files to convert", check_resample_file, &seen);
+}
+
+void test_play_queue(void) {
+  size_t count = 0;
+  char **files = require_test_files(&count, "No audio files to queue");
+
+  // Skipping through the queue opens every track and swaps outputs when the
+  // format changes, the stop ends it without playing everything out
+  const char *queue[3] = {files[0], files[count > 1 ? 1 : 0], files[0]};
+  command_queue_t commands;
+  TEST_ASSERT_EQUAL(OASIS_SUCCESS, command_queue_init(&commands));
+  command_queue_push(&commands, PLAYBACK_COMMAND_NEXT, 0);
+  command_queue_push(&commands, PLAYBACK_COMMAND_NEXT, 0);
+  command_queue_push(&commands, PLAYBACK_COMMAND_STOP, 0);
+
+  playback_options_t options = {
+    .output_backend = OUTPUT_BACKEND_MINIAUDIO,
+    .null_output = 1,
+    .commands = &commands,
+  };
+  TEST_ASSERT_EQUAL(OASIS_SUCCESS, playback_play_queue(queue, 3, &options));
+
+  // Same again with the tracks going through the mixer
+  command_queue_push(&commands, PLAYBACK_COMMAND_NEXT, 0);
+  command_queue_push(&commands, PLAYBACK_COMMAND_NEXT, 0);
+  command_queue_push(&commands, PLAYBACK_COMMAND_STOP, 0);
+  options.crossfade_ms = 2000;
+  TEST_ASSERT_EQUAL(OASIS_SUCCESS, playback_play_queue(queue, 3, &options));
+
+  // And with every DSP node in, turning the volume down on the way
+  dsp_eq_band_t bands[] = {
+    {DSP_EQ_LOW_SHELF, 100.0, 3.0, 0.707},
+    {DSP_EQ_PEAK, 3000.0, -2.0, 1.0},
+  };
+  command_queue_push(&commands, PLAYBACK_COMMAND_VOLUME, -600);
+  command_queue_push(&commands, PLAYBACK_COMMAND_NEXT, 0);
+  command_queue_push(&commands, PLAYBACK_COMMAND_VOLUME_RELATIVE, -200);
+  command_queue_push(&commands, PLAYBACK_COMMAND_NEXT, 0);
+  command_queue_push(&commands, PLAYBACK_COMMAND_STOP, 0);
+  options.replaygain = DSP_REPLAYGAIN_TRACK;
+  options.eq_bands = bands;
+  options.eq_band_count = 2;
+  options.dsp_profile = 1;
+  TEST_ASSERT_EQUAL(OASIS_SUCCESS, playback_play_queue(queue, 3, &options));
+
+  command_queue_free(&commands);
+  free_test_files(files, count);
+}
+
 void test_audio_playback(void) {
   int success_count = 0;
 
@@ -265,10 +704,1112 @@ void test_audio_playback(void) {
 
 void test_audio_play(void) {}
 
+void test_interleave(void) {
+  const int widths[] = {1, 2, 4, 8};
+  const int channel_counts[] = {1, 2, 3, 6, 8};
+  const int nb_samples = 1037, offset = 5; // Odd sizes to hit the tails
+
+  for (size_t w = 0; w < sizeof(widths) / sizeof(widths[0]); w++) {
+    for (size_t c = 0; c < sizeof(channel_counts) / sizeof(channel_counts[0]);
+         c++) {
+      int width = widths[w], channels = channel_counts[c];
+      size_t plane_size = (size_t)(nb_samples + offset) * width;
+      size_t out_size = (size_t)nb_samples * channels * width;
+      uint8_t *planes[8];
+      uint8_t *expected = malloc(out_size);
+      uint8_t *actual = malloc(out_size);
+      TEST_ASSERT_NOT_NULL(expected);
+      TEST_ASSERT_NOT_NULL(actual);
+
+      for (int ch = 0; ch < channels; ch++) {
+        planes[ch] = malloc(plane_size);
+        TEST_ASSERT_NOT_NULL(planes[ch]);
+        for (size_t i = 0; i < plane_size; i++)
+          planes[ch][i] = (uint8_t)(i * 31 + ch * 7);
+      }
+
+      for (int i = 0; i < nb_samples; i++) {
+        for (int ch = 0; ch < channels; ch++) {
+          memcpy(expected + ((size_t)i * channels + ch) * width,
+                 planes[ch] + (size_t)(i + offset) * width, width);
+        }
+      }
+
+      TEST_ASSERT_EQUAL(OASIS_SUCCESS,
+                        interleave_samples(actual, planes, offset, nb_samples,
+                                           channels, width));
+      TEST_ASSERT_EQUAL_MEMORY(expected, actual, out_size);
+
+      for (int ch = 0; ch < channels; ch++)
+        free(planes[ch]);
+      free(expected);
+      free(actual);
+    }
+  }
+
+  // A width without a kernel is an error, not an untouched buffer
+  uint8_t plane[6] = {0}, packed[6] = {0};
+  uint8_t *const odd_planes[1] = {plane};
+  TEST_ASSERT_EQUAL(OASIS_ERROR_UNSUPPORTED_FORMAT,
+                    interleave_samples(packed, odd_planes, 0, 2, 1, 3));
+
+  oasis_log(NULL, LOG_LEVEL_INFO, "Interleave kernels verified (%s)",
+            interleave_get_isa_name());
+}
+
+#define RING_TEST_BYTES (8u << 20)
+
+static void *ring_test_producer(void *arg) {
+  ring_buffer_t *rb = arg;
+  uint8_t block[997]; // Not a divisor of the capacity, to exercise wrapping
+  size_t produced = 0;
+
+  while (produced < RING_TEST_BYTES) {
+    if (ring_buffer_fill(rb) >= rb->high_watermark) {
+      ring_buffer_wait_for_space(rb);
+      continue;
+    }
+
+    size_t count = sizeof(block);
+    if (RING_TEST_BYTES - produced < count)
+      count = RING_TEST_BYTES - produced;
+    for (size_t i = 0; i < count; i++)
+      block[i] = (uint8_t)((produced + i) * 13);
+
+    produced += ring_buffer_write(rb, block, count);
+  }
+
+  ring_buffer_set_eof(rb);
+  return NULL;
+}
+
+void test_ring_buffer(void) {
+  ring_buffer_t rb;
+  pthread_t producer;
+  uint8_t block[1024];
+  size_t consumed = 0;
+  int mismatches = 0;
+
+  TEST_ASSERT_EQUAL(OASIS_SUCCESS, ring_buffer_init(&rb, 16384, 4096, 12288));
+  TEST_ASSERT_EQUAL(0, pthread_create(&producer, NULL, ring_test_producer, &rb));
+
+  while (!ring_buffer_drained(&rb)) {
+    size_t count = ring_buffer_read(&rb, block, sizeof(block));
+    for (size_t i = 0; i < count; i++) {
+      if (block[i] != (uint8_t)((consumed + i) * 13))
+        mismatches++;
+    }
+    consumed += count;
+  }
+
+  pthread_join(producer, NULL);
+  oasis_log(NULL, LOG_LEVEL_INFO, "Ring buffer: %llu reads, %llu underruns",
+            (unsigned long long)rb.reads, (unsigned long long)rb.underruns);
+  ring_buffer_free(&rb);
+
+  TEST_ASSERT_EQUAL(RING_TEST_BYTES, consumed);
+  TEST_ASSERT_EQUAL(0, mismatches);
+}
+
+void test_command_queue(void) {
+  command_queue_t queue;
+  playback_command_t command;
+  struct pollfd event = {0};
+
+  TEST_ASSERT_EQUAL(OASIS_SUCCESS, command_queue_init(&queue));
+  event.fd = command_queue_get_fd(&queue);
+  event.events = POLLIN;
+  TEST_ASSERT_EQUAL(0, poll(&event, 1, 0));
+
+  for (int i = 0; i < COMMAND_QUEUE_CAPACITY; i++) {
+    TEST_ASSERT_EQUAL(OASIS_SUCCESS, command_queue_push(
+                                       &queue, PLAYBACK_COMMAND_SEEK, i));
+  }
+  TEST_ASSERT_NOT_EQUAL(OASIS_SUCCESS,
+                        command_queue_push(&queue, PLAYBACK_COMMAND_STOP, 0));
+  TEST_ASSERT_EQUAL(1, poll(&event, 1, 0));
+
+  for (int i = 0; i < COMMAND_QUEUE_CAPACITY; i++) {
+    TEST_ASSERT_EQUAL(1, command_queue_pop(&queue, &command));
+    TEST_ASSERT_EQUAL(PLAYBACK_COMMAND_SEEK, command.type);
+    TEST_ASSERT_EQUAL(i, command.value);
+  }
+
+  // Drained, so the engine would go back to sleep
+  TEST_ASSERT_EQUAL(0, command_queue_pop(&queue, &command));
+  TEST_ASSERT_EQUAL(0, poll(&event, 1, 0));
+  command_queue_free(&queue);
+}
+
+void test_seek_index(void) {
+  seek_index_t index, loaded;
+  char cache_dir[] = "/tmp/oasis-test-XXXXXX";
+
+  TEST_ASSERT_EQUAL(OASIS_SUCCESS, seek_index_init(&index, 1000));
+
+  // Out of order and too close together, like points seen around seeks
+  const int64_t samples[] = {5000, 0, 2000, 2500, 9000, 1000, 5999};
+  for (size_t i = 0; i < sizeof(samples) / sizeof(samples[0]); i++) {
+    seek_point_t point = {samples[i], samples[i] * 2, samples[i] * 3};
+    TEST_ASSERT_EQUAL(OASIS_SUCCESS, seek_index_add(&index, &point));
+  }
+
+  TEST_ASSERT_EQUAL(5, index.count); // 2500 and 5999 are within the interval
+  TEST_ASSERT_NULL(seek_index_find(&index, -1));
+  TEST_ASSERT_EQUAL(0, seek_index_find(&index, 999)->sample);
+  TEST_ASSERT_EQUAL(2000, seek_index_find(&index, 4999)->sample);
+  TEST_ASSERT_EQUAL(5000, seek_index_find(&index, 5000)->sample);
+  TEST_ASSERT_EQUAL(9000, seek_index_find(&index, 1 << 30)->sample);
+
+  TEST_ASSERT_NOT_NULL(mkdtemp(cache_dir));
+  setenv("XDG_CACHE_HOME", cache_dir, 1);
+  TEST_ASSERT_EQUAL(OASIS_SUCCESS, seek_index_save(&index, __FILE__));
+  TEST_ASSERT_EQUAL(OASIS_SUCCESS, seek_index_init(&loaded, 1000));
+  TEST_ASSERT_EQUAL(OASIS_SUCCESS, seek_index_load(&loaded, __FILE__));
+  TEST_ASSERT_EQUAL(index.count, loaded.count);
+  TEST_ASSERT_EQUAL_MEMORY(index.points, loaded.points,
+                           index.count * sizeof(seek_point_t));
+
+  // The index sits in <cache>/oasis/seek, everything down to the temporary
+  // directory goes again
+  char seek_dir[PATH_MAX], entry[PATH_MAX], key[PATH_MAX];
+  TEST_ASSERT_EQUAL(OASIS_SUCCESS,
+                    cache_path_get_dir("seek", seek_dir, sizeof(seek_dir), 0));
+  cache_path_get_entry(seek_dir, __FILE__, "idx", entry, sizeof(entry), key);
+  unsetenv("XDG_CACHE_HOME");
+  TEST_ASSERT_EQUAL(0, unlink(entry));
+  TEST_ASSERT_EQUAL(0, rmdir(seek_dir));
+  *strrchr(seek_dir, '/') = '\0';
+  TEST_ASSERT_EQUAL(0, rmdir(seek_dir));
+  TEST_ASSERT_EQUAL(0, rmdir(cache_dir));
+
+  seek_index_free(&loaded);
+  seek_index_free(&index);
+}
+
+void test_pcm_cache(void) {
+  char cache_dir[] = "/tmp/oasis-test-XXXXXX";
+  char source[PATH_MAX];
+  pcm_cache_t cache;
+  int16_t samples[4096];
+
+  TEST_ASSERT_NOT_NULL(mkdtemp(cache_dir));
+  TEST_ASSERT_EQUAL(OASIS_SUCCESS, pcm_cache_open(&cache, cache_dir, 0));
+
+  // Any file will do as the source, only its path, size and mtime matter
+  snprintf(source, sizeof(source), "%s/source.flac", cache_dir);
+  FILE *file = fopen(source, "wb");
+  TEST_ASSERT_NOT_NULL(file);
+  fputs("not really audio", file);
+  fclose(file);
+
+  for (size_t i = 0; i < sizeof(samples) / sizeof(samples[0]); i++)
+    samples[i] = (int16_t)(i * 31);
+  audio_data_t audio_data = {
+    .pcm_data = (uint8_t *)samples,
+    .pcm_size = sizeof(samples),
+    .sample_rate = 44100,
+    .channels = 2,
+    .sample_format = AV_SAMPLE_FMT_S16,
+    .codec_id = AV_CODEC_ID_PCM_S16LE,
+  };
+  audio_data_t cached = {0};
+
+  TEST_ASSERT_EQUAL(OASIS_ERROR_FILE_NOT_FOUND,
+                    pcm_cache_lookup(&cache, source, &cached));
+  TEST_ASSERT_EQUAL(OASIS_SUCCESS,
+                    pcm_cache_store(&cache, source, &audio_data));
+  TEST_ASSERT_EQUAL(OASIS_SUCCESS, pcm_cache_lookup(&cache, source, &cached));
+  TEST_ASSERT_NOT_NULL(cached.mapping);
+  TEST_ASSERT_EQUAL(0, (uintptr_t)cached.pcm_data % 64);
+  TEST_ASSERT_EQUAL(44100, cached.sample_rate);
+  TEST_ASSERT_EQUAL(2, cached.channels);
+  TEST_ASSERT_EQUAL(AV_SAMPLE_FMT_S16, cached.sample_format);
+  TEST_ASSERT_EQUAL(sizeof(samples), cached.pcm_size);
+  TEST_ASSERT_EQUAL_MEMORY(samples, cached.pcm_data, sizeof(samples));
+  audio_data_free(&cached);
+  TEST_ASSERT_NULL(cached.pcm_data);
+
+  // Changing the source makes the entry stale
+  file = fopen(source, "ab");
+  TEST_ASSERT_NOT_NULL(file);
+  fputs(", still not audio", file);
+  fclose(file);
+  TEST_ASSERT_EQUAL(OASIS_ERROR_FILE_NOT_FOUND,
+                    pcm_cache_lookup(&cache, source, &cached));
+
+  // A cache smaller than one entry keeps nothing
+  TEST_ASSERT_EQUAL(OASIS_SUCCESS,
+                    pcm_cache_store(&cache, source, &audio_data));
+  cache.max_bytes = sizeof(samples) / 2;
+  TEST_ASSERT_EQUAL(OASIS_SUCCESS, pcm_cache_evict(&cache));
+  TEST_ASSERT_EQUAL(OASIS_ERROR_FILE_NOT_FOUND,
+                    pcm_cache_lookup(&cache, source, &cached));
+
+  // A temp file abandoned by an interrupted store goes before any entry, one
+  // that may still be written to is left alone
+  char entry[PATH_MAX], key[PATH_MAX], stale[PATH_MAX + 8], fresh[PATH_MAX + 8];
+  struct stat st;
+  cache_path_get_entry(cache_dir, source, "pcm", entry, sizeof(entry), key);
+  cache.max_bytes = UINT64_MAX;
+  TEST_ASSERT_EQUAL(OASIS_SUCCESS,
+                    pcm_cache_store(&cache, source, &audio_data));
+  TEST_ASSERT_EQUAL(0, stat(entry, &st));
+  snprintf(stale, sizeof(stale), "%s.AAAAAA", entry);
+  snprintf(fresh, sizeof(fresh), "%s.BBBBBB", entry);
+  file = fopen(stale, "wb");
+  TEST_ASSERT_NOT_NULL(file);
+  fputs("interrupted", file);
+  fclose(file);
+  struct timespec old[2] = {{0, 0}, {0, 0}};
+  TEST_ASSERT_EQUAL(0, utimensat(AT_FDCWD, stale, old, 0));
+  file = fopen(fresh, "wb");
+  TEST_ASSERT_NOT_NULL(file);
+  fputs("in flight", file);
+  fclose(file);
+  cache.max_bytes = (uint64_t)st.st_size;
+  TEST_ASSERT_EQUAL(OASIS_SUCCESS, pcm_cache_evict(&cache));
+  TEST_ASSERT_NOT_EQUAL(0, access(stale, F_OK));
+  TEST_ASSERT_EQUAL(0, unlink(fresh));
+  TEST_ASSERT_EQUAL(OASIS_SUCCESS, pcm_cache_lookup(&cache, source, &cached));
+  audio_data_free(&cached);
+
+  // Nothing of the test stays behind, should eviction have left the entry
+  unlink(entry);
+  TEST_ASSERT_EQUAL(0, unlink(source));
+  TEST_ASSERT_EQUAL(0, rmdir(cache_dir));
+}
+
+void test_pcm_store(void) {
+  pcm_store_t store;
+  uint8_t data[10000], out[10000];
+
+  // 4 byte frames, 1000 byte chunks, so reads and appends straddle chunks
+  TEST_ASSERT_EQUAL(OASIS_SUCCESS,
+                    pcm_store_init(&store, 48000, 2, AV_SAMPLE_FMT_S16, 1002));
+  TEST_ASSERT_EQUAL(1000, store.chunk_size);
+  TEST_ASSERT_NULL(store.chunks);
+
+  for (size_t i = 0; i < sizeof(data); i++)
+    data[i] = (uint8_t)(i * 7 + i / 251);
+  for (size_t done = 0; done < sizeof(data);) {
+    size_t piece = done % 3 == 0 ? 1236 : 404;
+    if (piece > sizeof(data) - done)
+      piece = sizeof(data) - done;
+    TEST_ASSERT_EQUAL(OASIS_SUCCESS,
+                      pcm_store_append(&store, data + done, piece));
+    done += piece;
+  }
+
+  TEST_ASSERT_EQUAL(sizeof(data), store.size);
+  TEST_ASSERT_EQUAL(10, store.count);
+  TEST_ASSERT_EQUAL(sizeof(data), pcm_store_read(&store, 0, out, sizeof(out)));
+  TEST_ASSERT_EQUAL_MEMORY(data, out, sizeof(data));
+
+  size_t contiguous;
+  const uint8_t *at = pcm_store_at(&store, 4321, &contiguous);
+  TEST_ASSERT_NOT_NULL(at);
+  TEST_ASSERT_EQUAL(679, contiguous);
+  TEST_ASSERT_EQUAL(data[4321], *at);
+  TEST_ASSERT_NULL(pcm_store_at(&store, sizeof(data), &contiguous));
+
+  // Everything before the chunk holding the playhead goes
+  pcm_store_release(&store, 3500);
+  TEST_ASSERT_NULL(pcm_store_at(&store, 2999, &contiguous));
+  TEST_ASSERT_NOT_NULL(pcm_store_at(&store, 3000, &contiguous));
+  TEST_ASSERT_EQUAL(0, pcm_store_read(&store, 0, out, 100));
+  TEST_ASSERT_EQUAL(7000, pcm_store_read(&store, 3000, out, sizeof(out)));
+  TEST_ASSERT_EQUAL_MEMORY(data + 3000, out, 7000);
+
+  // Appending carries on after a release
+  TEST_ASSERT_EQUAL(OASIS_SUCCESS, pcm_store_append(&store, data, 500));
+  TEST_ASSERT_EQUAL(500, pcm_store_read(&store, 10000, out, 1000));
+  TEST_ASSERT_EQUAL_MEMORY(data, out, 500);
+
+  pcm_store_free(&store);
+}
+
+// A stream with just enough parameters for decoder_find_stream to weigh
+static AVStream *add_test_stream(AVFormatContext *fmt_ctx,
+                                 enum AVMediaType type, const char *language,
+                                 int disposition) {
+  AVStream *stream = avformat_new_stream(fmt_ctx, NULL);
+  TEST_ASSERT_NOT_NULL(stream);
+  stream->codecpar->codec_type = type;
+  stream->codecpar->codec_id =
+    type == AVMEDIA_TYPE_AUDIO ? AV_CODEC_ID_FLAC : AV_CODEC_ID_MJPEG;
+  stream->codecpar->sample_rate = type == AVMEDIA_TYPE_AUDIO ? 44100 : 0;
+  av_channel_layout_default(&stream->codecpar->ch_layout,
+                            type == AVMEDIA_TYPE_AUDIO ? 2 : 0);
+  stream->disposition = disposition;
+  if (language)
+    av_dict_set(&stream->metadata, "language", language, 0);
+  return stream;
+}
+
+void test_stream_selection(void) {
+  AVFormatContext *fmt_ctx = avformat_alloc_context();
+  TEST_ASSERT_NOT_NULL(fmt_ctx);
+
+  add_test_stream(fmt_ctx, AVMEDIA_TYPE_VIDEO, NULL,
+                  AV_DISPOSITION_ATTACHED_PIC);
+  add_test_stream(fmt_ctx, AVMEDIA_TYPE_AUDIO, "eng", 0);
+  add_test_stream(fmt_ctx, AVMEDIA_TYPE_AUDIO, "jpn", 0);
+  add_test_stream(fmt_ctx, AVMEDIA_TYPE_AUDIO, "jpn", AV_DISPOSITION_DEFAULT);
+
+  audio_stream_selection_t by_index = {.stream_index = 2};
+  audio_stream_selection_t not_audio = {.stream_index = 0};
+  audio_stream_selection_t out_of_range = {.stream_index = 9};
+  audio_stream_selection_t by_language = {.stream_index = -1,
+                                          .language = "JPN"};
+  audio_stream_selection_t missing_language = {.stream_index = -1,
+                                               .language = "fra"};
+
+  TEST_ASSERT_EQUAL(2, decoder_find_stream(fmt_ctx, &by_index));
+  TEST_ASSERT_EQUAL(-1, decoder_find_stream(fmt_ctx, &not_audio));
+  TEST_ASSERT_EQUAL(-1, decoder_find_stream(fmt_ctx, &out_of_range));
+  TEST_ASSERT_EQUAL(3, decoder_find_stream(fmt_ctx, &by_language));
+
+  int best = decoder_find_stream(fmt_ctx, NULL);
+  TEST_ASSERT_TRUE(best >= 1);
+  TEST_ASSERT_EQUAL(best, decoder_find_stream(fmt_ctx, &missing_language));
+
+  avformat_free_context(fmt_ctx);
+}
+
+#define OUTPUT_TEST_RATE 48000
+#define OUTPUT_TEST_FRAMES (OUTPUT_TEST_RATE / 5)
+
+typedef struct {
+  size_t frames;
+  int pulls;
+} output_test_source_t;
+
+static size_t output_test_pull(void *user_data, uint8_t *buffer, size_t frames,
+                               int *end_of_stream) {
+  output_test_source_t *source = user_data;
+  int16_t *samples = (int16_t *)buffer;
+
+  if (OUTPUT_TEST_FRAMES - source->frames < frames)
+    frames = OUTPUT_TEST_FRAMES - source->frames;
+  for (size_t i = 0; i < frames * 2; i++)
+    samples[i] = (int16_t)((source->frames * 2 + i) * 37);
+
+  source->frames += frames;
+  source->pulls++;
+  if (source->frames == OUTPUT_TEST_FRAMES)
+    *end_of_stream = 1;
+  return frames;
+}
+
+void test_output_null(void) {
+  audio_output_t output;
+  output_test_source_t source = {0};
+  output_config_t config = {
+    .backend = OUTPUT_BACKEND_MINIAUDIO,
+    .sample_rate = OUTPUT_TEST_RATE,
+    .channels = 2,
+    .sample_format = AV_SAMPLE_FMT_S16,
+    .period_size = 240,
+    .null_device = 1,
+  };
+
+  TEST_ASSERT_EQUAL(OASIS_SUCCESS,
+                    output_open(&output, &config, output_test_pull, &source));
+  TEST_ASSERT_TRUE(output.latency_ms > 0);
+  TEST_ASSERT_EQUAL(OASIS_SUCCESS, output_start(&output));
+
+  nanosleep((const struct timespec[]){{0, 50000000}}, NULL);
+
+  // Nothing may be pulled between the pause returning and the resume
+  output_pause(&output);
+  int pulls = __atomic_load_n(&source.pulls, __ATOMIC_SEQ_CST);
+  nanosleep((const struct timespec[]){{0, 20000000}}, NULL);
+  TEST_ASSERT_EQUAL(pulls, __atomic_load_n(&source.pulls, __ATOMIC_SEQ_CST));
+  output_resume(&output);
+
+  while (!output_finished(&output))
+    nanosleep((const struct timespec[]){{0, 1000000}}, NULL);
+  output_drain(&output);
+
+  oasis_log(NULL, LOG_LEVEL_INFO, "Null output: %.1f ms latency, %d pulls",
+            output.latency_ms, source.pulls);
+  TEST_ASSERT_EQUAL(OUTPUT_TEST_FRAMES, source.frames);
+  TEST_ASSERT_EQUAL(OUTPUT_TEST_FRAMES, output.frames_rendered);
+  output_close(&output);
+}
+
+// Plays the test source through a sink to the end, returns the seconds taken
+static double play_to_sink(output_config_t *config,
+                           output_test_source_t *source) {
+  audio_output_t output;
+  struct timespec start, end;
+
+  TEST_ASSERT_EQUAL(OASIS_SUCCESS,
+                    output_open(&output, config, output_test_pull, source));
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  TEST_ASSERT_EQUAL(OASIS_SUCCESS, output_start(&output));
+  while (!output_finished(&output))
+    nanosleep((const struct timespec[]){{0, 1000000}}, NULL);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  TEST_ASSERT_EQUAL(OUTPUT_TEST_FRAMES, output.frames_rendered);
+  TEST_ASSERT_EQUAL(0, output.silence_frames);
+  output_close(&output);
+  return (double)(end.tv_sec - start.tv_sec) +
+         (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+void test_output_sinks(void) {
+  output_config_t config = {
+    .backend = OUTPUT_BACKEND_NULL,
+    .sample_rate = OUTPUT_TEST_RATE,
+    .channels = 2,
+    .sample_format = AV_SAMPLE_FMT_S16,
+    .period_size = 240,
+  };
+  double seconds = (double)OUTPUT_TEST_FRAMES / OUTPUT_TEST_RATE;
+
+  // Unpaced it goes as fast as the source, paced it follows its clock
+  output_test_source_t source = {0};
+  double unpaced = play_to_sink(&config, &source);
+  config.speed = 2.0;
+  source = (output_test_source_t){0};
+  double paced = play_to_sink(&config, &source);
+  oasis_log(NULL, LOG_LEVEL_INFO,
+            "Null sink: %.0fx real time unpaced, %.2fx at speed 2",
+            seconds / unpaced, seconds / paced);
+  TEST_ASSERT_TRUE(unpaced < seconds / 2);
+  TEST_ASSERT_TRUE(paced >= seconds / 2 * 0.9);
+
+  // The file sink writes a WAV header followed by every sample
+  char dir[] = "/tmp/oasis-test-XXXXXX";
+  char path[64];
+  TEST_ASSERT_NOT_NULL(mkdtemp(dir));
+  snprintf(path, sizeof(path), "%s/out.wav", dir);
+  config.backend = OUTPUT_BACKEND_FILE;
+  config.path = path;
+  config.speed = 0.0;
+  source = (output_test_source_t){0};
+  play_to_sink(&config, &source);
+
+  FILE *file = fopen(path, "rb");
+  TEST_ASSERT_NOT_NULL(file);
+  uint8_t header[44];
+  int16_t samples[4];
+  TEST_ASSERT_EQUAL(1, fread(header, sizeof(header), 1, file));
+  TEST_ASSERT_EQUAL(0, memcmp(header, "RIFF", 4));
+  TEST_ASSERT_EQUAL(0, memcmp(header + 8, "WAVEfmt ", 8));
+  uint32_t data_size = (uint32_t)header[40] | (uint32_t)header[41] << 8 |
+                       (uint32_t)header[42] << 16 | (uint32_t)header[43] << 24;
+  TEST_ASSERT_EQUAL(OUTPUT_TEST_FRAMES * 4, data_size);
+  TEST_ASSERT_EQUAL(OUTPUT_TEST_RATE,
+                    header[24] | header[25] << 8 | header[26] << 16);
+  TEST_ASSERT_EQUAL(4, fread(samples, sizeof(samples[0]), 4, file));
+  for (int i = 0; i < 4; i++)
+    TEST_ASSERT_EQUAL((int16_t)(i * 37), samples[i]);
+  fseek(file, 0, SEEK_END);
+  TEST_ASSERT_EQUAL(44 + OUTPUT_TEST_FRAMES * 4, ftell(file));
+  fclose(file);
+  remove(path);
+  remove(dir);
+}
+
+void test_output_session(void) {
+  output_session_t session = {0};
+  audio_output_t *output, *first;
+  output_test_source_t sources[3] = {{0}};
+  output_config_t config = {
+    .backend = OUTPUT_BACKEND_NULL,
+    .sample_rate = OUTPUT_TEST_RATE,
+    .channels = 2,
+    .sample_format = AV_SAMPLE_FMT_S16,
+    .period_size = 240,
+  };
+
+  TEST_ASSERT_EQUAL(OASIS_SUCCESS,
+                    output_session_acquire(&session, &config, output_test_pull,
+                                           &sources[0], &first));
+  TEST_ASSERT_EQUAL(OASIS_SUCCESS, output_start(first));
+  while (!output_finished(first))
+    nanosleep((const struct timespec[]){{0, 1000000}}, NULL);
+  output_session_release(&session);
+
+  // The same format keeps the device, which plays the next source to its end
+  TEST_ASSERT_EQUAL(OASIS_SUCCESS,
+                    output_session_acquire(&session, &config, output_test_pull,
+                                           &sources[1], &output));
+  TEST_ASSERT_EQUAL_PTR(first, output);
+  TEST_ASSERT_FALSE(output_finished(output));
+  output_resume(output);
+  while (!output_finished(output))
+    nanosleep((const struct timespec[]){{0, 1000000}}, NULL);
+  TEST_ASSERT_EQUAL(OUTPUT_TEST_FRAMES, sources[1].frames);
+  TEST_ASSERT_EQUAL(2 * OUTPUT_TEST_FRAMES, output->frames_rendered);
+  output_session_release(&session);
+
+  // Another rate needs another device
+  config.sample_rate = OUTPUT_TEST_RATE / 2;
+  TEST_ASSERT_EQUAL(OASIS_SUCCESS,
+                    output_session_acquire(&session, &config, output_test_pull,
+                                           &sources[2], &output));
+  TEST_ASSERT_EQUAL(0, output->frames_rendered);
+  TEST_ASSERT_EQUAL(OUTPUT_TEST_RATE / 2, output->config.sample_rate);
+  TEST_ASSERT_EQUAL(OASIS_SUCCESS, output_start(output));
+  while (!output_finished(output))
+    nanosleep((const struct timespec[]){{0, 1000000}}, NULL);
+  TEST_ASSERT_EQUAL(OUTPUT_TEST_FRAMES, sources[2].frames);
+  output_session_close(&session);
+  TEST_ASSERT_FALSE(session.open);
+}
+
+typedef struct {
+  int16_t value;
+  size_t frames_left;
+} mixer_test_source_t;
+
+static size_t mixer_test_pull(void *user_data, uint8_t *buffer, size_t frames,
+                              int *end_of_stream) {
+  mixer_test_source_t *source = user_data;
+  int16_t *samples = (int16_t *)buffer;
+
+  if (frames > source->frames_left)
+    frames = source->frames_left;
+  for (size_t i = 0; i < frames * 2; i++)
+    samples[i] = source->value;
+
+  source->frames_left -= frames;
+  if (source->frames_left == 0)
+    *end_of_stream = 1;
+  return frames;
+}
+
+void test_mixer(void) {
+  mixer_t mixer;
+  int16_t out[4096 * 2];
+  int end_of_stream = 0;
+
+  TEST_ASSERT_EQUAL(OASIS_SUCCESS,
+                    mixer_init(&mixer, 48000, 2, AV_SAMPLE_FMT_S16));
+
+  // Sums, then saturates instead of wrapping
+  mixer_test_source_t a = {8192, 48000}, b = {16384, 3000};
+  int id_a = mixer_add_stream(&mixer, mixer_test_pull, &a, 1.0f);
+  int id_b = mixer_add_stream(&mixer, mixer_test_pull, &b, 1.0f);
+  TEST_ASSERT_TRUE(id_a >= 0 && id_b >= 0 && id_a != id_b);
+  TEST_ASSERT_EQUAL(1000, mixer_pull(&mixer, (uint8_t *)out, 1000,
+                                     &end_of_stream));
+  TEST_ASSERT_EQUAL(24576, out[0]);
+  TEST_ASSERT_EQUAL(24576, out[1999]);
+
+  mixer_set_gain(&mixer, id_b, 2.0f, 0);
+  mixer_pull(&mixer, (uint8_t *)out, 1000, &end_of_stream);
+  TEST_ASSERT_EQUAL(32767, out[0]);
+
+  // b runs out on the way, a carries on alone
+  mixer_set_gain(&mixer, id_b, 1.0f, 0);
+  TEST_ASSERT_EQUAL(2000, mixer_pull(&mixer, (uint8_t *)out, 2000,
+                                     &end_of_stream));
+  TEST_ASSERT_EQUAL(24576, out[1999]);
+  TEST_ASSERT_EQUAL(8192, out[2000]);
+  TEST_ASSERT_FALSE(mixer_stream_active(&mixer, id_b));
+  TEST_ASSERT_EQUAL(0, end_of_stream);
+
+  // A linear fade out, half way is half the level, then the stream is gone
+  mixer_fade_out(&mixer, id_a, 4096);
+  mixer_pull(&mixer, (uint8_t *)out, 4096, &end_of_stream);
+  TEST_ASSERT_EQUAL(8192, out[0]);
+  TEST_ASSERT_TRUE(abs(out[2048 * 2] - 4096) <= 1);
+  TEST_ASSERT_TRUE(abs(out[4095 * 2]) <= 2);
+  TEST_ASSERT_FALSE(mixer_stream_active(&mixer, id_a));
+  TEST_ASSERT_EQUAL(0, mixer_pull(&mixer, (uint8_t *)out, 16,
+                                  &end_of_stream));
+  TEST_ASSERT_EQUAL(1, end_of_stream);
+  mixer_free(&mixer);
+
+  // The vector kernels agree with the plain definition at every channel count
+  float acc[1003 * 8], ref[1003 * 8], src[1003 * 8];
+  for (int channels = 1; channels <= 8; channels++) {
+    size_t frames = 1003;
+    for (size_t i = 0; i < frames * channels; i++) {
+      src[i] = (float)((i * 37) % 101) / 101.0f - 0.5f;
+      acc[i] = ref[i] = 0.25f;
+    }
+    mixer_mix_float(acc, src, frames, channels, 0.9f, -0.0008f);
+    for (size_t f = 0; f < frames; f++) {
+      for (int c = 0; c < channels; c++)
+        ref[f * channels + c] += src[f * channels + c] * (0.9f - 0.0008f * f);
+    }
+    for (size_t i = 0; i < frames * channels; i++)
+      TEST_ASSERT_FLOAT_WITHIN(1e-5f, ref[i], acc[i]);
+  }
+  oasis_log(NULL, LOG_LEVEL_INFO, "Mixer kernels: %s", mixer_get_isa_name());
+}
+
+typedef struct {
+  mixer_t *mixer;
+  int stop;
+  int pulls;
+} realtime_test_puller_t;
+
+static void *realtime_test_pull_main(void *arg) {
+  realtime_test_puller_t *puller = arg;
+  int16_t out[256 * 2];
+  int end_of_stream = 0;
+
+  realtime_enter();
+  while (!__atomic_load_n(&puller->stop, __ATOMIC_ACQUIRE)) {
+    mixer_pull(puller->mixer, (uint8_t *)out, 256, &end_of_stream);
+    __atomic_fetch_add(&puller->pulls, 1, __ATOMIC_RELEASE);
+  }
+  realtime_leave();
+  return NULL;
+}
+
+void test_realtime(void) {
+  const char *first = NULL;
+
+  // Logging from a real-time thread is dropped and counted
+  realtime_reset_violations();
+  realtime_enter();
+  TEST_ASSERT_TRUE(realtime_active());
+  oasis_log(NULL, LOG_LEVEL_ERROR, "Not printed");
+  realtime_leave();
+  TEST_ASSERT_FALSE(realtime_active());
+  oasis_log(NULL, LOG_LEVEL_DEBUG, "Printed");
+  TEST_ASSERT_EQUAL(1, realtime_get_violations(&first));
+  TEST_ASSERT_EQUAL_STRING("oasis_log", first);
+  realtime_reset_violations();
+
+  // The mix is pulled on a real-time thread while streams come and go, once a
+  // removal returns the source is not pulled again
+  mixer_t mixer;
+  realtime_test_puller_t puller = {.mixer = &mixer};
+  pthread_t thread;
+  TEST_ASSERT_EQUAL(OASIS_SUCCESS,
+                    mixer_init(&mixer, 48000, 2, AV_SAMPLE_FMT_S16));
+  mixer_test_source_t keep = {1000, SIZE_MAX};
+  mixer_add_stream(&mixer, mixer_test_pull, &keep, 1.0f);
+  TEST_ASSERT_EQUAL(0, pthread_create(&thread, NULL, realtime_test_pull_main,
+                                      &puller));
+
+  int late_pulls = 0;
+  for (int i = 0; i < 200; i++) {
+    mixer_test_source_t source = {2000, SIZE_MAX};
+    int id = mixer_add_stream(&mixer, mixer_test_pull, &source, 0.0f);
+    TEST_ASSERT_TRUE(id >= 0);
+    mixer_set_gain(&mixer, id, 1.0f, 64);
+    nanosleep((const struct timespec[]){{0, 100000}}, NULL);
+    mixer_remove_stream(&mixer, id);
+    TEST_ASSERT_FALSE(mixer_stream_active(&mixer, id));
+
+    size_t left = source.frames_left;
+    nanosleep((const struct timespec[]){{0, 100000}}, NULL);
+    late_pulls += left != source.frames_left;
+  }
+
+  __atomic_store_n(&puller.stop, 1, __ATOMIC_RELEASE);
+  pthread_join(thread, NULL);
+  mixer_free(&mixer);
+  TEST_ASSERT_EQUAL(0, late_pulls);
+  TEST_ASSERT_TRUE(puller.pulls > 0);
+
+  // A polling producer is fed by a consumer that never wakes it
+  ring_buffer_t rb;
+  uint8_t block[1024];
+  size_t consumed = 0;
+  int mismatches = 0;
+  TEST_ASSERT_EQUAL(OASIS_SUCCESS, ring_buffer_init(&rb, 16384, 4096, 12288));
+  ring_buffer_set_poll_ms(&rb, 1);
+  TEST_ASSERT_EQUAL(0, pthread_create(&thread, NULL, ring_test_producer, &rb));
+
+  realtime_enter();
+  while (!ring_buffer_drained(&rb)) {
+    size_t count = ring_buffer_read(&rb, block, sizeof(block));
+    for (size_t i = 0; i < count; i++) {
+      if (block[i] != (uint8_t)((consumed + i) * 13))
+        mismatches++;
+    }
+    consumed += count;
+  }
+  realtime_leave();
+
+  pthread_join(thread, NULL);
+  ring_buffer_free(&rb);
+  TEST_ASSERT_EQUAL(RING_TEST_BYTES, consumed);
+  TEST_ASSERT_EQUAL(0, mismatches);
+
+  // Debug builds would have counted any allocation on the way
+  TEST_ASSERT_EQUAL(0, realtime_get_violations(&first));
+}
+
+void test_sample_convert(void) {
+  enum { COUNT = 65536 + 13 };
+  int16_t *s16 = malloc(COUNT * sizeof(*s16));
+  int16_t *back = malloc(COUNT * sizeof(*back));
+  float *flt = malloc(COUNT * sizeof(*flt));
+  int32_t *s32 = malloc(COUNT * sizeof(*s32));
+  TEST_ASSERT_TRUE(s16 && back && flt && s32);
+
+  // Every 16 bit value makes it to float and back unchanged, and widens to 32
+  // bits exactly
+  for (int i = 0; i < COUNT; i++)
+    s16[i] = (int16_t)(i - 32768);
+  TEST_ASSERT_EQUAL(OASIS_SUCCESS,
+                    sample_convert((uint8_t *)flt, AV_SAMPLE_FMT_FLT,
+                                   (uint8_t *)s16, AV_SAMPLE_FMT_S16, COUNT));
+  TEST_ASSERT_EQUAL(OASIS_SUCCESS,
+                    sample_convert((uint8_t *)back, AV_SAMPLE_FMT_S16,
+                                   (uint8_t *)flt, AV_SAMPLE_FMT_FLT, COUNT));
+  TEST_ASSERT_EQUAL(0, memcmp(s16, back, COUNT * sizeof(*s16)));
+  sample_convert((uint8_t *)s32, AV_SAMPLE_FMT_S32, (uint8_t *)s16,
+                 AV_SAMPLE_FMT_S16, COUNT);
+  sample_convert((uint8_t *)back, AV_SAMPLE_FMT_S16, (uint8_t *)s32,
+                 AV_SAMPLE_FMT_S32, COUNT);
+  TEST_ASSERT_EQUAL(s16[100] * 65536, s32[100]);
+  TEST_ASSERT_EQUAL(0, memcmp(s16, back, COUNT * sizeof(*s16)));
+
+  // Out of range floats saturate, in the vector loops and in the tails
+  float hot[17];
+  int16_t hot_s16[17];
+  int32_t hot_s32[17];
+  uint8_t hot_u8[17];
+  for (int i = 0; i < 16; i += 4) {
+    hot[i] = 1.0f;
+    hot[i + 1] = -1.0f;
+    hot[i + 2] = 2.5f;
+    hot[i + 3] = -3.0f;
+  }
+  hot[16] = 0.5f;
+  sample_convert((uint8_t *)hot_s16, AV_SAMPLE_FMT_S16, (uint8_t *)hot,
+                 AV_SAMPLE_FMT_FLT, 17);
+  sample_convert((uint8_t *)hot_s32, AV_SAMPLE_FMT_S32, (uint8_t *)hot,
+                 AV_SAMPLE_FMT_FLT, 17);
+  sample_convert(hot_u8, AV_SAMPLE_FMT_U8, (uint8_t *)hot, AV_SAMPLE_FMT_FLT,
+                 17);
+  for (int i = 0; i < 16; i += 4) {
+    TEST_ASSERT_EQUAL(32767, hot_s16[i]);
+    TEST_ASSERT_EQUAL(-32768, hot_s16[i + 1]);
+    TEST_ASSERT_EQUAL(32767, hot_s16[i + 2]);
+    TEST_ASSERT_EQUAL(-32768, hot_s16[i + 3]);
+    TEST_ASSERT_TRUE(hot_s32[i + 2] > 2147483000);
+    TEST_ASSERT_EQUAL(INT32_MIN, hot_s32[i + 3]);
+    TEST_ASSERT_EQUAL(255, hot_u8[i]);
+    TEST_ASSERT_EQUAL(0, hot_u8[i + 1]);
+  }
+  TEST_ASSERT_EQUAL(16384, hot_s16[16]);
+  TEST_ASSERT_EQUAL(192, hot_u8[16]);
+
+  // NaN and floats too large for int32 agree between the vector loops and
+  // the tails, silence and saturation
+  const float wild_values[4] = {NAN, 1e10f, -1e10f, INFINITY};
+  const int16_t wild_expected[4] = {0, 32767, -32768, 32767};
+  float wild[35];
+  int16_t wild_s16[35];
+  for (int i = 0; i < 35; i++)
+    wild[i] = wild_values[i % 4];
+  sample_convert((uint8_t *)wild_s16, AV_SAMPLE_FMT_S16, (uint8_t *)wild,
+                 AV_SAMPLE_FMT_FLT, 35);
+  for (int i = 0; i < 35; i++)
+    TEST_ASSERT_EQUAL(wild_expected[i % 4], wild_s16[i]);
+
+  // A dithered constant between two steps lands on both, around the value
+  sample_converter_t converter;
+  TEST_ASSERT_EQUAL(OASIS_SUCCESS,
+                    sample_converter_init(&converter, AV_SAMPLE_FMT_FLT,
+                                          AV_SAMPLE_FMT_S16, 1, 16));
+  for (int i = 0; i < COUNT; i++)
+    flt[i] = 100.25f / 32768.0f;
+  uint8_t *dst = (uint8_t *)back, *src = (uint8_t *)flt;
+  sample_converter_run(&converter, &dst, &src, 0, COUNT);
+  double sum = 0.0;
+  for (int i = 0; i < COUNT; i++) {
+    TEST_ASSERT_TRUE(back[i] >= 99 && back[i] <= 101);
+    sum += back[i];
+  }
+  TEST_ASSERT_TRUE(fabs(sum / COUNT - 100.25) < 0.02);
+  sample_converter_free(&converter);
+
+  // Planar S16 to packed float and packed float to planar S32
+  int16_t left[300], right[300];
+  float packed[600];
+  int32_t planes_s32[2][300];
+  for (int i = 0; i < 300; i++) {
+    left[i] = (int16_t)(i * 100);
+    right[i] = (int16_t)(-i * 100);
+  }
+  uint8_t *planar_src[] = {(uint8_t *)left, (uint8_t *)right};
+  uint8_t *packed_plane[] = {(uint8_t *)packed};
+  TEST_ASSERT_EQUAL(OASIS_SUCCESS,
+                    sample_converter_init(&converter, AV_SAMPLE_FMT_S16P,
+                                          AV_SAMPLE_FMT_FLT, 2, 0));
+  sample_converter_run(&converter, packed_plane, planar_src, 10, 290);
+  TEST_ASSERT_FLOAT_WITHIN(1e-6f, 1000.0f / 32768.0f, packed[0]);
+  TEST_ASSERT_FLOAT_WITHIN(1e-6f, -29900.0f / 32768.0f, packed[579]);
+  sample_converter_free(&converter);
+
+  uint8_t *planar_dst[] = {(uint8_t *)planes_s32[0], (uint8_t *)planes_s32[1]};
+  TEST_ASSERT_EQUAL(OASIS_SUCCESS,
+                    sample_converter_init(&converter, AV_SAMPLE_FMT_FLT,
+                                          AV_SAMPLE_FMT_S32P, 2, 0));
+  sample_converter_run(&converter, planar_dst, packed_plane, 0, 290);
+  TEST_ASSERT_EQUAL(1000 * 65536, planes_s32[0][0]);
+  TEST_ASSERT_EQUAL(-29900 * 65536, planes_s32[1][289]);
+  sample_converter_free(&converter);
+
+  oasis_log(NULL, LOG_LEVEL_INFO, "Sample conversion kernels: %s",
+            sample_convert_get_isa_name());
+  free(s16);
+  free(back);
+  free(flt);
+  free(s32);
+}
+
+void test_channel_mix(void) {
+  channel_matrix_t matrix;
+  channel_mixer_t mixer;
+
+  // ITU 5.1 to stereo, scaled so a full scale mix does not clip
+  TEST_ASSERT_EQUAL(OASIS_SUCCESS, channel_matrix_standard(&matrix, 6, 2));
+  float front = 1.0f / (1.0f + 2.0f * 0.70710678f);
+  TEST_ASSERT_FLOAT_WITHIN(1e-6f, front, matrix.coefficients[0][0]);
+  TEST_ASSERT_FLOAT_WITHIN(1e-6f, 0.0f, matrix.coefficients[0][1]);
+  TEST_ASSERT_FLOAT_WITHIN(1e-6f, front * 0.70710678f,
+                           matrix.coefficients[1][2]);
+  TEST_ASSERT_FLOAT_WITHIN(1e-6f, 0.0f, matrix.coefficients[1][3]);
+  TEST_ASSERT_FLOAT_WITHIN(1e-6f, front * 0.70710678f,
+                           matrix.coefficients[1][5]);
+
+  // Mono and stereo both ways, and 7.1 backs into the 5.1 sides
+  TEST_ASSERT_EQUAL(OASIS_SUCCESS, channel_matrix_standard(&matrix, 1, 2));
+  TEST_ASSERT_FLOAT_WITHIN(1e-6f, 0.70710678f, matrix.coefficients[1][0]);
+  TEST_ASSERT_EQUAL(OASIS_SUCCESS, channel_matrix_standard(&matrix, 2, 1));
+  TEST_ASSERT_FLOAT_WITHIN(1e-6f, 0.5f, matrix.coefficients[0][1]);
+  TEST_ASSERT_EQUAL(OASIS_SUCCESS, channel_matrix_standard(&matrix, 8, 6));
+  TEST_ASSERT_TRUE(matrix.coefficients[4][4] > 0.0f);
+  TEST_ASSERT_TRUE(matrix.coefficients[4][6] > matrix.coefficients[4][4]);
+  TEST_ASSERT_EQUAL(OASIS_ERROR_UNSUPPORTED_FORMAT,
+                    channel_matrix_standard(&matrix, 3, 2));
+
+  // Every kernel agrees with the plain sum at every channel count, with frame
+  // counts that end in the middle of a vector
+  enum { FRAMES = 301 };
+  float src[FRAMES * 8], dst[FRAMES * 8 + 1];
+  for (int i = 0; i < FRAMES * 8; i++)
+    src[i] = (float)((i * 37) % 101) / 101.0f - 0.5f;
+  for (int in = 1; in <= CHANNEL_MIX_MAX_CHANNELS; in++) {
+    for (int out = 1; out <= CHANNEL_MIX_MAX_CHANNELS; out++) {
+      memset(&matrix, 0, sizeof(matrix));
+      matrix.in_channels = in;
+      matrix.out_channels = out;
+      for (int o = 0; o < out; o++) {
+        for (int i = 0; i < in; i++)
+          matrix.coefficients[o][i] = (float)((o * 7 + i * 3) % 5) * 0.25f;
+      }
+      TEST_ASSERT_EQUAL(OASIS_SUCCESS, channel_mixer_init(&mixer, &matrix));
+
+      dst[FRAMES * out] = 42.0f;
+      channel_mixer_run(&mixer, dst, src, FRAMES);
+      TEST_ASSERT_FLOAT_WITHIN(0.0f, 42.0f, dst[FRAMES * out]);
+      for (int f = 0; f < FRAMES; f++) {
+        for (int o = 0; o < out; o++) {
+          float sum = 0.0f;
+          for (int i = 0; i < in; i++)
+            sum += src[f * in + i] * matrix.coefficients[o][i];
+          TEST_ASSERT_FLOAT_WITHIN(1e-5f, sum, dst[f * out + o]);
+        }
+      }
+    }
+  }
+  oasis_log(NULL, LOG_LEVEL_INFO, "Channel mix kernels: %s",
+            channel_mix_get_isa_name());
+}
+
+// Counts what the chain hands it, and scales it to tell nodes apart
+typedef struct {
+  dsp_node_t node;
+  size_t largest;
+  float factor;
+} dsp_test_node_t;
+
+static void dsp_test_process(dsp_node_t *node, float *block, size_t frames) {
+  dsp_test_node_t *test = (dsp_test_node_t *)node;
+  if (frames > test->largest)
+    test->largest = frames;
+  for (size_t i = 0; i < frames * node->channels; i++)
+    block[i] = block[i] * test->factor + 1.0f;
+}
+
+void test_dsp(void) {
+  enum { FRAMES = 1000 };
+  static float samples[FRAMES * DSP_MAX_CHANNELS];
+  static float expected[FRAMES * DSP_MAX_CHANNELS];
+  dsp_chain_t chain;
+  dsp_gain_t gain;
+  dsp_test_node_t test = {
+    .node = {.name = "test", .process = dsp_test_process, .channels = 2},
+    .factor = 2.0f,
+  };
+
+  // Nodes run in order, a block at a time, and can be bypassed
+  TEST_ASSERT_EQUAL(OASIS_SUCCESS, dsp_chain_init(&chain, 2));
+  dsp_gain_init(&gain, 2);
+  dsp_gain_set_db(&gain, -6.0206f);
+  TEST_ASSERT_EQUAL(OASIS_SUCCESS, dsp_chain_add(&chain, &gain.node));
+  TEST_ASSERT_EQUAL(OASIS_SUCCESS, dsp_chain_add(&chain, &test.node));
+  for (int i = 0; i < FRAMES * 2; i++)
+    samples[i] = 1.0f;
+  chain.profile = 1;
+  dsp_chain_process(&chain, samples, FRAMES);
+  TEST_ASSERT_FLOAT_WITHIN(1e-4f, 2.0f, samples[0]);
+  TEST_ASSERT_FLOAT_WITHIN(1e-4f, 2.0f, samples[FRAMES * 2 - 1]);
+  TEST_ASSERT_EQUAL(DSP_BLOCK_FRAMES, test.largest);
+  TEST_ASSERT_EQUAL((FRAMES + DSP_BLOCK_FRAMES - 1) / DSP_BLOCK_FRAMES,
+                    test.node.blocks);
+  dsp_node_set_bypass(&gain.node, 1);
+  dsp_chain_process(&chain, samples, 1);
+  TEST_ASSERT_FLOAT_WITHIN(1e-4f, 5.0f, samples[0]);
+  dsp_test_node_t other = {.node = {.name = "other", .channels = 6}};
+  other.node.process = dsp_test_process;
+  TEST_ASSERT_EQUAL(OASIS_ERROR_INVALID_ARGUMENT,
+                    dsp_chain_add(&chain, &other.node));
+
+  // Tagged gains, held under the peak, and R128 gains at the same reference
+  AVDictionary *tags = NULL;
+  float db;
+  av_dict_set(&tags, "REPLAYGAIN_TRACK_GAIN", "-7.50 dB", 0);
+  av_dict_set(&tags, "REPLAYGAIN_TRACK_PEAK", "0.5", 0);
+  TEST_ASSERT_TRUE(
+    dsp_replaygain_from_tags(tags, DSP_REPLAYGAIN_TRACK, 0.0f, &db));
+  TEST_ASSERT_FLOAT_WITHIN(1e-4f, -7.5f, db);
+  TEST_ASSERT_TRUE(
+    dsp_replaygain_from_tags(tags, DSP_REPLAYGAIN_TRACK, 15.0f, &db));
+  TEST_ASSERT_FLOAT_WITHIN(1e-3f, 6.0206f, db);
+  TEST_ASSERT_TRUE(
+    dsp_replaygain_from_tags(tags, DSP_REPLAYGAIN_ALBUM, 0.0f, &db));
+  TEST_ASSERT_FLOAT_WITHIN(1e-4f, -7.5f, db);
+  TEST_ASSERT_FALSE(
+    dsp_replaygain_from_tags(tags, DSP_REPLAYGAIN_OFF, 0.0f, &db));
+  av_dict_free(&tags);
+  av_dict_set(&tags, "R128_TRACK_GAIN", "-512", 0);
+  TEST_ASSERT_TRUE(
+    dsp_replaygain_from_tags(tags, DSP_REPLAYGAIN_TRACK, 0.0f, &db));
+  TEST_ASSERT_FLOAT_WITHIN(1e-4f, 3.0f, db);
+  av_dict_free(&tags);
+  TEST_ASSERT_FALSE(
+    dsp_replaygain_from_tags(tags, DSP_REPLAYGAIN_TRACK, 0.0f, &db));
+
+  // A volume change glides down without a step larger than the ramp's
+  dsp_volume_t volume;
+  int ramp = 48000 * DSP_VOLUME_RAMP_MS / 1000;
+  dsp_volume_init(&volume, 1, 48000, 0.0f);
+  for (int i = 0; i < FRAMES; i++)
+    samples[i] = 1.0f;
+  dsp_volume_set_db(&volume, DSP_VOLUME_MUTE_DB);
+  TEST_ASSERT_FLOAT_WITHIN(1e-4f, DSP_VOLUME_MUTE_DB,
+                           dsp_volume_get_db(&volume));
+  volume.node.process(&volume.node, samples, FRAMES);
+  for (int i = 1; i < FRAMES; i++) {
+    TEST_ASSERT_TRUE(samples[i] <= samples[i - 1]);
+    TEST_ASSERT_TRUE(samples[i - 1] - samples[i] <= 1.01f / ramp);
+  }
+  TEST_ASSERT_TRUE(samples[ramp / 2] > 0.4f && samples[ramp / 2] < 0.6f);
+  TEST_ASSERT_FLOAT_WITHIN(0.0f, 0.0f, samples[ramp]);
+  TEST_ASSERT_FLOAT_WITHIN(0.0f, 0.0f, samples[FRAMES - 1]);
+
+  // Every EQ kernel agrees with the biquads run one channel at a time, at
+  // every channel count, across blocks
+  dsp_eq_t eq;
+  dsp_eq_band_t bands[] = {
+    {DSP_EQ_LOW_SHELF, 120.0, 4.0, 0.707},
+    {DSP_EQ_PEAK, 1000.0, -6.0, 1.4},
+    {DSP_EQ_HIGH_SHELF, 8000.0, 3.0, 0.707},
+    {DSP_EQ_HIGH_PASS, 30.0, 0.0, 0.707},
+  };
+  int band_count = sizeof(bands) / sizeof(bands[0]);
+  for (int channels = 1; channels <= DSP_MAX_CHANNELS; channels++) {
+    TEST_ASSERT_EQUAL(OASIS_SUCCESS,
+                      dsp_eq_init(&eq, channels, 48000, bands, band_count));
+    for (int i = 0; i < FRAMES * channels; i++)
+      samples[i] = (float)((i * 37) % 101) / 101.0f - 0.5f;
+
+    for (int c = 0; c < channels; c++) {
+      float z1[DSP_EQ_MAX_BANDS] = {0}, z2[DSP_EQ_MAX_BANDS] = {0};
+      for (int f = 0; f < FRAMES; f++) {
+        float x = samples[f * channels + c];
+        for (int b = 0; b < band_count; b++) {
+          const float *k = eq.coefficients[b];
+          float y = k[0] * x + z1[b];
+          z1[b] = k[1] * x - k[3] * y + z2[b];
+          z2[b] = k[2] * x - k[4] * y;
+          x = y;
+        }
+        expected[f * channels + c] = x;
+      }
+    }
+
+    TEST_ASSERT_EQUAL(OASIS_SUCCESS, dsp_chain_init(&chain, channels));
+    TEST_ASSERT_EQUAL(OASIS_SUCCESS, dsp_chain_add(&chain, &eq.node));
+    dsp_chain_process(&chain, samples, FRAMES);
+    for (int i = 0; i < FRAMES * channels; i++)
+      TEST_ASSERT_FLOAT_WITHIN(1e-6f, expected[i], samples[i]);
+  }
+
+  // A peak band boosts its centre and leaves the rest of the spectrum alone
+  dsp_eq_band_t peak = {DSP_EQ_PEAK, 1000.0, 6.0206, 2.0};
+  double peaks[2];
+  double frequencies[2] = {1000.0, 100.0};
+  for (int t = 0; t < 2; t++) {
+    TEST_ASSERT_EQUAL(OASIS_SUCCESS, dsp_eq_init(&eq, 1, 48000, &peak, 1));
+    TEST_ASSERT_EQUAL(OASIS_SUCCESS, dsp_chain_init(&chain, 1));
+    TEST_ASSERT_EQUAL(OASIS_SUCCESS, dsp_chain_add(&chain, &eq.node));
+    peaks[t] = 0.0;
+    for (int round = 0; round < 48; round++) {
+      for (int f = 0; f < FRAMES; f++) {
+        samples[f] = (float)(0.25 * sin(2.0 * 3.14159265358979 *
+                                          frequencies[t] *
+                                          (round * FRAMES + f) / 48000.0));
+      }
+      dsp_chain_process(&chain, samples, FRAMES);
+      for (int f = 0; round > 24 && f < FRAMES; f++)
+        peaks[t] = fabs(samples[f]) > peaks[t] ? fabs(samples[f]) : peaks[t];
+    }
+  }
+  TEST_ASSERT_FLOAT_WITHIN(0.01, 0.5, peaks[0]);
+  TEST_ASSERT_FLOAT_WITHIN(0.01, 0.25, peaks[1]);
+  TEST_ASSERT_EQUAL(OASIS_ERROR_INVALID_ARGUMENT,
+                    dsp_eq_init(&eq, 2, 48000,
+                                (dsp_eq_band_t[]){{DSP_EQ_PEAK, 30000.0, 0.0,
+                                                   1.0}},
+                                1));
+  oasis_log(NULL, LOG_LEVEL_INFO, "DSP kernels: %s", dsp_get_isa_name());
+}
+
 int main(void) {
   UNITY_BEGIN()
     ;
+  RUN_TEST(test_interleave);
+  RUN_TEST(test_ring_buffer);
+  RUN_TEST(test_command_queue);
+  RUN_TEST(test_seek_index);
+  RUN_TEST(test_pcm_cache);
+  RUN_TEST(test_pcm_store);
+  RUN_TEST(test_stream_selection);
+  RUN_TEST(test_output_null);
+  RUN_TEST(test_output_sinks);
+  RUN_TEST(test_output_session);
+  RUN_TEST(test_mixer);
+  RUN_TEST(test_realtime);
+  RUN_TEST(test_sample_convert);
+  RUN_TEST(test_channel_mix);
+  RUN_TEST(test_dsp);
   RUN_TEST(test_audio_decode);
+  RUN_TEST(test_batch_decode);
+  RUN_TEST(test_audio_probe);
+  RUN_TEST(test_packet_track);
+  RUN_TEST(test_decoder_gapless);
+  RUN_TEST(test_decoder_resample);
+  RUN_TEST(test_play_queue);
   RUN_TEST(test_audio_playback);
 
   UNITY_END();
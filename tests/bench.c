@@ -0,0 +1,442 @@
+#define _XOPEN_SOURCE 700
+
+// This include is necessary to prevent linker errors during compilation
+#include "oasis/utils.h"
+#define CLAY_IMPLEMENTATION
+#include <clay.h>
+
+#include <dirent.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include <oasis/audio/channel_mix.h>
+#include <oasis/audio/decode.h>
+#include <oasis/audio/dsp.h>
+#include <oasis/audio/mixer.h>
+#include <oasis/audio/mmap_input.h>
+#include <oasis/audio/playback.h>
+#include <oasis/audio/probe.h>
+#include <oasis/audio/resample.h>
+#include <oasis/audio/sample_convert.h>
+#include <unity/unity.h>
+
+#define BENCH_ROUNDS 5
+#define BENCH_MAX_FILES 256
+#define BENCH_MIX_STREAMS 8
+#define BENCH_MIX_SECONDS 60
+#define BENCH_CONVERT_SECONDS 60
+#define BENCH_CONVERT_BLOCK 1024 // Frames per call, about a decoded frame
+#define BENCH_KERNEL_SAMPLES 16384 // Per call, stays in cache
+#define BENCH_KERNEL_CALLS 2000
+#define BENCH_REMIX_SECONDS 600
+#define BENCH_DSP_SECONDS 600
+
+char *base_path = "./resources/test_files";
+static char *files[BENCH_MAX_FILES];
+static int file_count = 0;
+
+static void collect_files(const char *path) {
+  DIR *dir = opendir(path);
+  if (!dir)
+    return;
+
+  struct dirent *entry;
+  struct stat path_stat;
+  while ((entry = readdir(dir)) != NULL && file_count < BENCH_MAX_FILES) {
+    if (entry->d_name[0] == '.')
+      continue;
+
+    char full_path[512];
+    snprintf(full_path, sizeof(full_path), "%s/%s", path, entry->d_name);
+    if (stat(full_path, &path_stat) != 0)
+      continue;
+
+    if (S_ISDIR(path_stat.st_mode)) {
+      collect_files(full_path);
+    } else if (S_ISREG(path_stat.st_mode)) {
+      files[file_count++] = strdup(full_path);
+    }
+  }
+
+  closedir(dir);
+}
+
+static double now_seconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+// Reads every packet of a file, which is all the input layer is involved in
+static int demux_file(const char *filename, uint64_t *bytes) {
+  AVFormatContext *fmt_ctx = NULL;
+  mmap_input_t input;
+
+  if (mmap_input_open_format(&fmt_ctx, &input, filename) != OASIS_SUCCESS)
+    return -1;
+
+  AVPacket *packet = av_packet_alloc();
+  while (packet && av_read_frame(fmt_ctx, packet) >= 0) {
+    *bytes += packet->size;
+    av_packet_unref(packet);
+  }
+
+  av_packet_free(&packet);
+  avformat_close_input(&fmt_ctx);
+  mmap_input_close(&input);
+  return 0;
+}
+
+static double bench_demux(int mapped, uint64_t *bytes) {
+  if (mapped)
+    unsetenv("OASIS_NO_MMAP");
+  else
+    setenv("OASIS_NO_MMAP", "1", 1);
+
+  double start = now_seconds();
+  for (int round = 0; round < BENCH_ROUNDS; round++) {
+    for (int i = 0; i < file_count; i++)
+      demux_file(files[i], bytes);
+  }
+  double elapsed = now_seconds() - start;
+
+  unsetenv("OASIS_NO_MMAP");
+  return elapsed;
+}
+
+static double bench_decode(int mapped, uint64_t *bytes) {
+  if (mapped)
+    unsetenv("OASIS_NO_MMAP");
+  else
+    setenv("OASIS_NO_MMAP", "1", 1);
+
+  double start = now_seconds();
+  for (int i = 0; i < file_count; i++) {
+    audio_data_t audio_data = {0};
+    if (decode_file_to_pcm(files[i], &audio_data) == OASIS_SUCCESS) {
+      *bytes += audio_data.pcm_size;
+      audio_data_free(&audio_data);
+    }
+  }
+  double elapsed = now_seconds() - start;
+
+  unsetenv("OASIS_NO_MMAP");
+  return elapsed;
+}
+
+void setUp(void) {}
+
+void tearDown(void) {}
+
+void bench_mmap_input(void) {
+  if (file_count == 0) {
+    TEST_IGNORE_MESSAGE("No files to benchmark");
+  }
+
+  // Warm the page cache so both paths read from memory
+  uint64_t warm = 0;
+  bench_demux(0, &warm);
+
+  uint64_t read_bytes = 0, mapped_bytes = 0;
+  double read_time = bench_demux(0, &read_bytes);
+  double mapped_time = bench_demux(1, &mapped_bytes);
+  TEST_ASSERT_EQUAL(read_bytes, mapped_bytes);
+
+  oasis_log(NULL, LOG_LEVEL_INFO,
+            "Demux of %d files x%d: read %.3f s (%.1f MB/s), mmap %.3f s "
+            "(%.1f MB/s), %.2fx",
+            file_count, BENCH_ROUNDS, read_time,
+            read_bytes / read_time / (1024.0 * 1024.0), mapped_time,
+            mapped_bytes / mapped_time / (1024.0 * 1024.0),
+            read_time / mapped_time);
+
+  read_bytes = mapped_bytes = 0;
+  read_time = bench_decode(0, &read_bytes);
+  mapped_time = bench_decode(1, &mapped_bytes);
+  TEST_ASSERT_EQUAL(read_bytes, mapped_bytes);
+
+  oasis_log(NULL, LOG_LEVEL_INFO,
+            "Decode of %d files: read %.3f s, mmap %.3f s, %.2fx", file_count,
+            read_time, mapped_time, read_time / mapped_time);
+}
+
+static size_t bench_mix_pull(void *user_data, uint8_t *buffer, size_t frames,
+                             int *end_of_stream) {
+  const float *tone = user_data;
+  memcpy(buffer, tone, frames * 2 * sizeof(float));
+  return frames;
+}
+
+void bench_mixer(void) {
+  static float tones[BENCH_MIX_STREAMS][MIXER_BLOCK_FRAMES * 2];
+  static float out[MIXER_BLOCK_FRAMES * 2];
+  mixer_t mixer;
+  int ids[BENCH_MIX_STREAMS];
+  int end_of_stream = 0;
+
+  TEST_ASSERT_EQUAL(OASIS_SUCCESS,
+                    mixer_init(&mixer, 48000, 2, AV_SAMPLE_FMT_FLT));
+  for (int s = 0; s < BENCH_MIX_STREAMS; s++) {
+    for (int i = 0; i < MIXER_BLOCK_FRAMES * 2; i++)
+      tones[s][i] = (float)((i * (s + 3)) % 200) / 400.0f - 0.25f;
+    ids[s] = mixer_add_stream(&mixer, bench_mix_pull, tones[s], 0.5f);
+    TEST_ASSERT_TRUE(ids[s] >= 0);
+  }
+
+  // Every stream keeps ramping, the slow path of the kernel
+  size_t total = (size_t)48000 * BENCH_MIX_SECONDS;
+  double start = now_seconds();
+  for (size_t done = 0; done < total; done += MIXER_BLOCK_FRAMES) {
+    size_t period = (size_t)48 * MIXER_BLOCK_FRAMES;
+    if (done % period == 0) {
+      for (int s = 0; s < BENCH_MIX_STREAMS; s++)
+        mixer_set_gain(&mixer, ids[s], (done / period) % 2 ? 0.5f : 0.1f,
+                       period);
+    }
+    mixer_pull(&mixer, (uint8_t *)out, MIXER_BLOCK_FRAMES, &end_of_stream);
+  }
+  double elapsed = now_seconds() - start;
+  mixer_free(&mixer);
+
+  double load = elapsed / BENCH_MIX_SECONDS * 100.0;
+  oasis_log(NULL, LOG_LEVEL_INFO,
+            "Mixing %d stereo streams at 48 kHz (%s): %.3f%% of a core",
+            BENCH_MIX_STREAMS, mixer_get_isa_name(), load);
+  TEST_ASSERT_TRUE(load < 1.0);
+}
+
+// Converts a minute of a stereo source in decoder sized blocks, which is what
+// playback pays on top of decoding for every track not already in the
+// internal format
+static double bench_convert(int in_rate, enum AVSampleFormat in_format,
+                            int out_rate) {
+  static uint8_t in[BENCH_CONVERT_BLOCK * 2 * 8];
+  static uint8_t out[BENCH_CONVERT_BLOCK * 4 * 2 * 4];
+  resampler_t resampler = {0};
+
+  for (size_t i = 0; i < sizeof(in); i++)
+    in[i] = (uint8_t)(i * 37);
+  uint8_t *planes[2] = {in, in + sizeof(in) / 2};
+
+  TEST_ASSERT_EQUAL(OASIS_SUCCESS,
+                    resampler_configure(&resampler, in_rate, 2, in_format,
+                                        out_rate,
+                                        AUDIO_INTERNAL_SAMPLE_FORMAT));
+  size_t total = (size_t)in_rate * BENCH_CONVERT_SECONDS;
+  double start = now_seconds();
+  for (size_t done = 0; done < total; done += BENCH_CONVERT_BLOCK) {
+    int converted = resampler_convert(&resampler, out, BENCH_CONVERT_BLOCK * 4,
+                                      planes, 0, BENCH_CONVERT_BLOCK);
+    TEST_ASSERT_TRUE(converted >= 0);
+  }
+  double elapsed = now_seconds() - start;
+
+  oasis_log(NULL, LOG_LEVEL_INFO,
+            "Converting %d Hz %s to %d Hz %s%s: %.3f%% of a core", in_rate,
+            av_get_sample_fmt_name(in_format), out_rate,
+            av_get_sample_fmt_name(AUDIO_INTERNAL_SAMPLE_FORMAT),
+            resampler.passthrough ? " (passthrough)" : "",
+            elapsed / BENCH_CONVERT_SECONDS * 100.0);
+  resampler_free(&resampler);
+  return elapsed;
+}
+
+void bench_resample(void) {
+  double passthrough = bench_convert(48000, AV_SAMPLE_FMT_FLTP, 48000);
+  double format = bench_convert(48000, AV_SAMPLE_FMT_S16P, 48000);
+  double rate = bench_convert(44100, AV_SAMPLE_FMT_S16P, 48000);
+
+  // Whatever the source, conversion is a small part of real time
+  TEST_ASSERT_TRUE(passthrough < BENCH_CONVERT_SECONDS / 10.0);
+  TEST_ASSERT_TRUE(format < BENCH_CONVERT_SECONDS / 10.0);
+  TEST_ASSERT_TRUE(rate < BENCH_CONVERT_SECONDS / 10.0);
+}
+
+// Every conversion kernel on a block that stays in cache, counting the bytes
+// read and written
+static double bench_kernel(enum AVSampleFormat src_format,
+                           enum AVSampleFormat dst_format, int dither) {
+  static uint8_t src[BENCH_KERNEL_SAMPLES * 8];
+  static uint8_t dst[BENCH_KERNEL_SAMPLES * 8];
+  sample_dither_t state = {16, {1, 2, 3, 4, 5, 6, 7, 8}};
+
+  sample_convert_fn kernel =
+    sample_convert_get_kernel(src_format, dst_format, dither);
+  TEST_ASSERT_NOT_NULL(kernel);
+
+  // Small values in every format, so floats stay in range
+  for (size_t i = 0; i < sizeof(src); i++)
+    src[i] = (uint8_t)(i % 8 == 7 ? 0x3e : i * 37 % 64);
+  double start = now_seconds();
+  for (int i = 0; i < BENCH_KERNEL_CALLS; i++)
+    kernel(dst, src, BENCH_KERNEL_SAMPLES, &state);
+  double elapsed = now_seconds() - start;
+
+  size_t bytes = (size_t)BENCH_KERNEL_SAMPLES * BENCH_KERNEL_CALLS *
+                 (av_get_bytes_per_sample(src_format) +
+                  av_get_bytes_per_sample(dst_format));
+  return (double)bytes / elapsed / 1e9;
+}
+
+void bench_sample_convert(void) {
+  static const enum AVSampleFormat formats[] = {
+    AV_SAMPLE_FMT_U8,  AV_SAMPLE_FMT_S16, AV_SAMPLE_FMT_S32,
+    AV_SAMPLE_FMT_S64, AV_SAMPLE_FMT_FLT, AV_SAMPLE_FMT_DBL};
+  size_t count = sizeof(formats) / sizeof(*formats);
+
+  oasis_log(NULL, LOG_LEVEL_INFO, "Sample conversion kernels: %s",
+            sample_convert_get_isa_name());
+  for (size_t i = 0; i < count; i++) {
+    for (size_t j = 0; j < count; j++) {
+      oasis_log(NULL, LOG_LEVEL_INFO, "%s to %s: %.2f GB/s",
+                av_get_sample_fmt_name(formats[i]),
+                av_get_sample_fmt_name(formats[j]),
+                bench_kernel(formats[i], formats[j], 0));
+    }
+  }
+
+  double plain = bench_kernel(AV_SAMPLE_FMT_FLT, AV_SAMPLE_FMT_S16, 0);
+  double dithered = bench_kernel(AV_SAMPLE_FMT_FLT, AV_SAMPLE_FMT_S16, 1);
+  oasis_log(NULL, LOG_LEVEL_INFO, "flt to s16 with 16 bit dither: %.2f GB/s",
+            dithered);
+  oasis_log(NULL, LOG_LEVEL_INFO, "s32 to s16 with 16 bit dither: %.2f GB/s",
+            bench_kernel(AV_SAMPLE_FMT_S32, AV_SAMPLE_FMT_S16, 1));
+
+  // Dither costs a few random numbers a sample, not a different league
+  TEST_ASSERT_TRUE(dithered > plain / 10.0);
+}
+
+// Remixes ten minutes of 48 kHz audio in decoder sized blocks
+static double bench_remix(int in_channels, int out_channels) {
+  static float in[CHANNEL_MIX_BLOCK_FRAMES * CHANNEL_MIX_MAX_CHANNELS];
+  static float out[CHANNEL_MIX_BLOCK_FRAMES * CHANNEL_MIX_MAX_CHANNELS];
+  channel_matrix_t matrix;
+  channel_mixer_t mixer;
+
+  for (size_t i = 0; i < sizeof(in) / sizeof(*in); i++)
+    in[i] = (float)(i % 97) / 97.0f - 0.5f;
+  TEST_ASSERT_EQUAL(OASIS_SUCCESS, channel_matrix_standard(
+                                     &matrix, in_channels, out_channels));
+  TEST_ASSERT_EQUAL(OASIS_SUCCESS, channel_mixer_init(&mixer, &matrix));
+
+  size_t total = (size_t)48000 * BENCH_REMIX_SECONDS;
+  double start = now_seconds();
+  for (size_t done = 0; done < total; done += CHANNEL_MIX_BLOCK_FRAMES)
+    channel_mixer_run(&mixer, out, in, CHANNEL_MIX_BLOCK_FRAMES);
+  double elapsed = now_seconds() - start;
+
+  double load = elapsed / BENCH_REMIX_SECONDS * 100.0;
+  oasis_log(NULL, LOG_LEVEL_INFO,
+            "Remixing %d to %d channels at 48 kHz (%s): %.4f%% of a core",
+            in_channels, out_channels, channel_mix_get_isa_name(), load);
+  return load;
+}
+
+void bench_channel_mix(void) {
+  TEST_ASSERT_TRUE(bench_remix(6, 2) < 1.0);
+  TEST_ASSERT_TRUE(bench_remix(8, 6) < 1.0);
+  TEST_ASSERT_TRUE(bench_remix(8, 2) < 1.0);
+  TEST_ASSERT_TRUE(bench_remix(1, 2) < 1.0);
+}
+
+// Ten minutes of 48 kHz audio through ReplayGain, a volume ramp and a ten
+// band EQ, timing every node on every block
+static double bench_dsp(int channels) {
+  static float samples[DSP_BLOCK_FRAMES * 4 * DSP_MAX_CHANNELS];
+  dsp_chain_t chain;
+  dsp_gain_t gain;
+  dsp_volume_t volume;
+  dsp_eq_t eq;
+  dsp_eq_band_t bands[DSP_EQ_MAX_BANDS];
+  size_t frames = sizeof(samples) / sizeof(*samples) / channels;
+
+  for (int b = 0; b < DSP_EQ_MAX_BANDS; b++) {
+    bands[b] = (dsp_eq_band_t){DSP_EQ_PEAK, 31.25 * (1 << b),
+                               (double)(b % 5) - 2.0, 1.4};
+  }
+  TEST_ASSERT_EQUAL(OASIS_SUCCESS, dsp_chain_init(&chain, channels));
+  dsp_gain_init(&gain, channels);
+  dsp_gain_set_db(&gain, -7.5f);
+  dsp_volume_init(&volume, channels, 48000, 0.0f);
+  TEST_ASSERT_EQUAL(OASIS_SUCCESS, dsp_eq_init(&eq, channels, 48000, bands,
+                                               DSP_EQ_MAX_BANDS));
+  TEST_ASSERT_EQUAL(OASIS_SUCCESS, dsp_chain_add(&chain, &gain.node));
+  TEST_ASSERT_EQUAL(OASIS_SUCCESS, dsp_chain_add(&chain, &volume.node));
+  TEST_ASSERT_EQUAL(OASIS_SUCCESS, dsp_chain_add(&chain, &eq.node));
+  chain.profile = 1;
+
+  size_t total = (size_t)48000 * BENCH_DSP_SECONDS;
+  double start = now_seconds();
+  for (size_t done = 0; done < total; done += frames) {
+    // The volume keeps moving so the ramp is part of it
+    if (done % (48000 * 10) < frames)
+      dsp_volume_set_db(&volume, -(float)(done / 48000 % 20));
+    for (size_t i = 0; i < frames * channels; i++)
+      samples[i] = (float)((done + i) % 97) / 97.0f - 0.5f;
+    dsp_chain_process(&chain, samples, frames);
+  }
+  double elapsed = now_seconds() - start;
+
+  double load = elapsed / BENCH_DSP_SECONDS * 100.0;
+  oasis_log(NULL, LOG_LEVEL_INFO,
+            "DSP chain on %d channels at 48 kHz (%s): %.4f%% of a core",
+            channels, dsp_get_isa_name(), load);
+  for (int i = 0; i < chain.count; i++) {
+    oasis_log(NULL, LOG_LEVEL_INFO, "  %s: %.0f ns per %d frame block",
+              chain.nodes[i]->name,
+              (double)chain.nodes[i]->ns / chain.nodes[i]->blocks,
+              DSP_BLOCK_FRAMES);
+  }
+  return load;
+}
+
+void bench_dsp_chain(void) {
+  TEST_ASSERT_TRUE(bench_dsp(2) < 1.0);
+  TEST_ASSERT_TRUE(bench_dsp(6) < 2.0);
+}
+
+// The whole playback pipeline into the null sink, as fast as it will go
+void bench_headless_playback(void) {
+  if (file_count == 0) {
+    TEST_IGNORE_MESSAGE("No files to benchmark");
+  }
+
+  double seconds = 0.0;
+  for (int i = 0; i < file_count; i++) {
+    audio_probe_t probe;
+    if (audio_probe(files[i], &probe) == OASIS_SUCCESS && probe.sample_rate > 0)
+      seconds += (double)probe.duration / probe.sample_rate;
+  }
+
+  playback_options_t options = {.output_backend = OUTPUT_BACKEND_NULL};
+  double start = now_seconds();
+  TEST_ASSERT_EQUAL(OASIS_SUCCESS,
+                    playback_play_queue((const char *const *)files,
+                                        (size_t)file_count, &options));
+  double elapsed = now_seconds() - start;
+
+  oasis_log(NULL, LOG_LEVEL_INFO,
+            "Headless playback of %d files: %.1f s of audio in %.3f s, %.0fx "
+            "real time",
+            file_count, seconds, elapsed, seconds / elapsed);
+}
+
+int main(void) {
+  collect_files(base_path);
+
+  UNITY_BEGIN();
+  RUN_TEST(bench_mmap_input);
+  RUN_TEST(bench_mixer);
+  RUN_TEST(bench_resample);
+  RUN_TEST(bench_sample_convert);
+  RUN_TEST(bench_channel_mix);
+  RUN_TEST(bench_dsp_chain);
+  RUN_TEST(bench_headless_playback);
+  int result = UNITY_END();
+
+  for (int i = 0; i < file_count; i++)
+    free(files[i]);
+  return result;
+}